@@ -0,0 +1,133 @@
+// k-best paths by A* from the start toward final (--astar), expanding only the states the k best paths need,
+// and a heuristic for compositions: the costs to final in the transducers composed.  #included by fst.cc
+#include <graehl/shared/config.h>
+#include <carmel/src/fst.h>
+#include <carmel/src/state_names.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace graehl {
+
+namespace {
+
+// rounding in the composed weights (and in h) may break consistency by this much
+FLOAT_TYPE const kConsistencySlack = 1e-6;
+
+bool below_by_more_than_slack(FLOAT_TYPE x, FLOAT_TYPE y) {
+  return x < y - kConsistencySlack * (1 + std::fabs(y));
+}
+
+bool member_costs_to_final(WFST& w, std::vector<FLOAT_TYPE>& h) {
+  if (!w.valid()) return false;
+  costs_to_final(w, h);
+  return true;
+}
+
+// names: of a member, or of a composition (of compositions ...) of members, whose costs to final are added
+bool composed_costs_to_final(state_names const* names, std::vector<WFST*> const& members,
+                             std::vector<FLOAT_TYPE>& h) {
+  if (!names) return false;
+  for (unsigned i = 0, n = members.size(); i < n; ++i)
+    if (members[i]->shared_names.get() == names) return member_costs_to_final(*members[i], h);
+  composed_state_names const* c = dynamic_cast<composed_state_names const*>(names);
+  std::vector<FLOAT_TYPE> ha, hb;
+  if (!c || !composed_costs_to_final(c->a.get(), members, ha)
+      || !composed_costs_to_final(c->b.get(), members, hb))
+    return false;
+  h.resize(c->trios.size());
+  for (unsigned s = 0, ns = h.size(); s < ns; ++s) {
+    composed_state_names::trio const& t = c->trios[s];
+    if (t.tag == composed_state_names::kFinal)
+      h[s] = 0;
+    else if (t.qa < ha.size() && t.qb < hb.size())
+      h[s] = ha[t.qa] + hb[t.qb];  // mediate states: a's arc is taken, b's isn't
+    else
+      return false;
+  }
+  return true;
+}
+
+struct by_cost_to_final {
+  FLOAT_TYPE const* h;
+  FLOAT_TYPE operator()(FSTArc const* a) const { return a->weight.getCost() + (h ? h[a->dest] : 0); }
+  bool operator()(FSTArc const* a, FSTArc const* b) const { return (*this)(a) < (*this)(b); }
+};
+
+}
+
+WFST::astar_paths::astar_paths(WFST& w, unsigned k, FLOAT_TYPE const* h) : w(w), h(h), k(k), ok(true) {
+  if (!w.valid() || !k) return;
+  unsigned n = w.numStates();
+  if (below_by_more_than_slack(0, heuristic(w.final))) ok = false;
+  for (unsigned s = 0; s < n && ok; ++s) {
+    FLOAT_TYPE hs = heuristic(s);
+    if (hs == HUGE_VAL) continue;
+    for (State::Arcs::val_iterator a = w.states[s].arcs.val_begin(), e = w.states[s].arcs.val_end(); a != e;
+         ++a)
+      if (!a->weight.isZero() && below_by_more_than_slack(a->weight.getCost() + heuristic(a->dest), hs)) {
+        ok = false;
+        break;
+      }
+  }
+  if (!ok || heuristic(0) == HUGE_VAL) return;
+  pops.resize(n);
+  arcs.resize(n);
+  node start = {0, 0, 0, 0};
+  entry e = {heuristic(0), 0};
+  nodes.push_back(start);
+  heap.push_back(e);
+}
+
+void WFST::astar_paths::sort_arcs(unsigned s) {
+  arcs[s].begin = sorted.size();
+  State::Arcs& l = w.states[s].arcs;
+  for (State::Arcs::val_iterator a = l.val_begin(), e = l.val_end(); a != e; ++a)
+    if (!a->weight.isZero() && heuristic(a->dest) != HUGE_VAL) sorted.push_back(&*a);
+  arcs[s].end = sorted.size();
+  by_cost_to_final by = {h};
+  std::stable_sort(sorted.begin() + arcs[s].begin, sorted.end(), by);
+}
+
+void WFST::astar_paths::push(unsigned parent, unsigned rank) {
+  arcs_of const& l = arcs[state(nodes[parent])];
+  if (rank >= l.end - l.begin) return;
+  FSTArc* a = sorted[l.begin + rank];
+  node x = {a, parent, rank, nodes[parent].cost + a->weight.getCost()};
+  entry e = {x.cost + heuristic(a->dest), (unsigned)nodes.size()};
+  nodes.push_back(x);
+  heap.push_back(e);
+  std::push_heap(heap.begin(), heap.end());
+}
+
+bool WFST::astar_paths::next(path_type& path, Weight& weight) {
+  if (pops.empty() || pops[w.final] >= k) return false;
+  while (!heap.empty()) {
+    unsigned i = heap.front().node;
+    std::pop_heap(heap.begin(), heap.end());
+    heap.pop_back();
+    node const x = nodes[i];
+    if (x.arc) push(x.parent, x.rank + 1);
+    unsigned s = state(x);
+    if (pops[s] >= k) continue;  // already has its k best
+    if (!pops[s]++) sort_arcs(s);
+    push(i, 0);
+    if (s != w.final) continue;
+    path.clear();
+    for (unsigned p = i; nodes[p].arc; p = nodes[p].parent) path.push_back(nodes[p].arc);
+    std::reverse(path.begin(), path.end());
+    weight = Weight(x.cost, cost_weight());
+    return true;
+  }
+  return false;
+}
+
+bool WFST::cascade_costs_to_final(std::vector<WFST*> const& members, std::vector<FLOAT_TYPE>& h) {
+  h.clear();
+  for (unsigned i = 0, n = members.size(); i < n; ++i)
+    if (this == members[i]) return member_costs_to_final(*members[i], h);
+  return composed_costs_to_final(shared_names.get(), members, h) && h.size() == numStates();
+}
+
+
+}
@@ -0,0 +1,333 @@
+// carmel-bench: times carmel's core operations on synthetic transducers and corpora of a given size, printing
+// one tab-separated line per operation, so builds (or machines) can be compared run against run.  see usage()
+#define GRAEHL__SINGLE_MAIN
+#include <graehl/shared/config.h>
+#include <carmel/src/fst.h>
+#include <carmel/src/cascade.h>
+#include <carmel/src/sampler.h>
+#include <graehl/shared/monotonic_time.hpp>
+#include <graehl/shared/proc_linux.hpp>
+#include <graehl/shared/random.hpp>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <malloc.h>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <string>
+
+using namespace graehl;
+using namespace std;
+
+namespace {
+
+struct bench_opts {
+  typedef std::map<std::string, double> values;
+  values v;
+  bench_opts() {
+    v["states"] = 20000;
+    v["alphabet"] = 50;
+    v["fanout"] = 8;
+    v["length"] = 20;
+    v["pairs"] = 1000;
+    v["k"] = 10000;
+    v["iter"] = 5;
+    v["repeat"] = 3;
+    v["seed"] = 1;
+  }
+  unsigned operator[](char const* name) const { return (unsigned)v.find(name)->second; }
+  // --name=value for the names above; false on anything else
+  bool parse(char const* arg) {
+    if (std::strncmp(arg, "--", 2)) return false;
+    char const* eq = std::strchr(arg, '=');
+    if (!eq) return false;
+    values::iterator i = v.find(std::string(arg + 2, eq));
+    if (i == v.end()) return false;
+    char* end;
+    i->second = std::strtod(eq + 1, &end);
+    return !*end && i->second >= 0;
+  }
+};
+
+void usage() {
+  bench_opts o;
+  cerr << "usage: carmel-bench [--name=value ...]\n"
+          "times, on random acyclic transducers of the given size: reading and writing the text format, "
+          "composition, k-best (and by A*), pruning, EM training and gibbs sampling.  prints a tab-separated "
+          "header line, then per operation: name, items, unit, seconds (the fastest of --repeat runs), "
+          "items per second, and the process's peak resident bytes while running it (-1 if the peak "
+          "couldn't be reset first, as it needs linux >= 4.0 and a writable /proc/self/clear_refs).  "
+          "progress goes to stderr.\n";
+  for (bench_opts::values::const_iterator i = o.v.begin(), e = o.v.end(); i != e; ++i)
+    cerr << "  --" << i->first << "=" << i->second << "\n";
+  cerr << "states: per transducer; alphabet: input and output letters; fanout: arcs per state; length: "
+          "the average path's arcs; pairs: training examples; k: best paths; iter: EM and gibbs "
+          "iterations; repeat: timed runs per operation; seed: for the random transducers and corpus\n";
+}
+
+// a random acyclic transducer in the text format: arcs from each state s go forward to s+1 .. s+jump (the
+// last state is final), so the average path has about length arcs.  state s+1 is always one of them
+std::string random_wfst(bench_opts const& o, char in, char out, graehl::random& r) {
+  unsigned n = std::max(2u, o["states"]), a = std::max(1u, o["alphabet"]), fanout = std::max(1u, o["fanout"]);
+  unsigned jump = std::max(1u, 2 * n / std::max(1u, o["length"]) - 1);
+  std::ostringstream s;
+  s << n - 1 << '\n';
+  for (unsigned q = 0; q + 1 < n; ++q)
+    for (unsigned i = 0; i < fanout; ++i) {
+      unsigned to = i ? std::min(n - 1, q + 1 + (unsigned)(r() * jump)) : q + 1;
+      s << '(' << q << " (" << to << " \"" << in << (unsigned)(r() * a) << "\" \"" << out
+        << (unsigned)(r() * a) << "\" " << 0.01 + r() << "))\n";
+    }
+  return s.str();
+}
+
+// a cyclic channel for the composition: --fanout states, each reading every in letter with two arcs (to
+// random states, writing random out letters), so it accepts every string.  0 is both start and final
+std::string random_channel(bench_opts const& o, char in, char out, graehl::random& r) {
+  unsigned n = std::max(1u, o["fanout"]), a = std::max(1u, o["alphabet"]);
+  std::ostringstream s;
+  s << "0\n";
+  for (unsigned q = 0; q < n; ++q)
+    for (unsigned l = 0; l < a; ++l)
+      for (unsigned i = 0; i < 2; ++i)
+        s << '(' << q << " (" << (unsigned)(r() * n) << " \"" << in << l << "\" \"" << out
+          << (unsigned)(r() * a) << "\" " << 0.01 + r() << "))\n";
+  return s.str();
+}
+
+// forget the peak resident size so far (linux >= 4.0), so each operation's is its own (plus whatever is
+// still live from before it).  false if it couldn't be: VmHWM is then the peak since the process started
+bool reset_peak_rss() {
+  malloc_trim(0);
+  std::ofstream clear("/proc/self/clear_refs");
+  clear << "5\n";
+  clear.close();
+  return !clear.fail();
+}
+
+double peak_rss() {
+  return proc_bytes(get_proc_field("VmHWM"));
+}
+
+// o's output goes to buf until the end of the scope (even by an exception)
+struct redirect {
+  std::ostream& o;
+  std::streambuf* was;
+  redirect(std::ostream& o, std::streambuf* buf) : o(o), was(o.rdbuf(buf)) {}
+  ~redirect() { o.rdbuf(was); }
+};
+
+// one output line: the fastest of the timed runs
+struct row {
+  char const* name;
+  char const* unit;
+  double items, best, t;
+  bool rss_reset;
+  row(char const* name, char const* unit, double items = 0)
+      : name(name), unit(unit), items(items), best(std::numeric_limits<double>::infinity()) {
+    Config::log() << name << "...\n";
+    rss_reset = reset_peak_rss();
+    if (!rss_reset) Config::warn() << "couldn't reset the peak resident size; printing -1 for it.\n";
+  }
+  void start() { t = monotonic_time(); }
+  void stop() { best = std::min(best, monotonic_time() - t); }
+  void print() const {
+    cout << name << '\t' << (unsigned long long)items << '\t' << unit << '\t' << best << '\t'
+         << (best > 0 ? items / best : 0) << '\t';
+    if (rss_reset)
+      cout << (unsigned long long)peak_rss();
+    else
+      cout << -1;
+    cout << std::endl;
+  }
+};
+
+struct count_arcs {
+  enum { SIDETRACKS_ONLY = 0 };
+  unsigned paths, arcs;
+  count_arcs() : paths(), arcs() {}
+  void start_path(unsigned, Weight) { ++paths; }
+  void end_path() {}
+  void visit_best_arc(FSTArc const&) { ++arcs; }
+};
+
+unsigned n_arcs(WFST const& w) {
+  unsigned n = 0;
+  for (unsigned s = 0; s < w.numStates(); ++s) n += w.states[s].size;
+  return n;
+}
+
+// input/output pairs of random paths through x, as training examples
+void random_corpus(WFST const& x, unsigned n, graehl::random& r, training_corpus& corpus) {
+  path_sampler sampler(x, true);
+  path_sampler::path p;
+  for (unsigned i = 0; i < n; ++i) {
+    p.clear();
+    while (!sampler.sample(p, r)) p.clear();
+    List<unsigned> in, out;
+    for (path_sampler::path::const_reverse_iterator a = p.rbegin(), e = p.rend(); a != e; ++a) {
+      if ((*a)->in != WFST::epsilon_index) in.push_front((*a)->in);
+      if ((*a)->out != WFST::epsilon_index) out.push_front((*a)->out);
+    }
+    corpus.add(in, out);
+  }
+  corpus.finish_adding();
+}
+
+int bench(bench_opts const& o) {
+  unsigned repeat = std::max(1u, o["repeat"]), iter = std::max(1u, o["iter"]);
+  graehl::random r;
+  r.set_random_seed(o["seed"]);
+  set_random_seed(o["seed"]);
+  std::string text_a = random_wfst(o, 'x', 'y', r), text_b = random_channel(o, 'y', 'z', r);
+  WFST a(text_a, false), b(text_b, false);
+  if (!a.valid() || !b.valid()) {
+    Config::warn() << "couldn't read the generated transducers.\n";
+    return 1;
+  }
+  unsigned arcs = n_arcs(a);
+
+  cout << "#";
+  for (bench_opts::values::const_iterator i = o.v.begin(), e = o.v.end(); i != e; ++i)
+    cout << ' ' << i->first << '=' << i->second;
+  cout << "\noperation\titems\tunit\tseconds\tper_second\tpeak_rss_bytes" << std::endl;
+
+  {
+    row t("read_legible", "arcs", arcs);
+    for (unsigned i = 0; i < repeat; ++i) {
+      t.start();
+      WFST w(text_a, false);
+      t.stop();
+    }
+    t.print();
+  }
+  {
+    row t("write_legible", "arcs", arcs);
+    for (unsigned i = 0; i < repeat; ++i) {
+      std::ostringstream s;
+      t.start();
+      a.writeLegible(s);
+      t.stop();
+    }
+    t.print();
+  }
+  WFST* c = 0;
+  {
+    row t("compose", "result_arcs");
+    for (unsigned i = 0; i < repeat; ++i) {
+      delete c;
+      cascade_parameters cascade;
+      cascade.prepare_compose();
+      t.start();
+      c = new WFST(cascade, a, b);
+      t.stop();
+    }
+    t.items = n_arcs(*c);
+    t.print();
+  }
+  boost::scoped_ptr<WFST> composed(c);
+  if (!composed->valid()) {
+    Config::warn() << "the composition is empty.\n";
+    return 1;
+  }
+  {
+    row t("kbest", "path_arcs");
+    for (unsigned i = 0; i < repeat; ++i) {
+      count_arcs v;
+      t.start();
+      composed->visit_kbest(o["k"], v);
+      t.stop();
+      t.items = v.arcs;
+    }
+    t.print();
+  }
+  {
+    // A* needs weights of at most 1, and the composed states' names for its heuristic
+    WFST na(text_a, false), nb(text_b, false);
+    na.normalize(WFST::NormalizeMethod());
+    nb.normalize(WFST::NormalizeMethod());
+    cascade_parameters cascade;
+    cascade.prepare_compose();
+    WFST named(cascade, na, nb, true);
+    std::vector<WFST*> members;
+    members.push_back(&na);
+    members.push_back(&nb);
+    row t("kbest_astar", "path_arcs");
+    for (unsigned i = 0; i < repeat; ++i) {
+      count_arcs v;
+      std::vector<FLOAT_TYPE> h;
+      t.start();
+      if (!named.cascade_costs_to_final(members, h) || !named.visit_kbest_astar(o["k"], v, &h[0]))
+        Config::warn() << "no A* heuristic.\n";
+      t.stop();
+      t.items = v.arcs;
+    }
+    t.print();
+  }
+  composed.reset();
+  {
+    row t("prune_paths", "arcs", arcs);
+    for (unsigned i = 0; i < repeat; ++i) {
+      WFST w(text_a, false);
+      t.start();
+      w.prunePaths(o["states"] / 2);
+      t.stop();
+    }
+    t.print();
+  }
+
+  training_corpus corpus;
+  random_corpus(a, o["pairs"], r, corpus);
+  WFST::NormalizeMethods methods;
+  methods.push_back(WFST::NormalizeMethod());
+  WFST::train_opts topt;
+  topt.max_iter = iter;
+  {
+    row t("train_em", "pair_iterations", (double)corpus.size() * iter);
+    for (unsigned i = 0; i < repeat; ++i) {
+      WFST w(text_a, false);
+      t.start();
+      w.train(corpus, methods, false, Weight(), Weight(), Weight::INF(), topt);  // no early convergence
+      t.stop();
+    }
+    t.print();
+  }
+  {
+    gibbs_opts gopt;
+    topt.cache.cache_level = WFST::cache_forward;  // as carmel --crp
+    row t("train_gibbs", "pair_iterations", (double)corpus.size() * iter);
+    for (unsigned i = 0; i < repeat; ++i) {
+      WFST w(text_a, false);
+      cascade_parameters cascade;
+      cascade.set_composed(&w);
+      WFST::NormalizeMethods priors(methods);
+      priors[0].add_count = 1;
+      std::ostringstream samples;  // train_gibbs prints its final sample to cout
+      redirect quiet(cout, samples.rdbuf());
+      t.start();
+      w.train_gibbs(cascade, corpus, priors, topt, gopt);
+      t.stop();
+    }
+    t.print();
+  }
+  return 0;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  bench_opts o;
+  for (int i = 1; i < argc; ++i)
+    if (!o.parse(argv[i])) {
+      usage();
+      return std::strcmp(argv[i], "--help") ? 2 : 0;
+    }
+  try {
+    return bench(o);
+  } catch (std::exception& e) {
+    Config::warn() << "carmel-bench: " << e.what() << "\n";
+    return 1;
+  }
+}
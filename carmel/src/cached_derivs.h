@@ -3,6 +3,7 @@
 
 #include <carmel/src/derivations.h>
 #include <carmel/src/cascade.h>
+#include <carmel/src/saved_cascade.h>
 #include <graehl/shared/serialize_batch.hpp>
 #include <graehl/shared/time_space_report.hpp>
 #include <graehl/shared/periodic.hpp>
@@ -22,10 +23,11 @@ struct cached_derivs
   training_corpus &corpus;
   WFST::deriv_cache_opts const& copt;
   bool cached;
+  serialize_batch<derivations>* shared_derivs;  // if set, read another cache's (in-memory) derivs instead
 
   unsigned size()
   {
-    return cached?derivs.size():corpus.size();
+    return shared_derivs?shared_derivs->size():cached?derivs.size():corpus.size();
   }
   double n_output() const
   {
@@ -33,20 +35,30 @@ struct cached_derivs
   }
 
   cached_derivs(WFST &x, cascade_parameters const& cascade, training_corpus &corpus, WFST::deriv_cache_opts const& copt)
-      : x(x), derivs(copt.use_disk(), copt.disk_cache_filename, true, copt.disk_cache_bufsize), arcs(x), out_derivfile(copt.out_derivfile), cascade(cascade), corpus(corpus), copt(copt)
+      : x(x), derivs(copt.use_disk(), copt.disk_cache_filename, true, copt.disk_cache_bufsize), arcs(x), out_derivfile(copt.out_derivfile), cascade(cascade), corpus(corpus), copt(copt), shared_derivs(0)
   {
     if ((cached = copt.cache()))
       cache_derivations();
     first = true; // for non-caching
   }
+
+  /// x must have the same arcs (in the same order) as shared.x, e.g. WFST::replicate.  the derivations
+  /// aren't modified by forward/backward only when shared.copt.cache_backward(), so only then may several
+  /// of these visit them concurrently.
+  cached_derivs(WFST &x, cascade_parameters const& cascade, cached_derivs &shared)
+      : x(x), derivs(false, ""), arcs(x), cascade(cascade), corpus(shared.corpus), copt(shared.copt), cached(true), shared_derivs(&shared.derivs)
+  {
+    assert(shared.cached && !shared.derivs.use_file);
+    first = false;
+  }
   bool first;
 
   template <class F>
   void foreach_deriv(F &f)
   {
     if (first&&!out_derivfile.empty()) {
-      std::ofstream o(out_derivfile.c_str());
-      foreach_deriv(f, &o);
+      boost::scoped_ptr<std::ostream> o(new_output_file(out_derivfile));
+      foreach_deriv(f, o.get());
     } else
       foreach_deriv(f, 0);
   }
@@ -64,7 +76,13 @@ struct cached_derivs
     bool fem = od&&first;
     if (fem)
       cascade.arcids(aid);
-    if (cached) {
+    if (shared_derivs) {
+      unsigned n = 0;
+      typedef typename serialize_batch<derivations>::A store_t;
+      store_t &store = shared_derivs->store;
+      for (typename store_t::iterator i = store.begin(), e = store.end(); i!=e; ++i)
+        f(++n, *i);
+    } else if (cached) {
       unsigned n = 0;
       for (derivs.rewind(); derivs.advance();) {
         ++n;
@@ -103,6 +121,10 @@ struct cached_derivs
   //TODO: cascade arc ids for fem deriv out
   void cache_derivations()
   {
+    if (copt.saved) {
+      load_derivations(*copt.saved);
+      return;
+    }
     bool cache_backward = copt.cache_backward();
     bool prune = copt.prune();
     typedef List<IOSymSeq> Examples;
@@ -114,11 +136,11 @@ struct cached_derivs
     wfst_io_index io(x);
     unsigned n = 1;
     derivs.clear();
+    corpus.clear_counts();  // recounted: only examples with derivations
     for (Examples::const_iterator i = ex.begin(), end = ex.end();
          i!=end ; ++i, ++n) {
       num_progress(log, n, 10, 70,".","\n");
       derivations &d = derivs.start_new();
-      corpus.clear_counts();
       if (!d.init_and_compute(x, io, arcs, i->i, i->o, i->weight, n, cache_backward, prune)) {
         warn_no_derivations(x, *i, n);
         derivs.drop_new();
@@ -135,6 +157,43 @@ struct cached_derivs
     log << "\n";
     derivs.mark_end();
     log << derivations::global_stats;
+    if (!copt.save_cascade.empty()) {
+      saved_cascade::save(copt.save_cascade, copt.cascade_fingerprint, cascade, x, corpus, prune, derivs);
+      log << "Saved the cascade's derivations to " << copt.save_cascade << "\n";
+    }
+  }
+
+  // --load-cascade-derivations: as cache_derivations, but reading them.  they were computed for the same
+  // corpus, so examples without one (by lineno) had none then
+  void load_derivations(saved_cascade &saved)
+  {
+    saved.check_corpus(corpus, copt.prune());
+    typedef List<IOSymSeq> Examples;
+    Examples &ex = corpus.examples;
+    cached = true;
+    graehl::time_space_report r(Config::log(), "Loaded cached derivations: ");
+    unsigned n = 1, left = saved.n_derivations();
+    derivations *d = 0;
+    derivs.clear();
+    corpus.clear_counts();
+    for (Examples::const_iterator i = ex.begin(), end = ex.end();
+         i!=end ; ++i, ++n) {
+      if (!d && left) {
+        saved.read(*(d = &derivs.start_new()));
+        --left;
+      }
+      if (d && d->lineno == n) {
+        if (copt.cache_backward())
+          d->keep_backward();
+        derivs.keep_new();
+        corpus.count(*i);
+        d = 0;
+      } else
+        warn_no_derivations(x, *i, n);
+    }
+    if (d || left)
+      throw std::runtime_error("cascade derivations don't match the training corpus");
+    derivs.mark_end();
   }
 };
 
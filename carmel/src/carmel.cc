@@ -36,11 +36,15 @@
 #include <ctime>
 #include <carmel/src/fst.h>
 #include <carmel/src/cascade.h>
+#include <carmel/src/sampler.h>
+#include <carmel/src/saved_cascade.h>
+#include <graehl/shared/compressed_file.hpp>
 #include <graehl/shared/myassert.h>
 #include <graehl/shared/string_to.hpp>
 #include <graehl/shared/split.hpp>
 #include <graehl/shared/split_noquote.hpp>
 #include <boost/config.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <graehl/shared/random.hpp>
 
 #define DEBUG_CASCADE 0
@@ -115,14 +119,6 @@ static void setOutputFormat(bool* flags, ostream* fstout) {
     */
 }
 
-static void printSeq(Alphabet<StringKey, StringPool>& a, unsigned* seq, unsigned maxSize) {
-
-  for (unsigned i = 0; i < maxSize && seq[i] != 0; ++i) {
-    if (i > 0) cout << ' ';
-    cout << a[seq[i]];
-  }
-}
-
 template <class T>
 void readParam(T* t, char const* from, char sw) {
   istringstream is(from);
@@ -184,8 +180,10 @@ struct wfst_paths_printer {
   wfst_paths_printer(WFST& _wfst, ostream& _out, bool* _flags)
       : SIDETRACKS_ONLY(_flags[(unsigned)'%']), wfst(_wfst), pp(_flags) {
     pp.set_out(_out);
+    pp.flush_each = false;
     n_paths = 0;
   }
+  ~wfst_paths_printer() { pp.flush(); }
   void start_path(unsigned k, Weight path_w) {  // called with k=rank of path (1-best, 2-best, etc.) and
     // cost=sum of arcs from start to finish
     if (k == 1) best_w = path_w;
@@ -215,6 +213,46 @@ void printPath(bool* flags, const List<PathArc>* pli) {
   }
 }
 
+// -G
+struct print_sampled_path {
+  WFST const& x;
+  bool* flags;
+  print_sampled_path(WFST const& x, bool* flags) : x(x), flags(flags) {}
+  void operator()(path_sampler::path const& p) const {
+    List<PathArc> l;
+    List<PathArc>::back_insert_iterator i = l.back_inserter();
+    PathArc pa;
+    for (path_sampler::path::const_iterator a = p.begin(), e = p.end(); a != e; ++a) {
+      x.setPathArc(&pa, **a);
+      *i++ = pa;
+    }
+    if (flags[(unsigned)'@'])
+      WFST::print_training_pair(cout, l);
+    else
+      printPath(flags, &l);
+  }
+};
+
+// -g: the non-*e* inputs, then outputs, each on a line
+struct print_sampled_pair {
+  WFST& x;
+  explicit print_sampled_pair(WFST& x) : x(x) {}
+  void operator()(path_sampler::path const& p) const {
+    print(x.in_alph(), p, false);
+    print(x.out_alph(), p, true);
+  }
+  static void print(Alphabet<StringKey, StringPool>& a, path_sampler::path const& p, bool out) {
+    bool first = true;
+    for (path_sampler::path::const_iterator i = p.begin(), e = p.end(); i != e; ++i)
+      if (unsigned l = out ? (*i)->out : (*i)->in) {
+        if (!first) cout << ' ';
+        first = false;
+        cout << a[l];
+      }
+    cout << std::endl;
+  }
+};
+
 void usageHelp(void);
 void WFSTformatHelp(void);
 
@@ -222,7 +260,7 @@ typedef std::map<std::string, double> long_opts_t;
 typedef std::map<std::string, std::string> text_long_opts_t;
 
 struct carmel_main {
-  ifstream post_b;
+  boost::scoped_ptr<istream> post_b;
   graehl::gibbs_opts gopt;
   WFST::path_print printer;
   WFST::train_opts topt;
@@ -240,6 +278,12 @@ struct carmel_main {
               : (flags[(unsigned)':'] ? WFST::cache_forward_backward
                                       : (flags[(unsigned)'?'] ? WFST::cache_forward : WFST::cache_nothing));
     copt.do_prune = !have_opt("cache-no-prune");
+    get_opt("restart-threads", topt.restart_threads);
+    set_text("checkpoint-file", topt.checkpoint_file);
+    set_text("resume", topt.resume_file);
+    get_opt("checkpoint-every", topt.checkpoint_every);
+    get_opt("online-batch", topt.online_batch);
+    get_opt("online-alpha", topt.online_alpha);
     if (have_opt("disk-cache-derivations")) {
       copt.cache_level = WFST::cache_disk;
       copt.disk_cache_filename = set_default_text("disk-cache-derivations", "/tmp/carmel.derivations.XXXXXX");
@@ -300,6 +344,9 @@ struct carmel_main {
       gopt.init_from_p0 = have_opt("init-from-p0");
       gopt.dirichlet_p0 = have_opt("dirichlet-p0");
       gopt.final_counts = have_opt("final-counts");
+      gopt.checkpoint_file = topt.checkpoint_file;
+      gopt.resume_file = topt.resume_file;
+      gopt.checkpoint_every = topt.checkpoint_every;
     }
   }
 
@@ -319,8 +366,8 @@ struct carmel_main {
 
   istream* open_postb() {
     if (have_opt("post-b")) {
-      post_b.open(text_long_opts["post-b"].c_str(), ifstream::in);
-      return &post_b;
+      post_b.reset(new_input_file(text_long_opts["post-b"]));
+      return post_b.get();
     } else
       return NULL;
   }
@@ -376,11 +423,34 @@ struct carmel_main {
     }
   }
 
+  std::vector<WFST*> members;  // the transducers composed into the result (for --astar)
+
+  // --astar: guided by the costs to final in the members the result was composed from (with -m), else
+  // by none, which needs weights of at most 1
+  template <class Visitor>
+  bool visit_kbest_astar(unsigned kPaths, WFST* result, Visitor& v) {
+    std::vector<FLOAT_TYPE> h;
+    if (result->cascade_costs_to_final(members, h) && result->visit_kbest_astar(kPaths, v, &h[0]))
+      return true;
+    if (result->visit_kbest_astar(kPaths, v)) return true;
+    if (!flags[(unsigned)'q']) Config::log() << "--astar: some weight is above 1; using the usual k-best\n";
+    return false;
+  }
+
   void print_kbest(unsigned kPaths, WFST* result) {
     unsigned kPathsLeft = kPaths;
     if (result->valid()) {
       wfst_paths_printer pp(*result, cout, flags);
-      result->visit_kbest(kPaths, pp);
+      unsigned mbr_k = 0;
+      if (get_opt("mbr", mbr_k) && mbr_k) {
+        double alpha = 1;
+        get_opt("mbr-alpha", alpha);
+        unsigned n_threads = 1;
+        get_opt("threads", n_threads);
+        result->edit_distance_mbr(std::max(mbr_k, kPaths), kPaths, pp, alpha,
+                                  flags[(unsigned)'I'] ? kInput : kOutput, n_threads);
+      } else if (!(have_opt("astar") && visit_kbest_astar(kPaths, result, pp)))
+        result->visit_kbest(kPaths, pp);
       kPathsLeft -= pp.n_paths;
       if (pp.best_w.isZero())
         ++n_0prob;
@@ -396,6 +466,32 @@ struct carmel_main {
     }
   }
 
+  // --confusion-network: a line per position of the output (input with -I) yield, each symbol with its
+  // posterior, best first, then an empty line.  --consensus: a line with the best symbol at each position
+  bool want_consensus() const { return have_opt("consensus") || have_opt("confusion-network"); }
+  void print_consensus(WFST* result) {
+    LabelType dir = flags[(unsigned)'I'] ? kInput : kOutput;
+    WFST::confusion_network_type cn;
+    if (result->valid() && !result->confusion_network(cn, dir))
+      Config::warn() << "no consensus for a result with cycles or no paths (see --arc-posteriors)\n";
+    if (have_opt("confusion-network")) {
+      for (unsigned n = 0; n < cn.size(); ++n) {
+        graehl::word_spacer sp(' ');
+        for (unsigned i = 0; i < cn[n].size(); ++i)
+          cout << sp << result->letter(cn[n][i].symbol, dir) << ' ' << cn[n][i].p;
+        cout << '\n';
+      }
+      cout << '\n';
+    }
+    if (have_opt("consensus")) {
+      graehl::word_spacer sp(' ');
+      for (unsigned n = 0; n < cn.size(); ++n)
+        if (cn[n][0].symbol != WFST::epsilon_index) cout << sp << result->letter(cn[n][0].symbol, dir);
+      cout << '\n';
+    }
+    cout << std::flush;
+  }
+
   bool* flags;
   long_opts_t& long_opts;
   text_long_opts_t& text_long_opts;
@@ -500,6 +596,14 @@ struct carmel_main {
 
   Weight keep_path_ratio;
   int max_states;
+  compose_prune cprune;
+
+  void set_compose_prune() {
+    double r;
+    if (get_opt("compose-prune", r)) cprune.keep_paths_within_ratio = r < 1 ? 1 : r;
+    if (get_opt("compose-beam", r)) cprune.state_beam = r < 1 ? 1 : r;
+    cprune.heuristic = !long_opts["compose-prune-no-heuristic"];
+  }
 
   bool have_opt(std::string const& key) const { return long_opts.find(key) != long_opts.end(); }
 
@@ -567,10 +671,10 @@ struct carmel_main {
     prod_sum_pre *= s;
 
     if (have_opt("post-b")) {
-      post_b >> ws;
+      *post_b >> ws;
       std::string buf;
-      getline(post_b, buf);
-      if (!post_b) {
+      getline(*post_b, buf);
+      if (!*post_b) {
         Config::warn() << "--post-b file didn't have as many lines as -b file.\n";
         return false;
       }
@@ -611,10 +715,35 @@ struct carmel_main {
       result->randomSet();
     }
     if (flags[(unsigned)'n']) normalize(result);
+    if (long_opts["arc-posteriors"] && !result->arc_posteriors())
+      Config::warn() << "--arc-posteriors needs an acyclic result with some path; left the weights alone\n";
 
     return true;
   }
 
+  // --rmepsilon, for each transducer read
+  void maybe_rmepsilon(WFST* w, std::string const& filename) {
+    if (!long_opts["rmepsilon"]) return;
+    unsigned st = w->size(), arc = w->numArcs();
+    if (!w->rmepsilon(!long_opts["rmepsilon-max"], long_opts["rmepsilon-keep-cycles"])) {
+      Config::warn() << "*e* removal didn't converge for " << filename
+                     << " (an *e* cycle of weight >= 1?); try --rmepsilon-keep-cycles\n";
+      return;
+    }
+    if (!flags[(unsigned)'d']) w->reduce();
+    if (!flags[(unsigned)'q'])
+      Config::log() << "Removed *e* from " << filename << ": " << st << '/' << arc << " -> " << w->size()
+                    << '/' << w->numArcs() << "\n";
+  }
+
+  // --write-images: file.image, which carmel then reads (without parsing) in place of file
+  void maybe_write_image(WFST* w, std::string const& filename) {
+    if (!long_opts["write-images"]) return;
+    std::string image = filename + ".image";
+    w->write_image_file(image);
+    if (!flags[(unsigned)'q']) Config::log() << "Wrote transducer image " << image << "\n";
+  }
+
   void maybe_sink(WFST* result) {
     if (long_opts["final-sink"]) result->ensure_final_sink();
   }
@@ -662,7 +791,7 @@ struct carmel_main {
   };
 
 
-  bool shrink(WFST* result, bool print = true, bool do_prune = true, bool openfst_min = false,
+  bool shrink(WFST* result, bool print = true, bool do_prune = true, bool min = false,
               char const* end = "\n") {
     WFST& w = *result;
     bool changed = false;
@@ -675,14 +804,59 @@ struct carmel_main {
       shrink_monitor m("prune", w, print, changed);
       prune(result);
     }
-    if (openfst_min) {
-      shrink_monitor m("openfst-minimize", w, print, changed);
-      openfst_minimize(result);
+    if (min) {
+      shrink_monitor m("minimize", w, print, changed);
+#ifdef USE_OPENFST
+      if (long_opts["minimize-openfst"])
+        openfst_minimize(result);
+      else
+#endif
+        native_minimize(result);
     }
     if (print) Config::log() << end;
     return changed;
   }
 
+  // --minimize and its options, without OpenFST
+  void native_minimize(WFST* result) {
+    WFST& w = *result;
+    bool quiet = flags[(unsigned)'q'];
+    bool sum = long_opts["minimize-sum"];
+    double delta = long_opts["minimize-push-weights-delta"];
+    bool push = delta > 0;
+    if (!push) delta = WFST::kMinimizeDelta;
+    if (long_opts["minimize-inverted"]) w.invert();
+    if (long_opts["minimize-rmepsilon"] && !w.rmepsilon(sum, long_opts["rmepsilon-keep-cycles"], delta)
+        && !quiet)
+      Config::log() << " (*e* removal didn't converge; try --rmepsilon-keep-cycles)";
+    bool determinized = false;
+    if (long_opts["minimize-determinize"] || long_opts["minimize-determinize-only"]) {
+      if (!(long_opts["minimize-pairs"] || long_opts["minimize-pairs-no-epsilon"]) && !w.is_acceptor()) {
+        if (!quiet) Config::log() << " (not an acceptor, so not determinizing; try --minimize-pairs)";
+      } else if (!w.determinize(sum, limit_opt("minimize-max-subset"), limit_opt("minimize-max-states"),
+                                delta)) {
+        if (!quiet) Config::log() << " (gave up determinizing: past --minimize-max-subset/states)";
+      } else
+        determinized = true;
+    }
+    if (!long_opts["minimize-determinize-only"]) {
+      if (determinized || push) {
+        if (!w.push_weights(sum, delta)) {
+          if (!quiet) Config::log() << " (weight pushing didn't converge)";
+        } else if (!determinized)
+          w.clear_groups();
+      }
+      w.minimize(delta);
+    }
+    if (!long_opts["minimize-no-connect"]) w.reduce();
+    if (long_opts["minimize-inverted"]) w.invert();
+  }
+
+  unsigned limit_opt(char const* name) {
+    double n = long_opts[name];
+    return n > 0 ? (unsigned)n : (unsigned)WFST::UNLIMITED;
+  }
+
   template <class OpenFST>
   void openfst_minimize_type(WFST* result) {
 #ifdef USE_OPENFST
@@ -750,9 +924,55 @@ struct carmel_main {
     parse_cache_opts();
     parse_gibbs_opts();
     parse_fem_opts();
+    parse_saved_cascade_opts();
     no_compose = have_opt("no-compose");
   }
 
+  boost::scoped_ptr<saved_cascade> saved;  // --load-cascade-derivations
+
+  void parse_saved_cascade_opts() {
+    WFST::deriv_cache_opts& copt = topt.cache;
+    bool save = set_text("save-cascade-derivations", copt.save_cascade);
+    std::string load;
+    if (set_text("load-cascade-derivations", load)) {
+      saved.reset(new saved_cascade(load));
+      copt.saved = saved.get();
+    } else if (!save)
+      return;
+    if (flags[(unsigned)'p'] || prunePath() || cprune.enabled())
+      throw std::runtime_error("--save-cascade-derivations and --load-cascade-derivations can't be used with "
+                               "pruning (-p -w -z --compose-prune), which depends on the weights");
+    if (!copt.cache()) copt.cache_level = WFST::cache_forward;
+    force_cascade_derivs();
+  }
+
+  // for --save-cascade-derivations and --load-cascade-derivations: the structure of the cascade's
+  // transducers (just result, if it's trivial), and the options that shape their composition
+  uint64_t cascade_fingerprint(cascade_parameters const& cascade, WFST const& result) const {
+    std::ostringstream o;
+    for (char const* f = "Cadmr"; *f; ++f) o << flags[(unsigned)*f];
+    char const* shaping[] = {"consolidate-max", "consolidate-unclamped", "minimize-compositions",
+                             "minimize-all-compositions", "train-cascade-compress",
+                             "train-cascade-compress-always"};
+    for (unsigned i = 0; i < sizeof(shaping) / sizeof(*shaping); ++i) {
+      double v = 0;
+      get_opt(shaping[i], v);
+      o << ' ' << v;
+    }
+    uint64_t h = saved_cascade::fingerprint(o.str());
+    if (cascade.trivial) return saved_cascade::fingerprint(result, h);
+    for (unsigned i = 0, n = cascade.cascade.size(); i < n; ++i)
+      h = saved_cascade::fingerprint(*cascade.cascade[i], h);
+    return h;
+  }
+
+  void use_saved_cascade(cascade_parameters const& cascade, WFST const& result) {
+    if (saved)
+      saved->check_structure(cascade_fingerprint(cascade, result));
+    else if (!topt.cache.save_cascade.empty())
+      topt.cache.cascade_fingerprint = cascade_fingerprint(cascade, result);
+  }
+
   void parse_fem_opts() {
     set_text("load-fem-param", fem_inparam);
     set_text("write-loaded", fem_suffix);
@@ -791,11 +1011,11 @@ struct carmel_main {
     }
     if (!fem_inparam.empty()) {
       Config::log() << "Reading cascade weights from --load-fem-param=" << fem_inparam << endl;
-      std::ifstream i(fem_inparam.c_str());
-      if (!i) {
+      boost::scoped_ptr<istream> i(new_input_file(fem_inparam));
+      if (!*i) {
         throw std::runtime_error("Missing --load-fem-param file.\n");
       }
-      fems.read_params(i);
+      fems.read_params(*i);
     }
     fem_normby();
     fem_out_param(fem_early_outparam);
@@ -810,8 +1030,8 @@ struct carmel_main {
   void fem_out_param(std::string const& out) {
     if (!fem_outparam.empty()) {
       Config::log() << "Writing cascade weights to --fem-param=" << fem_outparam << endl;
-      std::ofstream o(fem_outparam.c_str());
-      fems.print_params(o);
+      boost::scoped_ptr<ostream> o(new_output_file(fem_outparam));
+      fems.print_params(*o);
     }
   }
 
@@ -819,13 +1039,13 @@ struct carmel_main {
     fem_out_param(fem_outparam);
     if (!fem_norm.empty()) {
       Config::log() << "Writing forest-em normgroups to --fem-norm=" << fem_norm << endl;
-      std::ofstream o(fem_norm.c_str());
-      fems.fem_norms(o, nms);
+      boost::scoped_ptr<ostream> o(new_output_file(fem_norm));
+      fems.fem_norms(*o, nms);
     }
     if (!fem_alpha.empty()) {
       Config::log() << "Writing forest-em alpha to --fem-alpha=" << fem_alpha << endl;
-      std::ofstream o(fem_alpha.c_str());
-      fems.fem_alpha(o, nms);
+      boost::scoped_ptr<ostream> o(new_output_file(fem_alpha));
+      fems.fem_alpha(*o, nms);
     }
   }
 
@@ -978,7 +1198,7 @@ int
         pruneFlag = 0;
         readParam(&cm.prune_wt, arg, 'p');
       } else if (fstout == NULL) {
-        fstout = NEW ofstream(arg);
+        fstout = new_output_file(arg);
         setOutputFormat(flags, fstout);
         if (!*fstout) {
           Config::warn() << "Could not create file " << arg << ".\n";
@@ -1076,6 +1296,9 @@ int
     setOutputFormat(flags, &cout);
     setOutputFormat(flags, &cerr);
     WFST::setIndexThreshold(thresh);
+    WFST::stream_writer = long_opts["stream-writer"];
+    WFST::normalize_threads = std::max(1., long_opts["threads"]);
+    cm.set_compose_prune();
     if (flags[(unsigned)'h']) {
       cout << endl
            << endl;
@@ -1140,7 +1363,7 @@ int
       //    if (parm[i][0]=='-' && parm[i][1] == '\0')
       //              files[i] = &cin;
       //      else
-      files[i] = NEW ifstream(parm[i]);
+      files[i] = new_input_file(parm[i]);
 #ifdef DEBUG
 // Config::debug() << "Created file " << i << " from " << parm[i] << " & " << files[i] <<"\n";
 #endif
@@ -1194,7 +1417,14 @@ int
     for (i = 0; i < nInputs; ++i) {
       if (i != nTarget) {
         WFST* w = chain + i;
-        PLACEMENT_NEW(w) WFST(*inputs[i], !flags[(unsigned)'K']);
+        if (inputs[i] != &cin && WFST::is_image_file(filenames[i]))
+          PLACEMENT_NEW(w) WFST(WFST::image_file, filenames[i]);
+        else
+          PLACEMENT_NEW(w) WFST(*inputs[i], !flags[(unsigned)'K'], long_opts["stream-reader"]);
+        if (w->valid()) {
+          cm.maybe_rmepsilon(w, filenames[i]);
+          if (inputs[i] != &cin) cm.maybe_write_image(w, filenames[i]);
+        }
         cm.fem_add(w, filenames[i]);
         if (i < exponents.size()) w->raisePower(exponents[i]);
         if (!flags[(unsigned)'m'] && nInputs > 1) w->unNameStates();
@@ -1261,7 +1491,8 @@ int
           if (!getline(*line_in, buf)) goto fail_ntarget;
           unsigned length;
           if (flags[(unsigned)'P']) {  // need a permutation lattice instead
-            PLACEMENT_NEW(&chain[nTarget]) WFST(buf.c_str(), length, 1);
+            unsigned window = long_opts["permute-window"];
+            PLACEMENT_NEW(&chain[nTarget]) WFST(buf.c_str(), length, 1, window);
           } else {  // no permutation, just need input acceptor
             PLACEMENT_NEW(&chain[nTarget]) WFST(buf.c_str());
             length = chain[nTarget].numStates() - 1;  // single letter uses separate start + final surrounding
@@ -1299,8 +1530,20 @@ int
         unsigned n_compositions = 0;
         bool first = true;
         cascade.add(result);
+        cm.members.clear();
+        for (i = 0; i < nChain; ++i) cm.members.push_back(chain + i);
         bool anycomposed = false;
-        for (i = (r ? nChain - 2 : 1); (r ? ~i : i < nChain) && result->valid();
+        bool loaded = cm.saved && !cascade.trivial;  // instead of composing, use the saved composition
+        if (loaded) {
+          for (i = (r ? nChain - 2 : 1); (r ? ~i : i < nChain); (r ? --i : ++i)) cascade.add(chain + i);
+          cm.use_saved_cascade(cascade, *result);
+          result = cm.saved->load_composed(cascade);
+          if (!flags[(unsigned)'q'])
+            Config::log() << "Loaded the composition (" << result->size() << " states / " << result->numArcs()
+                          << " arcs) from --load-cascade-derivations";
+          anycomposed = true;
+        }
+        for (i = (r ? nChain - 2 : 1); !loaded && (r ? ~i : i < nChain) && result->valid();
              (r ? --i : ++i), first = false) {
           // composition loop
           ++n_compositions;
@@ -1315,7 +1558,7 @@ int
             cascade.prepare_compose(r);
           WFST& t1 = (r ? chain[i] : *result);
           WFST& t2 = (r ? *result : chain[i]);
-          WFST* next = NEW WFST(cascade, t1, t2, flags[(unsigned)'m'], flags[(unsigned)'a']);
+          WFST* next = NEW WFST(cascade, t1, t2, flags[(unsigned)'m'], flags[(unsigned)'a'], cm.cprune);
 #ifndef NODELETE
 #ifdef DEBUGCOMPOSE
           Config::debug() << "deleting result and replacing it with next\n";
@@ -1338,6 +1581,7 @@ int
           if (!result->valid()) {
             Config::warn() << ")\nEmpty or invalid result of composition with transducer \"" << filenames[i]
                            << "\".\n";
+            if (cm.want_consensus()) cm.print_consensus(result);
             cm.print_kbest(kPaths, result);
             goto nextInput;
           }
@@ -1354,6 +1598,7 @@ int
           anycomposed = true;
         }
         if (!anycomposed) cascade.set_composed(result);
+        if (!loaded) cm.use_saved_cascade(cascade, *result);
         if (!flags[(unsigned)'q']) Config::log() << std::endl;
 
 
@@ -1377,6 +1622,7 @@ int
           else
             result->unTieGroups();
         }
+        if (cm.want_consensus()) cm.print_consensus(result);
         if (kPaths > 0) {
           cm.print_kbest(kPaths, result);
         } else if (flags[(unsigned)'x']) {
@@ -1393,19 +1639,34 @@ int
           if (flags[(unsigned)'S']) {
             n_pairs = 0;
             if (pairStream) {
-              for (;;) {
-                getline(*pairStream, buf);
-                if (!*pairStream) break;
-                ++input_lineno;
-                WFST::symbol_ids ins(*result, buf.c_str(), kInput, input_lineno);
-                getline(*pairStream, buf);
-                if (!*pairStream) break;
-                ++input_lineno;
-                WFST::symbol_ids outs(*result, buf.c_str(), kOutput, input_lineno);
-                Weight prob = result->sumOfAllPaths(ins, outs);
-                ++n_pairs;
-                prod_prob *= prob;
-                cout << prob << std::endl;
+              // with --threads, read a batch of pairs, score them at once, and print in input order
+              unsigned n_threads = std::max(1., long_opts["threads"]);
+              unsigned batch_size = n_threads > 1 ? 256 * n_threads : 1;
+              WFST::path_scorer scorer(*result);
+              std::vector<WFST::path_scorer::pair> batch;
+              for (bool more = true; more;) {
+                batch.clear();
+                while (batch.size() < batch_size) {
+                  getline(*pairStream, buf);
+                  if (!*pairStream) break;
+                  ++input_lineno;
+                  WFST::symbol_ids ins(*result, buf.c_str(), kInput, input_lineno);
+                  getline(*pairStream, buf);
+                  if (!*pairStream) break;
+                  ++input_lineno;
+                  WFST::symbol_ids outs(*result, buf.c_str(), kOutput, input_lineno);
+                  batch.push_back(WFST::path_scorer::pair());
+                  batch.back().in.assign(ins.begin(), ins.end());
+                  batch.back().out.assign(outs.begin(), outs.end());
+                }
+                more = batch.size() == batch_size;
+                scorer.score(batch, n_threads);
+                for (unsigned i = 0; i < batch.size(); ++i) {
+                  Weight prob = batch[i].prob;
+                  ++n_pairs;
+                  prod_prob *= prob;
+                  cout << prob << std::endl;
+                }
               }
             } else {
               List<unsigned> empty_list;
@@ -1443,48 +1704,20 @@ int
             cm.shrink(result, true, true, minimize, "\n");
             //                cm.minimize(result);
             if (maxGenArcs == 0) maxGenArcs = DEFAULT_MAX_GEN_ARCS;
+            unsigned n_threads = std::max(1., long_opts["threads"]);
             if (flags[(unsigned)'G']) {
               show_seed();
-              for (unsigned i = 0; i < nGenerate;) {
-                List<PathArc> l;
-                if (~result->randomPath(&l)) {
-                  if (flags[(unsigned)'@']) {
-                    WFST::print_training_pair(cout, l);
-                  } else {
-                    printPath(flags, &l);
-                  }
-                  ++i;
-                }
-              }
+              sample_paths(path_sampler(*result, false), nGenerate, n_threads, seed, (unsigned)-1,
+                           print_sampled_path(*result, flags));
             } else {
-              unsigned maxSize = maxGenArcs + 1;
-              unsigned* inSeq = NEW unsigned[maxSize];
-              unsigned* outSeq = NEW unsigned[maxSize];
-              for (unsigned s = 0; s < nGenerate; ++s) {
-                while (!result->generate(inSeq, outSeq, 0, maxGenArcs))
-                  ;
-                printSeq(result->in_alph(), inSeq, maxGenArcs);
-                cout << std::endl;
-                printSeq(result->out_alph(), outSeq, maxGenArcs);
-                cout << std::endl;
-                /*for ( i = 0 ; i < maxSize ; ) {
-                  if (outSeq[i] > 0)
-                  cout << result->outLetter(outSeq[i]);
-                  ++i;
-                  if ( i < maxSize && outSeq[i] > 0 )
-                  cout << ' ';
-                  }
-                  cout << std::endl;
-                */
-              }
-              delete[] inSeq;
-              delete[] outSeq;
+              sample_paths(path_sampler(*result, true), nGenerate, n_threads, seed, maxGenArcs - 1,
+                           print_sampled_pair(*result));
             }
           }
 
           if ((!flags[(unsigned)'k'] && !flags[(unsigned)'x'] && !flags[(unsigned)'y']
                && !flags[(unsigned)'S'] && !flags[(unsigned)'c'] && !flags[(unsigned)'g']
-               && !flags[(unsigned)'G'] && !trainc) || flags[(unsigned)'F']) {
+               && !flags[(unsigned)'G'] && !trainc && !cm.want_consensus()) || flags[(unsigned)'F']) {
             cm.shrink(result, true, true, long_opts["minimize"] || long_opts["minimize-determinize-only"],
                       "\n");
             //                cm.prune(result);
@@ -1636,6 +1869,11 @@ void usageHelp(void) {
   cout << "\n-w w\t\tprune states and arcs only used in paths w times worse\n\t\tthan the best path (1 means "
           "keep only best path, 10 = keep paths up to 10 times weaker)";
   cout << "\n-z n\t\tkeep at most n states (those used in highest-scoring paths)";
+  cout << "\n--compose-prune=w : like -w, but while composing, so the pruned states are never built"
+          "\n--compose-beam=b : while composing, drop arcs b times worse than the best arc leaving the same"
+          "\n\t\tstate (counting the best completion of the arc's destination)"
+          "\n--compose-prune-no-heuristic : for the above two, rank states by their best path so far,"
+          "\n\t\twithout the best completions in each transducer (these need weights <= 1, and no -a)";
   cout << "\n-g n\t\tstochastically generate";
   cout << " n input/output pairs by following\n\t\trandom paths (first choosing an input symbol with "
           "uniform\n\t\tprobability, then using the weights to choose an output symbol\n\t\tand destination) "
@@ -1702,7 +1940,6 @@ void usageHelp(void) {
   cout << "\n\t-H\tOne arc per line (by default one state and all its arcs per line)";
   cout << "\n\t-J\tDon't omit output=input or Weight=1";
 
-#ifdef USE_OPENFST
   cout << "\n\n--minimize-compositions=N : det/min after each of the first N compositions\n"
           "\n"
           "--minimize-all-compositions : the same, but for N=infinity\n"
@@ -1712,9 +1949,17 @@ void usageHelp(void) {
           "\n"
           "--minimize-determinize-only : just determinize, no minimize\n"
           "--minimize-sum : collapse paths by summing prob (default is to keep the best)\n"
-          "--minimize-determinize : determinize before minimize - necessary if transducer\n"
-          "isn't already deterministic.  if this fails, carmel will abort.  without this\n"
-          "option, carmel will detect nondeterminstic transducers and skip minimization\n"
+          "--minimize-determinize : determinize before minimize.  without this, minimization still\n"
+          "merges equivalent states, but a nondeterministic transducer may stay larger than necessary.\n"
+          "determinizing may not terminate (if lacking the twins property) - see the limits below\n"
+          "\n"
+          "--minimize-max-subset=N : give up determinizing (leaving the transducer as it was) if a\n"
+          "determinized state would stand for more than N states\n"
+          "--minimize-max-states=N : the same, if the result would have more than N states\n"
+          "\n"
+          "--minimize-push-weights-delta=d : push weights toward the start state before minimizing (always\n"
+          "done after determinizing), converging to within ln ratio d (default 1/1024, also the tolerance\n"
+          "for weights to count as equal).  loses tied groups\n"
           "\n"
           "--minimize-no-connect : skip the removal of unconnected states after\n"
           "minimization (not recommended)\n"
@@ -1722,21 +1967,23 @@ void usageHelp(void) {
           "--minimize-inverted : use this if your transducer is output deterministic, and\n"
           "not input deterministic.  inverts, minimizes, then inverts back\n"
           "\n"
-          "--minimize-rmepsilon : use to get rid of *e*/*e* (both input and output epsilon)\n"
-          "arcs prior to minimization.  necessary if you have any state with two outgoing\n"
-          "epsilon arcs, but makes minimization fail if you have loops (leaving final state)\n"
+          "--minimize-pairs : in case of a transducer (not an acceptor), determinize the FSA\n"
+          "treating the input:output as a single symbol '(input,output)'.  this provides less\n"
+          "minimization but always works\n"
           "\n"
-          "--minimize-pairs : in case of a nonfunctional transducer (input nondeterministic\n"
-          "with multiple possible output strings) perform a less ambitious FSA --minimize treating\n"
-          "the input:output as a single symbol '(input,output)'.  this provides less minimization but always "
-          "works\n"
+          "--minimize-rmepsilon : remove *e*:*e* arcs (as --rmepsilon) before determinizing.  otherwise *e*\n"
+          "is an ordinary symbol for --minimize and --minimize-determinize.\n"
+#ifdef USE_OPENFST
+          "\n"
+          "--minimize-openfst : use OpenFST (copies the transducer there and back, losing tied groups)\n"
+          "for the above, and enables:\n"
           "\n"
           "--minimize-pairs-no-epsilon : for --minimize-pairs, treat *e*:*e* as a real symbol and not an "
           "epsilon\n"
           "if you don't use this, you may need to use --minimize-rmepsilon, which should give a smaller "
-          "result anyway\n";
-
+          "result anyway\n"
 #endif
+      ;
   cout << "\n"
           "--restart-tolerance=w : like -X w, but applied to the first iteration of each random start.\n"
           "a random start is rejected unless its perplexity is within (log likelihood ratio) w of the best "
@@ -1746,11 +1993,50 @@ void usageHelp(void) {
           "--final-restart-tolerance=w : vary --restart-tolerance from its initial value to this\n"
           "\n"
           "--final-restart=N : the 1st...Nth random restart move from --restart-tolerance to\n"
-          "--final-restart-tolerance (exponentially) and then holds constant from restarts N,N+1,...\n";
+          "--final-restart-tolerance (exponentially) and then holds constant from restarts N,N+1,...\n"
+          "\n"
+          "--restart-threads=N : run up to N of the -! random restarts at once, each with its own copy of the "
+          "weights, over the derivations cached by the first start.  needs -: and no --train-cascade.  same "
+          "starts and result as N=1\n"
+          "\n"
+          "--checkpoint-file=f : every --checkpoint-every=N (default 1) iterations of -t training or --crp, "
+          "save the training state (binary) to f, written in the background\n"
+          "\n"
+          "--resume=f : continue -t training or --crp from a --checkpoint-file f saved by an earlier run with "
+          "the same inputs and options\n"
+          "\n"
+          "--online-batch=m : stepwise (online) EM for -t: renormalize after every m examples, interpolating the "
+          "expected counts so far with the new mini-batch's.  -M limits the number of passes over the corpus, "
+          "which converge like EM iterations.  no random restarts\n"
+          "\n"
+          "--online-alpha=a : for --online-batch, the kth mini-batch (k=0,1,...) gets weight (k+2)^-a (default "
+          ".7; .5<a<=1)\n"
+          "\n"
+          "--stream-reader : read input transducers a character at a time, as older versions did, instead of "
+          "all at once (slower, same result; see test/reader-conformance.sh)\n"
+          "\n"
+          "--stream-writer : write transducers and paths through ostream <<, as older versions did, instead of "
+          "formatting them into a buffer (slower, same result)\n"
+          "\n"
+          "Filenames ending in .gz or .lz4 (input transducers and corpora, -F, --post-b, --load-fem-param, "
+          "--fem-param, --fem-norm, --fem-alpha, --fem-forest) are read or written (de)compressed; training "
+          "writes a.wfst.gz's weights to a.wfst.trained.gz\n";
 
   cout << "\n\n--final-sink : if needed, add a new final state with no outgoing arcs\n";
   cout << "\n--consolidate-max : for -C, use max instead of sum for duplicate arcs\n";
   cout << "\n--consolidate-unclamped : for -C sums, clamp result to max of 1\n";
+  cout << "\n--rmepsilon : remove *e*:*e* arcs from each transducer read (before composing or training),\n"
+          "connecting each state directly to the arcs after its *e* paths, weighted by their sum\n"
+          "--rmepsilon-max : weight by the best *e* path instead of the sum\n"
+          "--rmepsilon-keep-cycles : keep *e* arcs that lie on *e* cycles of two or more states (always\n"
+          "safe; without this, *e* cycles must have weight < 1 to be removed, and the sums around them are\n"
+          "only approximate).  *e* self-loops (weight < 1, or <= 1 with --rmepsilon-max) are always removed,\n"
+          "exactly\n";
+  cout << "\n--write-images : for each transducer file read, write file.image: the same transducer in a\n"
+          "binary form that carmel reads (wherever a transducer file is expected) without parsing.  the file\n"
+          "is mapped, but its states and arcs are still copied into the usual (heap) transducer, so this saves\n"
+          "parsing time but not memory, and loads aren't shared between processes.  the image is specific to the\n"
+          "machine type and carmel build (FLOAT_TYPE) that wrote it\n";
   cout << "\n--project-left : replace arc x:y with x:*e*\n";
   cout << "\n--project-right : replace arc x:y with *e*:y\n";
   cout << "\n--project-identity-fsa : modifies either projection so result is an identity arc (left means "
@@ -1773,6 +2059,13 @@ void usageHelp(void) {
           "bytes (k=1000, K = 1024, M=1024K, etc)"
           "\n--cache-no-prune : don't prune unreachable states in derivation cache (not recommended)."
           "\n";
+  cout << "\n"
+          "--save-cascade-derivations=file : write the composition, the arcs of the cascade that each of its "
+          "arcs came from, and the cached derivations of the training corpus to file, so that later runs "
+          "can --load-cascade-derivations=file instead of composing and computing them (e.g. to try other "
+          "initial weights, --priors or --normby).  the file is refused unless the transducers are the "
+          "same but for their weights, and the corpus and composition options are the same.  both imply --train-cascade and derivation caching (-? unless -: or "
+          "--disk-cache-derivations), and rule out pruning during or before composition\n";
   cout << "\n"
           "--exponents=2,.1 : comma separated list of exponents, applied left to right to the input WFSTs "
           "(including stdin if -s).  if more inputs than exponents, use (noop) exponent of 1.  this differs "
@@ -1783,6 +2076,44 @@ void usageHelp(void) {
           "files instead of alternating lines, and gives best paths like -b.  also may succeed for "
           "compositions that wouldn't fit in memory under -S\n";
 
+  cout << "\n"
+          "--mbr=N : with -k K, print the K of the N best paths (N>=K) with the least expected edit "
+          "distance between their output (input with -I) symbols and those of all N, each weighted by its "
+          "probability normalized over the N (minimum Bayes risk reranking)\n"
+          "\n"
+          "--mbr-alpha=a : for --mbr, raise the path probabilities to the power a (sharper for a>1, flatter "
+          "for a<1) before normalizing (default 1)\n"
+          "\n"
+          "--astar : find the -k best paths by A* search from the start state, expanding only the states "
+          "they need, instead of first computing the best path from every state.  with -m, the search is "
+          "guided by the sum of the best costs to final in each transducer composed (computed on those, not "
+          "on the result); otherwise it's unguided.  faster for small k; for large k (or when those costs are "
+          "far from the paths' costs), the usual k-best can be faster.  needs all weights at most 1 (else the "
+          "usual k-best is used).  paths of equal cost may come out in a different order\n";
+
+  cout << "\n"
+          "--arc-posteriors : (acyclic results) replace each arc's weight by its posterior probability: the "
+          "sum of the paths through the arc over the sum of all paths\n"
+          "\n"
+          "--confusion-network : (acyclic results) for each position of the output yield (input with -I), "
+          "print a line of each symbol with its posterior probability at that position, best first (*e*: "
+          "the yield was shorter), then an empty line.  computed by forward-backward, in time linear in the "
+          "result times its longest yield\n"
+          "\n"
+          "--consensus : (acyclic results) print the yield of the best symbol at each position, as in "
+          "--confusion-network\n";
+
+  cout << "\n"
+          "--permute-window=w : for -P, only the reorderings where each word is one of the w input positions "
+          "starting at the first word not yet used (w=1 is the input as is).  the lattice has at most "
+          "n*2^(w-1) states instead of 2^n, so -P works on long inputs\n";
+
+  cout << "\n"
+          "--threads=N : with -S, score up to N input/output pairs at once (output is still in input "
+          "order).  with --mbr, compute that many edit distances at once.  with -g or -G, generate on N "
+          "threads, each with its own random numbers seeded from -R (the output is the same for the same -R "
+          "and N).  in training (and -n), normalize large transducers' groups on N threads\n";
+
   cout << "\n"
           "--sum : show (before and after --post-b) product of final transducer's sum-of-paths "
           "(acyclic-correct only), as prob and per-input-ppx.\n"
@@ -6,11 +6,14 @@
  */
 
 #include <graehl/shared/array.hpp>
+#include <graehl/shared/compressed_file.hpp>
 #include <graehl/shared/dynamic_array.hpp>
 #include <carmel/src/fst.h>
 #include <carmel/src/derivations.h>
 #include <graehl/shared/slist.h>
 #include <boost/pool/object_pool.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <vector>
 
 namespace graehl {
 // WARNING: thread unsafe for gibbs operator[](arc if trivial) identity node
@@ -23,11 +26,11 @@ struct cascade_parameters {
   void write_trained(std::string const& suffix, bool* flags, std::string* filenames, bool show0 = false) {
     for (unsigned i = 0, n = cascade.size(); i < n; ++i) {
       std::string const& f = filenames[i];
-      std::string const& f_trained = suffix.empty() ? f : (f + "." + suffix);
+      std::string const& f_trained = suffix.empty() ? f : suffixed_filename(f, suffix);
       Config::log() << "Writing " << suffix << ' ' << f << " to " << f_trained << std::endl;
-      std::ofstream of(f_trained.c_str());
-      WFST::output_format(flags, &of);
-      cascade[i]->writeLegible(of, show0);
+      boost::scoped_ptr<std::ostream> of(new_output_file(f_trained));
+      WFST::output_format(flags, of.get());
+      cascade[i]->writeLegible(*of, show0);
     }
   }
 
@@ -100,7 +103,6 @@ struct cascade_parameters {
   void fem_norms(std::ostream& o, arcid_type const& aid, WFST& w, WFST::NormalizeMethod const& nm) const {
     WFST::norm_group_by group = nm.group;
     if (group == WFST::NONE) return;
-    if (group == WFST::CONDITIONAL) w.indexInput();
 #include <graehl/shared/warning_push.h>
     GCC_DIAG_IGNORE(maybe-uninitialized)
     for (NormGroupIter g(group, w); g.moreGroups(); g.nextGroup()) {
@@ -206,6 +208,7 @@ struct cascade_parameters {
   // to single chain (if trivial).  note: this simplification hasn't actually been done yet.
   void set_composed(WFST* c) {
     pcomposed = c;
+    flat.clear();
     if (trivial) cascade.reinit(1, pcomposed);
   }
   bool trivial;  // if true, we're not using cascade_parameters to do anything
@@ -239,10 +242,123 @@ struct cascade_parameters {
       pcomposed->visit_arcs(*this);
     }
   }
-  void operator()(unsigned s, FSTArc& a) { chains.at_grow(a.groupId) = pool.construct(&a, (chain_t)0); }
+  void operator()(unsigned s, FSTArc& a) {
+    chains.at_grow(a.groupId) = pool.construct(&a, (chain_t)0);
+    flat.clear();
+  }
 
   std::vector<Weight> chain_weights;
   typedef FSTArc::group_t chain_id;
+
+  // chains (which are only consulted element by element for gibbs and fem_deriv) flattened for the per
+  // iteration update/distribute_counts: node i>0 is arc[i] followed by node next[i] < i; node 0 is the empty
+  // chain.  equal (arc, rest) suffixes are hash-consed to a single node, so chain weights are one multiply
+  // per node in increasing order, and counts one add per node in decreasing order.  the composed arcs (a
+  // linked list per state) are also kept in an array, with their chains' first nodes.
+  struct flat_chains {
+    std::vector<param> arc;
+    std::vector<unsigned> next;
+    std::vector<unsigned> head;  // [chain_id]: first node
+    std::vector<Weight> w;  // [node]: product of its chain suffix (weigh), or its count (distribute_counts)
+    std::vector<FSTArc*> composed_arc;
+    std::vector<unsigned> composed_head;  // [i]: head[composed_arc[i]->groupId]
+
+    bool stale(chains_t const& chains) const { return head.size() != chains.size(); }
+    void clear() { head.clear(); }
+    unsigned size() const { return arc.size(); }
+
+    void build(chains_t const& chains, WFST& composed) {
+      arc.assign(1, (param)0);
+      next.assign(1, 0);
+      consed.clear();
+      consed.rehash(chains.size());
+      head.resize(chains.size());
+      std::vector<param> rev;
+      for (unsigned c = 0, e = chains.size(); c != e; ++c) {
+        rev.clear();
+        for (chain_t p = chains[c]; p; p = p->next) rev.push_back(p->data);
+        unsigned n = 0;
+        for (unsigned i = rev.size(); i;) n = cons(rev[--i], n);
+        head[c] = n;
+      }
+      consed.clear();
+      composed_arc.clear();
+      composed_head.clear();
+      WFST::StateVector& st = composed.states;
+      for (WFST::StateVector::iterator i = st.begin(), e = st.end(); i != e; ++i) {
+        State::Arcs& arcs = i->arcs;
+        for (State::Arcs::val_iterator l = arcs.val_begin(), end = arcs.val_end(); l != end; ++l) {
+          assert(l->groupId < head.size());
+          composed_arc.push_back(&*l);
+          composed_head.push_back(head[l->groupId]);
+        }
+      }
+    }
+
+    void weigh(std::vector<Weight>& chain_weights) {
+      unsigned n = arc.size();
+      w.resize(n);
+      w[0] = Weight::ONE();
+      for (unsigned i = 1; i != n; ++i) w[i] = arc[i]->weight * w[next[i]];
+      chain_weights.resize(head.size());
+      for (unsigned c = 0, e = head.size(); c != e; ++c) chain_weights[c] = w[head[c]];
+    }
+
+    // composed arc weights from the last weigh
+    void update_composed() {
+      for (unsigned i = 0, e = composed_arc.size(); i != e; ++i)
+        composed_arc[i]->weight = w[composed_head[i]];
+    }
+
+    // from the composed arc counts, add to the (unlocked) chain arcs' weights
+    void distribute_counts() {
+      w.assign(arc.size(), Weight());
+      for (unsigned i = 0, e = composed_arc.size(); i != e; ++i) {
+        Weight c = composed_arc[i]->weight;
+        if (!c.isZero()) w[composed_head[i]] += c;
+      }
+      for (unsigned i = arc.size(); --i;) {
+        Weight c = w[i];
+        if (c.isZero()) continue;
+        if (!arc[i]->isLocked()) arc[i]->weight += c;
+        if (next[i]) w[next[i]] += c;
+      }
+    }
+
+   private:
+    struct cons_key {
+      typedef cons_key self_type;
+      param arc;
+      unsigned next;
+      cons_key(param arc, unsigned next) : arc(arc), next(next) {}
+      bool operator==(cons_key const& o) const { return arc == o.arc && next == o.next; }
+      std::size_t hash() const {
+        return mix_hash(uint32_hash((boost::uint32_t)((std::size_t)arc >> 3)), next);
+      }
+      MEMBER_HASH
+    };
+    typedef HashTable<cons_key, unsigned> consed_t;  // -> node
+    consed_t consed;
+
+    unsigned cons(param a, unsigned rest) {
+      consed_t::insert_result_type ins = consed.insert(cons_key(a, rest), (unsigned)arc.size());
+      if (ins.second) {
+        arc.push_back(a);
+        next.push_back(rest);
+      }
+      return ins.first->second;
+    }
+  };
+  flat_chains flat;
+
+  void flatten_chains() {
+    if (flat.stale(chains)) {
+      flat.build(chains, composed());
+      if (debug & DEBUG_CHAINS)
+        Config::debug() << "flattened " << chains.size() << " chains to " << flat.size() << " nodes\n";
+    }
+  }
+
   boost::object_pool<node_t> pool;
   chain_id nil_chain;
   unsigned debug;  // bitfield
@@ -302,26 +418,15 @@ struct cascade_parameters {
     distribute_chain_counts(chains[id], counts);
   }
 
-  struct arcs_table_distribute_counts {
-    cascade_parameters& cascade;
-    arcs_table_distribute_counts(cascade_parameters& cascade) : cascade(cascade) {}
-    void operator()(unsigned /*source*/, FSTArc const& a) const {
-      // note: using weight which is, after prep_new_weights, including the global prior. //FIXME: per-arc
-      // prior in original transducers also
-      cascade.distribute_chain_id_counts(a.groupId, a.weight);
-    }
-  };
-
   WFST& composed() const { return *pcomposed; }
 
   // take counts from composed, and add them to chain arcs' weight.  (clear_counts() 0s weight out first)
-  void distribute_counts()
-  // arcs_table &at
-  {
+  void distribute_counts() {
     if (trivial) return;
     clear_counts();
-    arcs_table_distribute_counts v(*this);
-    composed().visit_arcs(v);
+    flatten_chains();
+    // note: using weight which is, after prep_new_weights, including the global prior.
+    flat.distribute_counts();
   }
 
   dynamic_array<WFST::saved_weights_t> none_saves;
@@ -365,6 +470,7 @@ struct cascade_parameters {
 
   void set_trivial() {
     chain_weights.clear();
+    flat.clear();
     //        chains.clear();
     epsilon_chains.clear();
     trivial = true;
@@ -421,15 +527,10 @@ struct cascade_parameters {
     for (; p; p = p->next) w *= p->data->weight;
   }
 
-  // todo: using structure of composition, could perhaps use the shared structure to reduce number of
-  // accumulates (linked list by index might be tricky but possible, toposort dependencies then go?
+  // recall, nil chain gets ONE as it's an empty list
   void calculate_chain_weights() {
-    chain_weights.clear();
-    chain_weights.resize(chains.size(), Weight::ONE());
-    for (unsigned i = 0, e = chains.size(); i != e; ++i) {
-      accumulate_chain(chain_weights[i],
-                       chains[i]);  // recall, nil chain will keep the default ONE as it's an empty list
-    }
+    flatten_chains();
+    flat.weigh(chain_weights);
   }
 
   void print(std::ostream& o, bool cascade = true, bool chains = true) {
@@ -468,12 +569,7 @@ struct cascade_parameters {
     if (debug & DEBUG_COMPOSED) Config::debug() << "composed pre:\n" << composed() << std::endl;
     // composed has groupids that are indices into chains, unless trivial
     calculate_chain_weights();
-    WFST::StateVector& st = composed().states;
-    for (WFST::StateVector::iterator i = st.begin(), e = st.end(); i != e; ++i) {
-      State::Arcs& arcs = i->arcs;
-      for (State::Arcs::val_iterator l = arcs.val_begin(), end = arcs.val_end(); l != end; ++l)
-        update_composed_arc(*l);
-    }
+    flat.update_composed();
     print(Config::debug(), debug & DEBUG_CASCADE, debug & DEBUG_CHAINS);
     if (debug & DEBUG_COMPOSED) Config::debug() << "composed post:\n" << composed() << std::endl;
   }
@@ -640,6 +736,7 @@ struct cascade_parameters {
     r.rewrite_arcs(composed());
     r.newids.do_moves(chains);
     chain_weights.clear();
+    flat.clear();
     debug_chains(d, "compress chains post", v);
   }
 
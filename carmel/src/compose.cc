@@ -4,155 +4,172 @@
 #include <carmel/src/fst.h>
 #include <carmel/src/cascade.h>
 #include <graehl/shared/array.hpp>
+#include <graehl/shared/flat_uint64_map.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <queue>
+#include <vector>
 #include <cstring>
 
 namespace graehl {
 
 unsigned WFST::indexThreshold = 12;
-unsigned TrioKey::gAStates = 0;
-unsigned TrioKey::gBStates = 0;
-
-
-// FIXME: use stringstream so there are no artifical name length limits
-struct TrioNamer {
-  char* buf, *buf_escape;
-  const WFST& a;
-  const WFST& b;
-  char* limit;
-  BOOST_STATIC_CONSTANT(unsigned, n_char = 1 << (8 * sizeof(char)));
-  BOOST_STATIC_CONSTANT(char, escape = '\\');
-  bool special[n_char];
-  bool needs_escape;
-
-  TrioNamer(unsigned capacity, const WFST& a_, const WFST& b_) : a(a_), b(b_) {
-    buf = (char*)::operator new(capacity);
-    buf_escape = (char*)::operator new(2 * capacity + 3);
-    limit = buf + capacity - 6;  // shoudl be 4: end of string, | <filter-state> |.  but 6 to be safe.
-    Assert(limit > buf);
-    std::memset((char*)special, 0, sizeof(bool) * n_char);
-    special[(unsigned)escape] = special[(unsigned)' '] = special[(unsigned)'('] = special[(unsigned)')'] = 1;
-    needs_escape = false;
-  }
-  ~TrioNamer() {
-    ::operator delete(buf);
-    ::operator delete(buf_escape);
-  }
 
-  bool should_quote() const {
-    if (buf[0] == '"') return true;
-    for (char* p = buf; *p; ++p) {
-      if (*p == '(' || *p == ')' || *p == ' ')  //*p=='\n' || *p=='\t'
-        return true;
+
+namespace {
+
+// best cost (-log weight) from each state of w to its final state
+void costs_to_final(WFST& w, std::vector<FLOAT_TYPE>& h) {
+  h.resize(w.numStates());
+  Graph g = w.makeGraph();
+  Graph rev = reverseGraph(g);
+  shortestDistancesFrom(rev, w.final, &h[0]);
+  freeGraph(rev);
+  freeGraph(g);
+}
+
+bool weights_at_most_1(WFST const& w) {
+  for (unsigned s = 0, n = w.numStates(); s < n; ++s)
+    for (List<FSTArc>::const_iterator a = w.states[s].arcs.const_begin(), e = w.states[s].arcs.const_end();
+         a != e; ++a)
+      if (a->weight.getLogImp() > 0) return false;
+  return true;
+}
+
+// compose_prune: agenda ordered by best path cost so far + cost to final (a lower bound on the best full
+// path, and consistent since the completions are exact best paths in a and b), and the arcs leaving the
+// state being expanded, kept or dropped all at once when it's done
+struct compose_best_first {
+  struct candidate {
+    TrioKey dest;
+    unsigned in, out;
+    Weight weight;
+    FSTArc::group_t group;
+    FLOAT_TYPE cost;  // of arc + dest to final
+  };
+  struct entry {
+    FLOAT_TYPE priority, cost;
+    TrioID t;
+    bool operator<(entry const& o) const { return priority > o.priority; }
+  };
+  std::priority_queue<entry> agenda;
+  std::vector<FLOAT_TYPE> cost;  // [composed state]: best path cost so far
+  std::vector<bool> expanded;  // [composed state]
+  std::vector<candidate> pending;
+  std::vector<FLOAT_TYPE> ha, hb;  // [a state], [b state]: cost to final (0 without heuristic)
+  FLOAT_TYPE ratio, beam, cutoff;  // cutoff: worst full path cost we keep, once we know the best
+  unsigned afinal, bfinal;
+
+  compose_best_first(WFST& a, WFST& b, compose_prune const& prune)
+      : ratio(prune.keep_paths_within_ratio.isInfinity() ? HUGE_VAL : prune.keep_paths_within_ratio.getLogImp())
+      , beam(prune.state_beam.isInfinity() ? HUGE_VAL : prune.state_beam.getLogImp())
+      , cutoff(HUGE_VAL)
+      , afinal(a.final)
+      , bfinal(b.final) {
+    if (prune.heuristic) {
+      costs_to_final(a, ha);
+      costs_to_final(b, hb);
+    } else {
+      ha.resize(a.numStates());
+      hb.resize(b.numStates());
     }
-    return false;
   }
 
-  char const* finish() {
-    //        if (needs_escape) {
-    if (should_quote()) {
-      needs_escape = false;
-      char* o = buf_escape;
-      *o++ = '"';
-      for (char* p = buf; *p; ++p) {
-        if (*p == '"' || *p == escape) *o++ = escape;
-        *o++ = *p;
-      }
-      *o++ = '"';
-      *o = 0;
-      return buf_escape;
-    }
-    return buf;
+  FLOAT_TYPE h(TrioKey const& t) const { return ha[t.qa] + hb[t.qb]; }
+
+  void add(TrioKey const& dest, unsigned in, unsigned out, Weight weight, FSTArc::group_t group) {
+    candidate c;
+    c.dest = dest;
+    c.in = in;
+    c.out = out;
+    c.weight = weight;
+    c.group = group;
+    c.cost = weight.getCost() + h(dest);
+    pending.push_back(c);
   }
 
-  void append_safe(char*& p, char const* str) {
-    for (; *str && p < limit; ++str) {
-      if (special[(unsigned)(*p++ = *str)]) needs_escape = true;
+  // pending candidates from a state with best path cost 'from' cost more than this
+  FLOAT_TYPE pending_limit(FLOAT_TYPE from) const {
+    FLOAT_TYPE limit = cutoff - from;
+    if (beam != HUGE_VAL && !pending.empty()) {
+      FLOAT_TYPE best = pending[0].cost;
+      for (std::size_t i = 1, n = pending.size(); i < n; ++i)
+        if (pending[i].cost < best) best = pending[i].cost;
+      if (best + beam < limit) limit = best + beam;
     }
-
-    if (*str)
-#define STATENAME_TOO_LONG_ERROR_TEXT(x) "state name too long - exceeded " #x
-      throw std::runtime_error(STATENAME_TOO_LONG_ERROR_TEXT(MAX_STATENAME_LEN));
+    return limit;
   }
 
-  char const* make(unsigned qa, unsigned qb, char filter) {
-    char* p = buf;
-    append_safe(p, a.stateName(qa));
-    *p++ = '|';
-    *p++ = filter + '0';
-    *p++ = '|';
-    append_safe(p, b.stateName(qb));
-    *p = 0;
-    return finish();
+  void reach(unsigned id, TrioKey const& t, FLOAT_TYPE c) {
+    if (id >= cost.size()) {
+      cost.resize(id + 1, HUGE_VAL);
+      expanded.resize(id + 1);
+    }
+    if (expanded[id] || !(c < cost[id])) return;
+    cost[id] = c;
+    entry e;
+    e.cost = c;
+    e.priority = c + h(t);
+    e.t.num = id;
+    e.t.tri = t;
+    agenda.push(e);
   }
-  char const* make_mediate(unsigned astate, unsigned bstate, unsigned middle_letter) {
-    char* p = buf;
-    append_safe(p, b.stateName(bstate));
-    *p++ = ',';
-    append_safe(p, a.outLetter(middle_letter));
-    *p++ = '-';
-    *p++ = '>';
-    append_safe(p, a.stateName(astate));
-    *p = 0;
-    return finish();
+
+  bool pop(TrioID& t) {
+    while (!agenda.empty()) {
+      entry e = agenda.top();
+      if (e.priority > cutoff) break;
+      agenda.pop();
+      unsigned id = e.t.num;
+      if (expanded[id] || e.cost != cost[id]) continue;  // stale
+      expanded[id] = true;
+      t = e.t;
+      if (t.tri.qa == afinal && t.tri.qb == bfinal && cutoff == HUGE_VAL) cutoff = e.priority + ratio;
+      return true;
+    }
+    return false;
   }
 };
 
-//#define OLDCOMPOSEARC
+}
+
 #ifdef DEBUGCOMPOSE
 #define DUMPARC(a, b, c, d) Config::debug() << "arc" << FSTArc(a, b, c, d)
 #else
 #define DUMPARC(a, b, c, d)
 #endif
 
-#ifdef OLDCOMPOSEARC
-#define COMPOSEARC                                                          \
-  do {                                                                      \
-    if ((pDest = find_second(stateMap, triDest))) {                         \
-      states[sourceState].addArc(FSTArc(in, out, *pDest, weight));          \
-    } else {                                                                \
-      add(stateMap, triDest, numStates());                                  \
-      trioID.num = numStates();                                             \
-      trioID.tri = triDest;                                                 \
-      queue.push(trioID);                                                   \
-      states[sourceState].addArc(FSTArc(in, out, trioID.num, weight));      \
-      push_back(states);                                                    \
-      if (namedStates) {                                                    \
-        stateNames.add(namer.make(triDest.qa, triDest.qb, triDest.filter)); \
-      }                                                                     \
-    }                                                                       \
-  } while (0)
-#else
-
-// uses: stateMap[triDest] states, queue, in, out, weight, [namedStates,stateNames,namer,buf]
-
-#define COMPOSEARC_GROUP(g)                                                                             \
-  do {                                                                                                  \
-    hash_traits<HashTable<TrioKey, unsigned> >::insert_result_type i;                                   \
-    if ((i = stateMap.insert(HashTable<TrioKey, unsigned>::value_type(triDest, numStates()))).second) { \
-      trioID.num = numStates();                                                                         \
-      trioID.tri = triDest;                                                                             \
-      queue.push(trioID);                                                                               \
-      push_back(states);                                                                                \
-      if (namedStates) stateNames.add(namer.make(triDest.qa, triDest.qb, triDest.filter), trioID.num);  \
-    } else                                                                                              \
-      trioID.num = i.first->second;                                                                     \
-    states[sourceState].addArc(FSTArc(in, out, trioID.num, weight, g));                                 \
-    DUMPARC(in, out, trioID.num, weight);                                                               \
+// uses: stateMap[triDest] states, queue, in, out, weight, [names], [best]
+
+#define COMPOSEARC_GROUP(g)                                                             \
+  do {                                                                                  \
+    if (best) {                                                                         \
+      best->add(triDest, in, out, weight, g);                                           \
+      break;                                                                            \
+    }                                                                                   \
+    std::pair<unsigned*, bool> i = stateMap.insert(triDest.packed(), numStates());      \
+    if (i.second) {                                                                     \
+      trioID.num = numStates();                                                         \
+      trioID.tri = triDest;                                                             \
+      queue.push(trioID);                                                               \
+      push_back(states);                                                                \
+      if (names) names->add(triDest.qa, triDest.qb, triDest.filter);                    \
+    } else                                                                              \
+      trioID.num = *i.first;                                                            \
+    states[sourceState].addArc(FSTArc(in, out, trioID.num, weight, g));                 \
+    DUMPARC(in, out, trioID.num, weight);                                               \
   } while (0)
 
 #define COMPOSEARC COMPOSEARC_GROUP(FSTArc::no_group)
-#endif
 
 
-WFST::WFST(cascade_parameters& cascade, WFST& a, WFST& b, bool namedStates, bool groups) {
-  init_index();
+WFST::WFST(cascade_parameters& cascade, WFST& a, WFST& b, bool namedStates, bool groups,
+           compose_prune const& prune) {
   alph[0] = alph[1] = 0;
   owner_alph[0] = owner_alph[1] = 0;
-  set_compose(cascade, a, b, namedStates, groups);
+  set_compose(cascade, a, b, namedStates, groups, prune);
 }
 
 WFST::WFST(WFST& a, WFST& b, bool namedStates, bool preserveGroups) {
-  init_index();
   alph[0] = alph[1] = 0;
   owner_alph[0] = owner_alph[1] = 0;
   cascade_parameters c;
@@ -160,7 +177,8 @@ WFST::WFST(WFST& a, WFST& b, bool namedStates, bool preserveGroups) {
 }
 
 
-void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool namedStates, bool preserveGroups) {
+void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool namedStates, bool preserveGroups,
+                       compose_prune const& prune) {
   deleteAlphabet();
   owner_alph[0] = owner_alph[1] = 0;
   alph[0] = a.alph[0];
@@ -175,26 +193,31 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
     return;
   }
 
+  if (a.numStates() > TrioKey::max_qa) throw std::runtime_error("too many states to compose");
+
+  boost::scoped_ptr<compose_best_first> best;
+  if (prune.enabled()) {
+    if (preserveGroups)
+      Config::warn() << "Pruning during composition isn't supported with -a; composing without it.\n";
+    else if (!(weights_at_most_1(a) && weights_at_most_1(b)))
+      Config::warn() << "Pruning during composition needs weights <= 1; composing without it.\n";
+    else
+      best.reset(new compose_best_first(a, b, prune));
+  }
+
   unsigned* map = NEW unsigned[aout.size()];
   unsigned* revMap = NEW unsigned[bin.size()];
   Assert(aout.verify());
   Assert(bin.verify());
-  TrioNamer namer(MAX_STATENAME_LEN + 1, a, b);
   aout.computeMap(bin, map);  // find matching symbols in interfacing alphabet
   bin.computeMap(aout, revMap);
   Assert(map[0] == 0);
   Assert(revMap[0] == 0);  // *e* always 0
-  TrioKey::gAStates = a.numStates();  // used in hash function
-  TrioKey::gBStates = b.numStates();
-
-  HashTable<TrioKey, unsigned> stateMap(2 * (a.numStates() + b.numStates()));  // assign state numbers
+  flat_uint64_map stateMap(a.numStates() + b.numStates());  // assign state numbers
   // to composite states in the order they are first visited
 
   List<TrioID> queue;
   unsigned sourceState = ~0;
-#ifdef OLDCOMPOSEARC
-  unsigned* pDest;
-#endif
   unsigned in, out;
   Weight weight;
   TrioKey triSource, triDest;
@@ -203,18 +226,24 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
   trioID.tri = TrioKey(0, 0, 0);
   states.clear();
 
-  stateMap[trioID.tri] = 0;  // add the initial state
+  stateMap.insert(trioID.tri.packed(), 0);  // add the initial state
   push_back(states);
+  stateNames.clear();
+  shared_names.reset();
+  named_states = false;
+  composed_state_names* names = 0;  // owned by shared_names
+  std::vector<unsigned> mediate_letter;  // [hidden letter] index in names->letters, or ~0
   if (namedStates) {
-    stateNames.clear();
-    stateNames.add(namer.make(0, 0, 0), 0);
+    shared_names.reset(names = NEW composed_state_names(a.share_state_names(), b.share_state_names()));
+    names->add(0, 0, 0);
     named_states = true;
-  } else {
-    named_states = false;
   }
-  queue.push(trioID);
+  if (best)
+    best->reach(0, trioID.tri, 0);
+  else
+    queue.push(trioID);
 
-  List<HalfArc>* matches;
+  letter_index::range matches;
 
   if (preserveGroups) {  // use simpler 2 state filter since e transitions cannot be merged anyhow
     /* 2 state filter:
@@ -235,21 +264,19 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
       triSource = queue.top().tri;
       queue.pop();
       State* qa = &a.states[triSource.qa], * qb = &b.states[triSource.qb];
-      qa->indexBy(kOutput);
-      qb->indexBy(kInput);
-      const HashTable<UnsignedKey, List<HalfArc> >& aindex = *qa->index;
-      for (HashTable<UnsignedKey, List<HalfArc> >::const_iterator ll = aindex.begin(); ll != aindex.end();
-           ++ll) {
+      letter_index const& aindex = qa->indexBy(kOutput);
+      letter_index const& bindex = qb->indexBy(kInput);
+      for (unsigned g = 0, ng = aindex.size(); g < ng; ++g) {
+        letter_index::range ll = aindex.arcs(g);
         HalfArcState mediate;
-        mediate.l_hiddenLetter = ll->first;
+        mediate.l_hiddenLetter = aindex.letter(g);
         mediate.r_source = triSource.qb;
-        if (ll->first == EMPTY) {
+        if (mediate.l_hiddenLetter == EMPTY) {
           if (triSource.filter == 0) {
             out = EMPTY;
             triDest.filter = 0;
             triDest.qb = triSource.qb;
-            for (List<HalfArc>::const_iterator l = ll->second.const_begin(), end = ll->second.const_end();
-                 l != end; ++l) {
+            for (letter_index::iterator l = ll.begin(), end = ll.end(); l != end; ++l) {
               HalfArc const& la = *l;  // arc from a
               weight = la->weight;
               triDest.qa = la->dest;
@@ -257,9 +284,8 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
               COMPOSEARC_GROUP(cascade.record1(la));
             }
           }
-        } else if ((matches = find_second(*qb->index, (UnsignedKey)map[mediate.l_hiddenLetter]))) {
-          for (List<HalfArc>::const_iterator l = ll->second.const_begin(), end = ll->second.const_end();
-               l != end; ++l) {
+        } else if (!(matches = bindex.find(map[mediate.l_hiddenLetter])).empty()) {
+          for (letter_index::iterator l = ll.begin(), end = ll.end(); l != end; ++l) {
             HalfArc const& la = *l;
             mediate.l_dest = la->dest;
             unsigned mediateState = numStates();
@@ -268,17 +294,22 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
             if ((ins = arcStateMap.insert(HAT::value_type(mediate, mediateState))).second) {
               // populate new mediateState
               push_back(states);
-              if (namedStates)
-                stateNames.add(namer.make_mediate(mediate.l_dest, mediate.r_source, mediate.l_hiddenLetter),
-                               mediateState);
+              if (names) {
+                if (mediate_letter.empty()) mediate_letter.resize(aout.size(), (unsigned)~0);
+                unsigned& letter = mediate_letter[mediate.l_hiddenLetter];
+                if (letter == (unsigned)~0) {
+                  letter = names->letters.size();
+                  names->letters.push_back(a.outLetter(mediate.l_hiddenLetter));
+                }
+                names->add(mediate.l_dest, mediate.r_source, composed_state_names::kMediate + letter);
+              }
               unsigned temp = sourceState;
               {
                 sourceState = mediateState;
                 triDest.qa = mediate.l_dest;
                 in = EMPTY;
                 triDest.filter = 0;
-                for (List<HalfArc>::const_iterator r = matches->const_begin(), end = matches->const_end();
-                     r != end; ++r) {
+                for (letter_index::iterator r = matches.begin(), end = matches.end(); r != end; ++r) {
                   HalfArc const& ra = *r;  // arc from b
                   Assert(map[la->out] == ra->in);
                   out = ra->out;
@@ -296,12 +327,11 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
           }
         }
       }
-      if ((matches = find_second(*qb->index, (UnsignedKey)EMPTY))) {
+      if (!(matches = bindex.find(EMPTY)).empty()) {
         in = EMPTY;
         triDest.qa = triSource.qa;
         triDest.filter = 1;
-        for (List<HalfArc>::const_iterator r = matches->const_begin(), end = matches->const_end(); r != end;
-             ++r) {
+        for (letter_index::iterator r = matches.begin(), end = matches.end(); r != end; ++r) {
           HalfArc const& ra = *r;
           Assert(ra->in == EMPTY);
           out = ra->out;
@@ -322,10 +352,14 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
        2->0 or 1->0 : a:c from a:b (l) b:c (r) where b != *e*
     */
 
-    while (queue.notEmpty()) {
-      sourceState = queue.top().num;
-      triSource = queue.top().tri;
-      queue.pop();
+    TrioID next;
+    while (best ? best->pop(next) : queue.notEmpty()) {
+      if (!best) {
+        next = queue.top();
+        queue.pop();
+      }
+      sourceState = next.num;
+      triSource = next.tri;
       State* larger;
       State* qa = &a.states[triSource.qa], * qb = &b.states[triSource.qb];
       if (qa->size > qb->size) {
@@ -334,7 +368,7 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
         larger = qb;
       }
       if (larger->size > WFST::indexThreshold) {
-        larger->indexBy(larger == qa ? kOutput : kInput);  // create hash table
+        letter_index const& index = larger->indexBy(larger == qa ? kOutput : kInput);
         if (larger == qb) {  // qb (rhs transducer) is larger
           for (List<FSTArc>::const_iterator l = qa->arcs.const_begin(), end = qa->arcs.const_end(); l != end;
                ++l) {
@@ -349,10 +383,9 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
                 COMPOSEARC_GROUP(cascade.record1(&*l));
               }
               if (triSource.filter == 0)
-                if ((matches = find_second(*qb->index, (UnsignedKey)EMPTY))) {
+                if (!(matches = index.find(EMPTY)).empty()) {
                   triDest.filter = 0;
-                  for (List<HalfArc>::const_iterator r = matches->const_begin(), end = matches->const_end();
-                       r != end; ++r) {
+                  for (letter_index::iterator r = matches.begin(), end = matches.end(); r != end; ++r) {
                     Assert((*r)->in == EMPTY);
                     out = (*r)->out;
                     weight = l->weight * (*r)->weight;
@@ -361,10 +394,9 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
                   }
                 }
             } else {
-              if ((matches = find_second(*qb->index, (UnsignedKey)map[l->out]))) {
+              if (!(matches = index.find(map[l->out])).empty()) {
                 triDest.filter = 0;
-                for (List<HalfArc>::const_iterator r = matches->const_begin(), end = matches->const_end();
-                     r != end; ++r) {
+                for (letter_index::iterator r = matches.begin(), end = matches.end(); r != end; ++r) {
                   Assert(map[l->out] == (*r)->in);
                   out = (*r)->out;  // FIXME: uninit
                   weight = l->weight * (*r)->weight;
@@ -374,12 +406,11 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
               }
             }
           }
-          if (triSource.filter != 1 && (matches = find_second(*qb->index, (UnsignedKey)EMPTY))) {
+          if (triSource.filter != 1 && !(matches = index.find(EMPTY)).empty()) {
             in = EMPTY;
             triDest.qa = triSource.qa;
             triDest.filter = 2;
-            for (List<HalfArc>::const_iterator r = matches->const_begin(), end = matches->const_end();
-                 r != end; ++r) {
+            for (letter_index::iterator r = matches.begin(), end = matches.end(); r != end; ++r) {
               Assert((*r)->in == EMPTY);
               out = (*r)->out;
               weight = (*r)->weight;
@@ -403,10 +434,9 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
                 COMPOSEARC_GROUP(cascade.record2(&*r));
               }
               if (triSource.filter == 0)
-                if ((matches = find_second(*qa->index, (UnsignedKey)EMPTY))) {
+                if (!(matches = index.find(EMPTY)).empty()) {
                   triDest.filter = 0;
-                  for (List<HalfArc>::const_iterator l = matches->const_begin(), end = matches->const_end();
-                       l != end; ++l) {
+                  for (letter_index::iterator l = matches.begin(), end = matches.end(); l != end; ++l) {
                     Assert((*l)->out == EMPTY);
                     in = (*l)->in;
                     weight = (*l)->weight * r->weight;
@@ -416,9 +446,8 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
                 }
             } else {
               triDest.filter = 0;
-              if ((matches = find_second(*qa->index, (UnsignedKey)revMap[r->in]))) {
-                for (List<HalfArc>::const_iterator l = matches->const_begin(), end = matches->const_end();
-                     l != end; ++l) {
+              if (!(matches = index.find(revMap[r->in])).empty()) {
+                for (letter_index::iterator l = matches.begin(), end = matches.end(); l != end; ++l) {
                   Assert(map[(*l)->out] == r->in);
                   in = (*l)->in;
                   weight = (*l)->weight * r->weight;
@@ -428,12 +457,11 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
               }
             }
           }
-          if (triSource.filter != 2 && (matches = find_second(*qa->index, (UnsignedKey)EMPTY))) {
+          if (triSource.filter != 2 && !(matches = index.find(EMPTY)).empty()) {
             out = EMPTY;
             triDest.qb = triSource.qb;
             triDest.filter = 1;
-            for (List<HalfArc>::const_iterator l = matches->const_begin(), end = matches->const_end();
-                 l != end; ++l) {
+            for (letter_index::iterator l = matches.begin(), end = matches.end(); l != end; ++l) {
               Assert((*l)->out == EMPTY);
               in = (*l)->in;
               weight = (*l)->weight;
@@ -495,6 +523,22 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
           }
         }
       }
+      if (best) {  // keep the pending arcs within the beam and cutoff
+        FLOAT_TYPE from = best->cost[sourceState], limit = best->pending_limit(from);
+        for (std::size_t i = 0, n = best->pending.size(); i < n; ++i) {
+          compose_best_first::candidate const& c = best->pending[i];
+          if (c.cost > limit || c.cost == HUGE_VAL) continue;
+          std::pair<unsigned*, bool> ins = stateMap.insert(c.dest.packed(), numStates());
+          unsigned dest = *ins.first;
+          if (ins.second) {
+            push_back(states);
+            if (names) names->add(c.dest.qa, c.dest.qb, c.dest.filter);
+          }
+          best->reach(dest, c.dest, from + c.weight.getCost());
+          states[sourceState].addArc(FSTArc(c.in, c.out, dest, c.weight, c.group));
+        }
+        best->pending.clear();
+      }
     }
   }
   delete[] map;
@@ -507,7 +551,7 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
   unsigned i;
   for (i = 0; i < 3; ++i) {
     triDest.filter = i;
-    if ((pFinal[i] = find_second(stateMap, triDest))) {
+    if ((pFinal[i] = stateMap.find(triDest.packed()))) {
       ++nFinal;
       final = *pFinal[i];
     }
@@ -519,7 +563,7 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
   if (nFinal > 1) {
     final = numStates();
     push_back(states);
-    if (namedStates) stateNames.add("final", final);
+    if (names) names->add(0, 0, composed_state_names::kFinal);
     for (i = 0; i < 3; ++i)
       if (pFinal[i]) {
         State& s = states[*pFinal[i]];
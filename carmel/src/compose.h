@@ -3,13 +3,15 @@
 
 #include <graehl/shared/myassert.h>
 #include <graehl/shared/2hash.h>
+#include <graehl/shared/hash_functions.hpp>
+#include <graehl/shared/weight.h>
+#include <boost/config.hpp>
+#include <stdint.h>
 
 
 namespace graehl {
 
 struct TrioKey {
-  static unsigned gAStates;
-  static unsigned gBStates;
   unsigned qa;
   unsigned qb;
   char filter;
@@ -19,10 +21,10 @@ struct TrioKey {
   TrioKey() {}
 
   TrioKey(unsigned a, unsigned b, char c) : qa(a), qb(b), filter(c) {}
-  size_t hash() const {
-    Assert(qa < gAStates && qb < gBStates);
-    return uint32_hash((gBStates * (filter * gAStates + qa) + qb));
-  }
+
+  /// unique (for qa < max_qa) key for flat_uint64_map: high word 3*qa+filter, low word qb
+  uint64_t packed() const { return (uint64_t)(3 * qa + (unsigned)filter) << 32 | qb; }
+  BOOST_STATIC_CONSTANT(unsigned, max_qa = 0x55555555);
 };
 
 
@@ -39,21 +41,29 @@ struct HalfArcState {
   HalfArcState() {}
 
   HalfArcState(unsigned a, unsigned b, unsigned c) : l_dest(a), r_source(b), l_hiddenLetter(c) {}
-  size_t hash() const {
-    return uint32_hash(TrioKey::gBStates * (l_hiddenLetter * TrioKey::gAStates + l_dest) + r_source);
-  }
+  size_t hash() const { return uint32_hash(hash3_fast(l_dest, r_source, l_hiddenLetter)); }
 };
 
 struct TrioID {
   unsigned num;
   TrioKey tri;
 };
-}
 
-BEGIN_HASH(graehl::TrioKey) {
-  return x.hash();
+/// pruning while composing (WFST::set_compose): states are expanded best first, by their best path so far
+/// times the best completions of their a and b states (an upper bound on their best full path), and we never
+/// create states or arcs that are beyond either limit
+struct compose_prune {
+  Weight keep_paths_within_ratio;  // like -w: skip states only on paths this many times worse than the best
+  Weight state_beam;  // skip arcs this many times worse than the best arc leaving the same state
+  bool heuristic;  // false: rank states by their best path so far alone
+
+  compose_prune() : heuristic(true) {
+    keep_paths_within_ratio.setInfinity();
+    state_beam.setInfinity();
+  }
+  bool enabled() const { return !(keep_paths_within_ratio.isInfinity() && state_beam.isInfinity()); }
+};
 }
-END_HASH
 
 BEGIN_HASH(graehl::HalfArcState) {
   return x.hash();
@@ -54,7 +54,4 @@ struct log_message_exception : public LogMessage
 
 #endif
 
-// allows WFST to be indexed in either direction?  not recommended. or tested lately.
-//#define BIDIRECTIONAL
-
 #endif
@@ -246,7 +246,7 @@ struct derivations {
     TO_OSTREAM_PRINT
   };
 
-  static statistics global_stats;
+  static THREADLOCAL statistics global_stats;  // per thread, for -S --threads
 
   double weight;
   unsigned lineno;
@@ -522,6 +522,13 @@ struct derivations {
     }
   }
 
+  // after loading, keep the reverse graph and order as compute(cache_backward=true) would have
+  void keep_backward() {
+    cache_backward = true;
+    make_reverse();
+    make_order();
+  }
+
   void free_extras()  // no longer needed after compute
   {
     cache_backward = false;
@@ -4,6 +4,9 @@
 #include <graehl/shared/kbest.h>
 #include <graehl/shared/array.hpp>
 #include <graehl/shared/genio.h>
+#include <graehl/shared/thread_group.hpp>
+#include <algorithm>
+#include <map>
 
 namespace graehl {
 
@@ -11,6 +14,7 @@ const int WFST::per_line_index = ios_base::xalloc();
 const int WFST::arc_format_index = ios_base::xalloc();
 THREADLOCAL int WFST::default_per_line = WFST::STATE;
 THREADLOCAL int WFST::default_arc_format = WFST::BRIEF;
+THREADLOCAL bool WFST::stream_writer = false;
 
 #define DP_SLIDE_36
 // slide 36 gives what seems like a bad norm method: scale(c)/scale(sum {c_i}).  slide 38 looks better:
@@ -21,158 +25,145 @@ void WFST::pruneArcs(Weight thresh) {
   for (unsigned s = 0, n = numStates(); s < n; ++s) states[s].prune(thresh);
 }
 
-unsigned WFST::generate(unsigned* inSeq, unsigned* outSeq, unsigned minArcs, unsigned bufLen) {
-  unsigned i, o, nArcs;
-  unsigned s;
-  indexInput();
-  unsigned maxArcs = bufLen - 1;
-  i = o = s = nArcs = 0;
-  for (;;) {
-    if (s == final && (states[s].arcs.isEmpty() || nArcs >= minArcs)) {
-      inSeq[i] = outSeq[o] = 0;
-      indexFlush();
-      return 1;
-    }
-    unsigned whichInput = (unsigned)(states[s].index->size() * randomFloat());
-    const HashTable<UnsignedKey, List<HalfArc> >& hat = *states[s].index;
-    for (HashTable<UnsignedKey, List<HalfArc> >::const_iterator ha = hat.begin(); ha != hat.end(); ++ha)
-      if (!whichInput--) {
-        Weight which = randomFloat();
-        Weight cum;
-
-        List<HalfArc>::const_iterator a, begin = ha->second.const_begin(), end = ha->second.const_end();
-
-        for (a = begin; a != end; ++a) {
-          cum += (*a)->weight;
-        }
-        which *= cum;
-        cum.setZero();
-        for (a = begin; a != end; ++a) {
-          if ((cum += (*a)->weight) >= which) {
-            if ((*a)->in) {
-              if (i >= maxArcs)
-                goto bad;
-              else
-                inSeq[i++] = (*a)->in;
-            }
-
-            if ((*a)->out) {
-              if (o >= maxArcs)
-                goto bad;
-              else
-                outSeq[o++] = (*a)->out;
-            }
-
-            s = (*a)->dest;
-            ++nArcs;
-            break;
-          }
-        }
-        if (a == end) {
-        bad:
-          indexFlush();
-          return 0;
-        }
-        break;
-      }
-  }
-}
-
 template <class charT, class Traits>
 std::basic_ostream<charT, Traits>& operator<<(std::basic_ostream<charT, Traits>& os, const NormGroupIter& arg) {
   return gen_inserter(os, arg);
 }
 
-void WFST::normalize(NormalizeMethod const& method, bool uniform_zero_normgroups) {
-  norm_group_by group = method.group;
+// the normalization groups as flat arrays: each group's arcs, with tie groups renumbered densely.  built once
+// and reused by every normalize while the arcs (and their inputs and tie groups) stay the same, e.g. over
+// the iterations of EM
+struct WFST::norm_plan {
+  enum { kNotTied = (unsigned)-1 };
+  struct arc_key {
+    FSTArc* arc;
+    unsigned in;
+    FSTArc::group_t group;
+  };
+  norm_group_by group;
+  std::vector<arc_key> arcs;  // what we were built from: each state's arcs, in list order
+  std::vector<unsigned> state_end;  // [state]: end in arcs
+  std::vector<FSTArc*> members;  // the arcs of each normalization group in turn
+  std::vector<unsigned> group_end;  // [group]: end in members
+  std::vector<unsigned> tie;  // [member]: dense tie group, or kNotTied
+  unsigned n_ties;
+  std::vector<Weight> sum, locked_sum;  // [group]
+  std::vector<Weight> tie_arcs, tie_states, tie_locked;  // [tie]
+
+  unsigned begin(unsigned g) const { return g ? group_end[g - 1] : 0; }
+
+  bool current(WFST const& x, norm_group_by by) const {
+    if (by != group || x.numStates() != state_end.size()) return false;
+    std::vector<arc_key>::const_iterator k = arcs.begin();
+    for (unsigned s = 0, n = x.numStates(); s < n; ++s) {
+      if (x.states[s].size != state_end[s] - (s ? state_end[s - 1] : 0)) return false;
+      State::Arcs const& l = x.states[s].arcs;
+      for (State::Arcs::const_iterator a = l.const_begin(), e = l.const_end(); a != e; ++a, ++k)
+        if (k->arc != &*a || k->in != a->in || k->group != a->groupId) return false;
+    }
+    return true;
+  }
 
-  if (group == NONE) return;
-  if (group == CONDITIONAL) indexInput();
+  struct by_in {
+    bool operator()(FSTArc const* a, FSTArc const* b) const { return a->in < b->in; }
+  };
+
+  // conditional groups are a state's arcs with the same input, in the order of the per-input index (reverse
+  // list order) so sums come out as they always have; joint groups are a state's arcs in list order
+  void build(WFST& x, norm_group_by by) {
+    group = by;
+    arcs.clear();
+    state_end.clear();
+    members.clear();
+    group_end.clear();
+    tie.clear();
+    std::map<FSTArc::group_t, unsigned> ties;
+    std::vector<FSTArc*> state_arcs;
+    for (unsigned s = 0, n = x.numStates(); s < n; ++s) {
+      state_arcs.clear();
+      State::Arcs& l = x.states[s].arcs;
+      for (State::Arcs::val_iterator a = l.val_begin(), e = l.val_end(); a != e; ++a) {
+        arc_key k = {&*a, a->in, a->groupId};
+        arcs.push_back(k);
+        state_arcs.push_back(&*a);
+      }
+      state_end.push_back(arcs.size());
+      if (state_arcs.empty()) continue;
+      if (by == CONDITIONAL) {
+        std::reverse(state_arcs.begin(), state_arcs.end());
+        std::stable_sort(state_arcs.begin(), state_arcs.end(), by_in());
+      }
+      for (std::vector<FSTArc*>::const_iterator a = state_arcs.begin(), e = state_arcs.end(); a != e; ++a) {
+        if (by == CONDITIONAL && a != state_arcs.begin() && (*a)->in != a[-1]->in)
+          group_end.push_back(members.size());
+        members.push_back(*a);
+        tie.push_back(isTied((*a)->groupId)
+                          ? ties.insert(std::make_pair((*a)->groupId, (unsigned)ties.size())).first->second
+                          : (unsigned)kNotTied);
+      }
+      group_end.push_back(members.size());
+    }
+    n_ties = ties.size();
+  }
+};
 
-  graehl::mean_field_scale const& scale = method.scale;
+THREADLOCAL unsigned WFST::normalize_threads = 1;
 
-  // NEW plan:
-  // step 1: compute sum of counts for non-locked arcs, and divide it by (1-(sum of locked arcs)) to reserve
-  // appropriate counts for the locked arcs
-  // step 2: for tied arc groups, add these inferred counts to the group state counts total.  also sum group
-  // arc counts total.
-  // step 3: assign tied arc weights; trouble: tied arcs sharing space with inflexible tied arcs.  under- or
-  // over- allocation can result ...
-  //   ... alternative: give locked arcs implied counts in the tie group; norm-group having tie-group arcs,
-  //   with highest locked arc sum R divides unscaled tie group state counts total by (1-R) instead of
-  //   dividing individual state counts by (1-sum).  this ensures that tied arcs are kept small enough to make
-  //   room for locked ones in ALL states and should leave some room for normal arcs as well
-  // step 4: give normal arcs their share of what's left, if anything
+namespace {
 
-  Weight addc = method.add_count;
-  unsigned pGroup;
-  HashTable<UnsignedKey, Weight> groupArcTotal;
-  HashTable<UnsignedKey, Weight> groupStateTotal;
-  HashTable<UnsignedKey, Weight> groupMaxLockedSum;
-// global pass 1: compute the sum of unnormalized weights for each normalization group.  sum for each arc in
-// a tie group, its weight and its normalization group's weight.
-#include <graehl/shared/warning_push.h>
-  GCC_DIAG_IGNORE(maybe-uninitialized)
-  for (NormGroupIter g(group, *this); g.moreGroups(); g.nextGroup()) {
-#include <graehl/shared/warning_pop.h>
-#ifdef DEBUGNORMALIZE
-    Config::debug() << "Normgroup=" << g;
-#endif
-    Weight sum, locked_sum;  // =0, sum of probability of all arcs that has this input
-    for (g.beginArcs(); g.moreArcs(); g.nextArc()) {
-      FSTArc& a = **g;
+// WFST::normalize's passes over groups first, first+stride, ...
+struct normalize_groups {
+  WFST::norm_plan* p;
+  WFST::NormalizeMethod const* method;
+  bool uniform_zero_normgroups;
+  unsigned first, stride;
+  bool assign;  // else sum
+
+  void operator()() {
+    for (unsigned g = first, n = p->group_end.size(); g < n; g += stride)
+      if (assign)
+        assign_weights(g);
+      else
+        sum(g);
+  }
+
+  // add the prior count, and sum the group's locked and other arcs
+  void sum(unsigned g) {
+    Weight addc = method->add_count;
+    Weight sum, locked_sum;
+    for (unsigned m = p->begin(g), e = p->group_end[g]; m < e; ++m) {
+      FSTArc& a = *p->members[m];
       Weight& w = a.weight;
       w += addc;
-      if (isLocked(a.groupId))  // note: training does not set any counts for locked arcs.  so this is the
-        // original weight
+      if (WFST::isLocked(a.groupId))  // note: training does not set any counts for locked arcs.  so this is
+        // the original weight
         locked_sum += w;
-      else {
+      else
         sum += w;
-      }
     }
 #ifdef DEBUGNORMALIZE
-    Config::debug() << " locked_sum=" << locked_sum << " sum=" << sum << std::endl;
-#endif
-    for (g.beginArcs(); g.moreArcs(); g.nextArc()) {
-      FSTArc const& a = **g;
-      if (isTied(pGroup = a.groupId)) {
-        groupArcTotal[pGroup] += a.weight;  // default init is to 0
-        groupStateTotal[pGroup] += sum;
-        Weight& m = groupMaxLockedSum[pGroup];
-        if (locked_sum > m) m = locked_sum;
-        NANCHECK(groupStateTotal[pGroup]);
-        NANCHECK(groupStateTotal[pGroup]);
-        NANCHECK(groupMaxLockedSum[pGroup]);
-#ifdef DEBUGNORMALIZE
-        Config::debug() << "Tiegroup=" << pGroup << " Normgroup=" << g
-                        << " tie_weight=" << groupArcTotal[pGroup]
-                        << " sum_state_weight=" << groupStateTotal[pGroup] << " max_locked=" << m << std::endl;
+    Config::debug() << "Normgroup=" << g << " locked_sum=" << locked_sum << " sum=" << sum << std::endl;
 #endif
-      }
-    }
+    p->sum[g] = sum;
+    p->locked_sum[g] = locked_sum;
   }
 
-
-// global pass 2: assign weights
-#include <graehl/shared/warning_push.h>
-  GCC_DIAG_IGNORE(maybe-uninitialized)
-  for (NormGroupIter g(group, *this); g.moreGroups(); g.nextGroup()) {
-#include <graehl/shared/warning_pop.h>
+  void assign_weights(unsigned g) {
+    graehl::mean_field_scale const& scale = method->scale;
     Weight normal_sum;  //=0
     Weight reserved;  // =0
-    Assert(reserved.isZero() && normal_sum.isZero());
     // pass 2a: assign tied (and locked) arcs their weights, taking 'reserved' weight from the normal arcs in
     // their group
     // tied arc weight = sum (over arcs in tie group) of weight / sum (over arcs in tie group) of
     // norm-group-total-weight
     // also, compute sum of normal arcs
-    for (g.beginArcs(); g.moreArcs(); g.nextArc()) {
-      FSTArc& a = **g;
-      if (isTied(pGroup = a.groupId)) {  // tied:
-        Weight groupNorm
-            = *find_second(groupStateTotal,
-                           (UnsignedKey)pGroup);  // can be 0 if no counts at all for any states of group
-        Weight gmax = *find_second(groupMaxLockedSum, (UnsignedKey)pGroup);
+    unsigned begin = p->begin(g), end = p->group_end[g];
+    for (unsigned m = begin; m < end; ++m) {
+      FSTArc& a = *p->members[m];
+      unsigned t = p->tie[m];
+      if (t != WFST::norm_plan::kNotTied) {  // tied:
+        Weight groupNorm = p->tie_states[t];  // can be 0 if no counts at all for any states of group
+        Weight gmax = p->tie_locked[t];
         NANCHECK(gmax);
         Weight one(1.);
         if (gmax > one) {
@@ -183,7 +174,7 @@ void WFST::normalize(NormalizeMethod const& method, bool uniform_zero_normgroups
           // worst case competing locked arcs sum in any norm-group
           NANCHECK(groupNorm);
 
-          Weight groupTotal = *find_second(groupArcTotal, (UnsignedKey)pGroup);
+          Weight groupTotal = p->tie_arcs[t];
           NANCHECK(groupTotal);
           if (!groupTotal.isZero()) {  // then groupNorm non0 also
             a.weight = scale(groupTotal) / scale(groupNorm);
@@ -193,7 +184,7 @@ void WFST::normalize(NormalizeMethod const& method, bool uniform_zero_normgroups
             a.weight.setZero();
           NANCHECK(reserved);
         }
-      } else if (isLocked(pGroup)) {  // locked:
+      } else if (WFST::isLocked(a.groupId)) {  // locked:
         reserved += a.weight;
         NANCHECK(reserved);
       } else {  // normal
@@ -203,7 +194,7 @@ void WFST::normalize(NormalizeMethod const& method, bool uniform_zero_normgroups
 
 #ifdef DEBUGNORMALIZE
     if (reserved > 1.001)
-      Config::warn() << "Warning: sum of reserved arcs for " << g << " = " << reserved
+      Config::warn() << "Warning: sum of reserved arcs for normgroup " << g << " = " << reserved
                      << " - should not exceed 1.0\n";
 #endif
 
@@ -215,32 +206,107 @@ void WFST::normalize(NormalizeMethod const& method, bool uniform_zero_normgroups
     if (something_left_for_normal && (uniform_zero_normgroups || !normal_sum.isZero())) {
       NANCHECK(normal_sum);
       Weight scaled_sum = scale(normal_sum);
-      for (g.beginArcs(); g.moreArcs(); g.nextArc()) {
-        FSTArc& a = **g;
-        if (isNormal(a.groupId)) {
+      for (unsigned m = begin; m < end; ++m) {
+        FSTArc& a = *p->members[m];
+        if (WFST::isNormal(a.groupId)) {
           a.weight = fraction_remain * scale(a.weight) / scaled_sum;
           NANCHECK(a.weight);
         }
       }
     } else  // nothing left, sorry
-      for (g.beginArcs(); g.moreArcs(); g.nextArc()) {
-        FSTArc& a = **g;
-        if (isNormal(a.groupId)) a.weight.setZero();
+      for (unsigned m = begin; m < end; ++m) {
+        FSTArc& a = *p->members[m];
+        if (WFST::isNormal(a.groupId)) a.weight.setZero();
       }
   }
+};
+
+struct run_normalize_groups {
+  normalize_groups* n;
+  void operator()() { (*n)(); }
+};
+
+}
+
+void WFST::normalize(NormalizeMethod const& method, bool uniform_zero_normgroups) {
+  norm_group_by group = method.group;
+
+  if (group == NONE) return;
+  if (!norm_cache) norm_cache.reset(new norm_plan);
+  norm_plan& p = *norm_cache;
+  if (!p.current(*this, group)) p.build(*this, group);
+
+  // NEW plan:
+  // step 1: compute sum of counts for non-locked arcs, and divide it by (1-(sum of locked arcs)) to reserve
+  // appropriate counts for the locked arcs
+  // step 2: for tied arc groups, add these inferred counts to the group state counts total.  also sum group
+  // arc counts total.
+  // step 3: assign tied arc weights; trouble: tied arcs sharing space with inflexible tied arcs.  under- or
+  // over- allocation can result ...
+  //   ... alternative: give locked arcs implied counts in the tie group; norm-group having tie-group arcs,
+  //   with highest locked arc sum R divides unscaled tie group state counts total by (1-R) instead of
+  //   dividing individual state counts by (1-sum).  this ensures that tied arcs are kept small enough to make
+  //   room for locked ones in ALL states and should leave some room for normal arcs as well
+  // step 4: give normal arcs their share of what's left, if anything
+
+  enum { kMinArcsPerThread = 1 << 14 };
+  unsigned n_groups = p.group_end.size();
+  unsigned n_threads = std::max(1u, normalize_threads), most = p.members.size() / kMinArcsPerThread;
+  if (n_threads > most) n_threads = std::max(1u, most);
+  if (n_threads > n_groups) n_threads = std::max(1u, n_groups);
+  p.sum.resize(n_groups);
+  p.locked_sum.resize(n_groups);
+  std::vector<normalize_groups> passes(n_threads);
+  for (unsigned t = 0; t < n_threads; ++t) {
+    normalize_groups& n = passes[t];
+    n.p = &p;
+    n.method = &method;
+    n.uniform_zero_normgroups = uniform_zero_normgroups;
+    n.first = t;
+    n.stride = n_threads;
+  }
+  for (unsigned assign = 0; assign < 2; ++assign) {
+    if (assign && p.n_ties) {
+      // between the passes: sum for each arc in a tie group, its weight and its normalization group's weight
+      p.tie_arcs.assign(p.n_ties, Weight());
+      p.tie_states.assign(p.n_ties, Weight());
+      p.tie_locked.assign(p.n_ties, Weight());
+      for (unsigned g = 0; g < n_groups; ++g)
+        for (unsigned m = p.begin(g), e = p.group_end[g]; m < e; ++m) {
+          unsigned t = p.tie[m];
+          if (t == norm_plan::kNotTied) continue;
+          p.tie_arcs[t] += p.members[m]->weight;  // default init is to 0
+          p.tie_states[t] += p.sum[g];
+          Weight& max_locked = p.tie_locked[t];
+          if (p.locked_sum[g] > max_locked) max_locked = p.locked_sum[g];
+          NANCHECK(p.tie_states[t]);
+          NANCHECK(max_locked);
+        }
+    }
+    // global pass 1 (sum) then 2 (assign weights)
+    for (unsigned t = 0; t < n_threads; ++t) passes[t].assign = assign;
+    if (n_threads == 1)
+      passes[0]();
+    else {
+      thread_group threads;
+      for (unsigned t = 0; t < n_threads; ++t) {
+        run_normalize_groups r = {&passes[t]};
+        threads.create_thread(r);
+      }
+      threads.join_all();
+    }
+  }
 
 #ifdef CHECKNORMALIZE
-  for (NormGroupIter g(group, *this); g.moreGroups(); g.nextGroup()) {
+  for (unsigned g = 0; g < n_groups; ++g) {
     Weight sum;
-    for (g.beginArcs(); g.moreArcs(); g.nextArc()) sum += (*g)->weight;
+    for (unsigned m = p.begin(g), e = p.group_end[g]; m < e; ++m) sum += p.members[m]->weight;
 #define NORM_EPSILON .01
     if (sum > 1 + NORM_EPSILON || sum < 1 - NORM_EPSILON)
-      Config::warn() << "Warning: sum of normalized arcs for " << g << " = " << sum
+      Config::warn() << "Warning: sum of normalized arcs for normgroup " << g << " = " << sum
                      << " - should equal 1.0\n";
   }
 #endif
-
-  if (group == CONDITIONAL) indexFlush();  // free up by-input index we created at start
 }
 
 void WFST::assignWeights(const WFST& source) {
@@ -533,7 +599,11 @@ void WFST::removeMarkedStates(bool marked[]) {
   unsigned n_pre = numStates();
 
   if (n_pre != graehl::indices_after_remove_marked(oldToNew, marked, n_pre)) {  // something removed
-    stateNames.removeMarked(marked, oldToNew, n_pre);
+    if (shared_names) {
+      if (!shared_names.unique()) shared_names = shared_names->clone();
+      shared_names->remove_marked(marked, oldToNew, n_pre);
+    } else
+      stateNames.removeMarked(marked, oldToNew, n_pre);
     remove_marked_swap(states, marked);  // states.removeMarked(marked);
     for (unsigned i = 0; i < states.size(); ++i) {
       states[i].renumberDestinations(oldToNew);
@@ -583,3 +653,8 @@ List<List<PathArc> >* WFST::randomPaths(unsigned k, unsigned max_len) {
 #include <carmel/src/wfstio.cc>
 
 #include <carmel/src/compose.cc>
+#include <carmel/src/minimize.cc>
+#include <carmel/src/image.cc>
+#include <carmel/src/mbr.cc>
+#include <carmel/src/posterior.cc>
+#include <carmel/src/astar.cc>
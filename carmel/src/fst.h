@@ -12,11 +12,17 @@
 #include <graehl/shared/myassert.h>
 #include <graehl/shared/size_mega.hpp>
 #include <graehl/shared/strhash.h>
+#include <graehl/shared/string_builder.hpp>
 #include <graehl/shared/threadlocal.hpp>
 #include <graehl/shared/weight.h>
+#include <graehl/shared/word_spacer.hpp>
 #include <boost/config.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/utility.hpp>
 #include <carmel/src/compose.h>
 #include <carmel/src/config.hpp>
+#include <carmel/src/state_names.h>
 #include <carmel/src/train.h>
 #include <algorithm>
 #include <cmath>
@@ -25,7 +31,9 @@
 #include <ctime>
 #include <iostream>
 #include <iterator>
+#include <locale>
 #include <sstream>
+#include <stdint.h>
 #include <vector>
 
 namespace graehl {
@@ -46,7 +54,53 @@ struct PathArc {
 
 std::ostream& operator<<(std::ostream& o, const PathArc& p);
 
+/// appends to buf exactly what o << would write for the chars, strings, unsigneds and Weights (in o's
+/// Weight output format) that writeLegible and path_print print, for writing to o all at once
+struct legible_buffer {
+  enum { kChunk = 64 * 1024 };
+  string_builder& buf;
+  std::ostream& o;
+  int base, log;
+  legible_buffer(string_builder& buf, std::ostream& o)
+      : buf(buf), o(o), base(Weight::get_log_base(o)), log(Weight::get_log(o)) {}
+  legible_buffer& operator<<(char c) {
+    buf.push_back(c);
+    return *this;
+  }
+  legible_buffer& operator<<(char const* s) {
+    buf(s);
+    return *this;
+  }
+  legible_buffer& operator<<(unsigned u) {
+    buf(u);
+    return *this;
+  }
+  legible_buffer& operator<<(Weight w) {
+    std::size_t n = buf.size();
+    buf.resize(n + Weight::kMaxPrintChars);
+    buf.resize(w.print(buf.begin() + n, base, log) - buf.begin());
+    return *this;
+  }
+  legible_buffer& operator<<(word_spacer& sp) {
+    sp.print(*this);
+    return *this;
+  }
+  void write() {
+    o.write(buf.begin(), buf.size());
+    buf.clear();
+  }
+  void write_chunk() {
+    if (buf.size() >= kChunk) write();
+  }
+  /// false if o's number format isn't the default (so only o << knows what it would write)
+  static bool usable(std::ostream& o) {
+    return !(o.flags() & (std::ios::floatfield | std::ios::showpos | std::ios::showpoint | std::ios::uppercase))
+           && !o.width() && o.getloc() == std::locale::classic();
+  }
+};
+
 struct cascade_parameters;  // in cascade.h, but we avoid circular dependency by knowing only about references
+struct saved_cascade;  // saved_cascade.h
 // in this header
 
 class WFST {
@@ -60,6 +114,7 @@ class WFST {
   struct path_print {
     // options
     bool O, I, Q, AT, W, E;
+    bool flush_each;  // flush the ostream after each path (else call flush() yourself)
     typedef dynamic_array<unsigned> Output;
     // bound here for fun:
     std::ostream* pout;
@@ -68,8 +123,10 @@ class WFST {
     graehl::word_spacer sp;
     state_id src;
     Weight w;
-    path_print() : O(), I(), Q(), AT(), W(), E(), pout(&Config::out()) {}
-    path_print(bool const* flags) : pout(&Config::out()) { set_flags(flags); }
+    string_builder pending;  // this path so far, unless !buffered
+    bool buffered;
+    path_print() : O(), I(), Q(), AT(), W(), E(), flush_each(true), pout(&Config::out()) {}
+    path_print(bool const* flags) : flush_each(true), pout(&Config::out()) { set_flags(flags); }
     void set_flags(bool const* flags) {
       O = flags[(unsigned)'O'];
       I = flags[(unsigned)'I'];
@@ -85,30 +142,50 @@ class WFST {
       sp.reset();
       output.clear();
       w.setOne();
+      buffered = !stream_writer && legible_buffer::usable(*pout);
     }
     bool needs_weight() const { return AT || (!W && (O || I)); }
 
     void finish(WFST const& wfst) {
-      std::ostream& out = *pout;
-      using namespace std;
+      if (!buffered) {
+        finish(wfst, *pout);
+        pout->flush();
+        return;
+      }
+      legible_buffer out(pending, *pout);
+      finish(wfst, out);
+      if (flush_each)
+        flush();
+      else
+        out.write_chunk();
+    }
+    /// writes the paths finished so far, if they're still buffered, and flushes the ostream
+    void flush() {
+      if (!pending.empty()) legible_buffer(pending, *pout).write();
+      pout->flush();
+    }
+    template <class Out>
+    void finish(WFST const& wfst, Out& out) {
       if (AT) {
-        out << endl;
+        out << '\n';
         sp.reset();
         for (Output::const_iterator i = output.begin(), e = output.end(); i != e; ++i)
           out << sp << wfst.outLetter(*i);
-        out << endl;
+        out << '\n';
       } else {
         if (!W) out << sp << w;
-        out << endl;
+        out << '\n';
       }
     }
-    static void out_maybe_quote(char const* str, ostream& out, bool quote) {
+    template <class Out>
+    static void out_maybe_quote(char const* str, Out& out, bool quote) {
       if (quote)
         out << str;
       else
         outWithoutQuotes(str, out);
     }
-    static void outWithoutQuotes(const char* str, ostream& out) {
+    template <class Out>
+    static void outWithoutQuotes(const char* str, Out& out) {
       if (*str != '\"') {
         out << str;
         return;
@@ -129,7 +206,14 @@ class WFST {
     void arc(WFST const& w, PathArc const& p) { arc(p); }
     void arc(WFST const& wfst, FSTArc const* a) { arc(wfst, *a); }
     void arc(WFST const& wfst, FSTArc const& arc) {
-      std::ostream& out = *pout;
+      if (buffered) {
+        legible_buffer out(pending, *pout);
+        this->arc(wfst, arc, out);
+      } else
+        this->arc(wfst, arc, *pout);
+    }
+    template <class Out>
+    void arc(WFST const& wfst, FSTArc const& arc, Out& out) {
       w *= arc.weight;
       if (AT) {
         unsigned inid = arc.in, outid = arc.out;
@@ -176,10 +260,7 @@ class WFST {
     initAlphabet(kOutput);
   }
 
-  void init() {
-    initAlphabet();
-    init_index();
-  }
+  void init() { initAlphabet(); }
 
   void train_prune();  // delete states with zero counts
 
@@ -201,6 +282,8 @@ class WFST {
 
   unsigned
   getStateIndex(const char* buf);  // creates the state according to named_states, returns ~0 (-1) on failure
+  template <class Text>
+  bool readLegibleText(Text& text, bool alwaysNamed);  // the parser behind readLegible and readLegibleStream
  public:
   // openfst MutableFst<LogArc> or <StdArc>, eg StdVectorFst
   template <class Fst>
@@ -254,6 +337,7 @@ class WFST {
           if (ins.second) syms.push_back(s);
           l->in = l->out = ins.first->second;
         }
+        i->flush();
       }
     }
     ~as_pairs_fsa() {
@@ -266,6 +350,7 @@ class WFST {
           l->in = s.in;
           l->out = s.out;
         }
+        i->flush();
       }
     }
   };
@@ -422,10 +507,26 @@ class WFST {
 
   static THREADLOCAL int default_per_line;
   static THREADLOCAL int default_arc_format;
+  static THREADLOCAL bool stream_writer;  // writeLegible and path_print use ostream << (else legible_buffer)
 
   static inline void set_arc_default_per(int per) { default_per_line = per; }
   static inline void set_arc_default_format(int ver) { default_arc_format = ver; }
 
+  // this thread's output defaults (Weight's and the ones above), to set() on a thread writing for it
+  struct output_defaults {
+    Weight::default_format weight;
+    int per_line, arc_format;
+    bool stream_writer;
+    output_defaults()
+        : per_line(default_per_line), arc_format(default_arc_format), stream_writer(WFST::stream_writer) {}
+    void set() const {
+      weight.set();
+      default_per_line = per_line;
+      default_arc_format = arc_format;
+      WFST::stream_writer = stream_writer;
+    }
+  };
+
   static inline int get_arc_format(std::ostream& os) {
     int r = os.iword(arc_format_index);
     return r == DEFAULT_ARC_FORMAT ? default_arc_format : r;
@@ -487,6 +588,7 @@ class WFST {
   alphabet_type& out_alph() const { return *alph[kOutput]; }
 
   alphabet_type stateNames;
+  state_names::pointer shared_names;  // if set, has the names instead of stateNames (see share_state_names)
   state_id final;  // final state number - initial state always number 0
   // bool is_final(state_id stateid) const { return stateid==final; }
   typedef dynamic_array<State> StateVector;
@@ -500,11 +602,32 @@ class WFST {
   //  WFST(WFST &) {}   // disallow copy constructor - Yaser commented this ow to allow copy constructors
   //  WFST & operator = (WFST &) {return *this;} Yaser
   // WFST & operator = (WFST &) {std::cerr <<"Unauthorized use of assignemnt operator\n";;return *this;}
-  bool readLegible(istream&, bool alwaysNamed = false);  // returns false on failure (bad input)
+  // reads the rest of the istream into memory and parses it there; returns false on failure (bad input)
+  bool readLegible(istream&, bool alwaysNamed = false);
   bool readLegible(const string& str, bool alwaysNamed = false);
+  // the same, reading the istream a character at a time (slower; checks readLegible)
+  bool readLegibleStream(istream&, bool alwaysNamed = false);
+  // binary image (image.cc): the same transducer, loaded without parsing from the mapped file (only on the
+  // kind of machine that wrote it).  the arcs are copied out of the mapping into states' lists, so the
+  // transducer doesn't share the file's pages.  read_image expects a fresh (init()) WFST; false if the
+  // image is bad
+  void write_image(std::ostream&) const;
+  void write_image_file(std::string const& filename) const;
+  bool read_image(char const* begin, std::size_t size);
+  bool read_image_file(std::string const& filename);
+  static bool is_image(char const* begin, std::size_t size);
+  static bool is_image_file(std::string const& filename);  // starts with the image magic
   void writeArc(ostream& os, const FSTArc& a, bool GREEK_EPSILON = false);  // for graphviz
   void writeLegible(ostream&, bool include_zero = false);
   void writeLegibleFilename(std::string const& name, bool include_zero = false);
+
+ private:
+  template <class Out>
+  void writeLegibleTo(Out&, bool brief, bool onearc, bool include_zero);
+  static void write_chunk(std::ostream&) {}
+  static void write_chunk(legible_buffer& out) { out.write_chunk(); }
+
+ public:
   void writeGraphViz(ostream&);  // see http://www.research.att.com/sw/tools/graphviz/
   unsigned numStates() const { return states.size(); }
   bool isFinal(unsigned s) { return s == final; }
@@ -520,7 +643,8 @@ class WFST {
     setPathArc(&p, a);
     return o << p;
   }
-  std::ostream& printArc(const FSTArc& a, unsigned source, std::ostream& o, bool weight = true) const {
+  template <class O>
+  O& printArc(const FSTArc& a, unsigned source, O& o, bool weight = true) const {
     o << '(' << stateName(source) << " -> " << stateName(a.dest) << ' ' << inLetter(a.in) << " : "
       << outLetter(a.out);
     if (weight) o << " / " << a.weight;
@@ -624,33 +748,11 @@ class WFST {
   WFST(const WFST& a) { throw std::runtime_error("No copying of WFSTs allowed!"); }
 
  public:
-  LabelType indexed_by;
-
-  void index(LabelType dir) {
-    if (indexed_by != dir) {
-      indexed_by = dir;
-      for (unsigned s = 0; s < numStates(); ++s) {
-        states[s].flush();
-        states[s].indexBy(dir);
-      }
-    }
-  }
-  void indexInput() { index(kInput); }
-  void indexOutput() { index(kOutput); }
-
   void project(LabelType dir = kInput, bool identity_fsa = false) {
     if (identity_fsa) identity_alphabet_from(dir);
     for (unsigned s = 0; s < numStates(); ++s) states[s].project(dir, identity_fsa);
   }
 
-  void init_index() { indexed_by = kNone; }
-
-  void indexFlush() {  // index on input symbol or output symbol depending on composition direction
-    init_index();
-    for (unsigned s = 0; s < numStates(); ++s) {
-      states[s].flush();
-    }
-  }
   WFST() {
     init();
     named_states = 0;
@@ -661,9 +763,10 @@ class WFST {
   // ownerInOut(1), in(((a.in == 0)? 0:(NEW Alphabet(*a.in)))), out(((a.out == 0)? 0:(NEW Alphabet(*a.out)))),
   // stateNames(a.stateNames), final(a.final), states(a.states),
 
-  WFST(istream& istr, bool alwaysNamed = false) {
+  WFST(istream& istr, bool alwaysNamed = false, bool stream_reader = false) {
     init();
-    if (!this->readLegible(istr, alwaysNamed)) final = invalid_state;
+    if (!(stream_reader ? this->readLegibleStream(istr, alwaysNamed) : this->readLegible(istr, alwaysNamed)))
+      final = invalid_state;
   }
 
   WFST(const string& str, bool alwaysNamed) {
@@ -671,16 +774,25 @@ class WFST {
     if (!this->readLegible(str, alwaysNamed)) final = invalid_state;
   }
 
+  enum image_file_t { image_file };
+  WFST(image_file_t, std::string const& filename) {
+    init();
+    if (!this->read_image_file(filename)) final = invalid_state;
+  }
+
   WFST(const char* buf);  // make a simple transducer representing an input sequence
   WFST(const char* buf, unsigned& length,
-       bool permuteNumbers);  // make a simple transducer representing an input sequence lattice - Yaser
+       bool permuteNumbers,  // make a simple transducer representing an input sequence lattice - Yaser
+       unsigned window = 0);  // if nonzero, the next word is within window of the first one not yet used
   WFST(WFST& a, WFST& b, bool namedStates = false, bool preserveGroups = false);  // a composed with b
-  WFST(cascade_parameters& cascade, WFST& a, WFST& b, bool namedStates = false,
-       bool preserveGroups = false);  // a composed with b, but remembering in cascade the identities.
-  // preserveGroups is meaningless since cascade keeps refs to original
+  WFST(cascade_parameters& cascade, WFST& a, WFST& b, bool namedStates = false, bool preserveGroups = false,
+       compose_prune const& prune = compose_prune());  // a composed with b, but remembering in cascade the
+  // identities.  preserveGroups is meaningless since cascade keeps refs to original
   // arcs anyway
   void set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool namedStates = false,
-                   bool preserveGroups = false);
+                   bool preserveGroups = false, compose_prune const& prune = compose_prune());
+  // prune needs a and b weights <= 1 (else it's ignored, with a warning), and isn't supported with
+  // preserveGroups (-a)
   // resulting WFST has only reference to input/output alphabets - use ownAlphabet()
   // if the original source of the alphabets must be deleted
 
@@ -811,6 +923,69 @@ class WFST {
     }
   }
 
+  /// the k best paths from 0 to final, best first, by A*: a state is expanded at most k times, and only
+  /// once some path to it could still be among the k best, so no graph (or sidetrack heap) is built for the
+  /// whole WFST.  h: [state] a lower bound on its best cost to final (0 if none)
+  struct astar_paths {
+    astar_paths(WFST& w, unsigned k, FLOAT_TYPE const* h = 0);
+    /// A* needs h[final] = 0 and h[src] <= cost(arc) + h[dest] for every arc (with no h: no weight above 1)
+    bool consistent() const { return ok; }
+    /// the next best path (its arcs, in order) and its weight.  false when there are no more
+    bool next(path_type& path, Weight& weight);
+
+   private:
+    // a path is the path of its parent node and one more arc, the rank-th best (by cost + h[dest]) of those
+    // leaving the parent's state.  popping a node pushes only its next sibling and its first child
+    struct node {
+      FSTArc* arc;  // 0 for the start
+      unsigned parent, rank;
+      FLOAT_TYPE cost;  // of the path so far
+    };
+    struct entry {
+      FLOAT_TYPE f;  // cost + h[state]
+      unsigned node;
+      bool operator<(entry const& o) const { return f > o.f || (f == o.f && node > o.node); }
+    };
+    struct arcs_of {
+      unsigned begin, end;  // in sorted
+    };
+    WFST& w;
+    FLOAT_TYPE const* h;
+    unsigned k;
+    bool ok;
+    std::vector<node> nodes;
+    std::vector<entry> heap;
+    std::vector<unsigned> pops;  // [state]
+    std::vector<arcs_of> arcs;  // [state], once it's expanded
+    std::vector<FSTArc*> sorted;
+    FLOAT_TYPE heuristic(unsigned s) const { return h ? h[s] : 0; }
+    unsigned state(node const& x) const { return x.arc ? x.arc->dest : 0; }
+    void sort_arcs(unsigned s);
+    void push(unsigned parent, unsigned rank);
+  };
+
+  /// visit_kbest by astar_paths.  false (and nothing visited) if h isn't consistent, e.g. it's 0 and some
+  /// weight is above 1, or if v wants only sidetracks
+  template <class Visitor>
+  bool visit_kbest_astar(unsigned k, Visitor& v, FLOAT_TYPE const* h = 0) {
+    if (v.SIDETRACKS_ONLY) return false;
+    astar_paths search(*this, k, h);
+    if (!search.consistent()) return false;
+    path_type path;
+    Weight weight;
+    for (unsigned i = 1; search.next(path, weight); ++i) {
+      v.start_path(i, weight);
+      for (path_type::const_iterator a = path.begin(), e = path.end(); a != e; ++a) v.visit_best_arc(**a);
+      v.end_path();
+    }
+    return true;
+  }
+
+  /// for one of members, or a composition of them with named states (-m, either association): h[state]
+  /// is the sum over the members of the best cost from its state in each to final, a lower bound for
+  /// visit_kbest_astar.  false (h empty) if this wasn't composed so
+  bool cascade_costs_to_final(std::vector<WFST*> const& members, std::vector<FLOAT_TYPE>& h);
+
   struct annotated_path {
     path_type p;
     unsigned k;
@@ -884,28 +1059,59 @@ class WFST {
   };
 
 
-  /* take the current WFSA (project on chosen direction) as a weighted distribution (the accepting paths are
-     normalized).  alpha sharpens(>1)/softens(<1)/neutral(=1) (e^alph*a)/sum(e^(alph*a_i)).  then choose the
-     highest weight path out of the top search_k under MBR edit distance, and emit the best rescored visit_k
-
-     visitor V is called with:
-     v.visit(WFST &w,unsigned k,unsigned pre_mbr_k,Weight mbr_score,path_type const& p,yield_type const& y)
-
-     of course w,k,and y are redundant.  but i like you so they're given.
+  /* take the current WFSA (project on chosen direction) as a weighted distribution (the search_k best paths
+     are normalized).  alpha sharpens(>1)/softens(<1)/neutral(=1) (e^alph*a)/sum(e^(alph*a_i)).  then rerank
+     those paths by their expected edit distance (minimum Bayes risk) to the dir yields of all of them, and
+     visit the visit_k with the least risk.  ties keep their k-best order, as do all the paths if their
+     weights sum to 0 (all 0, or underflowing after alpha): there's no distribution to take risks under
 
+     visitor V is called as for visit_kbest, except that k is the rank after reranking (the weight is still
+     the path's)
   */
-
-
   template <class V>
-  void edit_distance_mbr(unsigned search_k, unsigned visit_k, V& v, double alpha = 1., LabelType dir = kInput) {
+  void edit_distance_mbr(unsigned search_k, unsigned visit_k, V& v, double alpha = 1., LabelType dir = kInput,
+                         unsigned n_threads = 1) {
     annotated_paths paths(*this, search_k, true);
-    raisePower(alpha);
+    unsigned n = paths.size();
+    std::vector<std::vector<unsigned> > yields(n);
+    std::vector<double> posterior(n), risk;
+    Weight sum;
+    for (unsigned i = 0; i < n; ++i) {
+      annotated_path& p = paths[i];
+      for (path_type::const_iterator a = p.p.begin(), e = p.p.end(); a != e; ++a)
+        if (!(*a)->is_epsilon(dir)) yields[i].push_back((*a)->symbol(dir));
+      p.w.raisePower(alpha);
+      sum += p.w;
+    }
+    for (unsigned i = 0; i < n; ++i) {
+      Weight& w = paths[i].w;
+      if (!sum.isZero()) posterior[i] = (w / sum).getReal();
+      w = paths[i].orig_w;
+    }
+    std::vector<unsigned> order(n);
+    for (unsigned i = 0; i < n; ++i) order[i] = i;
+    if (!sum.isZero()) {
+      edit_distance_risks(yields, posterior, risk, n_threads);
+      std::stable_sort(order.begin(), order.end(), by_risk(risk));
+    }
+    for (unsigned r = 0, e = std::min(visit_k, n); r < e; ++r) {
+      annotated_path& p = paths[order[r]];
+      p.k = r + 1;
+      p.replay_to(v);
+    }
+  }
 
-    // STUB:
-    paths.replay_first_k_to(v, visit_k);
+  struct by_risk {
+    std::vector<double> const& risk;
+    explicit by_risk(std::vector<double> const& risk) : risk(risk) {}
+    bool operator()(unsigned a, unsigned b) const { return risk[a] < risk[b]; }
+  };
 
-    raisePower(1. / alpha);
-  }
+  /// risk[i] = sum over j of posterior[j] * (edit distance between yields i and j), computing the distances
+  /// for pairs of yields on up to n_threads threads (see mbr.cc)
+  static void edit_distance_risks(std::vector<std::vector<unsigned> > const& yields,
+                                  std::vector<double> const& posterior, std::vector<double>& risk,
+                                  unsigned n_threads = 1);
 
 
   void set_string(alphabet_type& a, string_type const& str, bool clone_alph = true) {
@@ -964,12 +1170,59 @@ class WFST {
   const char* stateName(unsigned i) const {
     Assert(i < numStates());
     if (named_states)
-      return stateNames[i].c_str();
+      return shared_names ? shared_names->name(i) : stateNames[i].c_str();
     else
       return static_utoa(i);
   }
+
+  /// our state names, moved out of stateNames (if they're still there) so that transducers composed from
+  /// us can refer to them after we're gone
+  state_names::pointer share_state_names() {
+    if (!named_states) {
+      if (!shared_names) shared_names.reset(new numbered_state_names);  // kept, to tell which transducer
+      return shared_names;
+    }
+    if (!shared_names) {
+      flat_state_names* f = new flat_state_names;
+      shared_names.reset(f);
+      f->names.swap(stateNames);
+    }
+    return shared_names;
+  }
+
+  /// move shared (or composed) names back into stateNames so they can be added to
+  void unshare_state_names() {
+    if (!shared_names) return;
+    flat_state_names* f = dynamic_cast<flat_state_names*>(shared_names.get());
+    if (f && shared_names.unique())
+      stateNames.swap(f->names);
+    else if (named_states) {
+      stateNames.clear();
+      for (unsigned i = 0, n = numStates(); i < n; ++i) stateNames.add(shared_names->name(i));
+    }
+    shared_names.reset();
+  }
   Weight sumOfAllPaths(List<unsigned>& inSeq, List<unsigned>& outSeq);
   // gives sum of weights of all paths from initial->final with the input/output sequence (empties are elided)
+
+  // -S: sumOfAllPaths for many input/output pairs against one index of the arcs (sumOfAllPaths builds one per
+  // pair).  the WFST mustn't change while a path_scorer uses it
+  struct path_scorer : boost::noncopyable {
+    typedef std::vector<unsigned> symbols;
+    struct pair {
+      symbols in, out;
+      Weight prob;
+    };
+    explicit path_scorer(WFST& x);
+    ~path_scorer();
+    Weight score(symbols const& in, symbols const& out) const;
+    /// sets each pairs[i].prob, scoring up to n_threads pairs at once
+    void score(std::vector<pair>& pairs, unsigned n_threads = 1) const;
+
+   private:
+    struct index;
+    boost::scoped_ptr<index> p;
+  };
   void randomScale() {  // randomly scale weights (of unlocked arcs) before training by (0..1]
     changeEachParameter(scaleRandom());
   }
@@ -989,7 +1242,12 @@ class WFST {
 
   // bool uniform_zero_normgroups=true -> if a group's arcs' weights are all 0, set them uniform instead of
   // leaving them 0
+  // the normalization groups are computed once into flat arrays (norm_plan, in fst.cc) and reused while the
+  // arcs stay the same.  with normalize_threads > 1, large transducers' groups are normalized in parallel
   void normalize(NormalizeMethod const& method, bool uniform_zero_normgroups = false);
+  struct norm_plan;
+  boost::shared_ptr<norm_plan> norm_cache;
+  static THREADLOCAL unsigned normalize_threads;
 
   // if weight_is_prior_count, weights before training are prior counts.  smoothFloor counts are also added to
   // all arcs
@@ -1066,9 +1324,17 @@ class WFST {
     bool use_disk() const { return cache_level == cache_disk; }
     bool cache() const { return cache_level != cache_nothing && cache_level != matrix_fb; }
     bool cache_backward() const { return cache_level == cache_forward_backward; }
+    // --save-cascade-derivations: once computed, write the derivations (with the composition and its chains)
+    // to save_cascade, marked with the cascade's fingerprint.  --load-cascade-derivations: read them from
+    // saved instead of computing them
+    std::string save_cascade;
+    uint64_t cascade_fingerprint;
+    saved_cascade* saved;
     deriv_cache_opts() { set_defaults(); }
     void set_defaults() {
       do_prune = true;
+      cascade_fingerprint = 0;
+      saved = 0;
       cache_level = cache_nothing;
       disk_cache_filename = "/tmp/carmel.derivations.XXXXXX";
       disk_cache_bufsize = 256 * 1024 * 1024;
@@ -1082,7 +1348,12 @@ class WFST {
     unsigned max_iter;
     double learning_rate_growth_factor;
     int ran_restarts;
+    unsigned restart_threads;  // >1: run that many random restarts at once (see train.cc)
     random_restart_acceptor ra;
+    std::string checkpoint_file, resume_file;  // see graehl/shared/checkpoint.hpp
+    unsigned checkpoint_every;
+    unsigned online_batch;  // >0: stepwise EM with mini-batches of this many examples (see train.cc)
+    double online_alpha;  // stepwise EM step size is (k+2)^-online_alpha for the kth mini-batch
 
     train_opts() { set_defaults(); }
     void set_defaults() {
@@ -1090,7 +1361,12 @@ class WFST {
       cache.set_defaults();
       learning_rate_growth_factor = 1.;
       ran_restarts = 0;
+      restart_threads = 1;
       ra = random_restart_acceptor();
+      checkpoint_file = resume_file = "";
+      checkpoint_every = 1;
+      online_batch = 0;
+      online_alpha = .7;
     }
   };
 
@@ -1128,6 +1404,30 @@ class WFST {
   // all of them, if max_states<0), after removing states and arcs that do not lie on any path of weight less
   // than (best_path/keep_paths_within_ratio)
 
+  // native weighted determinization, pushing and minimization (minimize.cc).  sum=true uses the log
+  // semiring (paths merged by summing), else max (the best path survives).  weights are taken as equal when
+  // their logs are within delta.  *e* is an ordinary symbol throughout (no epsilon removal)
+
+  bool is_acceptor() const;  // every arc's input letter is its output letter
+  // replaces each path of *e*:*e* arcs and the non-*e* arc after it by a single arc (adding a final sink if
+  // needed).  only the empty string, if accepted, keeps a *e*:*e* arc, from start to final.  *e* self-loops
+  // are removed exactly; keep_cycles leaves arcs on longer *e* cycles (and copies of arcs entering them),
+  // which needn't converge otherwise.  arcs that change weight lose their group.  returns false if the *e*
+  // distances don't converge
+  bool rmepsilon(bool sum = true, bool keep_cycles = false, double delta = kMinimizeDelta);
+  // subset construction over (input, output) pairs - for an acceptor, its symbols; for a transducer, the
+  // --minimize-pairs trick.  groups are lost.  returns false (and leaves us unchanged) if a subset would
+  // have more than max_subset states or the result more than max_states (either may never happen otherwise)
+  bool determinize(bool sum = false, unsigned max_subset = UNLIMITED, unsigned max_states = UNLIMITED,
+                   double delta = kMinimizeDelta);
+  // reweights arcs toward the start state, preserving every path's weight (adds a final sink if needed).
+  // returns false (unchanged) if the distances to final don't converge
+  bool push_weights(bool sum = false, double delta = kMinimizeDelta);
+  // merges states whose arcs agree in (in, out, group, weight, merged destination).  works on any
+  // transducer, but is only minimal for deterministic, pushed ones
+  void minimize(double delta = kMinimizeDelta);
+  static const double kMinimizeDelta;  // 1/1024
+
 
   void assignWeights(const WFST& weightSource);  // for arcs in this transducer with the same group number as
   // an arc in weightSource, assign the weight of the arc in
@@ -1141,9 +1441,6 @@ class WFST {
   void unTieGroups();
 
 
-  /// \return # of arcs generated (i.e. length of inseq, outseq which may have epsilons)
-  unsigned generate(unsigned* inSeq, unsigned* outSeq, unsigned minArcs, unsigned maxArcs);
-
   BOOST_STATIC_CONSTANT(unsigned, invalid_state = (unsigned)-1);
   bool valid() const { return (final != invalid_state); }
   unsigned size() const {
@@ -1190,6 +1487,19 @@ class WFST {
     return w[final];
   }
 
+  /// replaces each arc's weight by its posterior: the sum of the paths through it over the sum of all
+  /// paths.  only for acyclic WFSTs; false (and unchanged) if there's a cycle or no path (see posterior.cc)
+  bool arc_posteriors();
+
+  struct symbol_posterior {
+    unsigned symbol;  // epsilon_index: the yield ended before this position
+    Weight p;
+  };
+  typedef std::vector<std::vector<symbol_posterior> > confusion_network_type;  // [position], best first
+  /// the posterior of each symbol at each position of the dir yield, by forward-backward over (state,
+  /// position) in topological order.  only for acyclic WFSTs; false if there's a cycle or no path
+  bool confusion_network(confusion_network_type& cn, LabelType dir = kOutput);
+
   static void setIndexThreshold(unsigned t) { WFST::indexThreshold = t; }
 
   // FIXME: these aren't technically const because they leave a mutable pointer to orig. arc, but can we make
@@ -1222,12 +1532,24 @@ class WFST {
     }
   }
 
+  // copy of o's states and arcs, in the same order (so arcs_table ids agree), sharing o's alphabets.  no
+  // state names or index.  lets training keep an independent set of weights (see --restart-threads)
+  void replicate(WFST const& o) {
+    deleteAlphabet();
+    alph[kInput] = o.alph[kInput];
+    alph[kOutput] = o.alph[kOutput];
+    unNameStates();
+    final = o.final;
+    states = o.states;
+  }
+
   void unNameStates() {
     if (named_states) {
       stateNames.~Alphabet();
       named_states = false;
       PLACEMENT_NEW(&stateNames) alphabet_type();
     }
+    shared_names.reset();
   }
 
   void raisePower(double exponent = 1.0) {
@@ -1237,6 +1559,7 @@ class WFST {
 
   // returns id of newly added empty state
   unsigned add_state(char const* name = "NEWSTATE") {
+    unshare_state_names();
     unsigned r = states.size();
     states.push_back();
     if (named_states) {
@@ -1364,22 +1687,25 @@ class NormGroupIter {
   State* begin;
   State* state;
   State* end;
-  typedef HashTable<UnsignedKey, List<HalfArc>>::iterator Cit;
-  typedef List<HalfArc>::const_iterator Cit2;
   typedef List<FSTArc>::val_iterator Jit;
-  Cit Ci;
-  Cit2 Ci2, Cend;
+  letter_index const* groups;  // of state, by input
+  unsigned Ci;
+  letter_index::iterator Ci2, Cend;
   Jit Ji, Jend;
   const WFST::norm_group_by method;
   bool empty_state() { return state->size == 0; }
   void beginState() {
     if (method == WFST::CONDITIONAL)
-      if (!empty_state()) Ci = state->index->begin();
+      if (!empty_state()) {
+        groups = &state->indexBy(kInput);
+        Ci = 0;
+      }
   }
 
  public:
   unsigned source() { return state - begin; }
-  NormGroupIter(WFST::norm_group_by meth, WFST& wfst_) : wfst(wfst_), method(meth) {
+  NormGroupIter(WFST::norm_group_by meth, WFST& wfst_)
+      : wfst(wfst_), groups(0), Ci(0), Ci2(0), Cend(0), method(meth) {
     state = begin = &*wfst.states.begin();
     end = begin + wfst.numStates();
     beginState();
@@ -1388,7 +1714,7 @@ class NormGroupIter {
   template <class charT, class Traits>
   std::ios_base::iostate print(std::basic_ostream<charT, Traits>& os) const {
     if (method == WFST::CONDITIONAL) {
-      os << "(conditional normalization group for input=" << wfst.inLetter(Ci->first) << " in ";
+      os << "(conditional normalization group for input=" << wfst.inLetter(groups->letter(Ci)) << " in ";
     } else if (method == WFST::JOINT) {
       os << "(joint normalizaton group for ";
     } else {
@@ -1400,8 +1726,9 @@ class NormGroupIter {
   void beginArcs() {
     if (method == WFST::CONDITIONAL) {
       if (empty_state()) return;
-      Ci2 = Ci->second.const_begin();  // segfault w/ *e* selfloop as only arc
-      Cend = Ci->second.const_end();
+      letter_index::range arcs = groups->arcs(Ci);
+      Ci2 = arcs.begin();
+      Cend = arcs.end();
     } else {
       Ji = state->arcs.val_begin();
       Jend = state->arcs.val_end();
@@ -1432,7 +1759,7 @@ class NormGroupIter {
   void nextGroup() {
     if (method == WFST::CONDITIONAL) {
       if (!empty_state()) ++Ci;
-      while (empty_state() || Ci == state->index->end()) {
+      while (empty_state() || Ci == groups->size()) {
         ++state;
         if (moreGroups())
           beginState();
@@ -120,7 +120,6 @@ struct carmel_gibbs : public gibbs_base {
       w.visit_arcs(v);
     } else if (!w.isEmpty()) {
       bool cond = nm.group == WFST::CONDITIONAL;
-      if (cond) w.indexInput();
       Weight ac = nm.add_count;
       double alpha = ac.getReal();
       typedef dynamic_array<FSTArc*> U;
@@ -410,6 +409,7 @@ void WFST::train_gibbs(cascade_parameters& cascade, training_corpus& corpus, Nor
     if (em) {
       train_opts t2 = topt;
       t2.max_iter = gopt.init_em;
+      t2.checkpoint_file = t2.resume_file = "";  // those are for the sampler
       // EM:
       train(cascade, corpus, m2, false, 0, 0, 1, t2, true);
     } else if (gopt.init_from_p0) {
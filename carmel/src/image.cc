@@ -0,0 +1,175 @@
+// binary images of a WFST (--write-images), loaded from the mapped file instead of parsing it.  states
+// keep their arcs in (heap) lists, so the arcs are copied out of the mapping: this saves parsing, not
+// memory.  #included by fst.cc
+#include <graehl/shared/config.h>
+#include <carmel/src/fst.h>
+#include <graehl/shared/memmap.hpp>
+#include <cstring>
+#include <fstream>
+#include <stdint.h>
+
+namespace graehl {
+
+namespace {
+
+// layout: magic (padded to kMagicSpace), image_header, uint64_t arcs_end[n_states] (cumulative arc counts),
+// image_arc[n_arcs], then '\0'-terminated input letters, output letters and (if named) state names.  in
+// native byte order, so an image is only good on the kind of machine (and FLOAT_TYPE) that wrote it
+char const kImageMagic[] = "carmel wfst image 1\n";
+enum { kMagicSpace = 32 };
+
+struct image_header {
+  uint32_t weight_size;
+  uint32_t named_states;
+  uint64_t n_states, final, n_arcs;
+  uint64_t n_letters[2];
+  uint64_t string_bytes;
+};
+
+struct image_arc {
+  uint32_t in, out, dest, group;
+  Weight weight;
+};
+
+template <class T>
+void write_pod(std::ostream& o, T const& t) {
+  o.write((char const*)&t, sizeof(T));
+}
+
+}
+
+void WFST::write_image(std::ostream& o) const {
+  image_header h;
+  h.weight_size = sizeof(Weight);
+  h.named_states = named_states;
+  h.n_states = numStates();
+  h.final = final;
+  h.n_arcs = 0;
+  for (unsigned s = 0; s < numStates(); ++s) h.n_arcs += states[s].size;
+  h.string_bytes = 0;
+  for (unsigned d = 0; d < 2; ++d) {
+    alphabet_type const& a = alphabet((LabelType)d);
+    h.n_letters[d] = a.size();
+    for (unsigned i = 0, n = a.size(); i < n; ++i) h.string_bytes += std::strlen(a[i].c_str()) + 1;
+  }
+  if (named_states)
+    for (unsigned s = 0; s < numStates(); ++s) h.string_bytes += std::strlen(stateName(s)) + 1;
+
+  char magic[kMagicSpace] = {0};
+  std::memcpy(magic, kImageMagic, sizeof(kImageMagic));
+  o.write(magic, kMagicSpace);
+  write_pod(o, h);
+  uint64_t end = 0;
+  for (unsigned s = 0; s < numStates(); ++s) write_pod(o, end += states[s].size);
+  for (unsigned s = 0; s < numStates(); ++s)
+    for (State::Arcs::const_iterator a = states[s].arcs.const_begin(), e = states[s].arcs.const_end(); a != e;
+         ++a) {
+      image_arc i;
+      i.in = a->in;
+      i.out = a->out;
+      i.dest = a->dest;
+      i.group = a->groupId;
+      i.weight = a->weight;
+      write_pod(o, i);
+    }
+  for (unsigned d = 0; d < 2; ++d) {
+    alphabet_type const& a = alphabet((LabelType)d);
+    for (unsigned i = 0, n = a.size(); i < n; ++i) {
+      char const* l = a[i].c_str();
+      o.write(l, std::strlen(l) + 1);
+    }
+  }
+  if (named_states)
+    for (unsigned s = 0; s < numStates(); ++s) {
+      char const* n = stateName(s);
+      o.write(n, std::strlen(n) + 1);
+    }
+}
+
+void WFST::write_image_file(std::string const& filename) const {
+  std::ofstream o(filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  write_image(o);
+  o.close();
+  if (!o) throw std::runtime_error("couldn't write transducer image " + filename);
+}
+
+bool WFST::is_image(char const* begin, std::size_t size) {
+  return size >= sizeof(kImageMagic) && !std::memcmp(begin, kImageMagic, sizeof(kImageMagic));
+}
+
+bool WFST::is_image_file(std::string const& filename) {
+  char buf[sizeof(kImageMagic)];
+  std::ifstream i(filename.c_str(), std::ios::in | std::ios::binary);
+  return i.read(buf, sizeof(buf)) && is_image(buf, sizeof(buf));
+}
+
+// we're fresh from init(): alphabets holding just *e* and *w*, and no states
+bool WFST::read_image(char const* begin, std::size_t size) {
+  char const* end = begin + size;
+  image_header h;
+  uint64_t const* arcs_end;
+  image_arc const* arcs;
+  char const* str;
+  if (!is_image(begin, size) || size < kMagicSpace + sizeof(h)) goto INVALID;
+  std::memcpy(&h, begin + kMagicSpace, sizeof(h));
+  if (h.weight_size != sizeof(Weight)) {
+    Config::warn() << "transducer image has " << h.weight_size << " byte weights, but we have "
+                   << sizeof(Weight) << ".\n";
+    goto INVALID;
+  }
+  if (!h.n_states || h.final >= h.n_states || h.n_states > invalid_state
+      || h.n_states > (size - kMagicSpace - sizeof(h)) / sizeof(uint64_t)
+      || h.n_arcs > (size - kMagicSpace - sizeof(h)) / sizeof(image_arc))
+    goto INVALID;  // (before the pointer arithmetic below can overflow)
+  arcs_end = (uint64_t const*)(begin + kMagicSpace + sizeof(h));
+  arcs = (image_arc const*)(arcs_end + h.n_states);
+  str = (char const*)(arcs + h.n_arcs);
+  if (str > end || (uint64_t)(end - str) != h.string_bytes || end[-1] || arcs_end[h.n_states - 1] != h.n_arcs)
+    goto INVALID;
+  {
+    unsigned n = h.n_states;
+    states.resize(n);
+    State::arc_adder arc_add(states);
+    image_arc const* a = arcs;
+    for (unsigned s = 0; s < n; ++s) {
+      if (arcs_end[s] > h.n_arcs) goto INVALID;
+      for (image_arc const* e = arcs + arcs_end[s]; a < e; ++a) {
+        if (a->dest >= n) goto INVALID;
+        arc_add(s, FSTArc(a->in, a->out, a->dest, a->weight, a->group));
+      }
+    }
+    final = h.final;
+    for (unsigned d = 0; d < 2; ++d) {
+      alphabet_type& l = alphabet((LabelType)d);
+      for (uint64_t i = 0; i < h.n_letters[d]; ++i, str += std::strlen(str) + 1) {
+        if (str >= end) goto INVALID;
+        if (i >= l.size())
+          l.add(StringKey(str));
+        else if (std::strcmp(l[i].c_str(), str))
+          goto INVALID;
+      }
+    }
+    named_states = h.named_states;
+    if (named_states)
+      for (unsigned s = 0; s < n; ++s, str += std::strlen(str) + 1) {
+        if (str >= end) goto INVALID;
+        stateNames.add(StringKey(str));
+      }
+    for (unsigned s = 0; s < n; ++s)
+      for (State::Arcs::const_iterator a = states[s].arcs.const_begin(), e = states[s].arcs.const_end();
+           a != e; ++a)
+        if (a->in >= h.n_letters[kInput] || a->out >= h.n_letters[kOutput]) goto INVALID;
+    return true;
+  }
+INVALID:
+  invalidate();
+  return false;
+}
+
+bool WFST::read_image_file(std::string const& filename) {
+  mapped_file image(filename, std::ios::in);
+  return read_image(image.data(), image.size());
+}
+
+
+}
@@ -0,0 +1,75 @@
+// expected edit distance among k-best yields, for minimum Bayes risk reranking (--mbr).  #included by fst.cc
+#include <graehl/shared/config.h>
+#include <carmel/src/fst.h>
+#include <graehl/shared/myers_edit_distance.hpp>
+#include <graehl/shared/thread_group.hpp>
+#include <algorithm>
+#include <vector>
+
+namespace graehl {
+
+namespace {
+
+typedef std::vector<std::vector<unsigned> > yields_type;
+
+// distance[pair_index(i,j)] = edit distance of yields i < j, filled a row (all j > i) at a time
+struct edit_distance_rows {
+  yields_type const* yields;
+  unsigned n_symbols;
+  std::vector<unsigned>* distance;
+  unsigned first, stride;
+  static std::size_t row_begin(unsigned i, unsigned n) { return (std::size_t)i * (2 * n - i - 1) / 2; }
+  void operator()() {
+    yields_type const& y = *yields;
+    unsigned n = y.size();
+    myers_edit_distance d(n_symbols);
+    for (unsigned i = first; i < n; i += stride) {
+      d.set_pattern(y[i].begin(), y[i].end());
+      unsigned* to = &(*distance)[0] + row_begin(i, n);
+      for (unsigned j = i + 1; j < n; ++j) *to++ = d(y[j].begin(), y[j].end());
+    }
+  }
+};
+
+}
+
+void WFST::edit_distance_risks(std::vector<std::vector<unsigned> > const& yields,
+                               std::vector<double> const& posterior, std::vector<double>& risk,
+                               unsigned n_threads) {
+  unsigned n = yields.size();
+  risk.assign(n, 0.);
+  if (n < 2) return;
+  // the myers tables are indexed by symbol, so renumber the symbols that occur densely
+  std::vector<unsigned> symbols;
+  for (unsigned i = 0; i < n; ++i) symbols.insert(symbols.end(), yields[i].begin(), yields[i].end());
+  std::sort(symbols.begin(), symbols.end());
+  symbols.erase(std::unique(symbols.begin(), symbols.end()), symbols.end());
+  yields_type dense(yields);
+  for (unsigned i = 0; i < n; ++i)
+    for (std::vector<unsigned>::iterator s = dense[i].begin(), e = dense[i].end(); s != e; ++s)
+      *s = std::lower_bound(symbols.begin(), symbols.end(), *s) - symbols.begin();
+
+  std::vector<unsigned> distance((std::size_t)n * (n - 1) / 2);
+  if (n_threads > n - 1) n_threads = n - 1;
+  if (n_threads <= 1) {
+    edit_distance_rows all = {&dense, (unsigned)symbols.size(), &distance, 0, 1};
+    all();
+  } else {
+    thread_group threads;
+    for (unsigned t = 0; t < n_threads; ++t) {
+      edit_distance_rows rows = {&dense, (unsigned)symbols.size(), &distance, t, n_threads};
+      threads.create_thread(rows);
+    }
+    threads.join_all();
+  }
+  // summed in the same order however many threads there were
+  std::vector<unsigned>::const_iterator d = distance.begin();
+  for (unsigned i = 0; i < n; ++i)
+    for (unsigned j = i + 1; j < n; ++j, ++d) {
+      risk[i] += posterior[j] * *d;
+      risk[j] += posterior[i] * *d;
+    }
+}
+
+
+}
@@ -0,0 +1,438 @@
+// native (without OpenFST) weighted epsilon removal, determinization, weight pushing and minimization.
+// #included by fst.cc
+#include <graehl/shared/config.h>
+#include <carmel/src/fst.h>
+#include <graehl/shared/unordered.hpp>
+#include <boost/functional/hash.hpp>
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <limits>
+#include <vector>
+#include <stdint.h>
+
+namespace graehl {
+
+const double WFST::kMinimizeDelta = 1. / 1024;
+
+namespace {
+
+// semiring plus: log-add if sum, else max
+inline void plus_by(Weight& w, Weight d, bool sum) {
+  if (sum)
+    w += d;
+  else if (d > w)
+    w = d;
+}
+
+inline bool near_weight(Weight a, Weight b, double delta) {
+  if (a.isZero() || b.isZero()) return a.isZero() == b.isZero();
+  return std::fabs(a.getLogImp() - b.getLogImp()) <= delta;
+}
+
+// ln w rounded to multiples of delta, so weights that are near each other usually hash alike
+inline int64_t quantize(Weight w, double delta) {
+  return w.isZero() ? std::numeric_limits<int64_t>::min() : (int64_t)std::floor(w.getLogImp() / delta + .5);
+}
+
+struct det_arc {
+  unsigned in, out, dest;
+  Weight weight;
+  bool operator<(det_arc const& o) const {
+    return in < o.in || (in == o.in && (out < o.out || (out == o.out && dest < o.dest)));
+  }
+};
+
+// strongly connected components of the graph succ (Tarjan's, without recursion): comp[i] is i's component
+void components(std::vector<std::vector<unsigned> > const& succ, std::vector<unsigned>& comp) {
+  unsigned const none = (unsigned)-1;
+  unsigned n = succ.size(), next = 0, ncomp = 0;
+  std::vector<unsigned> index(n, none), low(n), stack;
+  std::vector<bool> on_stack(n);
+  std::vector<std::pair<unsigned, unsigned> > call;  // (state, position in its succ)
+  comp.assign(n, none);
+  for (unsigned root = 0; root < n; ++root) {
+    if (index[root] != none) continue;
+    index[root] = low[root] = next++;
+    stack.push_back(root);
+    on_stack[root] = true;
+    call.push_back(std::make_pair(root, 0u));
+    while (!call.empty()) {
+      unsigned v = call.back().first;
+      if (call.back().second < succ[v].size()) {
+        unsigned w = succ[v][call.back().second++];
+        if (index[w] == none) {
+          index[w] = low[w] = next++;
+          stack.push_back(w);
+          on_stack[w] = true;
+          call.push_back(std::make_pair(w, 0u));
+        } else if (on_stack[w] && index[w] < low[v])
+          low[v] = index[w];
+      } else {
+        call.pop_back();
+        if (!call.empty()) {
+          unsigned u = call.back().first;
+          if (low[v] < low[u]) low[u] = low[v];
+        }
+        if (low[v] == index[v]) {
+          unsigned w;
+          do {
+            w = stack.back();
+            stack.pop_back();
+            on_stack[w] = false;
+            comp[w] = ncomp;
+          } while (w != v);
+          ++ncomp;
+        }
+      }
+    }
+  }
+}
+
+typedef std::vector<int64_t> int64s;
+typedef unordered_map<int64s, unsigned, boost::hash<int64s> > int64s_ids;
+
+}
+
+bool WFST::is_acceptor() const {
+  bool same_alph = alph[kInput] == alph[kOutput];
+  for (StateVector::const_iterator i = states.begin(), e = states.end(); i != e; ++i)
+    for (State::Arcs::const_iterator a = i->arcs.const_begin(), end = i->arcs.const_end(); a != end; ++a)
+      if (!(a->in == a->out && same_alph) && std::strcmp(inLetter(a->in), outLetter(a->out))) return false;
+  return true;
+}
+
+bool WFST::rmepsilon(bool sum, bool keep_cycles, double delta) {
+  if (!valid()) return true;
+  // a final state with arcs leaving it gets a final sink after it (as ensure_final_sink), only added to
+  // the transducer if we succeed: until then, view[] has an empty state for it, and eps[] the *e* arc to it
+  unsigned const n_old = numStates();
+  bool const add_sink = states[final].size;
+  unsigned const n = n_old + add_sink, fin = add_sink ? n_old : final;
+  State sink;
+  std::vector<State const*> view(n, &sink);
+  for (unsigned s = 0; s < n_old; ++s) view[s] = &states[s];
+  FSTArc const to_sink(epsilon_index, epsilon_index, fin, 1);
+  // *e*:*e* self-loops are always removed, exactly: each arrival at s is weighted by star[s], the sum (or
+  // best) of going around them any number of times.  (carmel drops *e* self-loops when it reduces anyway)
+  std::vector<Weight> star(n, Weight::ONE());
+  for (unsigned s = 0; s < n; ++s) {
+    Weight loop;
+    for (State::Arcs::const_iterator a = view[s]->arcs.const_begin(), e = view[s]->arcs.const_end(); a != e;
+         ++a)
+      if (a->dest == s && a->in == epsilon_index && a->out == epsilon_index) plus_by(loop, a->weight, sum);
+    if (loop.isZero()) continue;
+    if (!(loop < Weight::ONE()) && (sum || loop > Weight::ONE())) return false;
+    if (sum) star[s] = 1. / (1. - loop.getReal());
+  }
+  // the other *e*:*e* arcs we remove (in keep_cycles mode, those between different epsilon components)
+  std::vector<std::vector<unsigned> > eps_succ(n);
+  for (unsigned s = 0; s < n; ++s)
+    for (State::Arcs::const_iterator a = view[s]->arcs.const_begin(), e = view[s]->arcs.const_end(); a != e;
+         ++a)
+      if (a->in == epsilon_index && a->out == epsilon_index) eps_succ[s].push_back(a->dest);
+  if (add_sink) eps_succ[final].push_back(fin);
+  std::vector<unsigned> comp;
+  if (keep_cycles) components(eps_succ, comp);
+  std::vector<std::vector<FSTArc> > eps(n);
+  for (unsigned s = 0; s < n; ++s)
+    for (State::Arcs::const_iterator a = view[s]->arcs.const_begin(), e = view[s]->arcs.const_end(); a != e;
+         ++a)
+      if (a->in == epsilon_index && a->out == epsilon_index && a->dest != s
+          && !(keep_cycles && comp[s] == comp[a->dest]))
+        eps[s].push_back(*a);
+  if (add_sink) eps[final].push_back(to_sink);  // (the sink is its own epsilon component)
+
+  // p gets the arcs of each q in its closure (weighted by the *e* distance p->q).  if final is in the
+  // closure, arcs into p get a copy into final (a sink, so nothing continues from there) - except for the
+  // start state, which keeps a *e* arc to final instead
+  StateVector out;
+  std::vector<Weight> to_final(n), dist(n), resid(n);
+  std::vector<bool> queued(n), seen(n);
+  std::vector<unsigned> touched;
+  std::deque<unsigned> queue;
+  std::vector<FSTArc> arcs;
+  enum { kMaxPopsPerState = 10000 };  // *e* cycles with weight >= 1 never converge
+  // summing around a cycle of weight c stops short by about delta/(1-c) of the closure 1/(1-c).  a closure
+  // past 1/(2 delta) is off by half or more - or c is 1, and the sum it stopped short of is infinite
+  double const max_ln_dist = -std::log(2 * delta);
+  for (unsigned p = 0; p < n; ++p) {
+    touched.assign(1, p);
+    seen[p] = queued[p] = true;
+    dist[p] = resid[p] = star[p];
+    queue.push_back(p);
+    bool converged = true;
+    for (std::size_t pops = 0; !queue.empty(); ++pops) {
+      if (pops > (std::size_t)kMaxPopsPerState * touched.size()) {
+        converged = false;
+        queue.clear();
+        break;
+      }
+      unsigned q = queue.front();
+      queue.pop_front();
+      queued[q] = false;
+      Weight rq = resid[q];
+      resid[q].setZero();
+      for (std::vector<FSTArc>::const_iterator a = eps[q].begin(), e = eps[q].end(); a != e; ++a) {
+        unsigned r = a->dest;
+        if (!seen[r]) {
+          seen[r] = true;
+          touched.push_back(r);
+        }
+        Weight x = rq * a->weight * star[r], dr = dist[r];
+        plus_by(dr, x, sum);
+        if (near_weight(dr, dist[r], delta)) continue;
+        dist[r] = dr;
+        plus_by(resid[r], x, sum);
+        if (!queued[r]) {
+          queued[r] = true;
+          queue.push_back(r);
+        }
+      }
+    }
+    arcs.clear();
+    for (std::vector<unsigned>::const_iterator t = touched.begin(), te = touched.end(); t != te; ++t) {
+      unsigned q = *t;
+      Weight d = dist[q];
+      if (sum && !(d.getLogImp() < max_ln_dist)) converged = false;
+      if (q == fin && q != p) to_final[p] = d;
+      for (State::Arcs::const_iterator a = view[q]->arcs.const_begin(), e = view[q]->arcs.const_end();
+           a != e; ++a) {
+        if (a->in == epsilon_index && a->out == epsilon_index
+            && (a->dest == q || !(keep_cycles && comp[q] == comp[a->dest])))
+          continue;
+        arcs.push_back(*a);
+        if (!d.isOne()) {  // no longer the parameter it was
+          arcs.back().weight *= d;
+          arcs.back().clear_group();
+        }
+      }
+      dist[q].setZero();
+      resid[q].setZero();
+      seen[q] = false;
+    }
+    if (!converged) return false;
+    out.push_back();
+    State& s = out.back();
+    for (std::vector<FSTArc>::const_reverse_iterator a = arcs.rbegin(), ae = arcs.rend(); a != ae; ++a)
+      s.addArc(*a);
+  }
+  for (unsigned s = 0; s < n; ++s) {
+    State& st = out[s];
+    arcs.clear();
+    for (State::Arcs::const_iterator a = st.arcs.const_begin(), e = st.arcs.const_end(); a != e; ++a)
+      if (a->dest && !to_final[a->dest].isZero()) {
+        arcs.push_back(*a);
+        arcs.back().dest = fin;
+        arcs.back().weight *= to_final[a->dest];
+        arcs.back().clear_group();
+      }
+    for (std::vector<FSTArc>::const_iterator a = arcs.begin(), ae = arcs.end(); a != ae; ++a) st.addArc(*a);
+  }
+  if (!to_final[0].isZero())  // the empty string
+    out[0].addArc(FSTArc(epsilon_index, epsilon_index, fin, to_final[0]));
+  if (add_sink) final = add_state("FINAL_SINK");
+  states.swap(out);
+  return true;
+}
+
+bool WFST::determinize(bool sum, unsigned max_subset, unsigned max_states, double delta) {
+  if (!valid()) return true;
+  // a det state is a subset of our states, each with the residual weight not yet output
+  typedef std::pair<unsigned, Weight> element;
+  typedef std::vector<element> subset;
+  std::vector<subset> subsets(1, subset(1, element(0, Weight::ONE())));
+  int64s_ids ids;
+  int64s key;
+  key.push_back(0);
+  key.push_back(quantize(Weight::ONE(), delta));
+  ids[key] = 0;
+
+  StateVector det;
+  std::vector<det_arc> arcs;
+  std::vector<FSTArc> out;
+  std::vector<std::pair<unsigned, Weight> > finals;  // (det state, final weight)
+  subset next;
+  for (unsigned i = 0; i < subsets.size(); ++i) {
+    subset cur;
+    cur.swap(subsets[i]);
+    arcs.clear();
+    for (subset::const_iterator s = cur.begin(), se = cur.end(); s != se; ++s) {
+      if (s->first == final) finals.push_back(std::make_pair(i, s->second));
+      State::Arcs const& as = states[s->first].arcs;
+      for (State::Arcs::const_iterator a = as.const_begin(), ae = as.const_end(); a != ae; ++a) {
+        det_arc d;
+        d.in = a->in;
+        d.out = a->out;
+        d.dest = a->dest;
+        d.weight = s->second * a->weight;
+        arcs.push_back(d);
+      }
+    }
+    std::sort(arcs.begin(), arcs.end());
+    out.clear();
+    for (std::vector<det_arc>::const_iterator a = arcs.begin(), ae = arcs.end(); a != ae;) {
+      unsigned in = a->in, o = a->out;
+      next.clear();
+      Weight total;
+      while (a != ae && a->in == in && a->out == o) {  // the arcs labeled in:o, by dest
+        unsigned dest = a->dest;
+        Weight w = a->weight;
+        for (++a; a != ae && a->in == in && a->out == o && a->dest == dest; ++a) plus_by(w, a->weight, sum);
+        next.push_back(element(dest, w));
+        plus_by(total, w, sum);
+      }
+      if (total.isZero()) continue;
+      key.clear();
+      for (subset::iterator s = next.begin(), se = next.end(); s != se; ++s) {
+        s->second /= total;
+        key.push_back(s->first);
+        key.push_back(quantize(s->second, delta));
+      }
+      std::pair<int64s_ids::iterator, bool> ins = ids.insert(int64s_ids::value_type(key, subsets.size()));
+      if (ins.second) {
+        if (next.size() > max_subset || subsets.size() >= max_states) return false;
+        subsets.push_back(next);
+      }
+      out.push_back(FSTArc(in, o, ins.first->second, total));
+    }
+    det.push_back();
+    State& s = det.back();
+    for (std::vector<FSTArc>::const_reverse_iterator a = out.rbegin(), ae = out.rend(); a != ae; ++a)
+      s.addArc(*a);
+  }
+
+  unNameStates();
+  states.swap(det);
+  if (finals.empty())
+    clear();
+  else if (finals.size() == 1 && finals[0].second.isOne())
+    final = finals[0].first;
+  else {  // carmel has no final weights, so: a new final state with *e* arcs from the subsets holding final
+    final = states.size();
+    states.push_back();
+    for (unsigned i = 0, n = finals.size(); i < n; ++i)
+      states[finals[i].first].addArc(FSTArc(epsilon_index, epsilon_index, final, finals[i].second));
+  }
+  return true;
+}
+
+bool WFST::push_weights(bool sum, double delta) {
+  if (!valid()) return true;
+  ensure_final_sink();
+  unsigned n = numStates();
+  // d[q]: sum (or max) over paths q->final, by queue relaxation on the reversed arcs
+  struct rev_arc {
+    unsigned src;
+    Weight weight;
+    rev_arc(unsigned src, Weight weight) : src(src), weight(weight) {}
+  };
+  std::vector<std::vector<rev_arc> > into(n);
+  for (unsigned s = 0; s < n; ++s)
+    for (State::Arcs::const_iterator a = states[s].arcs.const_begin(), e = states[s].arcs.const_end(); a != e;
+         ++a)
+      into[a->dest].push_back(rev_arc(s, a->weight));
+  std::vector<Weight> d(n), r(n);  // distance, and the part of it not yet relaxed
+  std::vector<bool> queued(n);
+  std::deque<unsigned> queue;
+  d[final] = r[final] = Weight::ONE();
+  queue.push_back(final);
+  queued[final] = true;
+  enum { kMaxPopsPerState = 10000 };  // cycles with weight >= 1 never converge
+  for (std::size_t pops = 0, max_pops = (std::size_t)kMaxPopsPerState * n; !queue.empty(); ++pops) {
+    if (pops > max_pops) return false;
+    unsigned q = queue.front();
+    queue.pop_front();
+    queued[q] = false;
+    Weight rq = r[q];
+    r[q].setZero();
+    for (std::vector<rev_arc>::const_iterator a = into[q].begin(), e = into[q].end(); a != e; ++a) {
+      unsigned p = a->src;
+      Weight x = rq * a->weight, dp = d[p];
+      plus_by(dp, x, sum);
+      if (near_weight(dp, d[p], delta)) continue;
+      d[p] = dp;
+      plus_by(r[p], x, sum);
+      if (!queued[p]) {
+        queued[p] = true;
+        queue.push_back(p);
+      }
+    }
+  }
+  // w(p->q) *= d[q]/d[p] multiplies each path by d[final]/d[0] = 1/d[0].  we give back d[0] by not
+  // dividing arcs leaving the start state by it, unless they can return there; then arcs entering final
+  // (exactly once per path: it's a sink) get it
+  Weight d0 = d[0];
+  if (d0.isZero()) return true;
+  bool reentered = !into[0].empty();
+  for (unsigned s = 0; s < n; ++s) {
+    if (d[s].isZero()) continue;
+    State::Arcs& arcs = states[s].arcs;
+    for (State::Arcs::val_iterator a = arcs.val_begin(), e = arcs.val_end(); a != e; ++a) {
+      if (d[a->dest].isZero()) continue;
+      a->weight *= d[a->dest];
+      if (s || reentered) a->weight /= d[s];
+      if (reentered && a->dest == final) a->weight *= d0;
+    }
+  }
+  return true;
+}
+
+void WFST::minimize(double delta) {
+  if (!valid()) return;
+  unsigned n = numStates();
+  // Moore refinement: the final state starts in its own class, and each round splits classes by the arcs'
+  // (in, out, group, weight, dest class) until nothing splits
+  std::vector<unsigned> cls(n), next(n);
+  for (unsigned i = 0; i < n; ++i) cls[i] = (i == final);
+  unsigned ncls = n > 1 ? 2 : 1;
+  typedef std::vector<int64_t> arc_sig;
+  std::vector<arc_sig> arcs;
+  int64s sig;
+  for (;;) {
+    int64s_ids ids;
+    for (unsigned i = 0; i < n; ++i) {
+      arcs.clear();
+      State::Arcs const& as = states[i].arcs;
+      for (State::Arcs::const_iterator a = as.const_begin(), e = as.const_end(); a != e; ++a) {
+        arc_sig s(5);
+        s[0] = a->in;
+        s[1] = a->out;
+        s[2] = a->groupId;
+        s[3] = quantize(a->weight, delta);
+        s[4] = cls[a->dest];
+        arcs.push_back(s);
+      }
+      std::sort(arcs.begin(), arcs.end());
+      sig.assign(1, cls[i]);
+      for (std::vector<arc_sig>::const_iterator a = arcs.begin(), e = arcs.end(); a != e; ++a)
+        sig.insert(sig.end(), a->begin(), a->end());
+      next[i] = ids.insert(int64s_ids::value_type(sig, ids.size())).first->second;
+    }
+    unsigned nnext = ids.size();
+    cls.swap(next);
+    if (nnext == ncls) break;
+    ncls = nnext;
+  }
+  if (ncls == n) return;
+
+  // keep the first state of each class (so 0 stays the start), pointing all arcs at kept states
+  std::vector<unsigned> rep(ncls, (unsigned)-1);
+  bool* marked = NEW bool[n];
+  for (unsigned i = 0; i < n; ++i) {
+    unsigned& r = rep[cls[i]];
+    if (r == (unsigned)-1) r = i;
+    marked[i] = r != i;
+  }
+  for (unsigned i = 0; i < n; ++i) {
+    if (marked[i]) continue;
+    states[i].flush();
+    for (State::Arcs::val_iterator a = states[i].arcs.val_begin(), e = states[i].arcs.val_end(); a != e; ++a)
+      a->dest = rep[cls[a->dest]];
+  }
+  removeMarkedStates(marked);
+  delete[] marked;
+}
+
+
+}
@@ -0,0 +1,119 @@
+// posteriors over an acyclic WFST (a lattice) by forward-backward: per arc (--arc-posteriors) and per yield
+// position (--confusion-network, --consensus).  #included by fst.cc
+#include <graehl/shared/config.h>
+#include <carmel/src/fst.h>
+#include <graehl/shared/graph.h>
+#include <graehl/shared/push_backer.hpp>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+namespace graehl {
+
+namespace {
+
+// forward (f: start to state) and backward (b: state to final) sums of paths, in topological order from 0
+struct acyclic_forward_backward {
+  Graph g;
+  dynamic_array<unsigned> rev;  // reverse topological order of the states reachable from 0
+  fixed_array<Weight> f, b;
+  bool acyclic;
+
+  explicit acyclic_forward_backward(WFST& x) : g(x.makeGraph()), f(x.numStates()), b(x.numStates()) {
+    reverse_topo_order r(g);
+    r.order_from(make_push_backer(rev), 0);
+    acyclic = !r.get_n_back_edges();
+    if (!acyclic) return;
+    WFST::weight_for_cost w;
+    f[0] = 1;
+    propagate_paths_in_order(g, rev.rbegin(), rev.rend(), w, f);
+    b[x.final] = 1;
+    for (dynamic_array<unsigned>::const_iterator s = rev.begin(), e = rev.end(); s != e; ++s) {
+      List<GraphArc> const& arcs = g.states[*s].arcs;
+      for (List<GraphArc>::const_iterator a = arcs.const_begin(), ae = arcs.const_end(); a != ae; ++a)
+        b[*s] += w(*a) * b[a->dest];
+    }
+  }
+  ~acyclic_forward_backward() { delete[] g.states; }
+  Weight total() const { return b[0]; }
+  bool ok() const { return acyclic && !total().isZero(); }
+};
+
+struct more_probable {
+  bool operator()(WFST::symbol_posterior const& a, WFST::symbol_posterior const& b) const {
+    return a.p > b.p || (a.p == b.p && a.symbol < b.symbol);
+  }
+};
+
+}
+
+bool WFST::arc_posteriors() {
+  if (!valid()) return false;
+  acyclic_forward_backward fb(*this);
+  if (!fb.ok()) return false;
+  Weight z = fb.total();
+  for (unsigned s = 0, n = numStates(); s < n; ++s)
+    for (State::Arcs::val_iterator a = states[s].arcs.val_begin(), e = states[s].arcs.val_end(); a != e;
+         ++a) {
+      a->weight *= fb.f[s] * fb.b[a->dest];
+      a->weight /= z;
+    }
+  clear_groups();
+  return true;
+}
+
+bool WFST::confusion_network(confusion_network_type& cn, LabelType dir) {
+  cn.clear();
+  if (!valid()) return false;
+  acyclic_forward_backward fb(*this);
+  if (!fb.ok()) return false;
+  Weight z = fb.total();
+  // at[s][i]: the forward sum over the paths to s that have i symbols so far; freed once s is done
+  std::vector<std::vector<Weight> > at(numStates());
+  std::vector<std::map<unsigned, Weight> > p;  // [position][symbol]
+  at[0].push_back(Weight::ONE());
+  typedef dynamic_array<unsigned>::const_reverse_iterator topo_iterator;
+  for (topo_iterator i = fb.rev.rbegin(), ie = fb.rev.rend(); i != ie; ++i) {
+    unsigned s = *i;
+    std::vector<Weight> const& from = at[s];
+    for (State::Arcs::const_iterator a = states[s].arcs.const_begin(), e = states[s].arcs.const_end(); a != e;
+         ++a) {
+      unsigned sym = a->symbol(dir);
+      bool eps = sym == epsilon_index;
+      std::vector<Weight>& to = at[a->dest];
+      if (to.size() < from.size() + !eps) to.resize(from.size() + !eps);
+      for (unsigned n = 0; n < from.size(); ++n) {
+        if (from[n].isZero()) continue;
+        Weight w = from[n] * a->weight;
+        to[n + !eps] += w;
+        if (eps) continue;
+        if (p.size() <= n) p.resize(n + 1);
+        p[n][sym] += w * fb.b[a->dest] / z;
+      }
+    }
+    if (s != final) std::vector<Weight>().swap(at[s]);
+  }
+  cn.resize(p.size());
+  for (unsigned n = 0; n < p.size(); ++n) {
+    Weight some;
+    for (std::map<unsigned, Weight>::const_iterator i = p[n].begin(), e = p[n].end(); i != e; ++i) {
+      symbol_posterior sp;
+      sp.symbol = i->first;
+      sp.p = i->second;
+      cn[n].push_back(sp);
+      some += i->second;
+    }
+    // the rest of the mass: paths whose yield ended before position n
+    if (some < Weight::ONE()) {
+      symbol_posterior none;
+      none.symbol = epsilon_index;
+      none.p = Weight::ONE() - some;
+      if (none.p.getReal() > 1e-6) cn[n].push_back(none);
+    }
+    std::sort(cn[n].begin(), cn[n].end(), more_probable());
+  }
+  return true;
+}
+
+
+}
@@ -0,0 +1,201 @@
+#ifndef GRAEHL_CARMEL__SAMPLER_H
+#define GRAEHL_CARMEL__SAMPLER_H
+
+// random paths (-G) and input/output pairs (-g) drawn from alias tables (Walker 1977, Vose 1991) built once
+// per transducer, so each step costs one random number and two array lookups instead of summing and then
+// rescanning a state's arcs.  with --threads, thread t draws from its own stream, seeded from -R and t, so
+// the output depends only on the seed and the number of threads
+
+#include <carmel/src/fst.h>
+#include <graehl/shared/hash_murmur.hpp>
+#include <graehl/shared/random.hpp>
+#include <graehl/shared/thread_group.hpp>
+#include <algorithm>
+#include <vector>
+
+namespace graehl {
+
+struct path_sampler {
+  typedef std::vector<FSTArc const*> path;
+
+  /// by_input (-g): choose one of the state's inputs uniformly, then one of the arcs with that input in
+  /// proportion to its weight.  otherwise (-G), choose an arc in proportion to its weight
+  path_sampler(WFST const& x, bool by_input) : final(x.final), by_input(by_input) {
+    unsigned n = x.numStates();
+    first_table.reserve(n + 1);
+    path arcs;
+    for (unsigned s = 0; s < n; ++s) {
+      first_table.push_back(tables.size());
+      arcs.clear();
+      State::Arcs const& l = x.states[s].arcs;
+      for (State::Arcs::const_iterator a = l.const_begin(), e = l.const_end(); a != e; ++a)
+        arcs.push_back(&*a);
+      if (!by_input) {
+        add_table(arcs.begin(), arcs.end());
+        continue;
+      }
+      std::stable_sort(arcs.begin(), arcs.end(), by_in);
+      for (path::const_iterator i = arcs.begin(), e = arcs.end(); i != e;) {
+        path::const_iterator j = i;
+        while (++j != e && (*j)->in == (*i)->in) {
+        }
+        add_table(i, j);
+        i = j;
+      }
+    }
+    first_table.push_back(tables.size());
+  }
+
+  /// appends a random path from start to final to p.  false if it had more than max_len arcs (-G) or
+  /// more than max_len input or output letters (-g), or got stuck
+  template <class Random>
+  bool sample(path& p, Random& r, unsigned max_len = (unsigned)-1) const {
+    unsigned n_in = 0, n_out = 0, n_arcs = 0;
+    for (unsigned s = 0; s != final;) {
+      unsigned t = first_table[s], n = first_table[s + 1] - t;
+      if (!n) return false;
+      if (n > 1) t += below(n, r);
+      FSTArc const* a = choose(tables[t], r);
+      if (by_input ? (a->in && ++n_in > max_len) || (a->out && ++n_out > max_len) : ++n_arcs > max_len)
+        return false;
+      p.push_back(a);
+      s = a->dest;
+    }
+    return true;
+  }
+
+ private:
+  struct entry {
+    double keep;  // choose arc with probability keep, else the alias entry's arc
+    unsigned alias;  // index within the same table
+    FSTArc const* arc;
+  };
+  struct table {
+    unsigned begin, size;  // in entries
+  };
+  std::vector<entry> entries;
+  std::vector<table> tables;
+  std::vector<unsigned> first_table;  // [state] .. [state+1] in tables; one per input for -g
+  unsigned final;
+  bool by_input;
+  std::vector<double> p;
+  std::vector<unsigned> small, large;
+
+  static bool by_in(FSTArc const* a, FSTArc const* b) { return a->in < b->in; }
+
+  template <class Random>
+  static unsigned below(unsigned n, Random& r) {
+    unsigned i = (unsigned)(r() * n);
+    return i < n ? i : n - 1;
+  }
+
+  template <class Random>
+  FSTArc const* choose(table const& t, Random& r) const {
+    double u = r() * t.size;
+    unsigned i = (unsigned)u;
+    if (i >= t.size) i = t.size - 1;
+    entry const& e = entries[t.begin + i];
+    return u - i < e.keep ? e.arc : entries[t.begin + e.alias].arc;
+  }
+
+  // Vose's method.  if all the weights are zero, the choice is uniform
+  void add_table(path::const_iterator a, path::const_iterator end) {
+    table t;
+    t.begin = entries.size();
+    t.size = end - a;
+    tables.push_back(t);
+    Weight sum;
+    for (path::const_iterator i = a; i != end; ++i) sum += (*i)->weight;
+    p.clear();
+    small.clear();
+    large.clear();
+    for (unsigned i = 0; i < t.size; ++i) {
+      Weight w = a[i]->weight;
+      w /= sum;
+      p.push_back(sum.isZero() ? 1. : w.getReal() * t.size);
+      (p[i] < 1. ? small : large).push_back(i);
+      entry e;
+      e.keep = 1.;
+      e.alias = i;
+      e.arc = a[i];
+      entries.push_back(e);
+    }
+    while (!small.empty() && !large.empty()) {
+      unsigned s = small.back(), l = large.back();
+      small.pop_back();
+      entry& e = entries[t.begin + s];
+      e.keep = p[s];
+      e.alias = l;
+      if ((p[l] -= 1. - p[s]) < 1.) {
+        large.pop_back();
+        small.push_back(l);
+      }
+    }
+    // whatever is left is 1 but for rounding
+  }
+};
+
+/// the seed of thread t's random stream (thread 0 uses seed itself, so --threads=1 is the default)
+inline random_seed_type sampler_seed(random_seed_type seed, unsigned t) {
+  return t ? (random_seed_type)fmix64((uint64_t)seed << 32 | t) : seed;
+}
+
+/// calls print(path) for n random paths (retrying those sample rejects), drawing on n_threads threads in
+/// batches and printing them in a fixed order
+template <class Print>
+void sample_paths(path_sampler const& sampler, unsigned n, unsigned n_threads, random_seed_type seed,
+                  unsigned max_len, Print print) {
+  if (n_threads < 1) n_threads = 1;
+  enum { kBatch = 1024 };  // paths per thread per batch
+  struct drawer {
+    path_sampler const* sampler;
+    unsigned max_len;
+    random r;
+    std::vector<path_sampler::path> paths;
+    unsigned n;
+    void operator()() {
+      paths.resize(n);
+      for (unsigned i = 0; i < n; ++i)
+        do paths[i].clear();
+        while (!sampler->sample(paths[i], r, max_len));
+    }
+  };
+  struct run {
+    drawer* d;
+    void operator()() { (*d)(); }
+  };
+  std::vector<drawer> drawers(n_threads);
+  for (unsigned t = 0; t < n_threads; ++t) {
+    drawer& d = drawers[t];
+    d.sampler = &sampler;
+    d.max_len = max_len;
+    d.r.set_random_seed(sampler_seed(seed, t));
+  }
+  while (n) {
+    unsigned left = n;
+    for (unsigned t = 0; t < n_threads; ++t) {
+      unsigned take = left < kBatch ? left : kBatch;
+      drawers[t].n = take;
+      left -= take;
+    }
+    if (n_threads == 1)
+      drawers[0]();
+    else {
+      thread_group threads;
+      for (unsigned t = 0; t < n_threads; ++t)
+        if (drawers[t].n) {
+          run r = {&drawers[t]};
+          threads.create_thread(r);
+        }
+      threads.join_all();
+    }
+    for (unsigned t = 0; t < n_threads; ++t)
+      for (unsigned i = 0; i < drawers[t].n; ++i) print(drawers[t].paths[i]);
+    n = left;
+  }
+}
+
+
+}
+
+#endif
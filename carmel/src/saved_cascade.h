@@ -0,0 +1,237 @@
+#ifndef GRAEHL_CARMEL__SAVED_CASCADE_H
+#define GRAEHL_CARMEL__SAVED_CASCADE_H
+
+// --save-cascade-derivations / --load-cascade-derivations: a cascade's composition, the chains taking its
+// arcs to the cascade's arcs, and the training corpus's derivations, written once so that later runs (with
+// other initial weights, priors or --normby) read them instead of composing and computing derivations.
+// neither depends on the weights, so the file is marked with fingerprints of the transducers (all but their
+// weights) and of the corpus, and refused unless they match.  native byte order, like transducer images
+
+#include <carmel/src/cascade.h>
+#include <carmel/src/derivations.h>
+#include <carmel/src/fst.h>
+#include <graehl/shared/hash_murmur.hpp>
+#include <graehl/shared/serialize_batch.hpp>
+#include <graehl/shared/simple_serialize.hpp>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace graehl {
+
+struct saved_cascade {
+  /// continues h with w's states, arcs (in order), letters, and which arcs are locked or tied.  of the
+  /// weights, only whether a locked arc's is 1 (those are left out of chains)
+  static uint64_t fingerprint(WFST const& w, uint64_t h) {
+    h = mix(mix(h, w.numStates()), w.final);
+    for (unsigned s = 0, n = w.numStates(); s < n; ++s) {
+      State::Arcs const& arcs = w.states[s].arcs;
+      h = mix(h, w.states[s].size);
+      for (State::Arcs::const_iterator a = arcs.const_begin(), e = arcs.const_end(); a != e; ++a) {
+        h = mix(mix(mix(h, a->in), a->out), a->dest);
+        h = mix(h, (uint64_t)a->groupId << 1 | cascade_parameters::is_locked_1(const_cast<FSTArc*>(&*a)));
+      }
+    }
+    for (unsigned d = 0; d < 2; ++d) {
+      WFST::alphabet_type const& l = w.alphabet((LabelType)d);
+      h = mix(h, l.size());
+      for (unsigned i = 0, n = l.size(); i < n; ++i) h = mix(h, text(l[i].c_str()));
+    }
+    return h;
+  }
+
+  static uint64_t fingerprint(std::string const& s, uint64_t h = 0) { return mix(h, text(s.c_str())); }
+
+  /// the examples (in order) and whether those without derivations are dropped
+  static uint64_t fingerprint(training_corpus const& corpus, bool prune) {
+    uint64_t h = mix(corpus.examples.size(), prune);
+    for (List<IOSymSeq>::const_iterator i = corpus.examples.const_begin(), e = corpus.examples.const_end();
+         i != e; ++i) {
+      h = mix(h, MurmurHash64(&i->weight, sizeof(i->weight)));
+      h = mix(mix(h, i->i.n), MurmurHash64(i->i.let, i->i.n * sizeof(int)));
+      h = mix(mix(h, i->o.n), MurmurHash64(i->o.let, i->o.n * sizeof(int)));
+    }
+    return h;
+  }
+
+  /// writes filename: the composition and chains (unless the cascade is trivial), then derivs, which
+  /// were computed for corpus
+  static void save(std::string const& filename, uint64_t structure, cascade_parameters const& cascade,
+                   WFST const& composed, training_corpus const& corpus, bool prune,
+                   serialize_batch<derivations>& derivs) {
+    std::ofstream o(filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    header h;
+    h.weight_size = sizeof(Weight);
+    h.composed = !cascade.trivial;
+    h.structure = structure;
+    h.corpus = fingerprint(corpus, prune);
+    h.n_derivations = derivs.size();
+    char magic[kMagicSpace] = {0};
+    std::strcpy(magic, kMagic());
+    o.write(magic, kMagicSpace);
+    write_pod(o, h);
+    if (h.composed) {
+      std::ostringstream image;
+      composed.write_image(image);
+      std::string const& bytes = image.str();
+      write_pod(o, (uint64_t)bytes.size());
+      o.write(bytes.data(), bytes.size());
+      save_chains(o, cascade);
+    }
+    ostream_archive a(o);
+    for (derivs.rewind(); derivs.advance();) a << derivs.current();
+    o.close();
+    if (!o) throw std::runtime_error("couldn't write cascade derivations " + filename);
+  }
+
+  /// opens filename and reads its header
+  explicit saved_cascade(std::string const& filename)
+      : filename(filename), in(filename.c_str(), std::ios::in | std::ios::binary), a(in) {
+    if (!in) fail("couldn't be opened");
+    char magic[kMagicSpace];
+    if (!in.read(magic, kMagicSpace) || std::strncmp(magic, kMagic(), kMagicSpace) || !read_pod(h))
+      fail("isn't a --save-cascade-derivations file");
+    if (h.weight_size != sizeof(Weight)) fail("was written with a different size of weight");
+  }
+
+  bool has_composed() const { return h.composed; }
+
+  /// throws unless the file was saved for a cascade with this fingerprint
+  void check_structure(uint64_t structure) const {
+    if (structure != h.structure)
+      fail("was saved for different transducers (other than their weights) or composition options");
+  }
+
+  /// the saved composition, setting the chains of cascade (which already has the transducers) to match
+  WFST* load_composed(cascade_parameters& cascade) {
+    uint64_t size;
+    if (!h.composed || !read_pod(size)) fail("has no composition");
+    std::string bytes(size, '\0');
+    if (!in.read(&bytes[0], size)) fail("is truncated");
+    WFST* composed = NEW WFST();
+    if (!composed->read_image(bytes.data(), bytes.size())) {
+      delete composed;
+      fail("has a bad composition");
+    }
+    load_chains(cascade);
+    cascade.done_composing(composed);
+    return composed;
+  }
+
+  /// throws unless the derivations were computed for this corpus
+  void check_corpus(training_corpus const& corpus, bool prune) const {
+    if (fingerprint(corpus, prune) != h.corpus)
+      fail("was saved for a different training corpus (or --cache-no-prune)");
+  }
+
+  /// the saved derivations, one per example that had any, in order of their lineno
+  unsigned n_derivations() const { return h.n_derivations; }
+  void read(derivations& d) { a >> d; }
+
+ private:
+  static char const* kMagic() { return "carmel cascade derivations 1\n"; }
+  enum { kMagicSpace = 32 };
+
+  struct header {
+    uint32_t weight_size;
+    uint32_t composed;  // the composition's image and chains follow (unless the cascade was trivial)
+    uint64_t structure, corpus;
+    uint64_t n_derivations;
+  };
+
+  std::string filename;
+  std::ifstream in;
+  istream_archive a;
+  header h;
+
+  static uint64_t mix(uint64_t h, uint64_t x) { return fmix64(h * 0x9e3779b97f4a7c15ULL + x); }
+  static uint64_t text(char const* s) { return MurmurHash64(s, std::strlen(s)); }
+
+  void fail(char const* why) const {
+    throw std::runtime_error("cascade derivations file " + filename + " " + why);
+  }
+
+  template <class T>
+  static void write_pod(std::ostream& o, T const& t) {
+    o.write((char const*)&t, sizeof(T));
+  }
+  template <class T>
+  bool read_pod(T& t) {
+    return (bool)in.read((char*)&t, sizeof(T));
+  }
+  template <class T>
+  static void write_pods(std::ostream& o, std::vector<T> const& v) {
+    write_pod(o, (uint64_t)v.size());
+    if (!v.empty()) o.write((char const*)&v[0], v.size() * sizeof(T));
+  }
+  template <class T>
+  void read_pods(std::vector<T>& v) {
+    uint64_t n;
+    if (!read_pod(n)) fail("is truncated");
+    v.resize(n);
+    if (n && !in.read((char*)&v[0], n * sizeof(T))) fail("is truncated");
+  }
+
+  typedef cascade_parameters::chain_t chain_t;
+
+  struct arc_lister {
+    std::vector<FSTArc*>* arcs;
+    void operator()(FSTArc const& a) { arcs->push_back(const_cast<FSTArc*>(&a)); }
+  };
+
+  // chains share suffixes, so they're saved as nodes (arc: its index in the cascade's visit_arcs order;
+  // next: an earlier node, or 0 for the end) and the first node of each chain
+  static void save_chains(std::ostream& o, cascade_parameters const& cascade) {
+    cascade_parameters::arcid_type arc_id;
+    cascade.arcids(arc_id, 0);
+    HashTable<chain_t, uint32_t> node_id;
+    std::vector<uint32_t> arc(1, 0), next(1, 0), head;
+    std::vector<chain_t> fresh;
+    cascade_parameters::chains_t const& chains = cascade.chains;
+    for (unsigned c = 0, n = chains.size(); c < n; ++c) {
+      fresh.clear();
+      for (chain_t p = chains[c]; p && !node_id.find_second(p); p = p->next) fresh.push_back(p);
+      for (unsigned i = fresh.size(); i--;) {
+        chain_t p = fresh[i];
+        arc.push_back(arc_id[p->data]);
+        next.push_back(p->next ? node_id[p->next] : 0);
+        node_id.insert(p, arc.size() - 1);
+      }
+      head.push_back(chains[c] ? node_id[chains[c]] : 0);
+    }
+    write_pods(o, arc);
+    write_pods(o, next);
+    write_pods(o, head);
+  }
+
+  void load_chains(cascade_parameters& cascade) {
+    std::vector<FSTArc*> params;
+    arc_lister l = {&params};
+    cascade.visit_arcs(l);
+    std::vector<uint32_t> arc, next, head;
+    read_pods(arc);
+    read_pods(next);
+    read_pods(head);
+    if (arc.size() != next.size()) fail("has bad chains");
+    std::vector<chain_t> node(arc.size(), (chain_t)0);
+    for (unsigned i = 1, n = arc.size(); i < n; ++i) {
+      if (arc[i] >= params.size() || next[i] >= i) fail("has bad chains");
+      node[i] = cascade.pool.construct(params[arc[i]], node[next[i]]);
+    }
+    cascade.chains.clear();
+    cascade.chains.reserve(head.size());
+    for (unsigned c = 0, n = head.size(); c < n; ++c) {
+      if (head[c] >= node.size()) fail("has bad chains");
+      cascade.chains.push_back(node[head[c]]);
+    }
+  }
+};
+
+
+}
+
+#endif
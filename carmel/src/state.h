@@ -8,7 +8,9 @@
 #include <graehl/shared/weight.h>
 #include <graehl/shared/list.h>
 #include <graehl/shared/arc.h>
+#include <algorithm>
 #include <iostream>
+#include <vector>
 
 
 namespace graehl {
@@ -48,6 +50,83 @@ END_HASH
 
 namespace graehl {
 
+/// a state's arcs grouped by their letter on one tape: letters ascending, and each letter's arcs in reverse
+/// list order (the order compose and normalization have always visited them in).  a letter is found by
+/// scanning a few letters, by binary search among more, or (when the letters fill enough of their range) in
+/// a table indexed by letter
+struct letter_index {
+  typedef HalfArc const* iterator;
+  struct range {
+    iterator first, last;
+    iterator begin() const { return first; }
+    iterator end() const { return last; }
+    bool empty() const { return first == last; }
+  };
+
+  letter_index(List<FSTArc>& arcs, LabelType dir) {
+    for (List<FSTArc>::val_iterator a = arcs.val_begin(), e = arcs.val_end(); a != e; ++a) by.push_back(&*a);
+    std::reverse(by.begin(), by.end());
+    by_letter less = {dir};
+    std::stable_sort(by.begin(), by.end(), less);
+    for (unsigned i = 0, n = by.size(); i < n; ++i)
+      if (!i || by[i]->symbol(dir) != by[i - 1]->symbol(dir)) {
+        group g = {by[i]->symbol(dir), i};
+        groups.push_back(g);
+      }
+    unsigned n = groups.size();
+    group end = {(unsigned)-1, (unsigned)by.size()};
+    groups.push_back(end);
+    if (n > kScan && groups[n - 1].letter - groups[0].letter < kDenseSpread * n) {
+      slot.resize(groups[n - 1].letter - groups[0].letter + 1, (unsigned)-1);
+      for (unsigned g = 0; g < n; ++g) slot[groups[g].letter - groups[0].letter] = g;
+    }
+  }
+
+  /// number of letters
+  unsigned size() const { return groups.size() - 1; }
+  unsigned letter(unsigned g) const { return groups[g].letter; }
+  /// the arcs of the g-th letter
+  range arcs(unsigned g) const {
+    range r = {&by[0] + groups[g].begin, &by[0] + groups[g + 1].begin};
+    return r;
+  }
+
+  /// the arcs with letter l (empty if none)
+  range find(unsigned l) const {
+    unsigned n = size(), g;
+    if (!slot.empty()) {
+      unsigned i = l - groups[0].letter;
+      if (i >= slot.size() || (g = slot[i]) == (unsigned)-1) return none();
+    } else if (n <= kScan) {
+      for (g = 0; g < n && groups[g].letter < l; ++g) {
+      }
+      if (g == n || groups[g].letter != l) return none();
+    } else {
+      g = std::lower_bound(groups.begin(), groups.begin() + n, l, before) - groups.begin();
+      if (g == n || groups[g].letter != l) return none();
+    }
+    return arcs(g);
+  }
+
+ private:
+  enum { kScan = 8, kDenseSpread = 4 };  // scan up to kScan letters; a table if they fill 1/kDenseSpread
+  struct group {
+    unsigned letter, begin;  // in by
+  };
+  std::vector<HalfArc> by;
+  std::vector<group> groups;  // then one past the last, at by.size()
+  std::vector<unsigned> slot;  // [letter - the first letter]: index in groups, or -1.  empty unless dense
+  struct by_letter {
+    LabelType dir;
+    bool operator()(HalfArc a, HalfArc b) const { return a->symbol(dir) < b->symbol(dir); }
+  };
+  static bool before(group const& g, unsigned l) { return g.letter < l; }
+  static range none() {
+    range r = {0, 0};
+    return r;
+  }
+};
+
 struct State {
 
   typedef List<FSTArc> Arcs;
@@ -103,10 +182,6 @@ struct State {
 
   Arcs arcs;
   unsigned size;
-#ifdef BIDIRECTIONAL
-  int hitcount;  // how many times index is used, negative for index on input, positive for index on output
-#endif
-  typedef HashTable<UnsignedKey, List<HalfArc> > Index;
 
   template <class IOMap>
   void index_io(IOMap& m) const {
@@ -114,28 +189,10 @@ struct State {
       m[IOPair(a->in, a->out)].push_back(const_cast<FSTArc*>(&*a));
   }
 
-  Index* index;
+  letter_index* index[2];  // [tape], each built on demand (see indexBy) and kept until the arcs change
 
-  //    typedef HashTable<
-  State()
-      : arcs()
-      , size(0)
-      ,
-#ifdef BIDIRECTIONAL
-      hitcount(0)
-      ,
-#endif
-      index(NULL) {
-  }
-  State(const State& s) : arcs(s.arcs), size(s.size) {
-#ifdef BIDIRECTIONAL
-    hitcount = s.hitcount;
-#endif
-    //    if (s.index == NULL)
-    index = (Index*)NULL;
-    //    else
-    //     index = NEW Index(*s.index);
-  }
+  State() : arcs(), size(0) { index[kInput] = index[kOutput] = 0; }
+  State(const State& s) : arcs(s.arcs), size(s.size) { index[kInput] = index[kOutput] = 0; }
   ~State() { flush(); }
 
   void raisePower(double exponent = 1.0) {
@@ -154,55 +211,17 @@ struct State {
       else
         l->in = identity_fsa ? l->out : 0;
   }
-  // fixme: push back
-  void indexBy(LabelType dir = kInput) {
-    if (dir != kInput) {
-#ifdef BIDIRECTIONAL
-      if (hitcount++ > 0) return;
-      hitcount = 1;
-      delete index;
-#else
-      if (index) return;
-#endif
-      index = NEW Index(size);
-      for (Arcs::val_iterator l = arcs.val_begin(), end = arcs.val_end(); l != end; ++l) {
-// if you distrust ht[key], I guess: //#define QUEERINDEX
-#ifdef QUEERINDEX
-        if (!(list = find_second(*index, (UnsignedKey)l->out)))
-          add(*index, (UnsignedKey)l->out, List<HalfArc>(&(*l)));
-        else
-          list->push_front(&(*l));
-#else
-        (*index)[l->out].push_front(&(*l));
-#endif
-      }
-      return;
-    }
-#ifdef BIDIRECTIONAL
-    if (hitcount-- < 0) return;
-    hitcount = -1;
-    delete index;
-#else
-    if (index) return;
-#endif
-    index = NEW Index(size);
-    for (Arcs::val_iterator l = arcs.val_begin(), end = arcs.val_end(); l != end; ++l) {
-#ifdef QUEERINDEX
-      if (!(list = find_second(*index, (UnsignedKey)l->in)))
-        add(*index, (UnsignedKey)l->in, List<HalfArc>(&(*l)));
-      else
-        list->push_front(&(*l));
-#else
-      (*index)[l->in].push_front(&(*l));
-#endif
-    }
+  /// our arcs by their letter on tape dir.  the index of either tape is kept until flush, which everything
+  /// that changes the arcs' letters or removes arcs calls
+  letter_index const& indexBy(LabelType dir = kInput) {
+    if (!index[dir]) index[dir] = NEW letter_index(arcs, dir);
+    return *index[dir];
   }
   void flush() {
-    if (index) delete index;
-    index = NULL;
-#ifdef BIDIRECTIONAL
-    hitcount = 0;
-#endif
+    for (unsigned d = 0; d < 2; ++d) {
+      delete index[d];
+      index[d] = 0;
+    }
   }
 
   // don't pass by value, expensive
@@ -234,12 +253,11 @@ struct State {
   FSTArc& addArc(const FSTArc& arc) {
     arcs.push(arc);
     ++size;
-    Assert(!index);
+    Assert(!index[kInput] && !index[kOutput]);
 #ifdef DEBUG
-    if (index) {
+    if (index[kInput] || index[kOutput]) {
       std::cerr << "Warning: adding arc to indexed state.\n";
-      delete index;
-      index = NULL;
+      flush();
     }
 #endif
     return arcs.top();
@@ -298,6 +316,7 @@ struct State {
   }
   template <class T>
   T remove(T t) {
+    flush();
     --size;
     return arcs.erase(t);
   }
@@ -317,10 +336,9 @@ struct State {
     using std::swap;
     swap(size, b.size);
     swap(arcs, b.arcs);
-    swap(index, b.index);  // safe only because List iterators are stable when lists are swapped
-#ifdef BIDIRECTIONAL
-    swap(hitcount, b.hitcount);
-#endif
+    // safe only because List iterators are stable when lists are swapped
+    swap(index[kInput], b.index[kInput]);
+    swap(index[kOutput], b.index[kOutput]);
   }
 };
 
@@ -0,0 +1,133 @@
+#ifndef GRAEHL_CARMEL__STATE_NAMES_H
+#define GRAEHL_CARMEL__STATE_NAMES_H
+
+// state names that can be shared between a WFST and the transducers composed from it.  composition (-m)
+// records each new state's name as (qa, filter, qb) over its operands' names, and builds the string only
+// when something asks for it (stateName), so naming costs no more than numbering and has no length limit.
+
+#include <graehl/shared/array.hpp>
+#include <graehl/shared/static_itoa.h>
+#include <graehl/shared/strhash.h>
+#include <graehl/shared/threadlocal.hpp>
+#include <boost/shared_ptr.hpp>
+#include <string>
+#include <vector>
+
+namespace graehl {
+
+struct state_names {
+  typedef boost::shared_ptr<state_names> pointer;
+  virtual ~state_names() {}
+  /// name of state i as it appears in a legible file.  may be a static buffer (use or copy it before a few
+  /// more calls), as with static_utoa
+  virtual char const* name(unsigned i) const = 0;
+  /// appends name(i) to o
+  virtual void append(std::string& o, unsigned i) const { o += name(i); }
+  /// a copy we can remove_marked without disturbing others sharing this
+  virtual pointer clone() const = 0;
+  /// as Alphabet::removeMarked
+  virtual void remove_marked(bool marked[], unsigned* oldToNew, unsigned n) = 0;
+};
+
+/// states named by their index
+struct numbered_state_names : state_names {
+  char const* name(unsigned i) const { return static_utoa(i); }
+  pointer clone() const { return pointer(new numbered_state_names); }
+  void remove_marked(bool marked[], unsigned* oldToNew, unsigned n) {}
+};
+
+/// the names read from a file (taken from the WFST's Alphabet by swapping)
+struct flat_state_names : state_names {
+  typedef Alphabet<StringKey, StringPool> alphabet_type;
+  alphabet_type names;
+  char const* name(unsigned i) const { return names[i].c_str(); }
+  pointer clone() const { return pointer(new flat_state_names(*this)); }
+  void remove_marked(bool marked[], unsigned* oldToNew, unsigned n) {
+    names.removeMarked(marked, oldToNew, n);
+  }
+};
+
+/// the states of a composition a*b: (qa, filter, qb) are named qa|filter|qb, mediate states (compose -a)
+/// qb,letter->qa (letter being the matched a output/b input), and an added final state "final".  names
+/// containing spaces or parens are quoted
+struct composed_state_names : state_names {
+  enum { kFinal = 3, kMediate = 4 };  // tag: filter (0-2), kFinal, or kMediate + index in letters
+  struct trio {
+    unsigned qa, qb, tag;
+  };
+  pointer a, b;
+  std::vector<trio> trios;  // [state]
+  std::vector<std::string> letters;  // of mediate states
+
+  composed_state_names(pointer const& a, pointer const& b) : a(a), b(b) {}
+
+  void add(unsigned qa, unsigned qb, unsigned tag) {
+    trio t;
+    t.qa = qa;
+    t.qb = qb;
+    t.tag = tag;
+    trios.push_back(t);
+  }
+
+  char const* name(unsigned i) const {
+    enum { kRing = 4 };
+    static THREADLOCAL std::string ring[kRing];
+    static THREADLOCAL unsigned next;
+    std::string& s = ring[next++ % kRing];
+    s.clear();
+    append(s, i);
+    return s.c_str();
+  }
+
+  void append(std::string& o, unsigned i) const {
+    trio const& t = trios[i];
+    if (t.tag == kFinal) {
+      o += "final";
+      return;
+    }
+    std::string::size_type start = o.size();
+    if (t.tag < kFinal) {
+      a->append(o, t.qa);
+      o += '|';
+      o += (char)('0' + t.tag);
+      o += '|';
+      b->append(o, t.qb);
+    } else {
+      b->append(o, t.qb);
+      o += ',';
+      o += letters[t.tag - kMediate];
+      o += "->";
+      a->append(o, t.qa);
+    }
+    quote_from(o, start);
+  }
+
+  pointer clone() const { return pointer(new composed_state_names(*this)); }
+
+  void remove_marked(bool marked[], unsigned* oldToNew, unsigned n) {
+    if (trios.size() > n) trios.resize(n);
+    remove_marked_swap(trios, marked);
+  }
+
+ private:
+  // quote o[start..) if it needs it (as a legible file would)
+  static void quote_from(std::string& o, std::string::size_type start) {
+    std::string::size_type i = start, e = o.size();
+    bool quote = i < e && o[i] == '"';
+    for (; !quote && i < e; ++i) quote = o[i] == '(' || o[i] == ')' || o[i] == ' ';
+    if (!quote) return;
+    std::string raw(o, start);
+    o.resize(start);
+    o += '"';
+    for (std::string::const_iterator p = raw.begin(), pe = raw.end(); p != pe; ++p) {
+      if (*p == '"' || *p == '\\') o += '\\';
+      o += *p;
+    }
+    o += '"';
+  }
+};
+
+
+}
+
+#endif
@@ -8,6 +8,10 @@
 #include <graehl/shared/periodic.hpp>
 #include <graehl/shared/segments.hpp>
 #include <graehl/shared/time_space_report.hpp>
+#include <graehl/shared/thread_group.hpp>
+#include <graehl/shared/checkpoint.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <sstream>
 #define GRAEHL__DEBUG_PRINT_MAIN
 #include <graehl/shared/debugprint.hpp>
 //#define DEBUGTRAIN
@@ -27,7 +31,7 @@ void training_progress_scale(unsigned n, unsigned N, unsigned num_every) {
 }
 
 
-derivations::statistics derivations::global_stats;
+THREADLOCAL derivations::statistics derivations::global_stats;
 
 void check_fb_agree(Weight fin, Weight fin2) {
 #ifdef DEBUGTRAIN
@@ -317,7 +321,7 @@ struct forward_backward : public cached_derivs<arc_counts> {
     unweighted_corpus_prob = &unweighted_corpus_prob_accum;
     weighted_corpus_prob.setOne();
     cache_t::foreach_deriv(*this);
-    Config::log() << '\n';
+    if (!quiet) Config::log() << '\n';
     return weighted_corpus_prob;
   }
   Weight estimate_matrix(Weight& unweighted_corpus_prob_accum);
@@ -325,7 +329,7 @@ struct forward_backward : public cached_derivs<arc_counts> {
  public:
   void operator()(unsigned n, derivations& derivs)  // for foreach_deriv
   {
-    training_progress_scale(n, corpus().size());
+    if (!quiet) training_progress_scale(n, corpus().size());
     Weight prob = derivs.collect_counts(arcs);
     *unweighted_corpus_prob *= prob;
     weighted_corpus_prob *= prob.pow(derivs.weight);
@@ -362,6 +366,7 @@ struct forward_backward : public cached_derivs<arc_counts> {
   bool cache_backward;
   //    serialize_batch<derivations> cached_derivs;
   bool prune;
+  bool quiet;  // no progress output (concurrent restarts)
   std::string odf;
 
   forward_backward(WFST& x, cascade_parameters& cascade, bool per_arc_prior, Weight global_prior,
@@ -376,6 +381,7 @@ struct forward_backward : public cached_derivs<arc_counts> {
     cascade.set_composed(&x);
     trn = NULL;
     f = b = NULL;
+    quiet = false;
     remove_bad_training = true;
     cache = copt.cache();
     use_matrix = copt.use_matrix();
@@ -410,6 +416,23 @@ struct forward_backward : public cached_derivs<arc_counts> {
     }
   }
 
+  // x is a WFST::replicate of master.x, given its own weights; the derivations cached by master are only
+  // read (master must cache_backward), so several of these can estimate concurrently
+  forward_backward(WFST& x, cascade_parameters& cascade, forward_backward& master)
+      : cache_t(x, cascade, master), cascade(cascade), arcs(x), mio(arcs) {
+    assert(master.cache_backward && !master.derivs.use_file);
+    cascade.set_composed(&x);
+    trn = master.trn;
+    f = b = NULL;
+    quiet = true;
+    remove_bad_training = false;
+    cache = cache_backward = true;
+    use_matrix = false;
+    prune = master.prune;
+    n_st = x.numStates();
+    for (unsigned i = 0, N = arcs.size(); i != N; ++i) arcs[i].prior_counts = master.arcs[i].prior_counts;
+  }
+
   void matrix_dump(unsigned m_i, unsigned m_o) {
     assert(use_matrix && f && b);
     Config::debug() << "\nForwardProb/BackwardProb:\n";
@@ -469,6 +492,423 @@ Weight WFST::train(training_corpus& corpus, NormalizeMethods const& methods, boo
 }
 
 
+namespace {
+
+// EM settings common to every (random) start
+struct em_settings {
+  WFST::NormalizeMethods const& methods;
+  WFST::train_opts const& opts;
+  training_corpus& corpus;
+  Weight converge_arc_delta, converge_perplexity_ratio;
+  double learning_rate_growth_factor;
+  bool using_cascade;
+  em_settings(WFST::NormalizeMethods const& methods, WFST::train_opts const& opts, training_corpus& corpus,
+              Weight converge_arc_delta, Weight converge_perplexity_ratio, double learning_rate_growth_factor,
+              bool using_cascade)
+      : methods(methods)
+      , opts(opts)
+      , corpus(corpus)
+      , converge_arc_delta(converge_arc_delta)
+      , converge_perplexity_ratio(converge_perplexity_ratio)
+      , learning_rate_growth_factor(learning_rate_growth_factor)
+      , using_cascade(using_cascade) {}
+};
+
+// lowest perplexity over the starts so far; fb.save_best() holds its weights
+struct em_best {
+  Weight perplexity;
+  bool have_good_weights;
+  em_best() : have_good_weights(false) { perplexity.setInfinity(); }
+};
+
+struct em_start_result {
+  bool accepted;  // false: ra rejected the start after its first iteration
+  unsigned iterations;
+  Weight perplexity;  // at the last estimate
+};
+
+// where a start is between iterations (after maximize)
+struct em_progress {
+  unsigned restart_no;
+  unsigned iterations;  // 0: not begun (and for restart_no>0, not yet randomized)
+  Weight last_change, last_perplexity;
+  FLOAT_TYPE learning_rate;
+  explicit em_progress(unsigned restart_no = 0)
+      : restart_no(restart_no), iterations(0), last_change(10), learning_rate(1) {
+    last_perplexity.setInfinity();
+  }
+};
+
+/* --checkpoint-file / --resume: the weights and everything else em_start and the restart loop need to
+   continue from an em_progress.  with --train-cascade, the composed arcs' weights are the counts from the last
+   maximize (with em_weight and best_weight as usual), and the parameters are the cascade's transducers'
+   weights, which are restored first (restore_weights recomputes the composed weights) */
+struct em_checkpoint {
+  forward_backward& fb;
+  cascade_parameters& cascade;
+  em_best& best;
+  WFST::random_restart_acceptor& ra;
+  em_progress progress;
+  boost::scoped_ptr<checkpoint_writer> writer;
+  unsigned every;
+  enum { version = 2 };
+  em_checkpoint(forward_backward& fb, cascade_parameters& cascade, em_best& best,
+                WFST::random_restart_acceptor& ra, WFST::train_opts const& opts)
+      : fb(fb)
+      , cascade(cascade)
+      , best(best)
+      , ra(ra)
+      , every(opts.checkpoint_every ? opts.checkpoint_every : 1) {
+    if (!opts.checkpoint_file.empty()) writer.reset(NEW checkpoint_writer(opts.checkpoint_file, Config::log()));
+  }
+  void resume(std::string const& filename) {
+    checkpoint_reader(filename, "carmel-em", version)(*this);
+  }
+  void maybe_save(em_progress const& p) {
+    if (writer && p.iterations % every == 0) save(p);
+  }
+  void save(em_progress const& p) {
+    if (!writer) return;
+    progress = p;
+    checkpoint_buffer b("carmel-em", version);
+    checkpoint(b.archive);
+    writer->save(b);
+  }
+  template <class A>
+  void checkpoint(A& a) {
+    checkpoint_pod(a, progress);
+    checkpoint_pod(a, best.perplexity);
+    checkpoint_pod(a, best.have_good_weights);
+    checkpoint_pod(a, ra);
+    if (!cascade.trivial) {
+      WFST::saved_weights_t w;
+      cascade.save_weights(w);  // (when loading, just for the size)
+      checkpoint_fixed(a, &w[0], w.size(), "cascade weights");
+      if (A::is_loading) cascade.restore_weights(w);
+    }
+    forward_backward::arcs_t& arcs = fb.arcs;
+    checkpoint_size(a, arcs.size(), "arcs");
+    for (unsigned i = 0, N = arcs.size(); i != N; ++i) {
+      arc_counts& ac = arcs[i];
+      checkpoint_pod(a, ac.weight());
+      checkpoint_pod(a, ac.em_weight);
+      checkpoint_pod(a, ac.best_weight);
+    }
+    checkpoint_engine(a, g_random01.engine());
+  }
+};
+
+// EM from fb's current weights (after pr) until convergence (or max_iter), updating best
+em_start_result em_start(forward_backward& fb, cascade_parameters& cascade, em_settings const& em,
+                         em_best& best, WFST::random_restart_acceptor& ra, em_progress pr,
+                         std::ostream& log, em_checkpoint* ck = 0) {
+  WFST::train_opts const& opts = em.opts;
+  training_corpus& corpus = em.corpus;
+  Weight corpus_p;
+  em_start_result r;
+  r.accepted = true;
+  unsigned restart_no = pr.restart_no;
+  unsigned& train_iter = pr.iterations;
+  Weight& lastChange = pr.last_change;
+  Weight& lastPerplexity = pr.last_perplexity;
+  FLOAT_TYPE& learning_rate = pr.learning_rate;
+  bool last_was_reset = false;
+  for (;;) {
+    const bool first_time = train_iter == 0;
+    ++train_iter;
+//            time_report taken(log,"Time for iteration: ");
+#ifdef DEBUGTRAIN
+    Config::debug() << "Starting iteration: " << train_iter << '\n';
+#endif
+#ifdef DEBUG
+#define DWSTAT(a) print_stats(arcs, a)
+    arcs_table<arc_counts> const& arcs = fb.arcs;
+#else
+#define DWSTAT(a)
+#endif
+    //            DWSTAT("Before estimate");
+    bool cascade_counts = em.using_cascade && !first_time;
+    if (cascade_counts)
+      fb.arcs.visit(for_arcs::save_counts());  // so you can later save_best_counts if you like the ppx
+    cascade.update();
+    if (~opts.max_iter && train_iter > opts.max_iter && best.have_good_weights) {
+      log << "Maximum number of iterations (" << opts.max_iter
+          << ") reached before convergence criteria was met - greatest arc weight change was " << lastChange
+          << "\n";
+      --train_iter;  // (not run)
+      break;
+    }
+    Weight p = fb.estimate(corpus_p);  // lastPerplexity.isInfinity() // only delete no-path training the
+    // first time, in case we screw up with our learning rate
+    Weight newPerplexity = r.perplexity = p.ppxper(corpus.totalEmpiricalWeight);
+    DWSTAT("\nAfter estimate");
+    log << "i=" << train_iter << " (rate=" << learning_rate << "): ";
+    //            log << " per-output-symbol-perplexity="<<corpus_p.ppxper(corpus.n_output).as_base(2)<<"
+    //            per-example-perplexity="<<newPerplexity.as_base(2);
+    corpus_p.print_ppx_symbol(log, corpus.n_input, corpus.n_output,
+                              corpus.n_pairs);  // FIXME: newPerplexity is training-example-weighted
+    if (newPerplexity < best.perplexity
+        && (!em.using_cascade || cascade_counts)) {  // because of how I'm saving only composed counts, we
+      // can't actually get back to our initial starting point
+      // (iter 1)
+      log << " (new best)";
+      best.perplexity = newPerplexity;
+      best.have_good_weights = true;
+      fb.save_best();
+    }
+    Weight pp_ratio_scaled;
+    if (first_time) {
+
+      log << std::endl;
+      if (!ra.accept(newPerplexity, best.perplexity, restart_no, &log)) {
+        log << "Random start was insufficiently promising; trying another." << std::endl;
+        r.accepted = false;
+        break;  // to next random restart
+      }
+      pp_ratio_scaled.setZero();
+    } else {
+      pp_ratio_scaled = newPerplexity.relative_perplexity_ratio(lastPerplexity);
+      log << " (relative-perplexity-ratio=" << pp_ratio_scaled << ")";
+      if (lastChange < 1) log << ", max {d(weight)}=" << lastChange;
+#ifdef DEBUG_ADAPTIVE_EM
+      log << " last-perplexity=" << lastPerplexity << ' ';
+      if (learning_rate > 1) {
+        fb.arcs.visit(for_arcs::swap_em_scaled());
+        Weight d;
+        Weight em_pp = fb.estimate(d);
+        log << "unscaled-EM-perplexity=" << em_pp;
+        fb.arcs.visit(for_arcs::swap_em_scaled());
+        if (em_pp > lastPerplexity)
+          Config::warn() << " - last EM worsened perplexity, from " << lastPerplexity << " to " << em_pp
+                         << ", which is theoretically impossible." << std::endl;
+      }
+#endif
+      log << std::endl;
+    }
+    if (!last_was_reset) {
+      if (pp_ratio_scaled >= em.converge_perplexity_ratio) {
+        if (learning_rate > 1) {
+          log << "Failed to improve (relaxation rate too high); starting again at learning rate 1"
+              << std::endl;
+          learning_rate = 1;
+          fb.arcs.visit(for_arcs::keep_em_weight());
+          last_was_reset = true;
+          continue;
+        }
+        log << "Converged - per-example perplexity ratio exceeds " << em.converge_perplexity_ratio
+            << " after " << train_iter << " iterations.\n";
+        if (!best.have_good_weights)
+          log << "Because of the --train-cascade implementation, we need another iteration even though "
+                 "we've converged.\n";
+        else
+          break;
+      } else {
+        if (learning_rate < MAX_LEARNING_RATE_EXP) learning_rate *= em.learning_rate_growth_factor;
+      }
+    } else  // we need to have saved counts after an estimate, so we can't save a global best at i=1
+      last_was_reset = false;
+    //            DWSTAT("Before maximize");
+    lastChange = fb.maximize(em.methods, learning_rate);
+    if (lastChange <= em.converge_arc_delta && best.have_good_weights) {
+      log << "Converged - maximum weight change less than " << em.converge_arc_delta << " after "
+          << train_iter << " iterations.\n";
+      break;
+    }
+    lastPerplexity = newPerplexity;
+    if (ck) ck->maybe_save(pr);
+  }
+  r.iterations = train_iter;
+  return r;
+}
+
+// --restart-threads: one concurrent random start, on its own copy of the transducer (so its own weights and
+// arc_counts), over the derivations the first start cached.  its log is kept until the batch is done
+struct em_replica : boost::noncopyable {
+  WFST x;
+  cascade_parameters cascade;
+  forward_backward fb;
+  em_best best;
+  em_start_result result;
+  std::ostringstream log;
+  em_replica(WFST const& master_x, forward_backward& master) : fb(replicated(x, master_x), cascade, master) {}
+  static WFST& replicated(WFST& x, WFST const& o) {
+    x.replicate(o);
+    return x;
+  }
+
+  struct run {
+    em_replica* r;
+    em_settings const* em;
+    WFST::random_restart_acceptor ra;  // only best_start (from restart 0) is read after that
+    unsigned restart_no;
+    WFST::output_defaults format;  // the main thread's
+    void operator()() {
+      format.set();
+      r->log.str("");
+      r->result = em_start(r->fb, r->cascade, *em, r->best, ra, em_progress(restart_no), r->log);
+    }
+  };
+};
+
+bool can_thread_restarts(forward_backward const& fb, bool using_cascade) {
+  return fb.cache_backward && !fb.derivs.use_file && !using_cascade;
+}
+
+/* restarts 1...n_restarts, restart_threads at a time.  the random starts are drawn (on this thread) in the
+   same order as sequential restarts would draw them, and each is trained independently against the best
+   before its batch, so only the logging differs from running them one after another (each start's log is
+   shown, in order, when its batch is done, followed by a one line summary).  the winning
+   replica's weights become fb's best.  checkpoints are taken between batches */
+void em_restarts_threaded(forward_backward& fb, em_settings const& em, em_best& best,
+                          WFST::random_restart_acceptor const& ra, unsigned first, unsigned n_restarts,
+                          std::ostream& log, em_checkpoint& ck) {
+  if (first > n_restarts) return;
+  unsigned n_threads = std::min(em.opts.restart_threads, n_restarts + 1 - first);
+  log << "\nRunning random restarts " << first << "..." << n_restarts << ", " << n_threads << " at a time.\n";
+  std::vector<em_replica*> replicas;
+  for (unsigned i = 0; i < n_threads; ++i) replicas.push_back(NEW em_replica(fb.x, fb));
+  for (unsigned next = first; next <= n_restarts;) {
+    unsigned batch = std::min(n_threads, n_restarts + 1 - next);
+    thread_group threads;
+    for (unsigned i = 0; i < batch; ++i) {
+      em_replica& r = *replicas[i];
+      r.cascade.random_restart(em.methods);
+      r.best = best;
+      em_replica::run run = {&r, &em, ra, next + i, WFST::output_defaults()};
+      threads.create_thread(run);
+    }
+    threads.join_all();
+    for (unsigned i = 0; i < batch; ++i) {
+      em_replica& r = *replicas[i];
+      em_start_result const& res = r.result;
+      log << "\nRandom restart " << next + i << ":\n" << r.log.str();
+      log << "Random restart " << next + i << ": ";
+      if (!res.accepted)
+        log << "rejected (per-example-perplexity=" << res.perplexity.as_base(2) << " after 1 iteration)";
+      else
+        log << "per-example-perplexity=" << res.perplexity.as_base(2) << " after " << res.iterations
+            << " iterations";
+      if (r.best.perplexity < best.perplexity) {
+        log << " (new best)";
+        best = r.best;
+        forward_backward::arcs_t& to = fb.arcs;
+        forward_backward::arcs_t const& from = r.fb.arcs;
+        for (unsigned a = 0, N = to.size(); a != N; ++a) to[a].best_weight = from[a].best_weight;
+      }
+      log << std::endl;
+    }
+    next += batch;
+    if (next <= n_restarts) ck.save(em_progress(next));
+  }
+  for (unsigned i = 0; i < n_threads; ++i) delete replicas[i];
+}
+
+/* --online-batch=m: stepwise EM (Liang+Klein 2009, "Online EM for unsupervised models").  mu, the running
+   expected counts, moves toward each mini-batch's counts (scaled up to the whole corpus) by step size
+   eta_k=(k+2)^-alpha, k=0,1,... mini-batches so far, and the weights are renormalized from mu (+ prior) after
+   every mini-batch.  a pass over the corpus then makes many M steps instead of one.  mu starts as the
+   initial weights (times the corpus size), so arcs that the first mini-batches don't use keep some weight */
+struct online_em {
+  forward_backward& fb;
+  cascade_parameters& cascade;
+  em_settings const& em;
+  dynamic_array<Weight> mu;  // parallel to fb.arcs
+  unsigned k;
+  unsigned in_batch;
+  double batch_weight;
+  Weight prob, unweighted_prob;  // over the current pass (the weights change as it goes)
+  Weight max_change;
+  online_em(forward_backward& fb, cascade_parameters& cascade, em_settings const& em)
+      : fb(fb), cascade(cascade), em(em), mu(fb.arcs.size(), Weight::ZERO()), k(0), in_batch(0), batch_weight(0) {
+    Weight n(em.corpus.totalEmpiricalWeight);
+    for (unsigned i = 0, N = mu.size(); i != N; ++i) mu[i] = fb.arcs[i].weight() * n;
+  }
+
+  void start_pass() {
+    prob.setOne();
+    unweighted_prob.setOne();
+    max_change.setZero();
+  }
+  void operator()(unsigned n, derivations& d)  // for foreach_deriv
+  {
+    training_progress_scale(n, em.corpus.size());
+    Weight p = d.collect_counts(fb.arcs);
+    unweighted_prob *= p;
+    prob *= p.pow(d.weight);
+    batch_weight += d.weight;
+    if (++in_batch == em.opts.online_batch) step();
+  }
+  // M step from the mini-batch counts (fb.arcs[i].counts), which are then cleared
+  void step() {
+    if (!in_batch) return;
+    double eta = std::pow(k + 2., -em.opts.online_alpha);
+    ++k;
+    Weight keep(1. - eta), scale(eta * em.corpus.totalEmpiricalWeight / batch_weight);
+    forward_backward::arcs_t& arcs = fb.arcs;
+    for (unsigned i = 0, N = arcs.size(); i != N; ++i) {
+      Weight& m = mu[i];
+      m = m * keep + arcs[i].counts * scale;
+      arcs[i].counts = m;
+    }
+    Weight change = fb.maximize(em.methods, 1);
+    if (change > max_change) max_change = change;
+    arcs.visit(for_arcs::clear_count());
+    cascade.update();
+    in_batch = 0;
+    batch_weight = 0;
+  }
+};
+
+// passes of online_em until the (per pass) perplexity converges or max_iter passes
+Weight online_em_passes(forward_backward& fb, cascade_parameters& cascade, em_settings const& em,
+                        std::ostream& log) {
+  WFST::train_opts const& opts = em.opts;
+  training_corpus& corpus = em.corpus;
+  log << "Stepwise EM: mini-batches of " << opts.online_batch << " examples, step size (k+2)^-"
+      << opts.online_alpha << " for the kth.\n";
+  online_em o(fb, cascade, em);
+  fb.arcs.visit(for_arcs::clear_count());
+  cascade.update();
+  Weight lastPerplexity;
+  lastPerplexity.setInfinity();
+  for (unsigned pass = 1;; ++pass) {
+    if (~opts.max_iter && pass > opts.max_iter) {
+      log << "Maximum number of passes (" << opts.max_iter << ") reached before convergence.\n";
+      break;
+    }
+    o.start_pass();
+    fb.foreach_deriv(o);
+    o.step();  // partial last mini-batch
+    log << '\n';
+    if (pass == 1) fb.throw_if_no_derivation();
+    Weight newPerplexity = o.prob.ppxper(corpus.totalEmpiricalWeight);
+    log << "pass=" << pass << " (" << o.k << " mini-batches so far): ";
+    o.unweighted_prob.print_ppx_symbol(log, corpus.n_input, corpus.n_output, corpus.n_pairs);
+    Weight pp_ratio_scaled;
+    if (pass > 1) {
+      pp_ratio_scaled = newPerplexity.relative_perplexity_ratio(lastPerplexity);
+      log << " (relative-perplexity-ratio=" << pp_ratio_scaled << ")";
+    }
+    if (!em.using_cascade) log << ", max {d(weight)}=" << o.max_change;
+    log << std::endl;
+    bool converged = true;
+    if (pass > 1 && pp_ratio_scaled >= em.converge_perplexity_ratio)
+      log << "Converged - per-example perplexity ratio exceeds " << em.converge_perplexity_ratio << " after "
+          << pass << " passes.\n";
+    else if (!em.using_cascade && o.max_change <= em.converge_arc_delta)
+      log << "Converged - maximum weight change less than " << em.converge_arc_delta << " after " << pass
+          << " passes.\n";
+    else
+      converged = false;
+    lastPerplexity = newPerplexity;
+    if (converged) break;
+  }
+  return lastPerplexity;
+}
+
+}  // ns
+
+
 /* I want NONE normalization to lock the given transducer.  but that's not happening excpet in the simple
    single-iteration code.
 
@@ -538,8 +978,6 @@ Weight WFST::train(cascade_parameters& cascade, training_corpus& corpus, Normali
   }
 
   // multiple iterations and keep the best of possibly many random restarts
-  Weight bestPerplexity;
-  bestPerplexity.setInfinity();
   bool using_cascade = !cascade.trivial;
   if (using_cascade) {
     if (learning_rate_growth_factor != 1) {
@@ -548,114 +986,48 @@ Weight WFST::train(cascade_parameters& cascade, training_corpus& corpus, Normali
       learning_rate_growth_factor = 1;
     }
   }
-  bool have_good_weights = false;
-  for (unsigned restart_no = 0;; ++restart_no) {
-    unsigned train_iter = 0;
-    Weight lastChange = 10;
-    Weight lastPerplexity;
-    lastPerplexity.setInfinity();
-    FLOAT_TYPE learning_rate = 1;
-    bool last_was_reset = false;
-    for (;;) {
-      const bool first_time = train_iter == 0;
-      ++train_iter;
-//            time_report taken(log,"Time for iteration: ");
-#ifdef DEBUGTRAIN
-      Config::debug() << "Starting iteration: " << train_iter << '\n';
-#endif
-#ifdef DEBUG
-#define DWSTAT(a) print_stats(arcs, a)
-      arcs_table<arc_counts> const& arcs = fb.arcs;
-#else
-#define DWSTAT(a)
-#endif
-      //            DWSTAT("Before estimate");
-      bool cascade_counts = using_cascade && !first_time;
-      if (cascade_counts)
-        fb.arcs.visit(for_arcs::save_counts());  // so you can later save_best_counts if you like the ppx
-      cascade.update();
-      if (~opts.max_iter && train_iter > opts.max_iter && have_good_weights) {
-        log << "Maximum number of iterations (" << opts.max_iter
-            << ") reached before convergence criteria was met - greatest arc weight change was " << lastChange
-            << "\n";
-        break;
-      }
-      Weight p = fb.estimate(corpus_p);  // lastPerplexity.isInfinity() // only delete no-path training the
-      // first time, in case we screw up with our learning rate
-      Weight newPerplexity = p.ppxper(corpus.totalEmpiricalWeight);
-      DWSTAT("\nAfter estimate");
-      log << "i=" << train_iter << " (rate=" << learning_rate << "): ";
-      //            log << " per-output-symbol-perplexity="<<corpus_p.ppxper(corpus.n_output).as_base(2)<<"
-      //            per-example-perplexity="<<newPerplexity.as_base(2);
-      corpus_p.print_ppx_symbol(log, corpus.n_input, corpus.n_output,
-                                corpus.n_pairs);  // FIXME: newPerplexity is training-example-weighted
-      if (newPerplexity < bestPerplexity
-          && (!using_cascade || cascade_counts)) {  // because of how I'm saving only composed counts, we
-        // can't actually get back to our initial starting point
-        // (iter 1)
-        log << " (new best)";
-        bestPerplexity = newPerplexity;
-        have_good_weights = true;
-        fb.save_best();
-      }
-      Weight pp_ratio_scaled;
-      if (first_time) {
-
-        log << std::endl;
-        if (!ra.accept(newPerplexity, bestPerplexity, restart_no, &log)) {
-          log << "Random start was insufficiently promising; trying another." << std::endl;
-          break;  // to next random restart
-        }
-        pp_ratio_scaled.setZero();
-      } else {
-        pp_ratio_scaled = newPerplexity.relative_perplexity_ratio(lastPerplexity);
-        log << " (relative-perplexity-ratio=" << pp_ratio_scaled << ")";
-        if (lastChange < 1) log << ", max {d(weight)}=" << lastChange;
-#ifdef DEBUG_ADAPTIVE_EM
-        log << " last-perplexity=" << lastPerplexity << ' ';
-        if (learning_rate > 1) {
-          fb.arcs.visit(for_arcs::swap_em_scaled());
-          Weight d;
-          Weight em_pp = fb.estimate(d);
-          log << "unscaled-EM-perplexity=" << em_pp;
-          fb.arcs.visit(for_arcs::swap_em_scaled());
-          if (em_pp > lastPerplexity)
-            Config::warn() << " - last EM worsened perplexity, from " << lastPerplexity << " to " << em_pp
-                           << ", which is theoretically impossible." << std::endl;
-        }
-#endif
-        log << std::endl;
-      }
-      if (!last_was_reset) {
-        if (pp_ratio_scaled >= converge_perplexity_ratio) {
-          if (learning_rate > 1) {
-            log << "Failed to improve (relaxation rate too high); starting again at learning rate 1"
-                << std::endl;
-            learning_rate = 1;
-            fb.arcs.visit(for_arcs::keep_em_weight());
-            last_was_reset = true;
-            continue;
-          }
-          log << "Converged - per-example perplexity ratio exceeds " << converge_perplexity_ratio << " after "
-              << train_iter << " iterations.\n";
-          if (!have_good_weights)
-            log << "Because of the --train-cascade implementation, we need another iteration even though "
-                   "we've converged.\n";
-          else
-            break;
-        } else {
-          if (learning_rate < MAX_LEARNING_RATE_EXP) learning_rate *= learning_rate_growth_factor;
-        }
-      } else  // we need to have saved counts after an estimate, so we can't save a global best at i=1
-        last_was_reset = false;
-      //            DWSTAT("Before maximize");
-      lastChange = fb.maximize(methods, learning_rate);
-      if (lastChange <= converge_arc_delta && have_good_weights) {
-        log << "Converged - maximum weight change less than " << converge_arc_delta << " after " << train_iter
-            << " iterations.\n";
-        break;
-      }
-      lastPerplexity = newPerplexity;
+  em_settings em(methods, opts, corpus, converge_arc_delta, converge_perplexity_ratio,
+                 learning_rate_growth_factor, using_cascade);
+  if (opts.online_batch) {
+    if (fb.use_matrix)
+      throw std::runtime_error("--online-batch needs the derivation lattice (not --matrix-fb) forward/backward");
+    if (ran_restarts || !(opts.checkpoint_file.empty() && opts.resume_file.empty()))
+      Config::warn() << "--online-batch: ignoring random restarts, --checkpoint-file and --resume." << std::endl;
+    Weight ppx = online_em_passes(fb, cascade, em, log);
+    ts.report();
+    return ppx;
+  }
+  em_best best;
+  bool threaded_restarts = opts.restart_threads > 1 && ran_restarts > 0;
+  if (threaded_restarts && !can_thread_restarts(fb, using_cascade)) {
+    Config::warn() << "--restart-threads needs -: (derivations cached in memory with reverse structure) and "
+                      "no --train-cascade.  Running random restarts one at a time." << std::endl;
+    threaded_restarts = false;
+  }
+  em_checkpoint ck(fb, cascade, best, ra, opts);
+  em_progress start;
+  if (!opts.resume_file.empty()) {
+    ck.resume(opts.resume_file);
+    start = ck.progress;
+    log << "Resuming from " << opts.resume_file << " after iteration " << start.iterations
+        << " of random restart " << start.restart_no << ".\n";
+    ran_restarts -= start.restart_no;
+    if (ran_restarts < 0) ran_restarts = 0;
+    if (start.iterations == 0 && !threaded_restarts) {
+      cascade.random_restart(methods);  // the same draw as before the checkpoint: RNG state was restored
+      log << "\nRandom restart - " << ran_restarts << " remaining.\n";
+    }
+  }
+  for (unsigned restart_no = start.restart_no;; ++restart_no) {
+    if (threaded_restarts && restart_no > 0 && start.iterations == 0) {
+      em_restarts_threaded(fb, em, best, ra, restart_no, opts.ran_restarts, log, ck);
+      break;
+    }
+    em_start(fb, cascade, em, best, ra, restart_no == start.restart_no ? start : em_progress(restart_no),
+             log, &ck);
+    if (threaded_restarts) {
+      em_restarts_threaded(fb, em, best, ra, restart_no + 1, opts.ran_restarts, log, ck);
+      break;
     }
     if (ran_restarts > 0) {
       --ran_restarts;
@@ -665,6 +1037,7 @@ Weight WFST::train(cascade_parameters& cascade, training_corpus& corpus, Normali
       break;
     }
   }
+  Weight bestPerplexity = best.perplexity;
 
   log << "Setting weights to model with lowest per-example-perplexity ( = "
          "prod[modelprob(example)]^(-1/num_examples) = 2^(-log_2(p_model(corpus))/N) = "
@@ -924,24 +1297,54 @@ Weight forward_backward::maximize(WFST::NormalizeMethods const& methods, FLOAT_T
 
 Weight WFST::sumOfAllPaths(List<unsigned>& inSeq, List<unsigned>& outSeq) {
   Assert(valid());
-  training_corpus corpus;
-  corpus.add(inSeq, outSeq);
-  corpus.finish_adding();
-  IOSymSeq const& s = corpus.examples.front();
-  /*
-    cascade_parameters trivial;
-    train_opts topt;
-    topt.cache.cache_level=WFST::cache_forward_backward;
-    forward_backward fb(*this,trivial,false,0,false,topt,corpus);
-    fb.matrix_compute(s,false);
-    return fb.f[s.i.n][s.o.n][final];
-  */
-  WFST& x = *this;
+  typedef path_scorer::symbols symbols;
+  return path_scorer(*this).score(symbols(inSeq.begin(), inSeq.end()), symbols(outSeq.begin(), outSeq.end()));
+}
+
+struct WFST::path_scorer::index {
+  WFST& x;
+  arcs_table<arc_counts_base> arcs;
+  wfst_io_index io;
+  explicit index(WFST& x) : x(x), arcs(x, false, 0), io(x) {}
+};
+
+WFST::path_scorer::path_scorer(WFST& x) : p(new index(x)) {}
+
+WFST::path_scorer::~path_scorer() {}
+
+// derivations::global_stats is THREADLOCAL, so this is safe to call concurrently
+Weight WFST::path_scorer::score(symbols const& in, symbols const& out) const {
   derivations d;
-  typedef arcs_table<arc_counts_base> arcs_t;
-  arcs_t arcs(x, false, 0);
-  wfst_io_index io(x);
-  return d.init_and_compute(x, io, arcs, s.i, s.o) ? d.prob(arcs) : Weight::ZERO();
+  return d.init_and_compute(p->x, p->io, p->arcs, in, out) ? d.prob(p->arcs) : Weight::ZERO();
+}
+
+namespace {
+struct score_every {
+  WFST::path_scorer const* scorer;
+  std::vector<WFST::path_scorer::pair>* pairs;
+  unsigned first, stride;
+  void operator()() {
+    for (unsigned i = first, n = pairs->size(); i < n; i += stride) {
+      WFST::path_scorer::pair& p = (*pairs)[i];
+      p.prob = scorer->score(p.in, p.out);
+    }
+  }
+};
+}
+
+void WFST::path_scorer::score(std::vector<pair>& pairs, unsigned n_threads) const {
+  if (n_threads > pairs.size()) n_threads = pairs.size();
+  if (n_threads <= 1) {
+    score_every all = {this, &pairs, 0, 1};
+    all();
+    return;
+  }
+  thread_group threads;
+  for (unsigned i = 0; i < n_threads; ++i) {
+    score_every every = {this, &pairs, i, n_threads};
+    threads.create_thread(every);
+  }
+  threads.join_all();
 }
 
 ostream& operator<<(ostream& out, struct State& s) {  // Yaser 7-20-2000
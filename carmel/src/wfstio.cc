@@ -2,6 +2,12 @@
 #include <graehl/shared/config.h>
 #include <string>
 #include <map>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <stdint.h>
+#include <vector>
+#include <boost/scoped_ptr.hpp>
 #include <graehl/shared/myassert.h>
 #include <carmel/src/fst.h>
 #include <iterator>
@@ -10,7 +16,10 @@
 #include <graehl/shared/debugprint.hpp>
 #include <graehl/shared/input_error.hpp>
 #include <graehl/shared/assoc_container.hpp>
+#include <graehl/shared/atoi_fast.hpp>
+#include <graehl/shared/compressed_file.hpp>
 #include <graehl/shared/graphviz.hpp>
+#include <graehl/shared/flat_uint64_map.hpp>
 
 namespace graehl {
 
@@ -63,14 +72,14 @@ static const unsigned DEFAULTSTRBUFSIZE = 4096;
       goto INVALID; \
     }               \
   } while (0)
-#define GETC            \
-  do {                  \
-    REQUIRE(istr >> c); \
+#define GETC               \
+  do {                     \
+    REQUIRE(text.next(c)); \
   } while (0)
-#define PEEKC           \
-  do {                  \
-    REQUIRE(istr >> c); \
-    istr.unget();       \
+#define PEEKC              \
+  do {                     \
+    REQUIRE(text.next(c)); \
+    text.unget();          \
   } while (0)
 #define OUTARCWEIGHT(os, a)                                                \
   do {                                                                     \
@@ -186,7 +195,7 @@ bool isNonNegInt(const char* p) {
 }
 
 
-WFST::WFST(const char* buf, unsigned& length, bool permuteNumbers)
+WFST::WFST(const char* buf, unsigned& length, bool permuteNumbers, unsigned window)
 // Generate a permutation lattice for a given string
 {
   named_states = 0;
@@ -230,7 +239,40 @@ WFST::WFST(const char* buf, unsigned& length, bool permuteNumbers)
     symbols.push_back(symbolInNumber);
     if (maxSymbolNumber < symbolInNumber) maxSymbolNumber = symbolInNumber;
   }
-  if (permuteNumbers) {
+  if (permuteNumbers && window && window < symbols.size()) {
+    // bounded distortion: the next word is an uncovered one of the window words starting at the first
+    // uncovered position j.  a state is j and which of j+1..j+window-1 are covered, packed as j<<32 | mask,
+    // so there are at most n*2^(window-1) of them; we make only those reachable from the start
+    if (window > 32) throw std::runtime_error("permutation lattice window can't be more than 32");
+    unsigned const N = symbols.size();
+    flat_uint64_map ids(N * window);
+    vector<uint64_t> keys(1, 0);  // [state]
+    ids.insert(0, 0);
+    vector<bool> taken(maxSymbolNumber + 1);
+    for (unsigned k = 0; k < keys.size(); ++k) {
+      push_back(states);
+      unsigned j = (unsigned)(keys[k] >> 32);
+      uint64_t mask = (uint32_t)keys[k];
+      if (j == N) {
+        final = k;
+        continue;
+      }
+      std::fill(taken.begin(), taken.end(), false);
+      // as above, only the first uncovered copy of a repeated word, which loses no reordering
+      for (unsigned i = 0; i < window && j + i < N; ++i) {
+        unsigned l = j + i;
+        if ((mask >> i & 1) || taken[symbols[l]]) continue;
+        taken[symbols[l]] = true;
+        uint64_t m = mask | (uint64_t)1 << i;
+        unsigned to = j;
+        for (; m & 1; m >>= 1) ++to;
+        uint64_t key = (uint64_t)to << 32 | m;
+        std::pair<unsigned*, bool> id = ids.insert(key, keys.size());
+        if (id.second) keys.push_back(key);
+        states[k].addArc(FSTArc(symbols[l], symbols[l], *id.first, 1.0));
+      }
+    }
+  } else if (permuteNumbers) {
     push_back(states); /* final state*/
     final = pow2((unsigned)symbols.size()) - 1;
     for (unsigned k = 0; k < final; k++) {
@@ -337,8 +379,334 @@ unsigned WFST::getStateIndex(const char* buf) {
 
 static const char COMMENT_CHAR = '%';
 
-// FIXME: need to destroy old data or switch this to a constructor
+namespace {
+
+// what WFST::readLegibleText needs from its input; this one is the original, reading an istream a character
+// at a time into fixed size buffers
+struct legible_stream {
+  istream& in;
+  char buf[2][DEFAULTSTRBUFSIZE];
+  explicit legible_stream(istream& in) : in(in) {}
+  bool next(char& c) { return (bool)(in >> c); }  // skips whitespace
+  void unget() { in.unget(); }
+  void skip_comment() { ::skip_comment(in, COMMENT_CHAR); }
+  bool token(unsigned i) { return getString(in, buf[i]); }
+  char const* str(unsigned i) const { return buf[i]; }
+  bool set_weight(Weight& w, unsigned i) const { return w.setString(buf[i]); }
+  bool read_weight(Weight& w) { return (bool)(in >> w); }
+  bool read_group(unsigned& group) { return (bool)(in >> group); }
+  void show_error(ostream& o) { show_error_context(in, o); }
+};
+
+inline bool legible_space(char c) {
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+double const exact_pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                              1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+// [+-]digits[.digits][(e|E)[+-]digits] starting at p, when strtod would give exactly m*10^k or m/10^k for
+// an m < 2^53 and k <= 22 (both exact doubles, so one correctly rounded multiply or divide).  on success p
+// is left where strtod would stop.  anything else (more digits, hex, inf, ...) returns false for strtod
+bool fast_decimal(char const*& p, char const* end, double& d) {
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+  char const* s = p;
+  bool neg = false;
+  if (s < end && (*s == '-' || *s == '+')) neg = *s++ == '-';
+  uint64_t m = 0;
+  int ndigits = 0, nsignificant = 0, scale = 0;
+  for (; s < end && *s >= '0' && *s <= '9'; ++s, ++ndigits)
+    if (m || *s != '0') {
+      m = m * 10 + (*s - '0');
+      ++nsignificant;
+    }
+  if (s < end && *s == '.')
+    for (++s; s < end && *s >= '0' && *s <= '9'; ++s, ++ndigits, --scale)
+      if (m || *s != '0') {
+        m = m * 10 + (*s - '0');
+        ++nsignificant;
+      }
+  if (!ndigits || nsignificant > 19) return false;
+  if (s < end && (*s == 'e' || *s == 'E')) {
+    char const* x = s + 1;
+    bool eneg = false;
+    if (x < end && (*x == '-' || *x == '+')) eneg = *x++ == '-';
+    if (x < end && *x >= '0' && *x <= '9') {
+      int e = 0;
+      for (; x < end && *x >= '0' && *x <= '9'; ++x)
+        if (e < 1000) e = e * 10 + (*x - '0');
+      scale += eneg ? -e : e;
+      s = x;
+    }
+  }
+  if (m >> 53) return false;
+  if (!m)
+    d = 0;
+  else if (scale >= 0 && scale <= 22)
+    d = (double)m * exact_pow10[scale];
+  else if (scale < 0 && scale >= -22)
+    d = (double)m / exact_pow10[-scale];
+  else
+    return false;
+  if (neg) d = -d;
+  p = s;
+  return true;
+#else
+  return false;
+#endif
+}
+
+// the whole input in memory.  tokens are 0-terminated in place by overwriting the whitespace after them,
+// and only copied when there's no whitespace to overwrite (e.g. "a)").  otherwise, everything is just as
+// legible_stream would do it (but without a limit on symbol length)
+struct legible_text {
+  std::vector<char> text;  // followed by a 0
+  char *p, *end;
+  char const* tok[2];
+  std::size_t toklen[2];
+  std::string copy[2];
+  std::vector<std::pair<std::size_t, char> > changed;  // what we overwrote (but ' '), for show_error
+  bool eof;  // a read went past the end, so the stream's eofbit would be set, for show_error
+
+  explicit legible_text(istream& in) {
+    std::size_t n = 0;
+    if (std::streambuf* sb = in.rdbuf())
+      for (std::size_t chunk = 64 * 1024;; chunk *= 2) {
+        text.resize(n + chunk);
+        std::size_t got = (std::size_t)sb->sgetn(&text[n], chunk);
+        n += got;
+        if (got < chunk) break;
+      }
+    in.setstate(std::ios_base::eofbit);
+    init(n);
+  }
+  explicit legible_text(string const& str) : text(str.begin(), str.end()) { init(str.size()); }
+
+  bool next(char& c) {
+    while (p < end && legible_space(*p)) ++p;
+    if (p == end) return eof = true, false;
+    c = *p++;
+    return true;
+  }
+  void unget() { --p; }
+  void skip_comment() {
+    char c;
+    while (next(c)) {
+      if (c != COMMENT_CHAR) {
+        unget();
+        return;
+      }
+      while (p < end && *p++ != '\n') {
+      }
+      if (p == end) eof = true;
+    }
+  }
+
+  // getString
+  bool token(unsigned i) {
+    char c;
+    if (!next(c)) return false;
+    char *b = p - 1, *e;
+    switch (c) {
+      case '"': {
+        bool escaped = false;
+        for (e = p;; ++e) {
+          if (e == end) return p = end, eof = true, false;  // getString read to EOF
+          if (*e == '"' && !escaped) break;
+          escaped = *e == '\\' && !escaped;
+        }
+        p = ++e;
+        break;
+      }
+      case '*':
+        for (e = p;; ++e) {
+          if (e == end) return p = end, eof = true, false;
+          if (*e == '*') break;
+          char l = tolower(*e);
+          if (l != *e) change(e, l);
+        }
+        p = ++e;
+        break;
+      case '(':
+      case ')':
+        return false;
+      default:
+        for (e = p; e < end && *e != '\n' && *e != '\t' && *e != ' ' && *e != '!' && *e != ')'; ++e) {
+        }
+        if (e == end) eof = true;
+        p = e < end && *e != '!' && *e != ')' ? e + 1 : e;  // a whitespace delimiter is consumed
+        if (e[-1] == '\r') --e;
+    }
+    if (e < p || e == end)
+      terminate(e);
+    else if (legible_space(*e))
+      terminate(e), p = e + 1;
+    else {
+      copy[i].assign(b, e);
+      b = (char*)copy[i].c_str();
+    }
+    tok[i] = b;
+    toklen[i] = e - b;
+    return true;
+  }
+  char const* str(unsigned i) const { return tok[i]; }
+
+  // Weight::setString
+  bool set_weight(Weight& w, unsigned i) const {
+    char const *b = tok[i], *e = b + toklen[i], *s = b;
+    double d;
+    if (e - b > 2 && b[0] == 'e' && b[1] == '^') {
+      s += 2;
+      if (fast_decimal(s, e, d) && s == e) {
+        w.setLn(d);
+        return true;
+      }
+    } else if (e - b > 3 && b[0] == '1' && b[1] == '0' && b[2] == '^') {
+      s += 3;
+      if (fast_decimal(s, e, d) && s == e) {
+        w.setLog10(d);
+        return true;
+      }
+    } else if (fast_decimal(s, e, d)) {
+      if (s == e) {
+        w.setReal(d);
+        return true;
+      } else if (e - s == 2 && s[0] == 'l' && s[1] == 'n') {
+        w.setLn(d);
+        return true;
+      } else if (e - s == 3 && s[0] == 'l' && s[1] == 'o' && s[2] == 'g') {
+        w.setLog10(d);
+        return true;
+      }
+    }
+    return w.setString(b);
+  }
+
+  // istream >> double: the characters num_get would take, which must all convert
+  bool read_double(double& d) {
+    while (p < end && legible_space(*p)) ++p;
+    char const* b = p;
+    if (p < end && (*p == '-' || *p == '+')) ++p;
+    bool mantissa = false, point = false, exponent = false;
+    for (; p < end; ++p) {
+      char c = *p;
+      if (c >= '0' && c <= '9')
+        mantissa = true;
+      else if (c == '.' && !point && !exponent)
+        point = true;
+      else if ((c == 'e' || c == 'E') && mantissa && !exponent) {
+        exponent = true;
+        if (p + 1 < end && (p[1] == '-' || p[1] == '+')) ++p;
+      } else
+        break;
+    }
+    if (p == end) eof = true;
+    char const* s = b;
+    if (fast_decimal(s, p, d) && s == p) return true;
+    std::string num(b, (char const*)p);
+    char* numend;
+    d = std::strtod(num.c_str(), &numend);
+    return !num.empty() && !*numend && d != HUGE_VAL && d != -HUGE_VAL;
+  }
+
+  // istream >> Weight (see logweight::read)
+  bool read_weight(Weight& w) {
+    char c;
+    double f;
+    if (!next(c)) return false;
+    if (c == 'e') {
+      if (p == end) return eof = true, false;
+      if (*p++ != '^' || !read_double(f)) return false;
+      w.setLn(f);
+      return true;
+    }
+    unget();
+    if (!read_double(f)) return false;
+    if (f == 10) {
+      if (!next(c)) return false;
+      if (c == '^') {
+        if (!read_double(f)) return false;
+        w.setLog10(f);
+        return true;
+      }
+      unget();
+    } else if (p < end && *p == 'l') {
+      bool ok;
+      if (++p < end && *p == 'n')
+        ok = true, w.setLn(f);
+      else if (p < end && *p == 'o' && ++p < end && *p == 'g')
+        ok = true, w.setLog10(f);
+      else
+        ok = false;
+      if (p < end)
+        ++p;  // consumed even when it's wrong
+      else
+        eof = true;
+      return ok;
+    }
+    w.setReal(f);
+    return true;
+  }
+
+  // istream >> unsigned: takes all the digits, even past an overflow
+  bool read_group(unsigned& group) {
+    while (p < end && legible_space(*p)) ++p;
+    char const* b = p;
+    while (p < end && *p >= '0' && *p <= '9') ++p;
+    if (p == end) eof = true;
+    try {
+      group = atou_fast_advance_nooverflow<unsigned>(b, (char const*)p);
+    } catch (string_to_exception&) {
+      return false;
+    }
+    return true;
+  }
+
+  // show_error_context, but the input has lost the whitespace we overwrote
+  void show_error(ostream& o) {
+    std::string s(text.begin(), text.begin() + (end - &text[0]));
+    std::replace(s.begin(), s.end(), '\0', ' ');
+    for (std::size_t i = 0, n = changed.size(); i != n; ++i) s[changed[i].first] = changed[i].second;
+    istringstream in(s);
+    in.seekg(p - &text[0]);
+    if (eof) in.setstate(std::ios_base::eofbit);
+    show_error_context(in, o);
+  }
+
+ private:
+  void change(char* e, char c) {
+    if (*e && *e != ' ') changed.push_back(std::make_pair(e - &text[0], *e));
+    *e = c;
+  }
+  void terminate(char* e) { change(e, 0); }
+  void init(std::size_t n) {
+    text.resize(n + 1);
+    text[n] = 0;
+    p = &text[0];
+    end = p + n;
+    eof = false;
+  }
+};
+}
+
 bool WFST::readLegible(istream& istr, bool alwaysNamed) {
+  legible_text text(istr);
+  return readLegibleText(text, alwaysNamed);
+}
+
+bool WFST::readLegible(const string& str, bool alwaysNamed) {
+  legible_text text(str);
+  return readLegibleText(text, alwaysNamed);
+}
+
+bool WFST::readLegibleStream(istream& istr, bool alwaysNamed) {
+  legible_stream text(istr);
+  return readLegibleText(text, alwaysNamed);
+}
+
+// FIXME: need to destroy old data or switch this to a constructor
+template <class Text>
+bool WFST::readLegibleText(Text& text, bool alwaysNamed) {
   alphabet_type& in = alphabet(kInput), & out = alphabet(kOutput);
   State::arc_adder arc_add(states);
   StringKey finalName;
@@ -347,11 +715,9 @@ bool WFST::readLegible(istream& istr, bool alwaysNamed) {
     unsigned stateNumber, destState, inL, outL;
     Weight weight;
     char c;
-    char buf[DEFAULTSTRBUFSIZE], buf2[DEFAULTSTRBUFSIZE];
-    //        string buf,buf2; // FIXME: rewrite getString to use growing buffer?
-    skip_comment(istr, COMMENT_CHAR);
-    REQUIRE(getString(istr, buf));
-    finalName = buf;
+    text.skip_comment();
+    REQUIRE(text.token(0));
+    finalName = text.str(0);
 
     if (!alwaysNamed) {
       named_states = 0;
@@ -365,16 +731,16 @@ bool WFST::readLegible(istream& istr, bool alwaysNamed) {
     if (named_states)
       finalName.clone();
     else
-      final = getStateIndex(buf);
+      final = getStateIndex(text.str(0));
     //        Assert( *in.find(EPSILON_SYMBOL)==0 && *out.find(EPSILON_SYMBOL)==0 );
-    while (istr >> c) {
+    while (text.next(c)) {
       // begin line:
-      skip_comment(istr, COMMENT_CHAR);
+      text.skip_comment();
       REQUIRE(c == '(');
       // start state:
-      REQUIRE(getString(istr, buf));
+      REQUIRE(text.token(0));
 
-      stateNumber = getStateIndex(buf);
+      stateNumber = getStateIndex(text.str(0));
       if (!~stateNumber) goto INVALID;
 
       // PRE: read: '(' source
@@ -382,12 +748,12 @@ bool WFST::readLegible(istream& istr, bool alwaysNamed) {
       for (;;) {
         GETC;
         bool destparen = (c == '(');
-        if (!destparen) istr.unget();
+        if (!destparen) text.unget();
         if (c == ')') break;
 
         // dest state:
-        REQUIRE(getString(istr, buf));
-        destState = getStateIndex(buf);
+        REQUIRE(text.token(0));
+        destState = getStateIndex(text.str(0));
         if (!~destState) goto INVALID;
 
         // (iow!g)*
@@ -395,7 +761,7 @@ bool WFST::readLegible(istream& istr, bool alwaysNamed) {
           GETC;
           bool iowparen = (c == '(');
           if (!iowparen)
-            istr.unget();
+            text.unget();
           else
             PEEKC;
 // PRE: read: '(' source [destparen(] dest [iowparen(]
@@ -407,34 +773,32 @@ bool WFST::readLegible(istream& istr, bool alwaysNamed) {
             inL = outL = WFST::epsilon_index;
             weight = 1.0;
           } else {
-            char* e;
-#define GETBUF(buf) REQUIRE(e = getString(istr, buf))
-            GETBUF(buf);
+            REQUIRE(text.token(0));
             PEEKC;
             if (ENDIOW) {  // ... weight) or ... symbol)
               // FIXME: document: this means that even though unquoted symbols are supported, you must quote
               // any symbol that can parse into a weight, e.g. -10ln, e^3, 10^-3, 0.1
-              if (weight.setString(buf)) {  // ... weight)
+              if (text.set_weight(weight, 0)) {  // ... weight)
                 inL = outL = WFST::epsilon_index;
               } else {  // ... symbol)
-                inL = in.indexOf(buf);
-                outL = out.indexOf(buf);
+                inL = in.indexOf(text.str(0));
+                outL = out.indexOf(text.str(0));
                 weight = 1.0;
               }
             } else {
-              inL = in.indexOf(buf);
-              GETBUF(buf2);
+              inL = in.indexOf(text.str(0));
+              REQUIRE(text.token(1));
               PEEKC;
               if (ENDIOW) {  // ... iosymbol weight) or ... isymbol osymbol)
-                if (weight.setString(buf2)) {  // ... iosymbol weight)
-                  outL = out.indexOf(buf);
+                if (text.set_weight(weight, 1)) {  // ... iosymbol weight)
+                  outL = out.indexOf(text.str(0));
                 } else {  // ... iosymbol osymbol)
-                  outL = out.indexOf(buf2);
+                  outL = out.indexOf(text.str(1));
                   weight = 1.0;
                 }
               } else {  // ... isymbol osymbol weight)
-                outL = out.indexOf(buf2);
-                REQUIRE(istr >> weight);
+                outL = out.indexOf(text.str(1));
+                REQUIRE(text.read_weight(weight));
                 PEEKC;
                 REQUIRE(ENDIOW);
               }
@@ -443,7 +807,6 @@ bool WFST::readLegible(istream& istr, bool alwaysNamed) {
 
 // POST: read iow sequence
 // expecting: [ '!' [groupid]]
-#undef GETBUF
           //                    DBP5(stateNumber,destState,inL,outL,weight);
           //                    states[stateNumber].addArc(FSTArc(inL, outL, destState, weight));
           // TODO: use back_insert_iterator so arc list doesn't get reversed? or print out in reverse order?
@@ -455,26 +818,26 @@ bool WFST::readLegible(istream& istr, bool alwaysNamed) {
             PEEKC;
             if (isdigit(c)) {
               unsigned group;
-              REQUIRE(istr >> group);
+              REQUIRE(text.read_group(group));
               to_add.setGroup(group);
             } else {
               to_add.setLocked();
             }
           } else
-            istr.unget();
+            text.unget();
 
           arc_add(stateNumber, to_add);
 
           // POST: finished reading: iow!g)
           if (!iowparen) break;
-          REQUIRE(istr >> c && c == ')');
+          REQUIRE(text.next(c) && c == ')');
           PEEKC;
           if (c == ')') break;
         }
         if (!destparen) break;
-        REQUIRE(istr >> c && c == ')');
+        REQUIRE(text.next(c) && c == ')');
       }
-      REQUIRE(istr >> c && c == ')');
+      REQUIRE(text.next(c) && c == ')');
       // POST: finished with (dest (iow!g)*)* (done with "line")
     }
     // POST: no more input
@@ -499,17 +862,12 @@ bool WFST::readLegible(istream& istr, bool alwaysNamed) {
     goto INVALID;
   }
 INVALID:
-  show_error_context(istr, cerr);
+  text.show_error(cerr);
   if (named_states) finalName.kill();
   invalidate();
   return 0;
 }
 
-bool WFST::readLegible(const string& str, bool alwaysNamed) {
-  istringstream istr(str);
-  return (readLegible(istr, alwaysNamed));
-}
-
 static ostream& writeQuoted(ostream& os, const char* s) {
   os << '"';
   for (; *s; ++s) {
@@ -586,18 +944,30 @@ void WFST::writeArc(ostream& os, const FSTArc& a, bool GREEK_EPSILON) {
 }
 
 void WFST::writeLegibleFilename(std::string const& name, bool include_zero) {
-  std::ofstream of(name.c_str());
-  writeLegible(of, include_zero);
+  boost::scoped_ptr<std::ostream> of(new_output_file(name));
+  writeLegible(*of, include_zero);
 }
 
 
 void WFST::writeLegible(ostream& os, bool include_zero) {
+  if (!valid()) return;
   bool brief = get_arc_format(os) == BRIEF;
   bool onearc = get_per_line(os) == ARC;
+  if (stream_writer || !legible_buffer::usable(os)) {
+    writeLegibleTo(os, brief, onearc, include_zero);
+    return;
+  }
+  string_builder buf(legible_buffer::kChunk + 1024);
+  legible_buffer out(buf, os);
+  writeLegibleTo(out, brief, onearc, include_zero);
+  out.write();
+}
+
+template <class Out>
+void WFST::writeLegibleTo(Out& os, bool brief, bool onearc, bool include_zero) {
   unsigned i;
   const char* inLet, *outLet, *destState;
 
-  if (!valid()) return;
   os << stateName(final);
   for (i = 0; i < numStates(); i++) {
     if (!onearc) os << "\n(" << stateName(i);
@@ -620,6 +990,7 @@ void WFST::writeLegible(ostream& os, bool include_zero) {
       }
     }
     if (!onearc) os << ")";
+    write_chunk(os);
   }
   os << "\n";
 }
@@ -0,0 +1,22 @@
+#!/bin/bash
+# every file here, read by carmel's default (in memory) reader and by --stream-reader, must print the same
+# transducer, or fail with the same diagnostics (stderr, byte position and all).  usage: reader-conformance.sh
+# [carmel]
+cd `dirname $0`
+B=${1:-../bin/linux/carmel}
+crlf=`mktemp`
+trap "rm -f $crlf" EXIT
+sed 's/$/\r/' legible.syntax.wfst > $crlf
+fail=0
+for f in * $crlf; do
+  case $f in *.sh|logs|latest.log) continue;; esac
+  [ -f $f ] || continue
+  a=`$B -J $f 2>&1; echo "exit $?"`
+  b=`$B -J --stream-reader $f 2>&1 | grep -v '^option stream-reader'; echo "exit ${PIPESTATUS[0]}"`
+  if [ "$a" != "$b" ]; then
+    echo "MISMATCH: $f"
+    fail=1
+  fi
+done
+[ $fail = 0 ] && echo "readers agree"
+exit $fail
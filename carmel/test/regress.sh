@@ -0,0 +1,216 @@
+#!/bin/bash
+# small cases whose output is checked in: expected/NAME is what "carmel ARGS" printed (stdout, then its exit
+# status) for each "check NAME ARGS" below.  usage: regress.sh [carmel] [--update (rewrite expected/)]
+cd `dirname $0`
+B=${1:-../bin/linux/carmel}
+case $B in /*) ;; *) B=$PWD/$B ;; esac
+update=$2
+fail=0
+compare() {
+  local name=$1 got=$2
+  shift 2
+  if [ "$update" = --update ]; then
+    echo "$got" > expected/$name
+  elif [ "$got" != "`cat expected/$name 2>/dev/null`" ]; then
+    echo "MISMATCH: $name (carmel $*)"
+    diff expected/$name - <<< "$got" | head -20
+    fail=1
+  fi
+}
+check() {
+  local name=$1
+  shift
+  compare $name "`$B "$@" 2>/dev/null </dev/null; echo "exit $?"`" "$@"
+}
+# expected/NAME: carmel's ERROR lines (files in $scratch without the directory), then its exit status
+check_error() {
+  local name=$1
+  shift
+  compare $name "`$B "$@" 2>&1 >/dev/null </dev/null | grep ERROR | sed "s|$scratch/||g"
+    echo "exit ${PIPESTATUS[0]}"`" "$@"
+}
+# training's weights and perplexities to 10 digits (of the 15 printed, the last differ between carmel and
+# carmel.debug).  the exact output is kept in $scratch/NAME.out, for comparing runs
+compare_rounded() {
+  local name=$1 got=$2
+  shift 2
+  echo "$got" > $scratch/$name.out
+  compare $name "`perl -pe 's/\d+\.\d+(e[-+]?\d+)?/sprintf "%.10g", $&/ge' $scratch/$name.out`" "$@"
+}
+scratch=`mktemp -d`
+
+# --minimize
+check minimize.nondet --minimize minimize.nondet.wfst
+check minimize.nondet.det --minimize --minimize-determinize minimize.nondet.wfst
+check minimize.nondet.det-sum --minimize --minimize-determinize --minimize-sum minimize.nondet.wfst
+check minimize.nondet.det-only --minimize --minimize-determinize-only minimize.nondet.wfst
+check minimize.twins --minimize --minimize-determinize --minimize-max-states=50 minimize.twins.wfst
+check minimize.transducer --minimize --minimize-determinize minimize.transducer.wfst
+check minimize.transducer.pairs --minimize --minimize-pairs --minimize-determinize minimize.transducer.wfst
+
+# --rmepsilon (sums around *e* cycles of 2 or more states are approximate: within about 1/1024 / (1 - the
+# weight around), so rmepsilon.cycle has 0.666 for 2/3.  self-loops are exact)
+check rmepsilon.chain --rmepsilon rmepsilon.chain.wfst
+check rmepsilon.chain.max --rmepsilon --rmepsilon-max rmepsilon.chain.wfst
+check rmepsilon.cycle --rmepsilon rmepsilon.cycle.wfst
+check rmepsilon.cycle.max --rmepsilon --rmepsilon-max rmepsilon.cycle.wfst
+check rmepsilon.cycle.keep --rmepsilon --rmepsilon-keep-cycles rmepsilon.cycle.wfst
+check rmepsilon.cycle1 --rmepsilon rmepsilon.cycle1.wfst
+check rmepsilon.cycle1.max --rmepsilon --rmepsilon-max rmepsilon.cycle1.wfst
+check rmepsilon.diverge --rmepsilon rmepsilon.diverge.wfst
+check rmepsilon.diverge.final --rmepsilon rmepsilon.diverge.final.wfst
+check rmepsilon.diverge.final.keep --rmepsilon --rmepsilon-keep-cycles rmepsilon.diverge.final.wfst
+check rmepsilon.nondet --minimize --minimize-determinize rmepsilon.nondet.wfst
+check rmepsilon.nondet.min --minimize --minimize-determinize --minimize-rmepsilon rmepsilon.nondet.wfst
+check rmepsilon.nondet.min-sum --minimize --minimize-determinize --minimize-rmepsilon --minimize-sum \
+  rmepsilon.nondet.wfst
+
+# --compose-prune and --compose-beam (compose-prune.in is the input "a a")
+cp="-li compose-prune.in compose-prune.a.wfst compose-prune.b.wfst"
+check compose-prune.none $cp
+check compose-prune.3 --compose-prune=3 $cp
+check compose-prune.3.no-heuristic --compose-prune=3 --compose-prune-no-heuristic $cp
+check compose-prune.30 --compose-prune=30 $cp
+check compose-prune.30.after -w 30 $cp
+check compose-prune.beam.3 --compose-beam=3 $cp
+
+# -a (the mediate letters are visited in ascending alphabet index order: this pins the state numbering and
+# arc order; -k paths don't depend on it)
+check compose-a -am bad.-a.1 bad.-a.2
+check compose-a.paths -a -k 5 bad.-a.1 bad.-a.2
+check compose-a.prune -am $cp
+
+# -S, one pair at a time and on threads sharing the transducer's arc index
+check score -S score.pairs score.wfst
+check score.threads -S --threads=3 score.pairs score.wfst
+
+# -P --permute-window (permute.in is "a b c d": 5 orders within window 2, 12 within 3, all 24 without)
+check permute.1 -P --permute-window=1 -i permute.in
+check permute.2 -P --permute-window=2 -i permute.in
+check permute.2.paths -P --permute-window=2 -k 5 -i permute.in
+check permute.3 -P --permute-window=3 -i permute.in
+check permute.all -P -i permute.in
+check permute.repeat.2 -P --permute-window=2 -i permute.repeat.in
+
+# --mbr (ties keep their k-best order)
+check mbr.kbest -k 4 mbr.wfst
+check mbr.1 --mbr=4 -k 1 mbr.wfst
+check mbr.4 --mbr=4 -k 4 mbr.wfst
+check mbr.4.threads --mbr=4 -k 4 --threads=3 mbr.wfst
+check mbr.2 --mbr=2 -k 1 mbr.wfst
+check mbr.alpha.flat --mbr=4 -k 2 --mbr-alpha=0.1 mbr.wfst
+check mbr.alpha.sharp --mbr=4 -k 2 --mbr-alpha=4 mbr.wfst
+# (every weight to the 1e300 is 0, so there are no posteriors to rerank by: the k-best order is kept)
+check mbr.alpha.underflow --mbr=4 -k 4 --mbr-alpha=1e300 mbr.wfst
+if ! cmp -s expected/mbr.kbest expected/mbr.alpha.underflow; then
+  echo "MISMATCH: mbr.alpha.underflow (not in k-best order)"
+  fail=1
+fi
+
+# --arc-posteriors, --confusion-network and --consensus, on mbr.wfst (total 1) and on the composition above
+# (total 0.46: the X, Y and Z states' paths have 0.36, 0.09 and 0.01)
+check posteriors.arcs --arc-posteriors mbr.wfst
+check posteriors.arcs.composed --arc-posteriors $cp
+check posteriors.arcs.cyclic --arc-posteriors rmepsilon.cycle.wfst
+check posteriors.confusion --confusion-network mbr.wfst
+check posteriors.confusion.input --confusion-network -I $cp
+check posteriors.confusion.composed --confusion-network $cp
+check posteriors.consensus --consensus mbr.wfst
+
+# --astar: the weights must be those of plain -k (paths of equal weight may come out in another order, as in
+# the permutations, all of weight 1).  a single transducer is guided by its own costs to final, a composition
+# by its members' with -m, else not at all; unguided, astar.heavy (a weight of 3) is left to the usual k-best
+astar() {
+  local name=$1
+  shift
+  check astar.$name --astar "$@"
+  if [ "`$B "$@" 2>/dev/null </dev/null | awk '{print $NF}'`" != \
+       "`$B --astar "$@" 2>/dev/null </dev/null | awk '{print $NF}'`" ]; then
+    echo "MISMATCH: astar.$name (the weights of carmel --astar $* aren't those without --astar)"
+    fail=1
+  fi
+}
+astar mbr -k 6 mbr.wfst
+astar composed -k 8 $cp
+astar composed.guided -k 8 -m $cp
+astar score -k 5 score.wfst
+astar cyclic -k 6 rmepsilon.cycle.wfst
+astar twins -k 10 minimize.twins.wfst
+astar heavy -k 4 astar.heavy.wfst
+astar heavy.composed -k 4 astar.heavy.wfst astar.heavy.wfst
+astar heavy.composed.guided -k 4 -m astar.heavy.wfst astar.heavy.wfst
+astar permute -k 10 -P -i permute.in
+astar kbest -k 50 angela.knight.kbest.wfst
+
+# --restart-threads: the same random starts as one at a time (-R fixes them), so the same trained weights
+restarts() {
+  local name=$1
+  shift
+  compare_rounded $name "`$B "$@" -: -R 3 -! 4 -M 10 -t restarts.corpus restarts.wfst 2>/dev/null </dev/null
+    echo "exit $?"`" "$@" -: -R 3 -! 4 -M 10 -t restarts.corpus restarts.wfst
+}
+restarts restarts
+restarts restarts.threads --restart-threads=2
+if ! cmp -s $scratch/restarts.out $scratch/restarts.threads.out; then
+  echo "MISMATCH: restarts.threads (--restart-threads=2 trained other weights than one at a time)"
+  fail=1
+fi
+
+# -? and -: count every example with derivations (N=20, the empty pairs too), as training without them does.
+# a run loading --save-cascade-derivations trains the same weights (and logs the same perplexities) as the
+# run that saved them, a change to only the weights is accepted, and a new arc is refused.  cascade NAME
+# ARGS trains in a scratch directory (the .trained files go next to the transducers), with sed $edit applied
+# to jpron-asciikana first; expected/NAME is the log's per-iteration lines, the exit status, then the
+# .trained transducers
+cascade() {
+  local name=$1
+  shift
+  cp epron-jpron.1.transducer jpron-asciikana.transducer cascade.corpus $scratch
+  [ "$edit" ] && sed -i "$edit" $scratch/jpron-asciikana.transducer
+  rm -f $scratch/*.trained
+  compare_rounded $name "`cd $scratch && $B "$@" -M 4 --train-cascade -t cascade.corpus epron-jpron.1.transducer \
+    jpron-asciikana.transducer 2>&1 >/dev/null </dev/null | grep '^i='; echo "exit ${PIPESTATUS[0]}"
+    cat $scratch/*.trained 2>/dev/null`" "$@"
+}
+cascade cascade.fresh -?
+cascade cascade.memory -:
+cascade cascade.uncached
+cascade cascade.save --save-cascade-derivations=$scratch/saved
+cascade cascade.load --load-cascade-derivations=$scratch/saved
+edit='s/("N" "n" 0.99)/("N" "n" 0.5)/' cascade cascade.load.weights --load-cascade-derivations=$scratch/saved
+edit='s/("N" "n" 0.99)/("N" "n" 0.99) ("N" "nn" 0.01)/' cascade cascade.load.changed \
+  --load-cascade-derivations=$scratch/saved
+for name in memory uncached save load; do
+  if ! cmp -s $scratch/cascade.fresh.out $scratch/cascade.$name.out; then
+    echo "MISMATCH: cascade.$name (trained other weights than cascade.fresh)"
+    fail=1
+  fi
+done
+
+# .gz and .lz4 transducers and -S corpora, and -F output.  the .lz4 files have block checksums but no content
+# checksum (lz4 -BX --no-frame-crc), so the byte flipped in score.bad-block.wfst.lz4 is caught by its block's
+check compressed.gz -S score.pairs.gz score.wfst.gz
+check compressed.lz4 -S score.pairs.lz4 score.wfst.lz4
+for name in gz lz4; do
+  if ! cmp -s expected/score expected/compressed.$name; then
+    echo "MISMATCH: compressed.$name (scored other than the uncompressed files)"
+    fail=1
+  fi
+done
+check_error compressed.bad-block -S score.pairs score.bad-block.wfst.lz4
+head -c 120 score.wfst.gz > $scratch/truncated.wfst.gz
+head -c 30 score.pairs.gz > $scratch/truncated.pairs.gz
+head -c 150 score.wfst.lz4 > $scratch/truncated.wfst.lz4
+head -c 233 score.wfst.lz4 > $scratch/unended.wfst.lz4
+check_error compressed.truncated.gz -S score.pairs $scratch/truncated.wfst.gz
+check_error compressed.truncated.pairs.gz -S $scratch/truncated.pairs.gz score.wfst
+check_error compressed.truncated.lz4 -S score.pairs $scratch/truncated.wfst.lz4
+check_error compressed.unended.lz4 -S score.pairs $scratch/unended.wfst.lz4
+compare compressed.write.gz "`$B -F $scratch/out.wfst.gz score.wfst 2>/dev/null; echo "exit $?"
+  gzip -dc $scratch/out.wfst.gz`" -F out.wfst.gz score.wfst
+compare compressed.write.lz4 "`$B -F $scratch/out.wfst.lz4 score.wfst 2>/dev/null; echo "exit $?"
+  $B $scratch/out.wfst.lz4 2>/dev/null`" -F out.wfst.lz4 score.wfst
+
+rm -rf $scratch
+[ $fail = 0 ] && echo "outputs as expected"
+exit $fail
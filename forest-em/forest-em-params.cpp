@@ -54,6 +54,8 @@ ForestEmParams::validate_parameters()
   // forest-em files
   if (byid_output_file && !byid_rule_file)
     throw std::runtime_error("Must provide byid-rule-file.");
+  if (outkbest_file && !kbest)
+    throw std::runtime_error("--kbest must be positive.");
   if (max_iter && !forests_file)
     throw std::runtime_error("Missing forests-file.");
   if (!normgroups_file && (max_iter || normalize_initial))
@@ -112,7 +114,7 @@ ForestEmParams::perform_forest_em()
     if (gopt.iter)
       forests.run_gibbs();
     else if (max_iter)
-      overrelaxed_em(forests, max_iter, converge_ratio, random_restarts, converge_delta, 1, log(), log_level);
+      forests.run_em(*this);
   }
 
 
@@ -122,9 +124,11 @@ ForestEmParams::perform_forest_em()
   if (outcounts_file)
     forests.write_counts(*outcounts_file, outcounts_file.name);
 
-  if (outviterbi_file || out_per_forest_counts_file || out_score_per_forest) {
+  if (outviterbi_file || outkbest_file || out_per_forest_counts_file || out_score_per_forest) {
     if (outviterbi_file)
       forests.prep_final_viterbi(*outviterbi_file);
+    if (outkbest_file)
+      forests.prep_final_kbest(*outkbest_file, kbest);
     if (out_per_forest_counts_file)
       forests.prep_final_per_forest_counts(*out_per_forest_counts_file);
     if (out_score_per_forest)
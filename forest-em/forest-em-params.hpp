@@ -47,12 +47,13 @@ struct ForestEmParams {
   Weight count_report_threshold, prob_report_threshold;
   bool count_report_enable;
   unsigned random_seed;
+  unsigned kbest;
   Weight add_k_smoothing;
   size_t max_forest_nodes, max_normgroup_size, prealloc_params;
   unsigned watch_period;
   istream_arg initparam_file, priorcounts_file, byid_rule_file;
   ifstream_arg rules_file, forests_file, normgroups_file; // can't be STDIN
-  ostream_arg outviterbi_file, out_score_per_forest, out_per_forest_counts_file, outparam_file, log_file, byid_output_file, outcounts_file;
+  ostream_arg outviterbi_file, outkbest_file, out_score_per_forest, out_per_forest_counts_file, outparam_file, log_file, byid_output_file, outcounts_file;
   std::ostream *log_stream;
   std::string cmdline_str;
 #if __cplusplus < 201103L
@@ -114,6 +115,10 @@ struct ForestEmParams {
          "Write unnormalized em counts here (1-based)")
         ("outviterbi-file,v", defaulted_value(&outviterbi_file),
          "Write one-per-line 'prob <viterbi derivation forest>' e.g. 'e^-10.5 (1 (2 3))'")
+        ("outkbest-file,G", defaulted_value(&outkbest_file),
+         "Write the --kbest best derivations of each forest, one-per-line 'forest# prob <derivation>' e.g. '3 e^-10.5 (1 (2 3))'")
+        ("kbest,K", defaulted_value(&kbest),
+         "How many derivations per forest to write to --outkbest-file (fewer if the rest have probability 0)")
         ("out-per-forest-counts-file,E", defaulted_value(&out_per_forest_counts_file),
          "Write one-line-per-example '(ruleid:rulecounts ...)' e.g. '(2:e^-10.5 5:e^0 6:e^2.4)'")
         ("out-per-forest-inside-sum,S", defaulted_value(&out_score_per_forest),
@@ -202,6 +207,8 @@ struct ForestEmParams {
     outparam_file = ostream_arg();
     outcounts_file = ostream_arg();
     outviterbi_file = ostream_arg();
+    outkbest_file = ostream_arg();
+    kbest = 10;
     out_per_forest_counts_file = ostream_arg();
     initparam_file = istream_arg();
     priorcounts_file = istream_arg();
@@ -25,6 +25,7 @@
 #include <graehl/shared/unimplemented.hpp>
 #include <graehl/shared/weight.h>
 #include <forest-em/forest.hpp>
+#include <forest-em/forest-kbest.hpp>
 #include <forest-em/forest-em-params.hpp>
 
 #include <graehl/shared/em.hpp>
@@ -96,6 +97,10 @@ struct FForests : public gibbs_base {
   std::ofstream viterbi_o, per_forest_counts_o;
   std::ostream *viterbi_out, *per_forest_counts_out, *per_forest_inside_out;
   bool viterbi_go, per_forest_counts_go, per_forest_inside_go;
+  forest_kbest<Float> kbest;
+  std::ostream *kbest_out;
+  unsigned kbest_k;
+  bool kbest_go;
   double total_logprob;
   unsigned forest_no;
   typename Forest::prepare_inside_outside *forest_prep;
@@ -266,7 +271,7 @@ struct FForests : public gibbs_base {
                                                             , zero_zerocounts(false)
   {
     n_nodes = max_nodes = total_forests = 0; // set in read_forests.
-    per_forest_counts_go = per_forest_inside_go = viterbi_go = false;
+    per_forest_counts_go = per_forest_inside_go = viterbi_go = kbest_go = false;
     gibbs = gopt.iter>0;
     per_forest_inside_go = false;
     BACKTRACE;
@@ -494,6 +499,15 @@ struct FForests : public gibbs_base {
     logstream << "Running final viterbi forests decoding.\n";
   }
 
+  // assumes you already prepare_em
+  void prep_final_kbest(std::ostream &out, unsigned k)
+  {
+    kbest_go = true;
+    kbest_out = &out;
+    kbest_k = k;
+    logstream << "Running final " << k << "-best forests decoding.\n";
+  }
+
   // call after prep_final_per_forest_counts and/or prep_final_viterbi
   void final_iteration()
   {
@@ -551,6 +565,8 @@ struct FForests : public gibbs_base {
     if (per_forest_inside_go) {
       *per_forest_inside_out << sumptrees << '\n';
     }
+    if (kbest_go)
+      kbest.write(*kbest_out, f, rule_weights.begin(), kbest_k, forest_no);
   }
 
   unsigned size()
@@ -711,6 +727,56 @@ struct FForests : public gibbs_base {
     define_param_id(p, rule_weights[p]);
   }
 
+  // --checkpoint-file/--resume for EM (--crp checkpoints through gibbs_base instead): the parameters, the
+  // watched normalization group's order (normalize sums in that order), and overrelaxed_em's progress
+  enum { em_checkpoint_version = 1 };
+  overrelaxed_em_progress em_progress;
+  boost::scoped_ptr<checkpoint_writer> em_checkpointer;
+  struct em_snapshot
+  {
+    Forests *f;
+    template <class A>
+    void checkpoint(A &a) { f->checkpoint_em(a); }
+  };
+  template <class A>
+  void checkpoint_em(A &a)
+  {
+    checkpoint_pod(a, em_progress);
+    checkpoint_pod(a, restart);
+    checkpoint_pod(a, iteration);
+    checkpoint_pod(a, firsttime);
+    checkpoint_fixed(a, rule_weights.begin(), rulespace, "parameters");
+    checkpoint_fixed(a, best_weights.begin(), save_best_enable ? rulespace : 0, "best parameters");
+    if (watching_group)
+      checkpoint_fixed(a, watch_group->begin(), watch_group->size(), "watched normalization group");
+    checkpoint_engine(a, g_random01.engine());
+  }
+  void em_iteration_done(overrelaxed_em_progress const& progress)
+  {
+    if (!em_checkpointer || !divides(gopt.checkpoint_every, progress.train_iter)) return;
+    em_progress = progress;
+    checkpoint_buffer b("forest-em", em_checkpoint_version);
+    em_snapshot snap = {this};
+    snap.checkpoint(b.archive);
+    em_checkpointer->save(b);
+  }
+
+  void run_em(ForestEmParams const& p)
+  {
+    overrelaxed_em_progress start(p.random_restarts);
+    if (!gopt.resume_file.empty()) {
+      em_snapshot snap = {this};
+      checkpoint_reader(gopt.resume_file, "forest-em", em_checkpoint_version)(snap);
+      start = em_progress;
+      logstream << "Resuming from " << gopt.resume_file << " after iteration " << start.train_iter
+                << " of random restart " << restart << ".\n";
+    }
+    if (!gopt.checkpoint_file.empty())
+      em_checkpointer.reset(new checkpoint_writer(gopt.checkpoint_file, logstream));
+    overrelaxed_em(*this, p.max_iter, p.converge_ratio, p.random_restarts, p.converge_delta, 1, logstream, p.log_level, &start);
+    em_checkpointer.reset();
+  }
+
   void run_gibbs()
   {
     assert(gibbs);
@@ -0,0 +1,185 @@
+#ifndef GRAEHL_TT__FOREST_KBEST_HPP
+#define GRAEHL_TT__FOREST_KBEST_HPP
+
+/// k-best derivations of an FForest (forest.hpp) using graehl/shared/lazy_forest_kbest.hpp.  all the
+/// state (lazy nodes, derivations, lazy_forest environment) is in the forest_kbest object, so different
+/// forests may be enumerated in parallel with one forest_kbest per thread.  nothing here touches the
+/// FForest static (thread-local) inside/viterbi arrays.  derivations, queues and memos come from the
+/// environment's arena, which is released (but its last block kept) at the start of each forest.
+
+#include <forest-em/forest.hpp>
+#include <graehl/shared/lazy_forest_kbest.hpp>
+#include <vector>
+
+namespace graehl {
+
+/// node is an AND or OR forest node, or 0 for a list of (>=2) AND children: child[0] is the first, child[1]
+/// the rest.  an AND node's child[0] is its only child or the list of them; an OR node's is the chosen
+/// alternative.
+template <class Float>
+struct forest_derivation {
+  typedef logweight<Float> prob_t;
+  ForestNode const* node;
+  forest_derivation const* child[2];
+  prob_t prob;
+
+  template <class O>
+  void print(O& o) const {
+    if (!node) {
+      child[0]->print(o);
+      o << ' ';
+      child[1]->print(o);
+    } else if (node->is_or())
+      child[0]->print(o);
+    else if (!child[0])
+      o << node->label();
+    else {
+      o << '(' << node->label() << ' ';
+      child[0]->print(o);
+      o << ')';
+    }
+  }
+};
+
+template <class Float>
+struct lazy_kbest_derivation_traits<forest_derivation<Float> const*> {
+  static inline bool better_than(forest_derivation<Float> const* candidate,
+                                 forest_derivation<Float> const* than) {
+    return candidate->prob > than->prob;
+  }
+};
+
+template <class Float>
+struct forest_derivation_factory : lazy_kbest_derivation_factory_base {
+  typedef forest_derivation<Float> derivation;
+  typedef derivation const* derivation_type;
+  typedef typename derivation::prob_t prob_t;
+  static derivation_type NONE() { return (derivation_type)0; }
+  static derivation_type PENDING() { return (derivation_type)1; }
+
+  prob_t const* rule_weights;
+  arena* memory;  // owns every derivation
+
+  forest_derivation_factory() : rule_weights(), memory() {}
+
+  derivation_type make(ForestNode const* node, derivation_type c0 = 0, derivation_type c1 = 0) {
+    derivation& d = *memory->allocate_n<derivation>(1);
+    d.node = node;
+    d.child[0] = c0;
+    d.child[1] = c1;
+    if (node && !node->is_or()) {
+      d.prob = rule_weights[node->label()];
+      if (c0) d.prob *= c0->prob;
+    } else {
+      d.prob = c0->prob;
+      if (c1) d.prob *= c1->prob;
+    }
+    return &d;
+  }
+
+  derivation_type make_worse(derivation_type prototype, derivation_type old_child, derivation_type new_child,
+                             lazy_kbest_index_type changed_child_index) {
+    derivation const& p = *prototype;
+    assert(p.child[changed_child_index] == old_child);
+    return changed_child_index ? make(p.node, p.child[0], new_child) : make(p.node, new_child, p.child[1]);
+  }
+};
+
+template <class Float = FLOAT_TYPE>
+struct forest_kbest {
+  typedef FForest<Float> Forest;
+  typedef typename Forest::prob_t prob_t;
+  typedef forest_derivation_factory<Float> factory_type;
+  typedef typename factory_type::derivation_type derivation_type;
+  typedef lazy_forest<factory_type> lazy_type;
+  typedef typename lazy_type::Environment environment_type;
+
+  environment_type env;
+
+  forest_kbest() { env.derivation_factory.memory = &env.memory; }
+
+  /// calls visit(derivation, i) for the i=0,1,... best derivations of f, until visit returns false or k
+  /// (or all of f's) have been visited.  the derivations are valid until the next call.
+  template <class Visitor>
+  lazy_kbest_stats enumerate(Forest const& f, prob_t const* rule_weights, lazy_kbest_index_type k,
+                             Visitor visit) {
+    env.derivation_factory.rule_weights = rule_weights;
+    nodes = f.begin();
+    n = f.size();
+    lazy.clear();
+    env.memory.release();
+    lazy.reserve(2 * n);  // never reallocated after: hyperedges point into it
+    for (std::size_t i = 0, e = 2 * n; i != e; ++i) lazy.push_back(lazy_type(env));
+    built.assign(2 * n, false);
+    return build(nodes)->enumerate_kbest(env, k, visit);
+  }
+
+  /// one line per derivation, best first: "<id> <prob> <derivation>" e.g. "3 e^-10.5 (1 (2 3))".  stops
+  /// at the first derivation of probability 0 (it and all the rest use a rule with weight 0)
+  lazy_kbest_stats write(std::ostream& o, Forest const& f, prob_t const* rule_weights, lazy_kbest_index_type k,
+                         unsigned id) {
+    line_writer w = {&o, id};
+    return enumerate(f, rule_weights, k, w);
+  }
+
+ private:
+  struct line_writer {
+    std::ostream* o;
+    unsigned id;
+    bool operator()(derivation_type d, lazy_kbest_index_type) const {
+      if (d->prob.isZero()) return false;
+      *o << id << ' ' << d->prob << ' ';
+      d->print(*o);
+      *o << '\n';
+      return true;
+    }
+  };
+
+  ForestNode* nodes;
+  std::size_t n;
+  std::vector<lazy_type> lazy;  // [i] for forest node i, [n+i] for the list of AND children starting at node i
+  std::vector<bool> built;
+
+  lazy_type* build(ForestNode* p) {
+    if (p->is_backref()) p = p->l.pointer();
+    std::size_t i = p - nodes;
+    lazy_type& l = lazy[i];
+    if (built[i]) return &l;
+    built[i] = true;
+    factory_type& df = env.derivation_factory;
+    ForestNode* e = p->next;
+    if (p->is_or()) {
+      for (ForestNode* c = p + 1; c != e; c = c->next) {
+        lazy_type* alt = build(c);
+        l.add(df.make(p, alt->first_best()), alt);
+      }
+      l.sort(env);
+    } else if (p->is_leaf())
+      l.add_first_sorted(env, df.make(p));
+    else {
+      lazy_type* children = build_children(p + 1, e);
+      l.add_first_sorted(env, df.make(p, children->first_best()), children);
+    }
+    return &l;
+  }
+
+  // the AND children [c, e) as a right-branching binary list
+  lazy_type* build_children(ForestNode* c, ForestNode* e) {
+    ForestNode* rest = c->next;
+    if (rest == e) return build(c);
+    std::size_t i = n + (c - nodes);
+    lazy_type& l = lazy[i];
+    assert(!built[i]);
+    built[i] = true;
+    lazy_type* first = build(c);
+    lazy_type* others = build_children(rest, e);
+    l.add_first_sorted(env, env.derivation_factory.make(0, first->first_best(), others->first_best()), first,
+                       others);
+    return &l;
+  }
+};
+
+
+}
+
+#endif
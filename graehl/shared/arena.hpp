@@ -0,0 +1,230 @@
+// Copyright 2014 Jonathan Graehl - http://graehl.org/
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+/** \file
+
+    bump-pointer memory arena: allocation is a pointer increment, and nothing is freed until release()
+    frees everything at once.  good for many small objects (or growing vectors) that all die together,
+    e.g. the per-query state of lazy_forest_kbest.hpp.
+
+    arena_allocator<T> is a std allocator drawing from an arena, or from new/delete if it has no arena.  its
+    allocations are rounded up to a power of 2 and deallocate puts them on a free list for that size, so
+    the buffers std::vector<T, arena_allocator<T> > outgrows are reused by other vectors.  buffers over
+    k_max_reusable bytes go straight to new/delete instead.
+
+    objects in the arena aren't destroyed by release() - use it only for trivially destructible things, or
+    destroy them yourself first.
+*/
+
+#ifndef GRAEHL_SHARED__ARENA_HPP
+#define GRAEHL_SHARED__ARENA_HPP
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifdef GRAEHL_TEST
+#include <graehl/shared/test.hpp>
+#endif
+
+namespace graehl {
+
+struct arena : boost::noncopyable {
+  enum { k_first_block = 64 * 1024, k_max_block = 16 * 1024 * 1024, k_max_reusable = k_max_block / 4 };
+
+  explicit arena(std::size_t first_block = k_first_block)
+      : first_block(first_block), next_block(first_block), top(), end() {}
+  ~arena() { free_blocks(0); }
+
+  void* allocate(std::size_t bytes, std::size_t align = alignof(std::max_align_t)) {
+    char* p = align_up(top, align);
+    if (!top || p + bytes > end) p = grow(bytes, align);
+    top = p + bytes;
+    return p;
+  }
+
+  template <class T>
+  T* allocate_n(std::size_t n) {
+    return (T*)allocate(n * sizeof(T), alignof(T));
+  }
+
+  /// like allocate (aligned for anything), but may reuse memory given back by recycle
+  void* allocate_reusable(std::size_t bytes) {
+    if (bytes > k_max_reusable) return ::operator new(bytes);
+    std::size_t c = size_class(bytes);
+    if (c < free_lists.size() && free_lists[c]) {
+      void* p = free_lists[c];
+      free_lists[c] = *(void**)p;
+      return p;
+    }
+    return allocate((std::size_t)1 << c);
+  }
+
+  /// p came from allocate_reusable(bytes)
+  void recycle(void* p, std::size_t bytes) {
+    if (bytes > k_max_reusable) {
+      ::operator delete(p);
+      return;
+    }
+    std::size_t c = size_class(bytes);
+    if (c >= free_lists.size()) free_lists.resize(c + 1);
+    *(void**)p = free_lists[c];
+    free_lists[c] = p;
+  }
+
+  /// frees everything at once, keeping the most recent (normally largest) block for reuse
+  void release() {
+    free_lists.clear();
+    if (blocks.empty()) return;
+    free_blocks(1);
+    top = blocks[0].first;
+    end = top + blocks[0].second;
+  }
+
+  /// total size of the blocks we hold
+  std::size_t capacity() const {
+    std::size_t r = 0;
+    for (std::size_t i = 0, n = blocks.size(); i < n; ++i) r += blocks[i].second;
+    return r;
+  }
+
+ private:
+  typedef std::pair<char*, std::size_t> block;
+  std::vector<block> blocks;
+  std::vector<void*> free_lists;  // [c]: recycled 2^c byte pieces, linked through their first word
+  std::size_t first_block, next_block;
+  char *top, *end;
+
+  // smallest c with 2^c >= bytes (and big enough to hold a free list pointer)
+  static std::size_t size_class(std::size_t bytes) {
+    std::size_t c = 0;
+    while (((std::size_t)1 << c) < bytes || ((std::size_t)1 << c) < sizeof(void*)) ++c;
+    return c;
+  }
+
+  static char* align_up(char* p, std::size_t align) {
+    return (char*)(((std::size_t)p + align - 1) & ~(align - 1));
+  }
+
+  char* grow(std::size_t bytes, std::size_t align) {
+    std::size_t size = next_block;
+    if (size < bytes + align) size = bytes + align;  // one-off big block
+    else if (next_block < k_max_block)
+      next_block *= 2;
+    blocks.push_back(block((char*)::operator new(size), size));
+    top = blocks.back().first;
+    end = top + size;
+    return align_up(top, align);
+  }
+
+  // keep the last nkeep blocks (moved to the front)
+  void free_blocks(std::size_t nkeep) {
+    std::size_t n = blocks.size();
+    if (nkeep > n) nkeep = n;
+    for (std::size_t i = 0, e = n - nkeep; i < e; ++i) ::operator delete((void*)blocks[i].first);
+    blocks.erase(blocks.begin(), blocks.end() - nkeep);
+    if (!nkeep) {
+      top = end = 0;
+      next_block = first_block;
+    }
+  }
+};
+
+template <class T>
+struct arena_allocator {
+  typedef T value_type;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+  template <class U>
+  struct rebind {
+    typedef arena_allocator<U> other;
+  };
+
+  arena* memory;
+
+  arena_allocator(arena* memory = 0) noexcept : memory(memory) {}
+  template <class U>
+  arena_allocator(arena_allocator<U> const& o) noexcept : memory(o.memory) {}
+
+  T* allocate(std::size_t n) {
+    return (T*)(memory ? memory->allocate_reusable(n * sizeof(T)) : ::operator new(n * sizeof(T)));
+  }
+  void deallocate(T* p, std::size_t n) noexcept {
+    if (memory)
+      memory->recycle((void*)p, n * sizeof(T));
+    else
+      ::operator delete((void*)p);
+  }
+
+  template <class U>
+  bool operator==(arena_allocator<U> const& o) const {
+    return memory == o.memory;
+  }
+  template <class U>
+  bool operator!=(arena_allocator<U> const& o) const {
+    return memory != o.memory;
+  }
+};
+
+#ifdef GRAEHL_TEST
+BOOST_AUTO_TEST_CASE(test_arena) {
+  arena a(1024);
+  BOOST_CHECK_EQUAL(a.capacity(), 0u);
+  char* c = (char*)a.allocate(1, 1);
+  double* d = a.allocate_n<double>(3);
+  BOOST_CHECK_EQUAL((std::size_t)d % alignof(double), 0u);
+  BOOST_CHECK((char*)d > c);
+  a.allocate(3, 1);
+  void* p = a.allocate(16, 64);
+  BOOST_CHECK_EQUAL((std::size_t)p % 64, 0u);
+  BOOST_CHECK_EQUAL((std::size_t)a.allocate(1) % alignof(std::max_align_t), 0u);
+  BOOST_CHECK_EQUAL(a.capacity(), 1024u);
+
+  // recycled pieces are reused by requests of the same power of 2 size
+  void* r = a.allocate_reusable(20);
+  a.recycle(r, 20);
+  BOOST_CHECK_EQUAL(a.allocate_reusable(32), r);
+  BOOST_CHECK(a.allocate_reusable(17) != r);
+  void* big = a.allocate_reusable(arena::k_max_reusable + 1);  // straight from new
+  a.recycle(big, arena::k_max_reusable + 1);
+
+  // the next block is twice the first; a request bigger than that gets a block of its own
+  a.allocate(1000, 1);
+  BOOST_CHECK_EQUAL(a.capacity(), 1024u + 2048u);
+  std::size_t const huge = 10000;
+  char* h = (char*)a.allocate(huge, 1);  // (room for the alignment too)
+  BOOST_CHECK_EQUAL(a.capacity(), 1024u + 2048u + huge + 1);
+  h[huge - 1] = 1;
+  a.allocate(3000, 1);  // doesn't fit in the one-off block: the doubling resumes at 4096
+  BOOST_CHECK_EQUAL(a.capacity(), 1024u + 2048u + huge + 1 + 4096u);
+
+  // release keeps just the last block, and allocates from it again
+  a.release();
+  BOOST_CHECK_EQUAL(a.capacity(), 4096u);
+  a.allocate(4000, 1);
+  BOOST_CHECK_EQUAL(a.capacity(), 4096u);
+
+  arena_allocator<int> alloc(&a);
+  std::vector<int, arena_allocator<int> > v(alloc);
+  for (int i = 0; i < 1000; ++i) v.push_back(i);
+  BOOST_CHECK_EQUAL(v[999], 999);
+}
+#endif
+
+}
+
+#endif
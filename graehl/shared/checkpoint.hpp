@@ -0,0 +1,334 @@
+// Copyright 2014 Jonathan Graehl - http://graehl.org/
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+/** \file
+
+    binary checkpoints of long-running training (EM, gibbs) so a killed job can --resume.
+
+    the format is simple_serialize.hpp's: native byte order and word sizes, so resume on the same kind of
+    machine (and the same inputs/options - array sizes are checked, contents aren't).  a file starts with a
+    magic line and a kind ("carmel-em", "gibbs") + version, so you get an error rather than garbage if you
+    resume the wrong thing.
+
+    the training thread serializes a snapshot into memory (checkpoint_buffer), which is cheap next to an
+    iteration; checkpoint_writer then writes it to FILE.tmp on a background thread and renames it over
+    FILE, so a job killed at any moment leaves the previous (or new) complete checkpoint.  a failed write
+    is only a warning - better to keep training than to die because the checkpoint disk filled up.
+
+    save and load share one function per type:
+
+    template <class A> void checkpoint(A &a) { a & iter; checkpoint_vector(a, weights); }
+*/
+
+#ifndef GRAEHL_SHARED__CHECKPOINT_HPP
+#define GRAEHL_SHARED__CHECKPOINT_HPP
+
+#include <graehl/shared/simple_serialize.hpp>
+#include <graehl/shared/thread_group.hpp>
+#include <boost/lexical_cast.hpp>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#ifdef GRAEHL_TEST
+#include <graehl/shared/test.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <vector>
+#endif
+
+namespace graehl {
+
+struct checkpoint_error : public std::runtime_error
+{
+  explicit checkpoint_error(std::string const& msg) : std::runtime_error("checkpoint: "+msg) {}
+};
+
+// n contiguous plain-old-data T (no pointers)
+template <class A, class T>
+void checkpoint_pods(A &a, T *p, std::size_t n)
+{
+  if (!n) return;
+  if (A::is_loading)
+    a.load_binary((void *)p, n*sizeof(T));
+  else
+    a.save_binary((void const*)p, n*sizeof(T));
+}
+
+template <class A, class T>
+void checkpoint_pod(A &a, T &t)
+{
+  checkpoint_pods(a, &t, 1);
+}
+
+// n is already known to the resuming process (it comes from the model/corpus); a mismatch means the
+// checkpoint is for different inputs
+template <class A>
+void checkpoint_size(A &a, std::size_t n, char const* what)
+{
+  std::size_t saved = n;
+  checkpoint_pod(a, saved);
+  if (saved != n) {
+    std::ostringstream o;
+    o << "saved " << what << " has size " << saved << " but we have " << n << " - different inputs?";
+    throw checkpoint_error(o.str());
+  }
+}
+
+template <class A, class T>
+void checkpoint_fixed(A &a, T *begin, std::size_t n, char const* what)
+{
+  checkpoint_size(a, n, what);
+  checkpoint_pods(a, begin, n);
+}
+
+// variable length array of pods (dynamic_array, std::vector, std::string)
+template <class A, class V>
+void checkpoint_vector(A &a, V &v)
+{
+  std::size_t n = v.size();
+  checkpoint_pod(a, n);
+  if (A::is_loading)
+    v.resize(n);
+  if (n)
+    checkpoint_pods(a, &v[0], n);
+}
+
+// fixed_array (sized at load)
+template <class A, class V>
+void checkpoint_array(A &a, V &v)
+{
+  std::size_t n = v.size();
+  checkpoint_pod(a, n);
+  if (A::is_loading)
+    v.reinit(n);
+  if (n)
+    checkpoint_pods(a, &v[0], n);
+}
+
+// boost random engines only expose their state as text
+template <class A, class Engine>
+void checkpoint_engine(A &a, Engine &e)
+{
+  std::string s;
+  if (A::is_saving) {
+    std::ostringstream o;
+    o << e;
+    s = o.str();
+  }
+  checkpoint_vector(a, s);
+  if (A::is_loading) {
+    std::istringstream i(s + ' ');  // boost's engines fail if their last number ends the stream
+    if (!(i >> e))
+      throw checkpoint_error("couldn't restore random number generator state");
+  }
+}
+
+static char const* const checkpoint_magic = "graehl-checkpoint\n";
+
+template <class A>
+void checkpoint_header(A &a, std::string const& kind, unsigned version)
+{
+  std::string magic(checkpoint_magic), k(kind);
+  unsigned v = version;
+  checkpoint_vector(a, magic);
+  checkpoint_vector(a, k);
+  checkpoint_pod(a, v);
+  if (A::is_loading && (magic != checkpoint_magic || k != kind || v != version))
+    throw checkpoint_error("not a version "+boost::lexical_cast<std::string>(version)+" "+kind+" checkpoint");
+}
+
+/// serialize a snapshot into archive, then checkpoint_writer::save it
+struct checkpoint_buffer
+{
+  std::ostringstream buf;
+  ostream_archive archive;
+  checkpoint_buffer(std::string const& kind, unsigned version)
+      : buf(std::ios::out|std::ios::binary), archive(buf)
+  {
+    checkpoint_header(archive, kind, version);
+  }
+};
+
+/// reader(x) calls x.checkpoint(reader.archive) and checks that the whole file was used
+struct checkpoint_reader
+{
+  std::string filename;
+  std::ifstream file;
+  istream_archive archive;
+  checkpoint_reader(std::string const& filename, std::string const& kind, unsigned version)
+      : filename(filename), file(filename.c_str(), std::ios::in|std::ios::binary), archive(file)
+  {
+    if (!file)
+      throw checkpoint_error("couldn't open "+filename);
+    try {
+      checkpoint_header(archive, kind, version);
+    } catch (simple_archive_error &) {
+      truncated();
+    }
+  }
+  template <class F>
+  void operator()(F &f)
+  {
+    try {
+      f.checkpoint(archive);
+    } catch (simple_archive_error &) {
+      truncated();
+    }
+    if (file.peek() != EOF)
+      throw checkpoint_error(filename+" has extra data at the end - different inputs?");
+  }
+ private:
+  void truncated()
+  {
+    throw checkpoint_error(filename+" is truncated");
+  }
+};
+
+/// one background write at a time: save() waits for the previous write to finish first
+struct checkpoint_writer
+{
+  std::string filename;
+  std::ostream &log;
+  explicit checkpoint_writer(std::string const& filename, std::ostream &log = std::cerr)
+      : filename(filename), log(log), writing(false) {}
+  ~checkpoint_writer()
+  {
+    wait();
+  }
+  void save(checkpoint_buffer &b)
+  {
+    wait();
+    bytes = b.buf.str();
+    error.clear();
+    writing = true;
+    write_thread w = {this};
+    thread.create_thread(w);
+  }
+  // returns false (and warns) if the last save failed
+  bool wait()
+  {
+    if (!writing) return true;
+    thread.join_all();
+    writing = false;
+    bytes.clear();
+    if (error.empty()) return true;
+    log << "\nWARNING: " << error << " - continuing without it.\n";
+    return false;
+  }
+ private:
+  thread_group thread;
+  bool writing;
+  std::string bytes;
+  std::string error;
+  struct write_thread
+  {
+    checkpoint_writer *w;
+    void operator()() const { w->write(); }
+  };
+  void write()
+  {
+    std::string tmp = filename+".tmp";
+    {
+      std::ofstream o(tmp.c_str(), std::ios::out|std::ios::binary|std::ios::trunc);
+      if (!(o && o.write(bytes.data(), bytes.size()) && o.flush())) {
+        error = "couldn't write checkpoint "+tmp;
+        return;
+      }
+    }
+    if (std::rename(tmp.c_str(), filename.c_str()))
+      error = "couldn't rename checkpoint "+tmp+" to "+filename;
+  }
+};
+
+#ifdef GRAEHL_TEST
+struct checkpoint_test_state
+{
+  unsigned iter;
+  double fixed[3];
+  std::vector<double> weights;
+  boost::mt19937 engine;
+  template <class A>
+  void checkpoint(A &a)
+  {
+    checkpoint_pod(a, iter);
+    checkpoint_fixed(a, fixed, 3, "fixed");
+    checkpoint_vector(a, weights);
+    checkpoint_engine(a, engine);
+  }
+};
+
+inline void checkpoint_test_write(std::string const& filename, std::string const& bytes)
+{
+  std::ofstream o(filename.c_str(), std::ios::out|std::ios::binary|std::ios::trunc);
+  o.write(bytes.data(), bytes.size());
+}
+
+BOOST_AUTO_TEST_CASE(test_checkpoint)
+{
+  std::string const filename = "checkpoint_test.tmp";
+  checkpoint_test_state saved;
+  saved.iter = 7;
+  for (unsigned i = 0; i < 3; ++i) saved.fixed[i] = i + .5;
+  saved.weights.push_back(.25);
+  saved.weights.push_back(-1e300);
+  saved.engine.seed(42u);
+  saved.engine();
+  {
+    checkpoint_buffer b("test", 2);
+    saved.checkpoint(b.archive);
+    checkpoint_writer w(filename);
+    w.save(b);
+    BOOST_CHECK(w.wait());
+  }
+  std::string bytes;
+  {
+    std::ifstream i(filename.c_str(), std::ios::in|std::ios::binary);
+    std::ostringstream o;
+    o << i.rdbuf();
+    bytes = o.str();
+  }
+
+  checkpoint_test_state loaded;
+  loaded.iter = 0;
+  {
+    checkpoint_reader r(filename, "test", 2);
+    r(loaded);
+  }
+  BOOST_CHECK_EQUAL(loaded.iter, 7u);
+  BOOST_CHECK_EQUAL(loaded.fixed[2], 2.5);
+  BOOST_CHECK(loaded.weights == saved.weights);
+  BOOST_CHECK_EQUAL(loaded.engine(), saved.engine());
+
+  BOOST_CHECK_THROW(checkpoint_reader(filename, "test", 3), checkpoint_error);
+  BOOST_CHECK_THROW(checkpoint_reader(filename, "other", 2), checkpoint_error);
+  checkpoint_test_write(filename, bytes.substr(0, bytes.size() - 1));
+  {
+    checkpoint_reader r(filename, "test", 2);
+    BOOST_CHECK_THROW(r(loaded), checkpoint_error);
+  }
+  checkpoint_test_write(filename, bytes + '!');
+  {
+    checkpoint_reader r(filename, "test", 2);
+    BOOST_CHECK_THROW(r(loaded), checkpoint_error);
+  }
+  std::remove(filename.c_str());
+  BOOST_CHECK_THROW(checkpoint_reader(filename, "test", 2), checkpoint_error);
+}
+#endif
+
+}
+
+#endif
@@ -0,0 +1,567 @@
+// Copyright 2014 Jonathan Graehl - http://graehl.org/
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+/** \file
+
+    see compressed_file.hpp
+*/
+
+#include <graehl/shared/compressed_file.hpp>
+#include <graehl/shared/lz4.hpp>
+#include <graehl/shared/thread_group.hpp>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <stdint.h>
+#include <vector>
+#include <zlib.h>
+
+namespace graehl {
+
+namespace {
+
+char const gz_ext[] = ".gz";
+char const lz4_ext[] = ".lz4";
+
+bool ends_with(std::string const& s, char const* ext, std::size_t n) {
+  return s.size() > n && !s.compare(s.size() - n, n, ext);
+}
+
+bool gz_name(std::string const& s) {
+  return ends_with(s, gz_ext, sizeof(gz_ext) - 1);
+}
+
+bool lz4_name(std::string const& s) {
+  return ends_with(s, lz4_ext, sizeof(lz4_ext) - 1);
+}
+
+inline uint32_t get_le32(unsigned char const* p) {
+  return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+inline void put_le32(unsigned char* p, uint32_t x) {
+  p[0] = (unsigned char)x;
+  p[1] = (unsigned char)(x >> 8);
+  p[2] = (unsigned char)(x >> 16);
+  p[3] = (unsigned char)(x >> 24);
+}
+
+/// incremental xxHash32, the checksum of the lz4 frame format
+struct xxh32 {
+  enum { P1 = 2654435761U, P2 = 2246822519U, P3 = 3266489917U, P4 = 668265263U, P5 = 374761393U };
+  explicit xxh32(uint32_t seed = 0) : seed(seed), total(0), nmem(0) {
+    v[0] = seed + P1 + P2;
+    v[1] = seed + P2;
+    v[2] = seed;
+    v[3] = seed - P1;
+  }
+  void update(void const* data, std::size_t n) {
+    unsigned char const* p = (unsigned char const*)data;
+    unsigned char const* end = p + n;
+    total += n;
+    if (nmem + n < 16) {
+      std::memcpy(mem + nmem, p, n);
+      nmem += (unsigned)n;
+      return;
+    }
+    if (nmem) {
+      std::memcpy(mem + nmem, p, 16 - nmem);
+      p += 16 - nmem;
+      stripe(mem);
+      nmem = 0;
+    }
+    for (; p + 16 <= end; p += 16) stripe(p);
+    nmem = (unsigned)(end - p);
+    std::memcpy(mem, p, nmem);
+  }
+  uint32_t digest() const {
+    uint32_t h = total >= 16 ? rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18) : seed + P5;
+    h += (uint32_t)total;
+    unsigned char const* p = mem;
+    unsigned char const* end = mem + nmem;
+    for (; p + 4 <= end; p += 4) h = rotl(h + get_le32(p) * (uint32_t)P3, 17) * (uint32_t)P4;
+    for (; p < end; ++p) h = rotl(h + *p * (uint32_t)P5, 11) * (uint32_t)P1;
+    h ^= h >> 15;
+    h *= (uint32_t)P2;
+    h ^= h >> 13;
+    h *= (uint32_t)P3;
+    return h ^ (h >> 16);
+  }
+  static uint32_t of(void const* data, std::size_t n) {
+    xxh32 x;
+    x.update(data, n);
+    return x.digest();
+  }
+
+ private:
+  uint32_t seed, v[4];
+  uint64_t total;
+  unsigned char mem[16];
+  unsigned nmem;
+  static uint32_t rotl(uint32_t x, int r) { return (x << r) | (x >> (32 - r)); }
+  static uint32_t round(uint32_t acc, uint32_t in) { return rotl(acc + in * (uint32_t)P2, 13) * (uint32_t)P1; }
+  void stripe(unsigned char const* p) {
+    for (unsigned i = 0; i < 4; ++i) v[i] = round(v[i], get_le32(p + 4 * i));
+  }
+};
+
+/// decompresses a whole file; read throws std::runtime_error on bad input
+struct decoder {
+  std::filebuf file;
+  std::string name;
+  virtual ~decoder() {}
+  /// up to n bytes into out; 0 only at the end
+  virtual std::size_t read(char* out, std::size_t n) = 0;
+  void fail(std::string const& why) const { throw std::runtime_error(name + ": " + why); }
+};
+
+struct gzip_decoder : decoder {
+  enum { kIn = 256 * 1024 };
+  z_stream z;
+  std::vector<char> in;
+  bool member_done;  // and no input since
+  gzip_decoder() : in(kIn), member_done(false) {
+    std::memset(&z, 0, sizeof(z));
+    if (inflateInit2(&z, 15 + 32) != Z_OK) throw std::runtime_error("zlib inflateInit failed");
+  }
+  ~gzip_decoder() { inflateEnd(&z); }
+  std::size_t read(char* out, std::size_t n) {
+    z.next_out = (Bytef*)out;
+    z.avail_out = (uInt)n;
+    while (z.avail_out) {
+      if (!z.avail_in) {
+        z.next_in = (Bytef*)&in[0];
+        z.avail_in = (uInt)file.sgetn(&in[0], kIn);
+        if (!z.avail_in) {
+          if (!member_done) fail("truncated gzip data");
+          break;
+        }
+      }
+      if (member_done) {  // another gzip member follows (as from cat a.gz b.gz)
+        inflateReset(&z);
+        member_done = false;
+      }
+      int r = inflate(&z, Z_NO_FLUSH);
+      if (r == Z_STREAM_END)
+        member_done = true;
+      else if (r != Z_OK)
+        fail(std::string("corrupt gzip data: ") + (z.msg ? z.msg : "zlib error"));
+    }
+    return n - z.avail_out;
+  }
+};
+
+/// lz4 frame format (https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md)
+struct lz4_decoder : decoder {
+  enum { kMagic = 0x184D2204, kSkippableMagic = 0x184D2A50, kLegacyMagic = 0x184C2102, kWindow = 64 * 1024 };
+  bool in_frame, linked, block_checksum, content_checksum;
+  std::size_t max_block;
+  std::vector<char> block;  // compressed block
+  std::vector<char> window;  // [0, history): the end of the previous block, if linked; then the decoded block
+  std::size_t history, begin, end;  // decoded [begin, end) not yet read
+  xxh32 content;
+  lz4_decoder() : in_frame(), history(), begin(), end() {}
+
+  std::size_t read(char* out, std::size_t n) {
+    while (begin == end)
+      if (!next_block()) return 0;
+    if (n > end - begin) n = end - begin;
+    std::memcpy(out, &window[begin], n);
+    begin += n;
+    return n;
+  }
+
+ private:
+  void get(void* p, std::size_t n) {
+    if ((std::size_t)file.sgetn((char*)p, n) != n) fail("truncated lz4 data");
+  }
+  uint32_t get32() {
+    unsigned char b[4];
+    get(b, 4);
+    return get_le32(b);
+  }
+  // false at the end of the file
+  bool frame_header() {
+    unsigned char b[4];
+    for (;;) {
+      std::streamsize got = file.sgetn((char*)b, 4);
+      if (!got) return false;
+      if (got != 4) fail("truncated lz4 data");
+      uint32_t magic = get_le32(b);
+      if (magic == kMagic) break;
+      if ((magic & 0xFFFFFFF0) == kSkippableMagic) {
+        for (uint32_t skip = get32(); skip; --skip)
+          if (file.sbumpc() == EOF) fail("truncated lz4 data");
+        continue;
+      }
+      fail(magic == kLegacyMagic ? "lz4 legacy format (lz4 -l) isn't supported" : "not lz4 frame data");
+    }
+    unsigned char h[15];
+    get(h, 2);
+    unsigned flg = h[0], bd = h[1];
+    if ((flg >> 6) != 1) fail("unsupported lz4 frame version");
+    if (flg & 1) fail("lz4 frames with a dictionary aren't supported");
+    linked = !(flg & 0x20);
+    block_checksum = flg & 0x10;
+    content_checksum = flg & 4;
+    unsigned nh = 2 + (flg & 8 ? 8 : 0);
+    get(h + 2, nh + 1 - 2);
+    if (h[nh] != ((xxh32::of(h, nh) >> 8) & 0xFF)) fail("lz4 frame header checksum mismatch");
+    unsigned size_code = (bd >> 4) & 7;
+    if (size_code < 4) fail("bad lz4 block size");
+    max_block = (std::size_t)1 << (8 + 2 * size_code);
+    if (block.size() < max_block) block.resize(max_block);
+    if (window.size() < kWindow + max_block) window.resize(kWindow + max_block);
+    history = 0;
+    content = xxh32();
+    in_frame = true;
+    return true;
+  }
+  // false at the end of the file
+  bool next_block() {
+    if (!in_frame && !frame_header()) return false;
+    uint32_t size = get32();
+    if (!size) {
+      if (content_checksum && get32() != content.digest()) fail("lz4 content checksum mismatch");
+      in_frame = false;
+      begin = end = 0;
+      return true;
+    }
+    bool raw = size & 0x80000000;
+    size &= 0x7FFFFFFF;
+    if (size > max_block) fail("corrupt lz4 data (block too large)");
+    if (linked && history + max_block > window.size()) {  // keep the last kWindow bytes at the front
+      std::size_t keep = history < kWindow ? history : kWindow;
+      std::memmove(&window[0], &window[history - keep], keep);
+      history = keep;
+    } else if (!linked)
+      history = 0;
+    char* dest = &window[history];
+    char* stored = raw ? dest : &block[0];
+    int n;
+    get(stored, size);
+    if (block_checksum && get32() != xxh32::of(stored, size)) fail("lz4 block checksum mismatch");
+    if (raw)
+      n = (int)size;
+    else {
+      n = lz4::LZ4_uncompress_unknownOutputSize_withPrefix(&block[0], dest, (int)size, (int)max_block,
+                                                           (int)history);
+      if (n < 0) fail("corrupt lz4 data");
+    }
+    if (content_checksum) content.update(dest, n);
+    begin = history;
+    end = history += n;
+    return true;
+  }
+};
+
+/// a streambuf over a decoder that runs on a background thread, up to kChunks - 1 chunks ahead.  tellg works,
+/// and so do seeks back as far as the last kPutback bytes (enough for input_error.hpp's context)
+class threaded_decoder_buf : public std::streambuf {
+  enum { kChunk = 1024 * 1024, kChunks = 4, kPutback = 64 };
+
+ public:
+  explicit threaded_decoder_buf(decoder* d) : d(d), start(), produced(), taken(), done(), stop() {
+    for (unsigned i = 0; i < kChunks; ++i) chunk[i].resize(kPutback + kChunk);
+    setg(0, 0, 0);
+    thread.create_thread(producer_thread(this));
+  }
+  ~threaded_decoder_buf() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    changed.notify_all();
+    thread.join_all();
+  }
+
+ protected:
+  int_type underflow() {
+    if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (produced == taken && !done) changed.wait(lock);
+      if (produced == taken) {
+        if (!error.empty()) throw std::runtime_error(error);
+        return traits_type::eof();
+      }
+    }
+    // the chunk we're leaving stays unwritten until taken is incremented
+    char* b = &chunk[taken % kChunks][0];
+    std::size_t putback = egptr() - eback();
+    if (putback > kPutback) putback = kPutback;
+    if (putback) std::memcpy(b + kPutback - putback, egptr() - putback, putback);
+    start += egptr() - eback() - putback;
+    setg(b + kPutback - putback, b + kPutback, b + kPutback + size[taken % kChunks]);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ++taken;
+    }
+    changed.notify_all();
+    return traits_type::to_int_type(*gptr());
+  }
+
+  // unget before the first byte read, or before the buffer: a decoding error is reported again, so it isn't
+  // hidden behind the istream's failure to unget
+  int_type pbackfail(int_type) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!error.empty()) throw std::runtime_error(error);
+    return traits_type::eof();
+  }
+
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+    if (dir == std::ios_base::cur)
+      off += start + (gptr() - eback());
+    else if (dir != std::ios_base::beg)
+      return pos_type(off_type(-1));
+    return seekpos(pos_type(off), which);
+  }
+
+  pos_type seekpos(pos_type pos, std::ios_base::openmode which) {
+    off_type const i = off_type(pos) - start;
+    if (!(which & std::ios_base::in) || i < 0 || i > egptr() - eback()) return pos_type(off_type(-1));
+    setg(eback(), eback() + i, egptr());
+    return pos;
+  }
+
+ private:
+  std::unique_ptr<decoder> d;
+  off_type start;  // file position of eback()
+  std::vector<char> chunk[kChunks];
+  std::size_t size[kChunks];
+  std::size_t produced, taken;  // chunks filled by the producer and handed to the reader (the last of
+  // which it's reading)
+  bool done, stop;
+  std::string error;
+  std::mutex mutex;
+  std::condition_variable changed;
+  thread_group thread;
+
+  struct producer_thread {
+    threaded_decoder_buf* b;
+    explicit producer_thread(threaded_decoder_buf* b) : b(b) {}
+    void operator()() const { b->produce(); }
+  };
+
+  void produce() {
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (produced + 1 >= taken + kChunks && !stop) changed.wait(lock);
+        if (stop) return;
+      }
+      unsigned i = produced % kChunks;
+      char* p = &chunk[i][kPutback];
+      std::size_t n = 0;
+      std::string why;
+      try {
+        for (std::size_t got; n < kChunk && (got = d->read(p + n, kChunk - n));) n += got;
+      } catch (std::exception& e) {
+        why = e.what();
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        size[i] = n;
+        if (n) ++produced;
+        if (n < kChunk || !why.empty()) {
+          done = true;
+          error = why;
+        }
+      }
+      changed.notify_all();
+      if (done) return;
+    }
+  }
+};
+
+class decompressing_istream : public std::istream {
+ public:
+  decompressing_istream(decoder* d, std::string const& name) : std::istream(0) {
+    std::unique_ptr<decoder> owned(d);
+    d->name = name;
+    if (!d->file.open(name.c_str(), std::ios::in | std::ios::binary)) {
+      setstate(std::ios::failbit);
+      return;
+    }
+    buf.reset(new threaded_decoder_buf(owned.release()));
+    rdbuf(buf.get());
+    exceptions(std::ios::badbit);
+  }
+
+ private:
+  std::unique_ptr<threaded_decoder_buf> buf;
+};
+
+/// compresses blocks of (at most) block_size() bytes into file
+struct encoder {
+  std::filebuf file;
+  virtual ~encoder() {}
+  virtual std::size_t block_size() const = 0;
+  virtual bool write(char const* p, std::size_t n) = 0;
+  /// after the last write
+  virtual bool finish() = 0;
+};
+
+struct gzip_encoder : encoder {
+  enum { kBlock = 256 * 1024 };
+  z_stream z;
+  std::vector<char> out;
+  gzip_encoder() : out(kBlock) {
+    std::memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      throw std::runtime_error("zlib deflateInit failed");
+  }
+  ~gzip_encoder() { deflateEnd(&z); }
+  std::size_t block_size() const { return kBlock; }
+  bool write(char const* p, std::size_t n) { return deflate_all(p, n, Z_NO_FLUSH); }
+  bool finish() { return deflate_all(0, 0, Z_FINISH); }
+
+ private:
+  bool deflate_all(char const* p, std::size_t n, int flush) {
+    z.next_in = (Bytef*)p;
+    z.avail_in = (uInt)n;
+    for (;;) {
+      z.next_out = (Bytef*)&out[0];
+      z.avail_out = kBlock;
+      int r = deflate(&z, flush);
+      if (r == Z_STREAM_ERROR) return false;
+      std::streamsize nout = kBlock - z.avail_out;
+      if (file.sputn(&out[0], nout) != nout) return false;
+      if (flush == Z_FINISH ? r == Z_STREAM_END : !z.avail_in && z.avail_out) return true;
+    }
+  }
+};
+
+/// one frame of independent 1MB blocks (no checksums but the header's)
+struct lz4_encoder : encoder {
+  enum { kBlock = 1024 * 1024, kBlockSizeCode = 6 };
+  std::vector<char> out;
+  bool started;
+  lz4_encoder() : out(4 + lz4::LZ4_compressBound(kBlock)), started() {}
+  std::size_t block_size() const { return kBlock; }
+  bool write(char const* p, std::size_t n) {
+    if (!n) return true;
+    if (!started && !header()) return false;
+    unsigned char* o = (unsigned char*)&out[0];
+    int nc = lz4::LZ4_compress(p, (char*)o + 4, (int)n);
+    if (nc <= 0 || (std::size_t)nc >= n) {  // incompressible: store
+      put_le32(o, (uint32_t)n | 0x80000000);
+      return file.sputn((char*)o, 4) == 4 && file.sputn(p, n) == (std::streamsize)n;
+    }
+    put_le32(o, (uint32_t)nc);
+    return file.sputn((char*)o, 4 + nc) == 4 + nc;
+  }
+  bool finish() {
+    if (!started && !header()) return false;
+    unsigned char end[4] = {0, 0, 0, 0};
+    return file.sputn((char*)end, 4) == 4;
+  }
+
+ private:
+  bool header() {
+    started = true;
+    unsigned char h[7];
+    put_le32(h, lz4_decoder::kMagic);
+    h[4] = 0x60;  // version 1, independent blocks
+    h[5] = kBlockSizeCode << 4;
+    h[6] = (unsigned char)(xxh32::of(h + 4, 2) >> 8);
+    return file.sputn((char*)h, 7) == 7;
+  }
+};
+
+/// collects block_size() bytes at a time for the encoder.  sync() doesn't end a block
+class encoder_buf : public std::streambuf {
+ public:
+  explicit encoder_buf(encoder* e) : e(e), buf(e->block_size()), ok(true) {
+    setp(&buf[0], &buf[0] + buf.size());
+  }
+  ~encoder_buf() { close(); }
+  bool close() {
+    if (e) {
+      ok = write() && e->finish() && ok;
+      ok = e->file.close() && ok;
+      e.reset();
+    }
+    return ok;
+  }
+
+ protected:
+  int_type overflow(int_type c) {
+    if (!e || !write()) return traits_type::eof();
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+ private:
+  std::unique_ptr<encoder> e;
+  std::vector<char> buf;
+  bool ok;
+  bool write() {
+    std::size_t n = pptr() - pbase();
+    setp(&buf[0], &buf[0] + buf.size());
+    if (!ok || !e->write(&buf[0], n)) ok = false;
+    return ok;
+  }
+};
+
+class compressing_ostream : public std::ostream {
+ public:
+  compressing_ostream(encoder* e, std::string const& name) : std::ostream(0), name(name) {
+    std::unique_ptr<encoder> owned(e);
+    if (!e->file.open(name.c_str(), std::ios::out | std::ios::trunc | std::ios::binary)) {
+      setstate(std::ios::failbit);
+      return;
+    }
+    buf.reset(new encoder_buf(owned.release()));
+    rdbuf(buf.get());
+  }
+  ~compressing_ostream() {
+    if (buf && !buf->close()) std::cerr << "\nWARNING: error writing compressed file " << name << "\n";
+  }
+
+ private:
+  std::string name;
+  std::unique_ptr<encoder_buf> buf;
+};
+}
+
+bool compressed_filename(std::string const& name) {
+  return gz_name(name) || lz4_name(name);
+}
+
+std::string suffixed_filename(std::string const& name, std::string const& suffix) {
+  std::size_t n = gz_name(name) ? sizeof(gz_ext) - 1 : lz4_name(name) ? sizeof(lz4_ext) - 1 : 0;
+  std::size_t base = name.size() - n;
+  return name.substr(0, base) + "." + suffix + name.substr(base);
+}
+
+std::istream* new_input_file(std::string const& name) {
+  if (gz_name(name)) return new decompressing_istream(new gzip_decoder, name);
+  if (lz4_name(name)) return new decompressing_istream(new lz4_decoder, name);
+  return new std::ifstream(name.c_str());
+}
+
+std::ostream* new_output_file(std::string const& name) {
+  if (gz_name(name)) return new compressing_ostream(new gzip_encoder, name);
+  if (lz4_name(name)) return new compressing_ostream(new lz4_encoder, name);
+  return new std::ofstream(name.c_str());
+}
+
+
+}
@@ -0,0 +1,57 @@
+// Copyright 2014 Jonathan Graehl - http://graehl.org/
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+/** \file
+
+    files named X.gz (gzip, via zlib) or X.lz4 (lz4 frame format, via the lz4.c here) are transparently
+    (de)compressed; other names are plain fstreams.  link compressed_file.cpp and -lz.
+
+    input is decompressed on a background thread a few MB ahead of the reader, so parsing overlaps reading
+    and decompressing.  corrupt or truncated input throws std::runtime_error from the read that reaches it
+    (the istream has exceptions(badbit) set, so it isn't silently taken for the end of the file).
+
+    output is compressed on the calling thread, a block at a time.  flush() doesn't end a block (that would
+    ruin compression for streams flushed every line), so the file is complete only once the ostream is
+    destroyed.
+
+    concatenated gzip members (cat a.gz b.gz) and lz4 frames are read as one file.  lz4 frames may have
+    linked or independent blocks and any block size; the lz4 legacy format (lz4 -l) isn't supported.
+*/
+
+#ifndef GRAEHL_SHARED__COMPRESSED_FILE_HPP
+#define GRAEHL_SHARED__COMPRESSED_FILE_HPP
+#pragma once
+
+#include <iostream>
+#include <string>
+
+namespace graehl {
+
+/// name ends in .gz or .lz4
+bool compressed_filename(std::string const& name);
+
+/// "a.wfst" -> "a.wfst.suffix", but "a.wfst.gz" -> "a.wfst.suffix.gz" (so the result is compressed too)
+std::string suffixed_filename(std::string const& name, std::string const& suffix);
+
+/// new (delete it yourself) istream reading the file name, decompressed if compressed_filename(name).
+/// like an ifstream, !*result if it couldn't be opened
+std::istream* new_input_file(std::string const& name);
+
+/// new ostream writing (truncating) the file name, compressed if compressed_filename(name); the file is
+/// complete once it's deleted.  like an ofstream, !*result if it couldn't be created
+std::ostream* new_output_file(std::string const& name);
+
+
+}
+
+#endif
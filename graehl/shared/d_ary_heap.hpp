@@ -57,6 +57,7 @@ DECLARE_DBG_LEVEL(DDARY)
 #include <boost/smart_ptr/shared_array.hpp>
 #include <cstddef>
 #include <functional>
+#include <iterator>
 #include <memory>
 #include <string>
 
@@ -876,6 +877,77 @@ This is definitely linear to n.
   }
 };
 
+/**
+   std::push_heap / pop_heap / make_heap for an Arity-ary heap stored directly in a random-access range
+   (no index or distance maps, for when the values themselves are small enough to move around).  same
+   convention as std: a max-heap w.r.t. less, i.e. the top is the element x with no less(x, y).
+*/
+template <std::size_t Arity, class I, class Value, class Less>
+void d_ary_sift_down(I begin, std::ptrdiff_t hole, std::ptrdiff_t n, Value& v, Less less) {
+  for (;;) {
+    std::ptrdiff_t c = hole * (std::ptrdiff_t)Arity + 1;
+    if (c >= n) break;
+    std::ptrdiff_t ce = c + (std::ptrdiff_t)Arity, best = c;
+    if (ce > n) ce = n;
+    for (++c; c < ce; ++c)
+      if (less(begin[best], begin[c])) best = c;
+    if (!less(v, begin[best])) break;
+    begin[hole] = std::move(begin[best]);
+    hole = best;
+  }
+  begin[hole] = std::move(v);
+}
+
+/// [begin, end-1) is a heap; adds end[-1]
+template <std::size_t Arity, class I, class Less>
+void d_ary_push_heap(I begin, I end, Less less) {
+  std::ptrdiff_t hole = end - begin - 1;
+  if (hole <= 0) return;
+  typename std::iterator_traits<I>::value_type v(std::move(begin[hole]));
+  while (hole) {
+    std::ptrdiff_t parent = (hole - 1) / (std::ptrdiff_t)Arity;
+    if (!less(begin[parent], v)) break;
+    begin[hole] = std::move(begin[parent]);
+    hole = parent;
+  }
+  begin[hole] = std::move(v);
+}
+
+/// moves the top to end[-1], leaving [begin, end-1) a heap
+template <std::size_t Arity, class I, class Less>
+void d_ary_pop_heap(I begin, I end, Less less) {
+  std::ptrdiff_t n = end - begin - 1;
+  if (n <= 0) return;
+  typename std::iterator_traits<I>::value_type v(std::move(begin[n]));
+  begin[n] = std::move(begin[0]);
+  d_ary_sift_down<Arity>(begin, 0, n, v, less);
+}
+
+template <std::size_t Arity, class I, class Less>
+void d_ary_make_heap(I begin, I end, Less less) {
+  std::ptrdiff_t n = end - begin;
+  if (n < 2) return;
+  for (std::ptrdiff_t i = (n - 2) / (std::ptrdiff_t)Arity; i >= 0; --i) {
+    typename std::iterator_traits<I>::value_type v(std::move(begin[i]));
+    d_ary_sift_down<Arity>(begin, i, n, v, less);
+  }
+}
+
+template <std::size_t Arity, class I>
+void d_ary_push_heap(I begin, I end) {
+  d_ary_push_heap<Arity>(begin, end, std::less<typename std::iterator_traits<I>::value_type>());
+}
+
+template <std::size_t Arity, class I>
+void d_ary_pop_heap(I begin, I end) {
+  d_ary_pop_heap<Arity>(begin, end, std::less<typename std::iterator_traits<I>::value_type>());
+}
+
+template <std::size_t Arity, class I>
+void d_ary_make_heap(I begin, I end) {
+  d_ary_make_heap<Arity>(begin, end, std::less<typename std::iterator_traits<I>::value_type>());
+}
+
 
 }
 
@@ -68,6 +68,33 @@ std::basic_ostream<C, T>& operator <<(std::basic_ostream<C, T> &out, ParamDelta
     return out << "unchanged";
 }
 
+/// what overrelaxed_em carries from one iteration to the next (plain data, so it can be checkpointed); pass
+/// a saved one back to overrelaxed_em to continue from it
+struct overrelaxed_em_progress {
+  double best_alp; // alp=average log prob = (logprob1 +...+ logprobn )/ n (negative means 0 probability, 0 = 1 probability)
+  int ran_restarts; // remaining
+  bool very_first_time;
+  // for the current restart:
+  unsigned train_iter; // iterations done
+  ParamDelta max_delta_param;
+  double last_alp;
+  double learning_rate;
+  bool first_time;
+  bool last_was_reset;
+  explicit overrelaxed_em_progress(int ran_restarts = 0)
+      : best_alp(-HUGE_VAL), ran_restarts(ran_restarts), very_first_time(true) {
+    begin_restart();
+  }
+  void begin_restart() {
+    train_iter = 0;
+    max_delta_param = ParamDelta(0, 0);
+    last_alp = -HUGE_VAL;
+    learning_rate = 1;
+    first_time = true;
+    last_was_reset = false;
+  }
+};
+
 /// overrelaxed EM with random restarts.
 /// RETURN: best perplexity
 //  YOU SUPPLY (something that implements/extends):
@@ -86,6 +113,8 @@ struct EM_executor {
   // if you're doing random restarts, transfer the current parameters to safekeeping
   void save_best() {}
   void restore_best() {} // called when EM is (completely) finished
+  // end of each iteration (after maximize): a chance to checkpoint the parameters along with the progress
+  void em_iteration_done(overrelaxed_em_progress const& progress) {}
 };
 
 
@@ -104,26 +133,29 @@ inline void print_alp(std::ostream &logs, double N, double alp)
   prob.print_ppx_example(logs, N);
 }
 
+// resume: continue from the progress an earlier run passed to exec.em_iteration_done (exec's parameters must be
+// restored to match), instead of starting with ran_restarts remaining
 template <class Exec>
-double overrelaxed_em(Exec &exec, unsigned max_iter = 10000, double converge_relative_avg_logprob_epsilon = .0001, int ran_restarts = 0, double converge_param_delta = 0, double learning_rate_growth_factor = 1, std::ostream &logs = Config::log(), unsigned log_level = 1)
+double overrelaxed_em(Exec &exec, unsigned max_iter = 10000, double converge_relative_avg_logprob_epsilon = .0001, int ran_restarts = 0, double converge_param_delta = 0, double learning_rate_growth_factor = 1, std::ostream &logs = Config::log(), unsigned log_level = 1, overrelaxed_em_progress const* resume = 0)
 {
   DBP_INC_VERBOSE;
-  double best_alp=-HUGE_VAL; // alp=average log prob = (logprob1 +...+ logprobn )/ n (negative means 0 probability, 0 = 1 probability)
+  overrelaxed_em_progress pr(ran_restarts);
+  if (resume)
+    pr = *resume;
+  double &best_alp = pr.best_alp;
   if (max_iter == 0)
     return best_alp;
 
   double &rel_eps = converge_relative_avg_logprob_epsilon;
-  bool very_first_time = true;
+  bool &very_first_time = pr.very_first_time;
   double N = exec.size();
   while (1) { // random restarts
-    unsigned train_iter = 0;
-    ParamDelta max_delta_param;
-    double last_alp;
-
-    last_alp=-HUGE_VAL;
-    double learning_rate = 1;
-    bool first_time = true;
-    bool last_was_reset = false;
+    unsigned &train_iter = pr.train_iter;
+    ParamDelta &max_delta_param = pr.max_delta_param;
+    double &last_alp = pr.last_alp;
+    double &learning_rate = pr.learning_rate;
+    bool &first_time = pr.first_time;
+    bool &last_was_reset = pr.last_was_reset;
     //        exec.maximize(1); // may not be desireable if you wanted just 1 iteration to compute counts = inside*outside but you should do that outside this framework
     for ( ; ; ) {
       ++train_iter;
@@ -193,12 +225,14 @@ double overrelaxed_em(Exec &exec, unsigned max_iter = 10000, double converge_rel
       }
 
       last_alp = new_alp;
+      exec.em_iteration_done(pr);
     } // for
     exec.converge_em();
-    if (ran_restarts > 0) {
-      --ran_restarts;
-      logs << "\nRandom restart - " << ran_restarts << " remaining.\n";
+    if (pr.ran_restarts > 0) {
+      --pr.ran_restarts;
+      logs << "\nRandom restart - " << pr.ran_restarts << " remaining.\n";
       exec.randomize();
+      pr.begin_restart();
     } else {
       break;
     }
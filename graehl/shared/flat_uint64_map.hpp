@@ -0,0 +1,149 @@
+// Copyright 2014 Jonathan Graehl - http://graehl.org/
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+/** \file
+
+    open-addressing (linear probing) hash map from uint64_t keys to unsigned values, for ids of packed
+    tuples (e.g. composition's (qa, filter, qb) states).  keys and values sit together in one flat array
+    of power-of-2 size, at most half full, and keys are scrambled by murmur's fmix64, so a lookup is
+    usually a single cache miss.
+
+    the key empty_key (all ones) is reserved: it's never found, and mustn't be inserted.  there's no erase.
+*/
+
+#ifndef GRAEHL_SHARED__FLAT_UINT64_MAP_HPP
+#define GRAEHL_SHARED__FLAT_UINT64_MAP_HPP
+#pragma once
+
+#include <graehl/shared/hash_murmur.hpp>
+#include <cassert>
+#include <cstddef>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+#ifdef GRAEHL_TEST
+#include <graehl/shared/test.hpp>
+#endif
+
+namespace graehl {
+
+struct flat_uint64_map {
+  typedef uint64_t key_type;
+  typedef unsigned mapped_type;
+  static const key_type empty_key = (key_type)-1;
+
+  /// room for expected_size keys before growing
+  explicit flat_uint64_map(std::size_t expected_size = 0) : n() { rehash(capacity_for(expected_size)); }
+
+  std::size_t size() const { return n; }
+
+  /// the value for key, or 0 if none
+  mapped_type* find(key_type key) {
+    if (key == empty_key) return 0;
+    for (std::size_t i = bucket(key);; i = (i + 1) & mask) {
+      slot& s = slots[i];
+      if (s.key == key) return &s.value;
+      if (s.key == empty_key) return 0;
+    }
+  }
+
+  /// (value for key, true if it was just inserted as value)
+  std::pair<mapped_type*, bool> insert(key_type key, mapped_type value) {
+    assert(key != empty_key);
+    for (std::size_t i = bucket(key);; i = (i + 1) & mask) {
+      slot& s = slots[i];
+      if (s.key == key) return std::pair<mapped_type*, bool>(&s.value, false);
+      if (s.key == empty_key) {
+        if (2 * (n + 1) > slots.size()) {
+          rehash(2 * slots.size());
+          return insert(key, value);
+        }
+        ++n;
+        s.key = key;
+        s.value = value;
+        return std::pair<mapped_type*, bool>(&s.value, true);
+      }
+    }
+  }
+
+ private:
+  struct slot {
+    key_type key;
+    mapped_type value;
+  };
+  std::vector<slot> slots;
+  std::size_t mask, n;
+
+  std::size_t bucket(key_type key) const { return (std::size_t)fmix64(key) & mask; }
+
+  static std::size_t capacity_for(std::size_t size) {
+    std::size_t c = 16;
+    while (c < 2 * size) c *= 2;
+    return c;
+  }
+
+  void rehash(std::size_t capacity) {
+    slot empty;
+    empty.key = empty_key;
+    empty.value = 0;
+    std::vector<slot> old(capacity, empty);
+    old.swap(slots);
+    mask = capacity - 1;
+    for (std::size_t j = 0, e = old.size(); j < e; ++j)
+      if (old[j].key != empty_key) {
+        std::size_t i = bucket(old[j].key);
+        while (slots[i].key != empty_key) i = (i + 1) & mask;
+        slots[i] = old[j];
+      }
+  }
+};
+
+#ifdef GRAEHL_TEST
+BOOST_AUTO_TEST_CASE(test_flat_uint64_map) {
+  flat_uint64_map m;
+  BOOST_CHECK(!m.find(0));
+  BOOST_CHECK(!m.find(flat_uint64_map::empty_key));
+  // keys next to the reserved one are ordinary
+  BOOST_CHECK(m.insert(0, 7).second);
+  BOOST_CHECK(m.insert(flat_uint64_map::empty_key - 1, 8).second);
+  BOOST_CHECK(!m.find(flat_uint64_map::empty_key));
+  BOOST_CHECK_EQUAL(*m.find(0), 7u);
+  BOOST_CHECK_EQUAL(*m.find(flat_uint64_map::empty_key - 1), 8u);
+  // past the initial 16 slots: rehashes move every key
+  unsigned const N = 10000;
+  for (unsigned i = 1; i < N; ++i) {
+    std::pair<unsigned*, bool> r = m.insert((uint64_t)i << 32 | i, i);
+    BOOST_CHECK(r.second);
+    BOOST_CHECK_EQUAL(*r.first, i);
+  }
+  BOOST_CHECK_EQUAL(m.size(), N + 1);
+  for (unsigned i = 1; i < N; ++i) {
+    std::pair<unsigned*, bool> r = m.insert((uint64_t)i << 32 | i, 0);  // present: keeps its value
+    BOOST_CHECK(!r.second);
+    BOOST_CHECK_EQUAL(*r.first, i);
+    BOOST_CHECK(!m.find((uint64_t)i << 32));
+  }
+  BOOST_CHECK_EQUAL(m.size(), N + 1);
+  *m.find(0) = 9;
+  BOOST_CHECK_EQUAL(*m.find(0), 9u);
+  flat_uint64_map sized(1000);  // room for 1000 without growing
+  for (unsigned i = 0; i < 1000; ++i) sized.insert(i, i);
+  for (unsigned i = 0; i < 1000; ++i) BOOST_CHECK_EQUAL(*sized.find(i), i);
+  BOOST_CHECK(!sized.find(1000));
+}
+#endif
+
+}
+
+#endif
@@ -70,6 +70,8 @@
 #include <assert.h>
 #include <graehl/shared/itoa.hpp>
 #include <cstdio>
+#include <cstring>
+#include <graehl/shared/cpp11.hpp>
 #include <graehl/shared/nan.hpp>
 //#include <graehl/shared/power_of_10.hpp>
 
@@ -96,9 +98,9 @@ struct ftoa_traits {};
       roundtripdig = roundtripd,                                                                           \
       bufsize = roundtripdig + 7                                                                           \
     };                                                                                                     \
-    static const double pow10_block = 1e##P10;                                                             \
-    static const float_t small_f = small;                                                                  \
-    static const float_t large_f = large;                                                                  \
+    static GRAEHL_CONSTEXPR const double pow10_block = 1e##P10;                                            \
+    static GRAEHL_CONSTEXPR const float_t small_f = small;                                                 \
+    static GRAEHL_CONSTEXPR const float_t large_f = large;                                                 \
     static inline int sprintf(char* buf, double f) { return std::sprintf(buf, "%." #used "g", f); }        \
     static inline int sprintf_sci(char* buf, double f) { return std::sprintf(buf, "%." #used "e", f); }    \
     static inline int sprintf_nonsci(char* buf, double f) { return std::sprintf(buf, "%." #used "f", f); } \
@@ -263,6 +265,9 @@ inline char* append_frac(char* p, F f, bool positive_sign = false) {
 // append_frac, append_pos_sci, append_sci.  notice these are all composed according to a pattern (but
 // reversing order of composition in pre vs app).  or can implement with copy through buffer
 
+template <class F>
+inline char* prepend_pos_sci(char* p, F f, bool positive_sign_exp = false);
+
 /* will switch to sci notation if integer part is too big for the int type. but for very small values, will
  * simply display 0 (i.e. //TODO: find out log10 and leftpad 0s then convert rest) */
 template <class F>
@@ -343,7 +348,7 @@ inline char* prepend_nonsci(char* p, F f, bool positive_sign = false) {
 }
 
 template <class F>
-inline char* prepend_pos_sci(char* p, F f, bool positive_sign_exp = false) {
+inline char* prepend_pos_sci(char* p, F f, bool positive_sign_exp) {
   FTOAassert(f > 0);
   typedef ftoa_traits<F> FT;
   int e10;
@@ -396,6 +401,72 @@ inline char* append_ftoa(char* p, F f, bool positive_sign = false) {
   return p + ftoa_traits<F>::sprintf(p, f);
 }
 
+/// the same text as snprintf(p, n, "%.*g", precision, f) for precision 1..17 (p must have room for
+/// precision + 8 chars), returning the end.  exact: the digits come from one correctly rounded long double
+/// multiply or divide by an exact power of 10, and if that leaves the rounding in doubt (or there's no
+/// 64-bit long double, or f is out of range), from snprintf
+inline char* append_printf_g(char* p, double f, int precision = 15) {
+  typedef long double ld;
+  static const ld pow10[] = {1e0L,  1e1L,  1e2L,  1e3L,  1e4L,  1e5L,  1e6L,  1e7L,  1e8L,  1e9L,
+                             1e10L, 1e11L, 1e12L, 1e13L, 1e14L, 1e15L, 1e16L, 1e17L, 1e18L, 1e19L,
+                             1e20L, 1e21L, 1e22L, 1e23L, 1e24L, 1e25L, 1e26L, 1e27L};
+  uint64_t bits;
+  std::memcpy(&bits, &f, sizeof(bits));
+  bool finite = (bits >> 52 & 0x7ff) != 0x7ff;  // not f == f, which -ffast-math may assume
+  if (std::numeric_limits<ld>::digits >= 64 && precision >= 1 && precision <= 17 && finite && f != 0) {
+    double a = f < 0 ? -f : f;
+    int e2;
+    std::frexp(a, &e2);
+    int x = (int)std::floor((e2 - 1) * 0.30102999566398120);  // exponent of a in base 10, or 1 less
+    for (int tries = 0; tries < 2; ++tries, ++x) {
+      int k = precision - 1 - x;
+      if (k > 27 || k < -27) break;
+      ld v = k >= 0 ? (ld)a * pow10[k] : (ld)a / pow10[-k];
+      if (v >= pow10[precision]) continue;
+      ld whole = std::floor(v), frac = v - whole;
+      ld doubt = v * (1 / 4611686018427387904.0L);  // v/2^62 > 2 ulp of v
+      if (frac > 0.5L - doubt && frac < 0.5L + doubt) break;
+      uint64_t n = (uint64_t)whole + (frac > 0.5L);
+      if (n == (uint64_t)pow10[precision]) {
+        n /= 10;
+        ++x;
+      }
+      char digits[24];
+      char* dend = digits + 24;
+      char* d = utoa(dend, n);
+      while (dend > d + 1 && dend[-1] == '0') --dend;
+      if (f < 0) *p++ = '-';
+      if (x < -4 || x >= precision) {
+        *p++ = *d++;
+        if (d < dend) {
+          *p++ = '.';
+          while (d < dend) *p++ = *d++;
+        }
+        *p++ = 'e';
+        *p++ = x < 0 ? '-' : '+';
+        unsigned ux = x < 0 ? -x : x;
+        if (ux < 10) *p++ = '0';
+        char ebuf[8];
+        char* eend = ebuf + 8;
+        for (char* e = utoa(eend, ux); e < eend;) *p++ = *e++;
+      } else if (x >= 0) {
+        for (char* point = d + x + 1; d < point; ++d) *p++ = d < dend ? *d : '0';
+        if (d < dend) {
+          *p++ = '.';
+          while (d < dend) *p++ = *d++;
+        }
+      } else {
+        *p++ = '0';
+        *p++ = '.';
+        for (int z = -1; z > x; --z) *p++ = '0';
+        while (d < dend) *p++ = *d++;
+      }
+      return p;
+    }
+  }
+  return p + std::sprintf(p, "%.*g", precision, f);
+}
+
 template <class F>
 inline char* prepend_ftoa(char* p, F f) {
   typedef ftoa_traits<F> FT;
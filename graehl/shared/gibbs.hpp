@@ -87,6 +87,8 @@
 #include <graehl/shared/print_width.hpp>
 #include <graehl/shared/unimplemented.hpp>
 #include <graehl/shared/debugprint.hpp>
+#include <graehl/shared/checkpoint.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/math/distributions/normal.hpp>
 
 //#define DEBUG_GIBBS
@@ -305,6 +307,13 @@ struct gibbs_base
       id.clear();
       wt.clear();
     }
+    template <class A>
+    void checkpoint(A &a)
+    {
+      checkpoint_pod(a, prob);
+      checkpoint_vector(a, id);
+      checkpoint_vector(a, wt);
+    }
     void swap(block_delta &o)
     {
       id.swap(o.id);
@@ -799,26 +808,32 @@ struct gibbs_base
 
  private:
   //actual impl:
+  // resumed: continue after the iteration a checkpoint was taken at
   template <class G>
-  gibbs_stats run(unsigned runi, G &imp)
+  gibbs_stats run(unsigned runi, G &imp, bool resumed = false)
   {
-    stats.clear(n_sym, n_blocks);
     Ni = gopt.iter;
-    restore_p0(); // sets counts to prior, and normsums so prob is right
+    if (!resumed) {
+      stats.clear(n_sym, n_blocks);
+      restore_p0(); // sets counts to prior, and normsums so prob is right
+    }
     imp.init_run(runi);
-    iter = 0;
-    time = 0;
-    if (gopt.print_every!=0 && gopt.print_counts_sparse==0) {
-      out<<"# ";
-      print_counts(imp, true,"(prior counts)");
+    if (!resumed) {
+      iter = 0;
+      time = 0;
+      if (gopt.print_every!=0 && gopt.print_counts_sparse==0) {
+        out<<"# ";
+        print_counts(imp, true,"(prior counts)");
+      }
+      clear_blocks();
+      iteration(imp, gopt.random_start || (runi&&gopt.expectation)); // initial sample; randomize deltas when doing expectation to prevent deterministic hillclimb
     }
-    clear_blocks();
-    iteration(imp, gopt.random_start || (runi&&gopt.expectation)); // initial sample; randomize deltas when doing expectation to prevent deterministic hillclimb
     //FIXME: isn't really random!  get the same sample after every iteration
-    for (iter = 1; iter<=Ni; ++iter) {
+    for (iter = resumed ? iter+1 : 1; iter<=Ni; ++iter) {
       time = (double)iter-(double)gopt.burnin; //very funny: unsigned arithmetic -> double (unsigned maximum) if you're sloppy
       if (time<0) time = 0;
       iteration(imp, false);
+      maybe_checkpoint();
     }
     log<<"\nGibbs stats: "<<stats<<"\n";
     if (gopt.prior_inference_show)
@@ -876,27 +891,80 @@ struct gibbs_base
     maybe_print_periodic(imp);
   }
   unsigned beststart;
+
+  // run_starts progress (members so they can be checkpointed)
+  unsigned starti;
+  saved_counts_t restart_priors, best_counts;
+  blocks_t best_sample;
+  gibbs_stats best;
+
+  boost::scoped_ptr<checkpoint_writer> checkpointer;
+  enum { checkpoint_version = 1 };
+  void maybe_checkpoint()
+  {
+    if (checkpointer && divides(gopt.checkpoint_every, iter)) {
+      checkpoint_buffer b("gibbs", checkpoint_version);
+      checkpoint(b.archive);
+      checkpointer->save(b);
+    }
+  }
+  template <class A>
+  void checkpoint_blocks(A &a, blocks_t &blocks)
+  {
+    checkpoint_size(a, blocks.size(), "blocks");
+    for (unsigned i = 0, N = blocks.size(); i<N; ++i)
+      blocks[i].checkpoint(a);
+  }
  public:
+  // everything needed to continue sampling after iteration iter of start starti (for --resume)
+  template <class A>
+  void checkpoint(A &a)
+  {
+    checkpoint_pod(a, starti);
+    checkpoint_pod(a, iter);
+    checkpoint_pod(a, time);
+    checkpoint_pod(a, stats);
+    checkpoint_fixed(a, gps.begin(), gps.size(), "parameters");
+    checkpoint_fixed(a, normsum.begin(), normsum.size(), "normalization groups");
+    checkpoint_blocks(a, sample);
+    checkpoint_fixed(a, prior_scale.cumulative.begin(), prior_scale.cumulative.size(), "prior scale groups");
+    checkpoint_array(a, restart_priors);
+    checkpoint_array(a, best_counts);
+    checkpoint_blocks(a, best_sample);
+    checkpoint_pod(a, best);
+    checkpoint_pod(a, beststart);
+    checkpoint_engine(a, g_random01.engine());
+  }
+
   template <class G>
   gibbs_stats run_starts(G &imp)
   {
     init_cache();
-    saved_counts_t priors;
-    saved_counts_t best_counts;
-    blocks_t best_sample(n_blocks);
-    gibbs_stats best;
+    best_sample.reinit(n_blocks);
     unsigned re = gopt.restarts;
-    bool restart_priors = re>0 && gopt.prior_inference_restart_fresh;
+    bool fresh_priors = re>0 && gopt.prior_inference_restart_fresh;
     prior_scale.init_cumulative();
-    if (restart_priors)
-      save_priors(priors);
-    for (unsigned r = 0; r<=re; ++r) {
+    if (fresh_priors)
+      save_priors(restart_priors);
+    starti = 0;
+    bool resumed = !gopt.resume_file.empty();
+    if (resumed) {
+      restore_p0(); // sizes normsum
+      checkpoint_reader(gopt.resume_file, "gibbs", checkpoint_version)(*this);
+      recompute_cache_priors();
+      log<<"Resuming from "<<gopt.resume_file<<" after iteration "<<iter<<" of random restart "<<starti<<".\n";
+    }
+    if (!gopt.checkpoint_file.empty())
+      checkpointer.reset(new checkpoint_writer(gopt.checkpoint_file, log));
+    for (; starti<=re; ++starti) {
+      unsigned r = starti;
       graehl::time_space_report(log,"Gibbs sampling run: ");
       if (re>0) log<<"(random restart "<<r<<" of "<<re<<"): ";
-      if (r>0&&restart_priors)
-        restore_priors(priors);
+      if (r>0&&fresh_priors&&!resumed)
+        restore_priors(restart_priors);
       log<<"\n";
-      gibbs_stats const& s = run(r, imp);
+      gibbs_stats const& s = run(r, imp, resumed);
+      resumed = false;
       if (r==0 || s.better(best, gopt)) {
         beststart = r;
         log << "\nNew best: "<<s<<"\n";
@@ -906,6 +974,7 @@ struct gibbs_base
         best_sample.swap(sample);
       }
     }
+    checkpointer.reset();
     best_sample.swap(sample);
     if (re>0)
       restore_probs(best_counts); //TESTME: used to erroneously be restore_counts! was this accidentally doing something good in start-selection?
@@ -87,6 +87,12 @@ struct gibbs_opts
         ("prior-inference-show", defaulted_value(&prior_inference_show),"show for each prior group the cumulative scale applied to its prior counts")
         ("prior-inference-start", defaulted_value(&prior_inference_start),"(if nonzero) on iterations [start,end) do hyperparam inference; default is to do inference starting from --burnin, but this overrides that")
         ("prior-inference-end", defaulted_value(&prior_inference_end),"see above")
+        ("checkpoint-file", defaulted_value(&checkpoint_file),
+         "every --checkpoint-every iterations, save the complete sampler (or forest-em EM) state (binary) to this file, written in the background")
+        ("checkpoint-every", defaulted_value(&checkpoint_every),
+         "iterations between --checkpoint-file saves")
+        ("resume", defaulted_value(&resume_file),
+         "continue from a --checkpoint-file saved by an earlier run with the same inputs and options")
         ;
     if (forest_opts)
       opt.add_options()
@@ -161,6 +167,9 @@ struct gibbs_opts
 
   bool include_self; // don't remove counts from current block before creating proposal. expectation+include_self = incremental EM
 
+  std::string checkpoint_file, resume_file; // see checkpoint.hpp
+  unsigned checkpoint_every;
+
 
   //carmel only:
   bool expectation; // instead of sampling, ask the gibbs impl. to compute full forward/backward fractional counts
@@ -249,10 +258,13 @@ struct gibbs_opts
     argmax_sum = false;
     exclude_prior = false;
     norm_order = false;
+    checkpoint_file = resume_file = "";
+    checkpoint_every = 1;
   }
   void validate()
   {
     if (width<4) width = 20;
+    if (!checkpoint_every) checkpoint_every = 1;
     if (no_prob) {
       cache_prob = cheap_prob = false;
     }
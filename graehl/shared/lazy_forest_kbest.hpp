@@ -25,6 +25,11 @@
 #define LAZY_FOREST_KBEST_SIZE unsigned
 #endif
 
+// per-node priority queues are d-ary heaps (4 is faster than binary for our ~32 byte hyperedges)
+#ifndef LAZY_FOREST_KBEST_HEAP_ARITY
+#define LAZY_FOREST_KBEST_HEAP_ARITY 4
+#endif
+
 // TODO: cycles - if you found a pending, then try not queueing successors until you're added to memo table.
 // but MAYBE our successors first approach makes us handle negative cost improvements more nicely? not sure.
 // if not, then always queue successors afterwards.
@@ -62,8 +67,11 @@
    fix_edge works. However, I'm certain that d_ary_heap.hpp doesn't frivolously
    check for heap property violations.
 
-   TODO: member pointer or recursive function argument pointer to context: deriv
-   factory, filter, stats. currently is thread-unsafe due to static globals.
+   The deriv factory, filter factory and stats live in a lazy_forest::Environment
+   passed to every call, so separate forests (each with its own Environment) may
+   be enumerated concurrently. The Environment's arena also holds every node's
+   priority queue and memo, so a whole query's memory goes away at once (your
+   factory may allocate derivations there too).
 
    TODO: resolve pq vs 1best indeterminacy by forcing user to specify which is
    best (default = min cost in forest node), then store "to be expanded"
@@ -110,8 +118,6 @@
   then build a lazy_forest<Factory> binary hypergraph
 */
 
-// TODO: use d_ary_heap.hpp (faster than binary)
-
 #ifndef GRAEHL_DEBUG_LAZY_FOREST_KBEST
 #define GRAEHL_DEBUG_LAZY_FOREST_KBEST 0
 #endif
@@ -128,7 +134,9 @@
 #endif
 
 #include <boost/noncopyable.hpp>
+#include <graehl/shared/arena.hpp>
 #include <graehl/shared/assertlvl.hpp>
+#include <graehl/shared/d_ary_heap.hpp>
 #include <graehl/shared/containers.hpp>
 #include <graehl/shared/os.hpp>
 #include <graehl/shared/percent.hpp>
@@ -228,10 +236,6 @@ struct lazy_derivation_cycle : public std::runtime_error {
 };
 
 /**
-   Note: unfortunately, this entire code does not allow for multiple concurrent jobs (per type of factory),
-since there is a static set_derivation_factory. Change would be simple but consume a little extra memory (at
-each kbest node?)
-
    build a copy of your (at most binary) derivation forest, then query its root for the 1st, 2nd, ... best
    <code>
    struct DerivationFactory
@@ -453,8 +457,13 @@ struct lazy_forest : public FilterFactory::filter_type  // empty base class opt.
     derivation_factory_type derivation_factory;
     filter_factory_type filter_factory;
     lazy_kbest_stats stats;
+    /// pq and memo of the lazy_forests constructed with this Environment.  memory.release() once they're
+    /// all destroyed (or only ever destroy them before the Environment)
+    arena memory;
     void set_derivation_factory(derivation_factory_type const& df) { derivation_factory = df; }
     void set_filter_factory(filter_factory_type const& f) { filter_factory = f; }
+    /// set this to false if you want negative cost cycles to silently stop producing successors rather than
+    /// throw
     bool throw_on_cycle;
     Environment() : throw_on_cycle(true) {}
   };
@@ -463,7 +472,8 @@ struct lazy_forest : public FilterFactory::filter_type  // empty base class opt.
   typedef lazy_forest<derivation_factory_type, filter_factory_type> forest;
   typedef forest self_type;
 
-  explicit lazy_forest(Environment const& env) : filter_type(env.filter_factory.filter_init()) {}
+  explicit lazy_forest(Environment& env)
+      : filter_type(env.filter_factory.filter_init()), pq(&env.memory), memo(&env.memory) {}
 
   typedef typename derivation_factory_type::derivation_type derivation_type;
 
@@ -527,7 +537,7 @@ struct lazy_forest : public FilterFactory::filter_type  // empty base class opt.
       child[1] = c1;
       derivation = _derivation;
     }
-    // NB: std::pop_heap puts largest element at top (max-heap)
+    // NB: pq is a max-heap (largest element at top)
     bool
     operator<(hyperedge const& o) const {  // true if o should dominate max-heap, i.e. o is better than us
       return call_derivation_better_than(o.derivation, derivation);
@@ -630,11 +640,6 @@ struct lazy_forest : public FilterFactory::filter_type  // empty base class opt.
     o << '}';
   }
 
-  /// if you have any state in your factory, assign to it here
-  // TODO: non-static, please (or thread specific/dynamic scoped? passed as arguments)
-
-  /// set this to true if you want negative cost cycles to throw rather than silently stop producing
-  /// successors
   static bool is_null(derivation_type d) { return d == NONE(); }
 
   filter_type& filter() { return *this; }
@@ -770,7 +775,7 @@ struct lazy_forest : public FilterFactory::filter_type  // empty base class opt.
       assert(call_derivation_better_than(pq[0].derivation, r));
       unsigned i = pq.size();
       assert(i > 0);
-      unsigned p = (i - 1);
+      unsigned p = (i - 1) / LAZY_FOREST_KBEST_HEAP_ARITY;
       assert(p >= 0);
       assert(call_derivation_better_than(pq[p].derivation, r));  // heap property
     }
@@ -790,7 +795,7 @@ struct lazy_forest : public FilterFactory::filter_type  // empty base class opt.
   }
 
   void sort(Environment& env, bool check_best_is_selfloop = false) {
-    std::make_heap(pq.begin(), pq.end());
+    d_ary_make_heap<LAZY_FOREST_KBEST_HEAP_ARITY>(pq.begin(), pq.end());
     finish_adding(env, check_best_is_selfloop);
     EIFDBG(LAZYF, 3, KBESTINFOT("sorted lazy-node=" << this << ": " << *this));
   }
@@ -802,11 +807,13 @@ struct lazy_forest : public FilterFactory::filter_type  // empty base class opt.
   // a selfloop as first-best
   bool postpone_selfloop() {
     if (!best_is_selfloop()) return true;
-    if (pq.size() == 1) return false;
-    if (pq.size() > 2 && pq[1] < pq[2])  // STL heap=maxheap. 2 better than 1.
-      std::swap(pq[0], pq[2]);
-    else
-      std::swap(pq[0], pq[1]);
+    std::size_t n = pq.size();
+    if (n == 1) return false;
+    std::size_t best = 1, e = 1 + LAZY_FOREST_KBEST_HEAP_ARITY;  // children of the top
+    if (e > n) e = n;
+    for (std::size_t c = 2; c < e; ++c)
+      if (pq[best] < pq[c]) best = c;  // heap=maxheap. c better than best.
+    std::swap(pq[0], pq[best]);
     return !best_is_selfloop();
   }
 
@@ -827,8 +834,8 @@ struct lazy_forest : public FilterFactory::filter_type  // empty base class opt.
   }
 
   // private:
-  typedef std::vector<hyperedge> pq_t;
-  typedef std::vector<derivation_type> memo_t;
+  typedef std::vector<hyperedge, arena_allocator<hyperedge> > pq_t;
+  typedef std::vector<derivation_type, arena_allocator<derivation_type> > memo_t;
 
   // MEMBERS:
   pq_t pq;  // INVARIANT: pq[0] contains the last entry added to memo
@@ -863,17 +870,10 @@ struct lazy_forest : public FilterFactory::filter_type  // empty base class opt.
 
   void push(hyperedge const& e) {
     pq.push_back(e);
-    std::push_heap(pq.begin(), pq.end());
-    // This algorithm puts the element at position end()-1 into what must be a pre-existing heap consisting of
-    // all elements in the range [begin(), end()-1), with the result that all elements in the range [begin(),
-    // end()) will form the new heap. Hence, before applying this algorithm, you should make sure you have a
-    // heap in v, and then add the new element to the end of v via the push_back member function.
+    d_ary_push_heap<LAZY_FOREST_KBEST_HEAP_ARITY>(pq.begin(), pq.end());
   }
   void pop() {
-    std::pop_heap(pq.begin(), pq.end());
-    // This algorithm exchanges the elements at begin() and end()-1, and then rebuilds the heap over the range
-    // [begin(), end()-1). Note that the element at position end()-1, which is no longer part of the heap,
-    // will nevertheless still be in the vector v, unless it is explicitly removed.
+    d_ary_pop_heap<LAZY_FOREST_KBEST_HEAP_ARITY>(pq.begin(), pq.end());
     pq.pop_back();
   }
   hyperedge const& top() const { return pq.front(); }
@@ -150,7 +150,8 @@ typedef lazy_forest<Result::Factory> LK;
 
 inline void jonmay_cycle(unsigned N = 25, int weightset = 0) {
   using std::log;
-  LK::lazy_forest qe, qo;
+  LK::Environment env;
+  LK qe(env), qo(env);
   // float ca=1.1, cb=1.1, cc=1.08, cd=1.37, ce=1.1, cf=1.37, cg=1.37;
   /*
     ca=cb=1.1;
@@ -177,9 +178,9 @@ inline void jonmay_cycle(unsigned N = 25, int weightset = 0) {
   Result f("qo->B(qe)", cf, &c);
 
 
-  qe.add_sorted(&c, &qo);
-  qe.add_sorted(&a, &qe, &qo);
-  qe.add_sorted(&b, &qo, &qe);
+  qe.add_sorted(env, &c, &qo);
+  qe.add_sorted(env, &a, &qe, &qo);
+  qe.add_sorted(env, &b, &qo, &qe);
   assert(qe.is_sorted());
 
   qo.add(&e, &qe);
@@ -188,13 +189,13 @@ inline void jonmay_cycle(unsigned N = 25, int weightset = 0) {
   qo.add(&f, &qe);
 
   assert(!qo.is_sorted());
-  qo.sort();
+  qo.sort(env);
   assert(qo.is_sorted());
 #if USE_DEBUGPRINT
   NESTT;
 #endif
   // LK::enumerate_kbest(10, &qo, ResultPrinter());
-  qe.enumerate_kbest(N, ResultPrinter());
+  qe.enumerate_kbest(env, N, ResultPrinter());
 }
 
 inline void simplest_cycle(unsigned N = 25) {
@@ -203,18 +204,19 @@ inline void simplest_cycle(unsigned N = 25) {
   Result b("q->B(q)", cb, &c);
   Result n("q->N(q)", cn, &c);
   Result a("q->A(q q)", ca, &c, &c);
-  LK::lazy_forest q, q2;
+  LK::Environment env;
+  LK q(env), q2(env);
   q.add(&a, &q, &q);
   q.add(&b, &q);
   q.add(&n, &q);
   q.add(&c);
   assert(!q.is_sorted());
-  q.sort();
+  q.sort(env);
 // assert(q.is_sorted());
 #if USE_DEBUGPRINT
   NESTT;
 #endif
-  q.enumerate_kbest(N, ResultPrinter());
+  q.enumerate_kbest(env, N, ResultPrinter());
 }
 
 inline void simple_cycle(unsigned N = 25) {
@@ -229,28 +231,30 @@ inline void simple_cycle(unsigned N = 25) {
   Result b("q->B(q2 q2)", cb, &d, &d);
   float ca = .5;
   Result a("q->A(q q)", ca, &c, &c);
-  LK::lazy_forest q, q2;
+  LK::Environment env;
+  LK q(env), q2(env);
   q.add(&a, &q, &q);
   q.add(&b, &q2, &q2);
   q.add(&c);
   assert(!q.is_sorted());
-  q.sort();
+  q.sort(env);
   assert(q.is_sorted());
-  q2.add_sorted(&d, &q);
-  q2.add_sorted(&eneg, &q2);
+  q2.add_sorted(env, &d, &q);
+  q2.add_sorted(env, &eneg, &q2);
   // assert(q2.is_sorted());
-  // q2.sort();
+  // q2.sort(env);
   // DBP2(*q2.pq[0].derivation,*q2.pq[1].derivation);
   // assert(!q2.is_sorted());
   //  DBP2(eneg, d);
   //  NESTT;
-  q.enumerate_kbest(N, ResultPrinter());
+  q.enumerate_kbest(env, N, ResultPrinter());
 }
 
 
 inline void jongraehl_example(unsigned N = 25) {
   float eps = -1000;
-  LK::lazy_forest a, b, c, f;
+  LK::Environment env;
+  LK a(env), b(env), c(env), f(env);
   float cf = -2;
   Result rf("f->F", cf);
   float cb = -5;
@@ -268,24 +272,26 @@ inline void jongraehl_example(unsigned N = 25) {
   float caa = -cabc + eps;
   Result raa("a->Z(a)", caa, &rabc);
   // Result ra("a",6), rb("b",5), rc("c",1), rf("d",2), rb2("B",5), rb3("D",10), ra2("A",12);
-  f.add_sorted(&rf);  // terminal
-  f.add_sorted(&rfb);
-  b.add_sorted(&rb);  // terminal
-  b.add_sorted(&rbf, &f);
-  b.add_sorted(&rbb, &b);
-  c.add_sorted(&rcbf, &b, &f);
-  a.add_sorted(&rabc, &b, &c);
-  a.add_sorted(&raa, &a);
+  f.add_sorted(env, &rf);  // terminal
+  f.add_sorted(env, &rfb);
+  b.add_sorted(env, &rb);  // terminal
+  b.add_sorted(env, &rbf, &f);
+  b.add_sorted(env, &rbb, &b);
+  c.add_sorted(env, &rcbf, &b, &f);
+  a.add_sorted(env, &rabc, &b, &c);
+  a.add_sorted(env, &raa, &a);
   assert(a.is_sorted());
   assert(b.is_sorted());
   assert(c.is_sorted());
   assert(f.is_sorted());
+#if USE_DEBUGPRINT
   NESTT;
-  LK::throw_on_cycle = true;
-  f.enumerate_kbest(1, ResultPrinter());
-  b.enumerate_kbest(1, ResultPrinter());
-  c.enumerate_kbest(1, ResultPrinter());
-  a.enumerate_kbest(N, ResultPrinter());
+#endif
+  env.throw_on_cycle = true;
+  f.enumerate_kbest(env, 1, ResultPrinter());
+  b.enumerate_kbest(env, 1, ResultPrinter());
+  c.enumerate_kbest(env, 1, ResultPrinter());
+  a.enumerate_kbest(env, N, ResultPrinter());
 }
 
 inline void all_examples(unsigned N = 30) {
@@ -328,7 +334,4 @@ int main() {
 }
 #endif
 
-
-}
-
 #endif
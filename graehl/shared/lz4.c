@@ -72,8 +72,13 @@
 #define LZ4_ARCH64 0
 #endif
 
-// Little Endian or Big Endian ?
-#if (defined(__BIG_ENDIAN__) || defined(__BIG_ENDIAN) || defined(_BIG_ENDIAN) || defined(_ARCH_PPC) || defined(__PPC__) || defined(__PPC) || defined(PPC) || defined(__powerpc__) || defined(__powerpc) || defined(powerpc) || ((defined(__BYTE_ORDER__)&&(__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__))) )
+// Little Endian or Big Endian ?  (glibc's endian.h defines __BIG_ENDIAN everywhere, so trust the compiler's
+// __BYTE_ORDER__ if it has one)
+#if defined(__BYTE_ORDER__)
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define LZ4_BIG_ENDIAN 1
+#endif
+#elif (defined(__BIG_ENDIAN__) || defined(__BIG_ENDIAN) || defined(_BIG_ENDIAN) || defined(_ARCH_PPC) || defined(__PPC__) || defined(__PPC) || defined(PPC) || defined(__powerpc__) || defined(__powerpc) || defined(powerpc) || ((defined(__BYTE_ORDER__)&&(__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__))) )
 #define LZ4_BIG_ENDIAN 1
 #else
 // Little Endian assumed. PDP Endian and other very rare endian format are unsupported.
@@ -688,7 +693,7 @@ int LZ4_uncompress(const char* source,
 		if unlikely(op-ref<LZ4_STEPSIZE)
 		{
 #if LZ4_ARCH64
-			size_t dec2table[]={0, 0, 0, -1, 0, 1, 2, 3};
+			size_t dec2table[]={0, 0, 0, (size_t)-1, 0, 1, 2, 3};
 			size_t dec2 = dec2table[op-ref];
 #else
 			const int dec2 = 0;
@@ -724,11 +729,12 @@ _output_error:
 }
 
 
-int LZ4_uncompress_unknownOutputSize(
+int LZ4_uncompress_unknownOutputSize_withPrefix(
 				const char* source,
 				char* dest,
 				int isize,
-				int maxOutputSize)
+				int maxOutputSize,
+				int prefixSize)
 {
 	// Local Variables
 	const BYTE* restrict ip = (const BYTE*) source;
@@ -768,7 +774,7 @@ int LZ4_uncompress_unknownOutputSize(
 
 		// get offset
 		LZ4_READ_LITTLEENDIAN_16(ref,cpy,ip); ip+=2;
-		if (ref < (BYTE* const)dest) goto _output_error;
+		if (ref < (BYTE* const)dest - prefixSize) goto _output_error;
 
 		// get matchlength
 		if ((length=(token&LZ4_ML_MASK)) == LZ4_ML_MASK) { while (ip<iend) { int s = *ip++; length +=s; if (s==255) continue; break; } }
@@ -777,7 +783,7 @@ int LZ4_uncompress_unknownOutputSize(
 		if unlikely(op-ref<LZ4_STEPSIZE)
 		{
 #if LZ4_ARCH64
-			size_t dec2table[]={0, 0, 0, -1, 0, 1, 2, 3};
+			size_t dec2table[]={0, 0, 0, (size_t)-1, 0, 1, 2, 3};
 			size_t dec2 = dec2table[op-ref];
 #else
 			const int dec2 = 0;
@@ -813,3 +819,12 @@ _output_error:
 
 
 }
+
+int LZ4_uncompress_unknownOutputSize(
+				const char* source,
+				char* dest,
+				int isize,
+				int maxOutputSize)
+{
+	return LZ4_uncompress_unknownOutputSize_withPrefix(source, dest, isize, maxOutputSize, 0);
+}
@@ -94,6 +94,14 @@ LZ4_uncompress_unknownOutputSize() :
 	note   : This version is slightly slower than LZ4_uncompress()
 */
 
+int LZ4_uncompress_unknownOutputSize_withPrefix (char const* source, char* dest, int isize, int maxOutputSize, int prefixSize);
+
+/*
+LZ4_uncompress_unknownOutputSize_withPrefix() :
+	the same, but matches may also copy from the prefixSize bytes before dest (the end of the previous block,
+	for lz4 frames with linked blocks)
+*/
+
 
 int LZ4_compressCtx(void** ctx, char const* source,  char* dest, int isize);
 int LZ4_compress64kCtx(void** ctx, char const* source,  char* dest, int isize);
@@ -23,6 +23,11 @@
 #endif
 #endif
 
+// lz4.c's system headers, outside the namespace (their include guards keep lz4.c from reincluding them)
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
 namespace lz4 {
 #include "lz4.c"
 #include "lz4.h"
@@ -0,0 +1,138 @@
+// Copyright 2014 Jonathan Graehl - http://graehl.org/
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+/** \file
+
+    levenshtein (unit cost insert/delete/substitute) distance between a fixed pattern and many texts, by
+    Myers' bit-parallel algorithm (Myers 1999) in 64-row blocks (Hyyro 2003): O(ceil(m/64) n) for pattern
+    length m and text length n.
+
+    symbols are dense ids [0, n_symbols).  text symbols >= n_symbols match nothing.
+*/
+
+#ifndef GRAEHL_SHARED__MYERS_EDIT_DISTANCE_HPP
+#define GRAEHL_SHARED__MYERS_EDIT_DISTANCE_HPP
+#pragma once
+
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+
+#ifdef GRAEHL_TEST
+#include <graehl/shared/test.hpp>
+#include <algorithm>
+#endif
+
+namespace graehl {
+
+struct myers_edit_distance {
+  typedef uint64_t word;
+  enum { kBits = 64 };
+
+  explicit myers_edit_distance(unsigned n_symbols = 0) : n_symbols(n_symbols), m(), blocks() {}
+
+  /// pattern [begin, end) of symbols < n_symbols
+  template <class It>
+  void set_pattern(It begin, It end) {
+    m = end - begin;
+    blocks = (m + kBits - 1) / kBits;
+    peq.assign((std::size_t)n_symbols * blocks, 0);
+    for (unsigned i = 0; begin != end; ++begin, ++i)
+      peq[(std::size_t)*begin * blocks + i / kBits] |= (word)1 << (i % kBits);
+    pv.resize(blocks);
+    mv.resize(blocks);
+  }
+
+  /// distance from the pattern to the text [begin, end)
+  template <class It>
+  unsigned operator()(It begin, It end) {
+    if (!m) return end - begin;
+    for (unsigned b = 0; b < blocks; ++b) {
+      pv[b] = ~(word)0;
+      mv[b] = 0;
+    }
+    unsigned last = (m - 1) % kBits, score = m;
+    for (; begin != end; ++begin) {
+      unsigned c = *begin;
+      word const* eq = c < n_symbols ? &peq[(std::size_t)c * blocks] : 0;
+      int hin = 1;  // the top row (distance from the empty pattern) goes up by one each text symbol
+      for (unsigned b = 0; b < blocks; ++b) {
+        word ph, mh;
+        hin = advance(pv[b], mv[b], eq ? eq[b] : 0, hin, ph, mh);
+        if (b + 1 == blocks) score += (ph >> last & 1) - (mh >> last & 1);
+      }
+    }
+    return score;
+  }
+
+ private:
+  unsigned n_symbols, m, blocks;
+  std::vector<word> peq;  // [symbol * blocks + block]: bit i set if pattern[block * kBits + i] == symbol
+  std::vector<word> pv, mv;  // vertical +1/-1 deltas of the current column
+
+  // one column of one block, given the horizontal delta hin (-1, 0, or 1) entering its top.  sets the
+  // block's horizontal deltas ph/mh (before shifting), and returns the delta leaving its bottom
+  static int advance(word& pv, word& mv, word eq, int hin, word& ph, word& mh) {
+    word hin_neg = hin < 0, hin_pos = hin > 0;
+    word xv = eq | mv;
+    eq |= hin_neg;
+    word xh = (((eq & pv) + pv) ^ pv) | eq;
+    ph = mv | ~(xh | pv);
+    mh = pv & xh;
+    int hout = (int)(ph >> (kBits - 1)) - (int)(mh >> (kBits - 1));
+    word phs = ph << 1 | hin_pos, mhs = mh << 1 | hin_neg;
+    pv = mhs | ~(xv | phs);
+    mv = phs & xv;
+    return hout;
+  }
+};
+
+#ifdef GRAEHL_TEST
+// plain O(mn) dynamic program
+inline unsigned edit_distance_dp(std::vector<unsigned> const& a, std::vector<unsigned> const& b) {
+  std::vector<unsigned> row(b.size() + 1);
+  for (unsigned j = 0; j <= b.size(); ++j) row[j] = j;
+  for (unsigned i = 1; i <= a.size(); ++i) {
+    unsigned diag = row[0];
+    row[0] = i;
+    for (unsigned j = 1; j <= b.size(); ++j) {
+      unsigned up = row[j];
+      row[j] = std::min(std::min(up, row[j - 1]) + 1, diag + (a[i - 1] != b[j - 1]));
+      diag = up;
+    }
+  }
+  return row[b.size()];
+}
+
+BOOST_AUTO_TEST_CASE(test_myers_edit_distance) {
+  unsigned const n_symbols = 4;
+  myers_edit_distance d(n_symbols);
+  std::vector<unsigned> a, b;
+  uint32_t seed = 1;
+  for (unsigned trial = 0; trial < 2000; ++trial) {
+    // lengths span 0, exactly one block, and several (the carry between blocks)
+    unsigned lengths[] = {0, 1, 5, 63, 64, 65, 130, 200};
+    a.resize(lengths[trial % 8]);
+    b.resize(lengths[trial / 8 % 8]);
+    for (unsigned i = 0; i < a.size(); ++i) a[i] = (seed = seed * 1103515245 + 12345) >> 16 & 3;
+    for (unsigned i = 0; i < b.size(); ++i) b[i] = (seed = seed * 1103515245 + 12345) >> 16 & 3;
+    if (trial % 3 == 0 && !b.empty()) b[b.size() / 2] = n_symbols;  // in no pattern
+    d.set_pattern(a.begin(), a.end());
+    BOOST_CHECK_EQUAL(d(b.begin(), b.end()), edit_distance_dp(a, b));
+  }
+}
+#endif
+
+}
+
+#endif
@@ -0,0 +1,138 @@
+// Copyright 2014 Jonathan Graehl - http://graehl.org/
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// throughput of lazy_forest_kbest.hpp on synthetic layered forests, for 1k..1M best.  see make_kbest_bench.sh
+// usage: lazy_forest_kbest_bench [max-k=1000000] [layers=30] [width=40] [edges-per-node=6] [seed=1]
+
+#include <graehl/shared/arena.hpp>
+#include <graehl/shared/lazy_forest_kbest.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+namespace graehl {
+namespace lazy_forest_kbest_bench {
+
+struct derivation {
+  double cost;
+  derivation const* child[2];
+};
+
+struct factory : lazy_kbest_derivation_factory_base {
+  typedef derivation const* derivation_type;
+  static derivation_type NONE() { return (derivation_type)0; }
+  static derivation_type PENDING() { return (derivation_type)1; }
+  arena* memory;
+  factory() : memory() {}
+  derivation_type make(double cost, derivation_type c0 = 0, derivation_type c1 = 0) {
+    derivation* d = memory->allocate_n<derivation>(1);
+    d->cost = cost;
+    d->child[0] = c0;
+    d->child[1] = c1;
+    return d;
+  }
+  derivation_type make_worse(derivation_type prototype, derivation_type old_child, derivation_type new_child,
+                             lazy_kbest_index_type i) {
+    derivation const& p = *prototype;
+    return make(p.cost - old_child->cost + new_child->cost, i ? p.child[0] : new_child,
+                i ? new_child : p.child[1]);
+  }
+};
+}
+
+template <>
+struct lazy_kbest_derivation_traits<lazy_forest_kbest_bench::derivation const*> {
+  static inline bool better_than(lazy_forest_kbest_bench::derivation const* candidate,
+                                 lazy_forest_kbest_bench::derivation const* than) {
+    return candidate->cost < than->cost;
+  }
+};
+
+namespace lazy_forest_kbest_bench {
+
+typedef lazy_forest<factory> forest;
+
+struct check_sorted {
+  double* last;
+  bool operator()(derivation const* d, lazy_kbest_index_type) const {
+    if (d->cost < *last) {
+      std::cerr << "ERROR: derivations out of order: " << d->cost << " after " << *last << "\n";
+      std::exit(1);
+    }
+    *last = d->cost;
+    return true;
+  }
+};
+
+/// layer 0 nodes have only leaf edges; others have unary and binary edges into the layer below.  returns
+/// the seconds to build the forest and enumerate its k best
+inline double run(lazy_kbest_index_type k, unsigned layers, unsigned width, unsigned edges, unsigned seed,
+                  std::size_t& arena_bytes, lazy_kbest_index_type& nfound) {
+  typedef std::chrono::steady_clock clock;
+  clock::time_point start = clock::now();
+  forest::Environment env;
+  env.derivation_factory.memory = &env.memory;
+  std::srand(seed);
+  std::vector<forest> nodes;
+  nodes.reserve(layers * width);
+  for (unsigned l = 0; l < layers; ++l)
+    for (unsigned w = 0; w < width; ++w) {
+      nodes.push_back(forest(env));
+      forest& n = nodes.back();
+      for (unsigned e = 0; e < edges; ++e) {
+        double cost = std::rand() / (RAND_MAX + 1.);
+        if (!l) {
+          n.add(env.derivation_factory.make(cost));
+          continue;
+        }
+        forest* below = &nodes[(l - 1) * width];
+        forest* c0 = below + std::rand() % width;
+        if (e % 2) {
+          forest* c1 = below + std::rand() % width;
+          n.add(env.derivation_factory.make(cost + c0->first_best()->cost + c1->first_best()->cost,
+                                            c0->first_best(), c1->first_best()),
+                c0, c1);
+        } else
+          n.add(env.derivation_factory.make(cost + c0->first_best()->cost, c0->first_best()), c0);
+      }
+      n.sort(env);
+    }
+  double last = 0;
+  check_sorted visit = {&last};
+  nfound = nodes.back().enumerate_kbest(env, k, visit).n_visited;
+  arena_bytes = env.memory.capacity();
+  return std::chrono::duration<double>(clock::now() - start).count();
+}
+}
+}
+
+int main(int argc, char* argv[]) {
+  using namespace graehl::lazy_forest_kbest_bench;
+  unsigned maxk = argc > 1 ? std::atoi(argv[1]) : 1000000;
+  unsigned layers = argc > 2 ? std::atoi(argv[2]) : 30;
+  unsigned width = argc > 3 ? std::atoi(argv[3]) : 40;
+  unsigned edges = argc > 4 ? std::atoi(argv[4]) : 6;
+  unsigned seed = argc > 5 ? std::atoi(argv[5]) : 1;
+  std::cout << "layers=" << layers << " width=" << width << " edges-per-node=" << edges << " seed=" << seed
+            << "\n";
+  for (unsigned k = 1000; k <= maxk; k *= 10) {
+    std::size_t arena_bytes;
+    graehl::lazy_kbest_index_type nfound;
+    double sec = run(k, layers, width, edges, seed, arena_bytes, nfound);
+    std::cout << "k=" << k << " found=" << nfound << " seconds=" << sec << " derivations/sec=" << nfound / sec
+              << " arena-MB=" << arena_bytes / (1024. * 1024.) << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,2 @@
+#!/bin/bash
+g++ -O3 -DNDEBUG -std=c++11 $* -I../../.. lazy_forest_kbest_bench.cpp -o lazy_forest_kbest_bench && ./lazy_forest_kbest_bench
@@ -53,6 +53,7 @@
 #include <graehl/shared/funcs.hpp>
 #include <graehl/shared/threadlocal.hpp>
 #include <graehl/shared/random.hpp>
+#include <graehl/shared/ftoa.hpp>
 #include <cstdlib>
 #include <limits>
 
@@ -169,6 +170,16 @@ struct logweight {  // capable of representing nonnegative reals
   static void default_sometimes_log() { default_thresh = SOMETIMES_LOG; }
   static void default_always_log() { default_thresh = ALWAYS_LOG; }
   static void default_never_log() { default_thresh = NEVER_LOG; }
+  // the defaults above are per thread: a thread formatting weights on another's behalf copies its
+  // default_format (captured on that thread) and set()s it
+  struct default_format {
+    int base, thresh;
+    default_format() : base(default_base), thresh(default_thresh) {}
+    void set() const {
+      default_base = base;
+      default_thresh = thresh;
+    }
+  };
   static Real getlogreal(double d) { return log(d); }
   static Real getlogreal(float d) { return log(d); }
   template <class charT, class Traits>
@@ -486,6 +497,32 @@ struct logweight {  // capable of representing nonnegative reals
     o.precision(old_precision);
     return GENIOGOOD;
   }
+  enum { kMaxPrintChars = 32 };
+
+  /// the same text as print(o) for an o with default float flags and get_log_base(o) == base, get_log(o) ==
+  /// log, into p (which has room for kMaxPrintChars); returns the end
+  char* print(char* p, int base, int log) const {
+    int precision = sizeof(Real) > 4 ? 15 : 7;
+    if (isZero())
+      *p++ = '0';
+    else if ((log == SOMETIMES_LOG && fitsInReal()) || log == NEVER_LOG)
+      p = append_printf_g(p, getReal(), precision);
+    else if (base == LN) {
+      p = append_printf_g(p, getLn(), precision);
+      *p++ = 'l';
+      *p++ = 'n';
+    } else if (base == LOG10) {
+      p = append_printf_g(p, getLog10(), precision);
+      *p++ = 'l';
+      *p++ = 'o';
+      *p++ = 'g';
+    } else {
+      *p++ = 'e';
+      *p++ = '^';
+      p = append_printf_g(p, getLn(), precision);
+    }
+    return p;
+  }
   void throwbadweight() { throw "bad logweight"; }
 
   bool setString(const std::string& str) {
@@ -549,6 +586,7 @@ struct logweight {  // capable of representing nonnegative reals
         if (c == '^') {
           EXPECTI(in >> f);
           setLog10((Real)f);
+          return GENIOGOOD;
         } else {
           in.unget();
           setReal(f);
@@ -1022,6 +1060,14 @@ class numeric_limits<graehl::logweight<Real> > : public std::numeric_limits<Real
 
 namespace boost {}
 
+namespace graehl {
+// thread_local template statics must be defined in every translation unit that uses them: otherwise g++
+// calls their (missing) TLS init function.  constant-initialized, so duplicates are harmless
+template <class Real>
+THREADLOCAL int logweight<Real>::default_base = logweight<Real>::EXP;
+template <class Real>
+THREADLOCAL int logweight<Real>::default_thresh = logweight<Real>::ALWAYS_LOG;
+}
 
 #ifdef GRAEHL__SINGLE_MAIN
 #include <graehl/shared/weight.cc>